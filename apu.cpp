@@ -0,0 +1,671 @@
+#include <string.h>
+#include <algorithm>
+#include <memory>
+
+#include "apu.h"
+
+static const u8 LENGTHS[32] = {
+    10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+    12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
+
+static const u8 DUTIES[4][8] = {
+    {0, 1, 0, 0, 0, 0, 0, 0},
+    {0, 1, 1, 0, 0, 0, 0, 0},
+    {0, 1, 1, 1, 1, 0, 0, 0},
+    {1, 0, 0, 1, 1, 1, 1, 1},
+};
+
+static const u8 TRIANGLE_STEPS[32] = {
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+};
+
+// in cpu cycles, NTSC
+static const u16 NOISE_PERIODS[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068,
+};
+
+static const u16 DMC_PERIODS[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72,
+    54,
+};
+
+// the cpu cycles into the frame counter's sequence its steps fall on, the
+// fourth only does anything in 4 step mode and the fifth only in 5 step mode
+static const u32 SEQUENCE_STEPS[5] = {7457, 14913, 22371, 29829, 37281};
+static const u32 FOUR_STEP_LENGTH = 29830;
+static const u32 FIVE_STEP_LENGTH = 37282;
+
+// each channel's step in the linear approximation of the mixer, so that
+// everything at full volume comes to a little under 32767:
+//   pulse 0.00752, triangle 0.00851, noise 0.00494 and DMC 0.00335
+static const s32 WEIGHTS[Apu::CHANNEL_COUNT] = {246, 246, 279, 162, 110};
+
+//-----------------------------------------------------------------------------
+// Channels
+//-----------------------------------------------------------------------------
+
+void Apu::Envelope::clock(void)
+{
+    if (start) {
+        start = false;
+        decay = 15;
+        divider = period;
+    } else if (divider) {
+        divider--;
+    } else {
+        divider = period;
+        if (decay) {
+            decay--;
+        } else if (loop) {
+            decay = 15;
+        }
+    }
+}
+
+u8 Apu::Envelope::volume(void) const
+{
+    return constant ? period : decay;
+}
+
+u16 Apu::Pulse::sweep_target(void) const
+{
+    s32 change = period >> sweepShift;
+    if (sweepNegate) {
+        change = -change - (ones ? 1 : 0);
+    }
+    return static_cast<u16>(std::max(static_cast<s32>(period) + change, 0));
+}
+
+/**
+ * A pulse is silenced below a period of 8, and when the sweep would take it
+ * past $7FF, whether the sweep is on or not.
+ */
+bool Apu::Pulse::muted(void) const
+{
+    return period < 8 || (!sweepNegate && sweep_target() > 0x7ff);
+}
+
+void Apu::Pulse::clock_sweep(void)
+{
+    if (!sweepDivider && sweepEnabled && sweepShift && !muted()) {
+        period = sweep_target();
+    }
+    if (!sweepDivider || sweepReload) {
+        sweepDivider = sweepPeriod;
+        sweepReload = false;
+    } else {
+        sweepDivider--;
+    }
+}
+
+s32 Apu::Pulse::output(void) const
+{
+    if (!length || muted() || !DUTIES[duty][step]) {
+        return 0;
+    }
+    return envelope.volume();
+}
+
+/**
+ * The sequencer stops while either counter is out, holding its level. It
+ * is held as well for periods under 2, which would only make a tone far
+ * above hearing and pops on the way there.
+ */
+bool Apu::Triangle::stepping(void) const
+{
+    return linear && length && period >= 2;
+}
+
+s32 Apu::Triangle::output(void) const
+{
+    return TRIANGLE_STEPS[step];
+}
+
+s32 Apu::Noise::output(void) const
+{
+    if (!length || (shift & 1)) {
+        return 0;
+    }
+    return envelope.volume();
+}
+
+//-----------------------------------------------------------------------------
+// Apu
+//-----------------------------------------------------------------------------
+
+Apu::Apu(Cpu &c, u32 sample_rate) : cpu(&c),
+    blip(CLOCK_RATE, sample_rate, sample_rate / 4 + sample_rate / 20)
+{
+    memset(ioPage, 0, sizeof(ioPage));
+    dropped = 0;
+    // what isn't read by then goes, the rest of the buffer is room for the
+    // samples of a frame the cpu runs on
+    maxBuffered = sample_rate / 4;
+
+    cycle = cpu->get_cycles();
+    frameStart = cycle;
+    pulses[0] = Pulse();
+    pulses[1] = Pulse();
+    pulses[0].ones = true;
+    triangle = Triangle();
+    // the triangle sits at 15 from power on, that is the level 0 starts at
+    triangle.level = triangle.output();
+    noise = Noise();
+    noise.shift = 1;
+    noise.period = NOISE_PERIODS[0];
+    dmc = Dmc();
+    dmc.period = DMC_PERIODS[0];
+    dmc.bits = 8;
+    dmc.silent = true;
+    pulses[0].next = pulses[1].next = triangle.next = noise.next = dmc.next
+        = cycle;
+
+    enabled = 0;
+    fiveStep = false;
+    irqInhibit = false;
+    frameIrq = false;
+    dmcIrq = false;
+    sequenceStart = cycle;
+    sequenceStep = 0;
+    nextStep = sequenceStart + SEQUENCE_STEPS[0];
+
+    Bus &bus = cpu->get_bus();
+    previous = bus.get_device(0x40);
+    bus.map_io(0x4000, Bus::PAGE_SIZE, this);
+    cpu->attach(this);
+}
+
+Apu::~Apu(void)
+{
+    Bus &bus = cpu->get_bus();
+    if (bus.get_device(0x40) == this) {
+        bus.map_io(0x4000, Bus::PAGE_SIZE, previous);
+    }
+    cpu->detach(this);
+}
+
+u32 Apu::get_sample_rate(void) const
+{
+    return blip.get_sample_rate();
+}
+
+const char *Apu::channel_name(Channel channel)
+{
+    static const char *names[CHANNEL_COUNT] = {
+        "pulse1", "pulse2", "triangle", "noise", "dmc",
+    };
+    return channel < CHANNEL_COUNT ? names[channel] : "unknown";
+}
+
+u32 Apu::read_samples(s16 *out, u32 count, s16 *const *channels)
+{
+    run_to(cpu->get_cycles());
+    end_frame();
+    count = blip.read_samples(out, count);
+    for (u32 i = 0; i < CHANNEL_COUNT && channelBlips[i]; i++) {
+        channelBlips[i]->read_samples(channels ? channels[i] : NULL, count);
+    }
+    return count;
+}
+
+u32 Apu::samples_available(void)
+{
+    run_to(cpu->get_cycles());
+    end_frame();
+    return blip.samples_available();
+}
+
+u64 Apu::get_dropped_samples(void) const
+{
+    return dropped;
+}
+
+void Apu::set_channel_capture(bool on)
+{
+    run_to(cpu->get_cycles());
+    end_frame();
+    if (!on) {
+        for (std::unique_ptr<BlipBuffer> &channel : channelBlips) {
+            channel.reset();
+        }
+        return;
+    }
+    if (channelBlips[0]) {
+        return;
+    }
+
+    // the channels' buffers start empty, in step with the mix's down to the
+    // fraction of a sample it is into the next. Each starts at 0 whatever
+    // level its channel is at, like the mix does at power on, the high-pass
+    // takes DC out anyway.
+    drop_samples(blip.samples_available());
+    for (std::unique_ptr<BlipBuffer> &channel : channelBlips) {
+        channel.reset(new BlipBuffer(blip));
+        channel->clear();
+    }
+}
+
+bool Apu::get_channel_capture(void) const
+{
+    return channelBlips[0] != nullptr;
+}
+
+u8 Apu::io_read(u16 address)
+{
+    if (address == 0x4015) {
+        sync();
+        return read_status();
+    }
+    return previous ? previous->io_read(address) : ioPage[address & 0xff];
+}
+
+void Apu::io_write(u16 address, u8 val)
+{
+    if (address <= 0x4013 || address == 0x4015 || address == 0x4017) {
+        sync();
+        write_register(address, val);
+        update_levels();
+    } else if (previous) {
+        previous->io_write(address, val);
+    } else {
+        ioPage[address & 0xff] = val;
+    }
+}
+
+/**
+ * Nothing the APU does needs the cpu to stop, the catch up is only there to
+ * keep the samples of a frame from piling up.
+ */
+u64 Apu::catch_up(u64 target)
+{
+    run_to(target);
+    end_frame();
+    return target + Cpu::CYCLES_PER_FRAME;
+}
+
+/**
+ * Catches up to the cycle the cpu accesses the APU on.
+ */
+void Apu::sync(void)
+{
+    run_to(cpu->get_access_cycle());
+}
+
+/**
+ * Runs the channels in turn up to the next step of the frame counter, which
+ * may change their volume, and so on until the target.
+ */
+void Apu::run_to(u64 target)
+{
+    while (cycle < target) {
+        u64 end = std::min(target, nextStep);
+        run_pulse(CHANNEL_PULSE1, end);
+        run_pulse(CHANNEL_PULSE2, end);
+        run_triangle(end);
+        run_noise(end);
+        run_dmc(end);
+        cycle = end;
+        if (cycle == nextStep) {
+            clock_frame_counter();
+            update_levels();
+        }
+    }
+}
+
+/**
+ * Makes the samples up to where the APU has run readable, throwing away the
+ * oldest if nothing has been reading them.
+ */
+void Apu::end_frame(void)
+{
+    blip.end_frame(cycle - frameStart);
+    for (u32 i = 0; i < CHANNEL_COUNT && channelBlips[i]; i++) {
+        channelBlips[i]->end_frame(cycle - frameStart);
+    }
+    frameStart = cycle;
+    u32 available = blip.samples_available();
+    if (available > maxBuffered) {
+        drop_samples(available - maxBuffered);
+    }
+}
+
+/**
+ * Throws away the oldest samples of the mix and of every channel.
+ */
+void Apu::drop_samples(u32 count)
+{
+    dropped += blip.read_samples(NULL, count);
+    for (u32 i = 0; i < CHANNEL_COUNT && channelBlips[i]; i++) {
+        channelBlips[i]->read_samples(NULL, count);
+    }
+}
+
+void Apu::set_level(Channel channel, s32 &level, s32 output, u64 when)
+{
+    if (output != level) {
+        s32 delta = (output - level) * WEIGHTS[channel];
+        blip.add_delta(when - frameStart, delta);
+        if (channelBlips[channel]) {
+            channelBlips[channel]->add_delta(when - frameStart, delta);
+        }
+        level = output;
+    }
+}
+
+void Apu::run_pulse(Channel channel, u64 end)
+{
+    Pulse &pulse = pulses[channel];
+    u64 period = 2 * (pulse.period + 1);
+    if (pulse.next >= end) {
+        return;
+    }
+    if (!pulse.length || pulse.muted() || !pulse.envelope.volume()) {
+        // silent until something changes, keep the phase and move on
+        u64 steps = (end - pulse.next + period - 1) / period;
+        pulse.step = (pulse.step + steps) & 7;
+        pulse.next += steps * period;
+        return;
+    }
+    for (; pulse.next < end; pulse.next += period) {
+        pulse.step = (pulse.step + 1) & 7;
+        set_level(channel, pulse.level, pulse.output(), pulse.next);
+    }
+}
+
+void Apu::run_triangle(u64 end)
+{
+    u64 period = triangle.period + 1;
+    if (triangle.next >= end) {
+        return;
+    }
+    if (!triangle.stepping()) {
+        triangle.next += (end - triangle.next + period - 1) / period * period;
+        return;
+    }
+    for (; triangle.next < end; triangle.next += period) {
+        triangle.step = (triangle.step + 1) & 31;
+        set_level(CHANNEL_TRIANGLE, triangle.level, triangle.output(),
+                triangle.next);
+    }
+}
+
+void Apu::run_noise(u64 end)
+{
+    // the shift register runs even while the channel is silent, only what
+    // it outputs doesn't matter then
+    bool silent = !noise.length || !noise.envelope.volume();
+    for (; noise.next < end; noise.next += noise.period) {
+        u16 feedback = (noise.shift ^ (noise.shift >> (noise.mode ? 6 : 1)))
+            & 1;
+        noise.shift = (noise.shift >> 1) | (feedback << 14);
+        if (!silent) {
+            set_level(CHANNEL_NOISE, noise.level, noise.output(), noise.next);
+        }
+    }
+}
+
+void Apu::run_dmc(u64 end)
+{
+    if (dmc.next >= end) {
+        return;
+    }
+    if (dmc.silent && !dmc.bufferFull) {
+        // nothing to play until $4015 starts a sample, only the bit count
+        // has to stay in step
+        u64 steps = (end - dmc.next + dmc.period - 1) / dmc.period;
+        dmc.bits = (dmc.bits - 1 + 8 - steps % 8) % 8 + 1;
+        dmc.next += steps * dmc.period;
+        return;
+    }
+    for (; dmc.next < end; dmc.next += dmc.period) {
+        if (!dmc.silent) {
+            if (dmc.shift & 1) {
+                if (dmc.output <= 125) {
+                    dmc.output += 2;
+                }
+            } else if (dmc.output >= 2) {
+                dmc.output -= 2;
+            }
+            set_level(CHANNEL_DMC, dmc.level, dmc.output, dmc.next);
+        }
+        dmc.shift >>= 1;
+        if (--dmc.bits == 0) {
+            dmc.bits = 8;
+            dmc.silent = !dmc.bufferFull;
+            if (dmc.bufferFull) {
+                dmc.shift = dmc.buffer;
+                dmc.bufferFull = false;
+                fetch_dmc();
+            }
+        }
+    }
+}
+
+/**
+ * Fills the sample buffer from memory, if it is empty and there are bytes
+ * left. The fetch steals cpu cycles on hardware, that isn't emulated.
+ */
+void Apu::fetch_dmc(void)
+{
+    if (dmc.bufferFull || !dmc.remaining) {
+        return;
+    }
+    dmc.buffer = cpu->read_memory(dmc.address);
+    dmc.bufferFull = true;
+    dmc.address = dmc.address == 0xffff ? 0x8000 : dmc.address + 1;
+    if (--dmc.remaining == 0) {
+        if (dmc.loop) {
+            restart_dmc();
+        } else if (dmc.irqEnabled) {
+            dmcIrq = true;
+        }
+    }
+}
+
+void Apu::restart_dmc(void)
+{
+    dmc.address = dmc.start;
+    dmc.remaining = dmc.size;
+}
+
+void Apu::clock_frame_counter(void)
+{
+    switch (sequenceStep) {
+    case 0:
+    case 2:
+        quarter_frame();
+        break;
+    case 3:
+        if (fiveStep) {
+            break;
+        }
+        if (!irqInhibit) {
+            frameIrq = true;
+        }
+        // fall through
+    default:
+        quarter_frame();
+        half_frame();
+        break;
+    }
+    if (++sequenceStep == (fiveStep ? 5u : 4u)) {
+        sequenceStart += fiveStep ? FIVE_STEP_LENGTH : FOUR_STEP_LENGTH;
+        sequenceStep = 0;
+    }
+    nextStep = sequenceStart + SEQUENCE_STEPS[sequenceStep];
+}
+
+void Apu::quarter_frame(void)
+{
+    pulses[0].envelope.clock();
+    pulses[1].envelope.clock();
+    noise.envelope.clock();
+    if (triangle.linearReload) {
+        triangle.linear = triangle.linearPeriod;
+    } else if (triangle.linear) {
+        triangle.linear--;
+    }
+    if (!triangle.control) {
+        triangle.linearReload = false;
+    }
+}
+
+void Apu::half_frame(void)
+{
+    for (Pulse &pulse : pulses) {
+        if (pulse.length && !pulse.envelope.loop) {
+            pulse.length--;
+        }
+        pulse.clock_sweep();
+    }
+    if (triangle.length && !triangle.control) {
+        triangle.length--;
+    }
+    if (noise.length && !noise.envelope.loop) {
+        noise.length--;
+    }
+}
+
+/**
+ * Records the levels the channels are at now, after something other than
+ * their timers changed them.
+ */
+void Apu::update_levels(void)
+{
+    set_level(CHANNEL_PULSE1, pulses[0].level, pulses[0].output(), cycle);
+    set_level(CHANNEL_PULSE2, pulses[1].level, pulses[1].output(), cycle);
+    set_level(CHANNEL_TRIANGLE, triangle.level, triangle.output(), cycle);
+    set_level(CHANNEL_NOISE, noise.level, noise.output(), cycle);
+    set_level(CHANNEL_DMC, dmc.level, dmc.output, cycle);
+}
+
+u8 Apu::read_status(void)
+{
+    u8 status = (pulses[0].length ? 0x01 : 0) | (pulses[1].length ? 0x02 : 0)
+        | (triangle.length ? 0x04 : 0) | (noise.length ? 0x08 : 0)
+        | (dmc.remaining ? 0x10 : 0) | (frameIrq ? 0x40 : 0)
+        | (dmcIrq ? 0x80 : 0);
+    frameIrq = false;
+    return status;
+}
+
+void Apu::write_register(u16 address, u8 val)
+{
+    Pulse &pulse = pulses[(address >> 2) & 1];
+    switch (address) {
+    case 0x4000:
+    case 0x4004:
+        pulse.duty = val >> 6;
+        pulse.envelope.loop = val & 0x20;
+        pulse.envelope.constant = val & 0x10;
+        pulse.envelope.period = val & 0x0f;
+        break;
+    case 0x4001:
+    case 0x4005:
+        pulse.sweepEnabled = val & 0x80;
+        pulse.sweepPeriod = (val >> 4) & 7;
+        pulse.sweepNegate = val & 0x08;
+        pulse.sweepShift = val & 7;
+        pulse.sweepReload = true;
+        break;
+    case 0x4002:
+    case 0x4006:
+        pulse.period = (pulse.period & 0x700) | val;
+        break;
+    case 0x4003:
+    case 0x4007:
+        pulse.period = (pulse.period & 0xff) | ((val & 7) << 8);
+        if (enabled & (address == 0x4003 ? 0x01 : 0x02)) {
+            pulse.length = LENGTHS[val >> 3];
+        }
+        pulse.step = 0;
+        pulse.envelope.start = true;
+        break;
+    case 0x4008:
+        triangle.control = val & 0x80;
+        triangle.linearPeriod = val & 0x7f;
+        break;
+    case 0x400a:
+        triangle.period = (triangle.period & 0x700) | val;
+        break;
+    case 0x400b:
+        triangle.period = (triangle.period & 0xff) | ((val & 7) << 8);
+        if (enabled & 0x04) {
+            triangle.length = LENGTHS[val >> 3];
+        }
+        triangle.linearReload = true;
+        break;
+    case 0x400c:
+        noise.envelope.loop = val & 0x20;
+        noise.envelope.constant = val & 0x10;
+        noise.envelope.period = val & 0x0f;
+        break;
+    case 0x400e:
+        noise.mode = val & 0x80;
+        noise.period = NOISE_PERIODS[val & 0x0f];
+        break;
+    case 0x400f:
+        if (enabled & 0x08) {
+            noise.length = LENGTHS[val >> 3];
+        }
+        noise.envelope.start = true;
+        break;
+    case 0x4010:
+        dmc.irqEnabled = val & 0x80;
+        if (!dmc.irqEnabled) {
+            dmcIrq = false;
+        }
+        dmc.loop = val & 0x40;
+        dmc.period = DMC_PERIODS[val & 0x0f];
+        break;
+    case 0x4011:
+        dmc.output = val & 0x7f;
+        break;
+    case 0x4012:
+        dmc.start = 0xc000 + val * 64;
+        break;
+    case 0x4013:
+        dmc.size = val * 16 + 1;
+        break;
+    case 0x4015:
+        enabled = val & 0x1f;
+        if (!(val & 0x01)) {
+            pulses[0].length = 0;
+        }
+        if (!(val & 0x02)) {
+            pulses[1].length = 0;
+        }
+        if (!(val & 0x04)) {
+            triangle.length = 0;
+        }
+        if (!(val & 0x08)) {
+            noise.length = 0;
+        }
+        dmcIrq = false;
+        if (!(val & 0x10)) {
+            dmc.remaining = 0;
+        } else if (!dmc.remaining) {
+            restart_dmc();
+            fetch_dmc();
+        }
+        break;
+    case 0x4017:
+        fiveStep = val & 0x80;
+        irqInhibit = val & 0x40;
+        if (irqInhibit) {
+            frameIrq = false;
+        }
+        // the sequence restarts 3 or 4 cycles after the write, 5 step mode
+        // clocks everything straight away
+        sequenceStart = cycle + 3 + (cycle & 1);
+        sequenceStep = 0;
+        nextStep = sequenceStart + SEQUENCE_STEPS[0];
+        if (fiveStep) {
+            quarter_frame();
+            half_frame();
+        }
+        break;
+    }
+}
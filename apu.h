@@ -0,0 +1,224 @@
+#ifndef APU_H
+#define APU_H
+
+#include "utils.h"
+#include "bus.h"
+#include "cpu.h"
+#include "blip_buffer.h"
+#include <memory>
+
+/**
+ * The 2A03's audio processing unit: two pulse channels, a triangle, noise
+ * and the delta modulation channel, with the frame counter that clocks their
+ * envelopes, sweeps and length counters. Like the PPU it is not stepped with
+ * the cpu. It sleeps until one of its registers is accessed, until the
+ * samples are asked for or for at most a frame, then runs each channel on
+ * its own up to the cpu, from one timer clock to the next, and only records
+ * the times its output level changes into a BlipBuffer. A silent channel
+ * skips ahead without looking at its timer at all.
+ *
+ * The channels are mixed with the usual linear approximation of the NES's
+ * mixer. The frame counter and DMC set their interrupt flags in $4015, the
+ * cpu has no IRQ line yet, so they have to be polled.
+ */
+class Apu : public IoDevice, public ClockedDevice
+{
+public:
+    static const u32 CLOCK_RATE = 1789773;
+
+    enum Channel
+    {
+        CHANNEL_PULSE1,
+        CHANNEL_PULSE2,
+        CHANNEL_TRIANGLE,
+        CHANNEL_NOISE,
+        CHANNEL_DMC,
+        CHANNEL_COUNT,
+    };
+
+    static const char *channel_name(Channel channel);
+
+    /**
+     * Maps the APU registers, $4000-$4013, $4015 and $4017, on the cpu's
+     * bus and runs the APU off the cpu's clock. The rest of the page still
+     * goes to the device that was on it before, e.g. OAM DMA at $4014 to
+     * the PPU, so the APU has to be made after it and destroyed before it.
+     *
+     * @param sample_rate: The rate read_samples() gives samples at.
+     */
+    Apu(Cpu &c, u32 sample_rate = 48000);
+
+    /**
+     * Gives the page back to the device that had it and detaches the APU
+     * from the cpu.
+     */
+    ~Apu(void);
+
+    Apu(const Apu &) = delete;
+    Apu &operator=(const Apu &) = delete;
+
+    u32 get_sample_rate(void) const;
+
+    /**
+     * Catches up to the cpu and reads the oldest samples, mono 16 bit.
+     *
+     * @param channels: With channel capture on, CHANNEL_COUNT buffers for
+     * the same samples of each channel on its own, or NULL.
+     * @return: How many samples were read, at most count.
+     */
+    u32 read_samples(s16 *out, u32 count, s16 *const *channels = NULL);
+
+    /**
+     * @return: The samples ready to read once the APU has caught up.
+     */
+    u32 samples_available(void);
+
+    /**
+     * @return: The samples thrown away because nothing read them, the APU
+     * keeps a quarter of a second at most.
+     */
+    u64 get_dropped_samples(void) const;
+
+    /**
+     * Starts or stops keeping the samples of each channel on its own as
+     * well as the mix, at the levels they have in it, e.g. to record them
+     * separately. Every channel costs as much again as the mix did. The mix
+     * samples not read yet are dropped, so the channels start in step.
+     */
+    void set_channel_capture(bool on);
+    bool get_channel_capture(void) const;
+
+    u8 io_read(u16 address) override;
+    void io_write(u16 address, u8 val) override;
+    u64 catch_up(u64 cycle) override;
+
+private:
+    struct Envelope
+    {
+        bool start;
+        bool loop;      // also halts the length counter
+        bool constant;
+        u8 period;      // also the constant volume
+        u8 divider;
+        u8 decay;
+
+        void clock(void);
+        u8 volume(void) const;
+    };
+
+    struct Pulse
+    {
+        Envelope envelope;
+        u8 duty;
+        u8 step;
+        u16 period;
+        u8 length;
+        bool sweepEnabled;
+        bool sweepNegate;
+        bool sweepReload;
+        u8 sweepPeriod;
+        u8 sweepShift;
+        u8 sweepDivider;
+        bool ones;      // pulse 1 negates with ones' complement
+        u64 next;       // the cpu cycle of the next sequencer step
+        s32 level;
+
+        u16 sweep_target(void) const;
+        bool muted(void) const;
+        void clock_sweep(void);
+        s32 output(void) const;
+    };
+
+    struct Triangle
+    {
+        bool control;   // also halts the length counter
+        u8 linearPeriod;
+        u8 linear;
+        bool linearReload;
+        u16 period;
+        u8 length;
+        u8 step;
+        u64 next;
+        s32 level;
+
+        bool stepping(void) const;
+        s32 output(void) const;
+    };
+
+    struct Noise
+    {
+        Envelope envelope;
+        bool mode;
+        u16 period;
+        u16 shift;
+        u8 length;
+        u64 next;
+        s32 level;
+
+        s32 output(void) const;
+    };
+
+    struct Dmc
+    {
+        bool irqEnabled;
+        bool loop;
+        u16 period;
+        u16 start;
+        u16 size;
+        u16 address;
+        u16 remaining;  // bytes still to fetch
+        u8 buffer;
+        bool bufferFull;
+        u8 shift;
+        u8 bits;
+        bool silent;
+        u8 output;
+        u64 next;
+        s32 level;
+    };
+
+    Cpu *cpu;
+    IoDevice *previous;     // the device the rest of the page goes to
+    u8 ioPage[0x100];       // the page without a previous device
+    BlipBuffer blip;
+    // each channel's own, with channel capture on
+    std::unique_ptr<BlipBuffer> channelBlips[CHANNEL_COUNT];
+    u64 cycle;              // the APU has run up to here
+    u64 frameStart;         // where the blip buffer's frame started
+    u64 dropped;
+    u32 maxBuffered;
+
+    Pulse pulses[2];
+    Triangle triangle;
+    Noise noise;
+    Dmc dmc;
+
+    u8 enabled;             // the channels on in $4015
+    bool fiveStep;
+    bool irqInhibit;
+    bool frameIrq;
+    bool dmcIrq;
+    u64 sequenceStart;      // the frame counter's sequence started here
+    u32 sequenceStep;       // the next step of the sequence
+    u64 nextStep;           // the cpu cycle it is due on
+
+    void run_to(u64 target);
+    void end_frame(void);
+    void drop_samples(u32 count);
+    void sync(void);
+    void set_level(Channel channel, s32 &level, s32 output, u64 when);
+    void run_pulse(Channel channel, u64 end);
+    void run_triangle(u64 end);
+    void run_noise(u64 end);
+    void run_dmc(u64 end);
+    void fetch_dmc(void);
+    void restart_dmc(void);
+    void clock_frame_counter(void);
+    void quarter_frame(void);
+    void half_frame(void);
+    void update_levels(void);
+    u8 read_status(void);
+    void write_register(u16 address, u8 val);
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "audio_output.h"
+
+AudioOutput::AudioOutput(u32 input_rate, u32 output_rate, u32 target_ms)
+    : stream(input_rate, output_rate, target_ms), device(0),
+    initialised(false), deviceRate(0), deviceSamples(0)
+{
+}
+
+AudioOutput::~AudioOutput(void)
+{
+    close();
+}
+
+bool AudioOutput::open(u32 device_samples)
+{
+    close();
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO)) {
+        error = std::string("failed to start SDL audio: ") + SDL_GetError();
+        return false;
+    }
+    initialised = true;
+
+    SDL_AudioSpec want, have;
+    SDL_zero(want);
+    want.freq = static_cast<int>(stream.get_output_rate());
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = static_cast<Uint16>(device_samples);
+    want.callback = callback;
+    want.userdata = this;
+    // no changes allowed, SDL converts to whatever the device wants itself
+    device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if (!device) {
+        error = std::string("failed to open an audio device: ")
+            + SDL_GetError();
+        close();
+        return false;
+    }
+    deviceRate = have.freq;
+    deviceSamples = have.samples;
+    SDL_PauseAudioDevice(device, 0);
+    return true;
+}
+
+void AudioOutput::close(void)
+{
+    if (device) {
+        // waits for a callback in progress
+        SDL_CloseAudioDevice(device);
+        device = 0;
+    }
+    if (initialised) {
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        initialised = false;
+    }
+    deviceRate = 0;
+    deviceSamples = 0;
+}
+
+u32 AudioOutput::push_samples(const s16 *in, u32 count)
+{
+    return stream.push_samples(in, count);
+}
+
+AudioStream &AudioOutput::get_stream(void)
+{
+    return stream;
+}
+
+u32 AudioOutput::get_device_rate(void) const
+{
+    return deviceRate;
+}
+
+double AudioOutput::get_latency_ms(void) const
+{
+    double buffered = deviceRate ? deviceSamples * 1000.0 / deviceRate : 0;
+    return stream.get_latency_ms() + buffered;
+}
+
+u64 AudioOutput::get_underruns(void) const
+{
+    return stream.get_underruns();
+}
+
+const std::string &AudioOutput::get_error(void) const
+{
+    return error;
+}
+
+void SDLCALL AudioOutput::callback(void *data, Uint8 *out, int bytes)
+{
+    AudioOutput *output = static_cast<AudioOutput *>(data);
+    output->stream.pull_samples(reinterpret_cast<s16 *>(out),
+            static_cast<u32>(bytes) / sizeof(s16));
+}
@@ -0,0 +1,87 @@
+#ifndef AUDIO_OUTPUT_H
+#define AUDIO_OUTPUT_H
+
+#include "utils.h"
+#include "audio_stream.h"
+#include <SDL.h>
+#include <string>
+
+/**
+ * Plays an AudioStream on an SDL audio device, mono 16 bit. SDL's audio
+ * thread pulls from the stream in its callback, the emulation thread
+ * pushes to it, so nothing the emulation does waits on the sound card.
+ *
+ * Which driver SDL uses is up to it, set SDL_AUDIODRIVER=dummy to run
+ * without a sound card, e.g. in tests: the dummy driver still calls back
+ * in real time and throws the samples away.
+ */
+class AudioOutput
+{
+public:
+    /**
+     * Nothing is played until open().
+     *
+     * @param input_rate: The rate samples are pushed at, e.g. the Apu's.
+     * @param target_ms: The latency the stream is kept at, on top of the
+     * device's buffer.
+     */
+    AudioOutput(u32 input_rate, u32 output_rate = 48000, u32 target_ms = 50);
+    ~AudioOutput(void);
+
+    AudioOutput(const AudioOutput &) = delete;
+    AudioOutput &operator=(const AudioOutput &) = delete;
+
+    /**
+     * Opens the default device and starts playing, silence until the
+     * stream has filled up.
+     *
+     * @param device_samples: The size of the device's buffer, a power of
+     * two; smaller is less latency, more callbacks.
+     * @return: False if SDL or the device failed, see get_error().
+     */
+    bool open(u32 device_samples = 512);
+
+    /**
+     * Stops playing and closes the device, open() can be called again.
+     */
+    void close(void);
+
+    /**
+     * Resamples and queues samples to play. Called by one thread only.
+     *
+     * @return: How many output samples didn't fit and were dropped.
+     */
+    u32 push_samples(const s16 *in, u32 count);
+
+    AudioStream &get_stream(void);
+
+    /**
+     * @return: The rate the device actually plays at, 0 if not open.
+     */
+    u32 get_device_rate(void) const;
+
+    /**
+     * @return: How long until a sample pushed now is played: the stream's
+     * latency and the device's buffer.
+     */
+    double get_latency_ms(void) const;
+
+    /**
+     * @return: How many times the stream ran dry while playing.
+     */
+    u64 get_underruns(void) const;
+
+    const std::string &get_error(void) const;
+
+private:
+    AudioStream stream;
+    SDL_AudioDeviceID device;
+    bool initialised;       // whether the audio subsystem is ours to quit
+    u32 deviceRate;
+    u32 deviceSamples;
+    std::string error;
+
+    static void SDLCALL callback(void *data, Uint8 *out, int bytes);
+};
+
+#endif
@@ -0,0 +1,252 @@
+#include <string.h>
+#include <algorithm>
+#include <filesystem>
+
+#include "audio_sink.h"
+
+static const u32 WAV_HEADER_SIZE = 44;
+// the sizes are 32 bit, a longer stream keeps the most a WAV can say
+static const u64 WAV_MAX_DATA = 0xffffffffull - (WAV_HEADER_SIZE - 8);
+
+static bool is_wav(const std::string &path)
+{
+    return path.size() >= 4 && path.compare(path.size() - 4, 4, ".wav") == 0;
+}
+
+static void put_u16(u8 *out, u16 val)
+{
+    out[0] = static_cast<u8>(val);
+    out[1] = static_cast<u8>(val >> 8);
+}
+
+static void put_u32(u8 *out, u32 val)
+{
+    put_u16(out, static_cast<u16>(val));
+    put_u16(out + 2, static_cast<u16>(val >> 16));
+}
+
+static u32 get_u32(const u8 *in)
+{
+    return in[0] | (in[1] << 8) | (in[2] << 16)
+        | (static_cast<u32>(in[3]) << 24);
+}
+
+/**
+ * (Re)writes the canonical 44 byte header of a mono 16 bit PCM WAV at the
+ * start of the file, leaving the file position at its end.
+ */
+static bool write_wav_header(FILE *fp, u32 sample_rate, u64 data_bytes)
+{
+    u32 size = static_cast<u32>(std::min(data_bytes, WAV_MAX_DATA));
+    u8 header[WAV_HEADER_SIZE];
+    memcpy(header, "RIFF", 4);
+    put_u32(header + 4, size + WAV_HEADER_SIZE - 8);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_u32(header + 16, 16);
+    put_u16(header + 20, 1);                // PCM
+    put_u16(header + 22, 1);                // mono
+    put_u32(header + 24, sample_rate);
+    put_u32(header + 28, sample_rate * 2);  // bytes a second
+    put_u16(header + 32, 2);                // bytes a sample
+    put_u16(header + 34, 16);               // bits a sample
+    memcpy(header + 36, "data", 4);
+    put_u32(header + 40, size);
+    return !fseek(fp, 0, SEEK_SET)
+        && fwrite(header, 1, sizeof(header), fp) == sizeof(header)
+        && !fseek(fp, 0, SEEK_END);
+}
+
+AudioSink::AudioSink(const std::vector<std::string> &paths, u32 sample_rate)
+    : paths(paths), sampleRate(sample_rate), stopping(false), written(0)
+{
+    blocks.reset(new Block[BLOCKS]);
+    for (u32 i = 0; i < BLOCKS; i++) {
+        blocks[i].count = 0;
+        blocks[i].samples.resize(paths.size() * BLOCK_SAMPLES);
+        freeBlocks.push(&blocks[i]);
+    }
+    freeBlocks.pop(current);
+    thread = std::thread(&AudioSink::run, this);
+}
+
+AudioSink::~AudioSink(void)
+{
+    close();
+}
+
+void AudioSink::push_samples(const s16 *const *streams, u32 count)
+{
+    for (u32 done = 0; current && done < count;) {
+        u32 part = std::min(count - done, BLOCK_SAMPLES - current->count);
+        for (size_t i = 0; i < paths.size(); i++) {
+            memcpy(&current->samples[i * BLOCK_SAMPLES + current->count],
+                    streams[i] + done, part * sizeof(s16));
+        }
+        current->count += part;
+        done += part;
+        if (current->count == BLOCK_SAMPLES) {
+            send_block();
+        }
+    }
+}
+
+void AudioSink::push_samples(const s16 *samples, u32 count)
+{
+    push_samples(&samples, count);
+}
+
+bool AudioSink::close(void)
+{
+    if (thread.joinable()) {
+        if (current->count) {
+            readyBlocks.push(current);
+        }
+        current = NULL;
+        stopping = true;
+        thread.join();
+    }
+    return error.empty();
+}
+
+u64 AudioSink::get_written_samples(void) const
+{
+    return written;
+}
+
+const std::string &AudioSink::get_error(void) const
+{
+    return error;
+}
+
+/**
+ * Hands the full block to the writer and waits for an empty one. There are
+ * as many slots in the ring as blocks, so the push can't fail, and the
+ * writer gives every block back, even after an error.
+ */
+void AudioSink::send_block(void)
+{
+    readyBlocks.push(current);
+    u32 tries = 0;
+    while (!freeBlocks.pop(current)) {
+        back_off(tries);
+    }
+    current->count = 0;
+}
+
+void AudioSink::run(void)
+{
+    bool ok = true;
+    std::vector<FILE *> files(paths.size(), NULL);
+    for (size_t i = 0; ok && i < paths.size(); i++) {
+        files[i] = fopen(paths[i].c_str(), "wb");
+        if (!files[i] || (is_wav(paths[i])
+                    && !write_wav_header(files[i], sampleRate, 0))) {
+            error = "failed to open " + paths[i];
+            ok = false;
+        }
+    }
+
+    std::vector<u8> bytes(BLOCK_SAMPLES * 2);
+    u64 samples = 0;
+    u32 tries = 0;
+    while (true) {
+        // stopping is read first, so a block pushed before close() is
+        // always seen by the pop
+        bool draining = stopping;
+        Block *block;
+        if (!readyBlocks.pop(block)) {
+            if (draining) {
+                break;
+            }
+            back_off(tries);
+            continue;
+        }
+        tries = 0;
+
+        for (size_t i = 0; ok && i < files.size(); i++) {
+            // little endian whatever the host is
+            const s16 *in = &block->samples[i * BLOCK_SAMPLES];
+            for (u32 j = 0; j < block->count; j++) {
+                put_u16(&bytes[j * 2], static_cast<u16>(in[j]));
+            }
+            ok = fwrite(bytes.data(), 2, block->count, files[i])
+                == block->count;
+            if (ok && is_wav(paths[i])) {
+                ok = write_wav_header(files[i], sampleRate,
+                        (samples + block->count) * 2);
+            }
+            // what is flushed survives the process crashing
+            ok = ok && !fflush(files[i]);
+            if (!ok) {
+                error = "failed to write " + paths[i];
+            }
+        }
+        if (ok) {
+            samples += block->count;
+            written = samples;
+        }
+        freeBlocks.push(block);
+    }
+
+    for (size_t i = 0; i < files.size(); i++) {
+        if (files[i] && fclose(files[i]) && error.empty()) {
+            error = "failed to write " + paths[i];
+        }
+    }
+}
+
+bool repair_wav(const std::string &path, std::string &error)
+{
+    std::error_code ec;
+    u64 length = std::filesystem::file_size(path, ec);
+    FILE *fp = ec ? NULL : fopen(path.c_str(), "r+b");
+    if (!fp) {
+        error = "failed to open " + path;
+        return false;
+    }
+
+    // walks the chunks up to the data, which is the one left unfinished
+    u8 header[12];
+    bool found = fread(header, 1, sizeof(header), fp) == sizeof(header)
+        && !memcmp(header, "RIFF", 4) && !memcmp(header + 8, "WAVE", 4);
+    u64 position = sizeof(header);
+    u32 align = 1;
+    u8 chunk[16];
+    while (found) {
+        if (fseek(fp, static_cast<long>(position), SEEK_SET)
+                || fread(chunk, 1, 8, fp) != 8) {
+            found = false;
+            break;
+        }
+        if (!memcmp(chunk, "data", 4)) {
+            break;
+        }
+        u32 size = get_u32(chunk + 4);
+        if (!memcmp(chunk, "fmt ", 4) && size >= 16) {
+            found = fread(chunk, 1, 16, fp) == 16;
+            align = std::max(chunk[12] | (chunk[13] << 8), 1);
+        }
+        // chunks are padded to an even size
+        position += 8 + size + (size & 1);
+    }
+    if (!found) {
+        fclose(fp);
+        error = path + " isn't a WAV file";
+        return false;
+    }
+
+    u64 start = position + 8;
+    u64 data = std::min((length - std::min(length, start)) / align * align,
+            WAV_MAX_DATA);
+    u8 size[4];
+    put_u32(size, static_cast<u32>(start + data - 8));
+    bool ok = !fseek(fp, 4, SEEK_SET) && fwrite(size, 1, 4, fp) == 4;
+    put_u32(size, static_cast<u32>(data));
+    ok = ok && !fseek(fp, static_cast<long>(position + 4), SEEK_SET)
+        && fwrite(size, 1, 4, fp) == 4;
+    if (fclose(fp) || !ok) {
+        error = "failed to write " + path;
+        return false;
+    }
+    return true;
+}
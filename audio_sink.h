@@ -0,0 +1,108 @@
+#ifndef AUDIO_SINK_H
+#define AUDIO_SINK_H
+
+#include "utils.h"
+#include "spsc_ring.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Records streams of mono 16 bit samples, e.g. the APU's mix and each of
+ * its channels, to one file each: WAV for paths ending in .wav, otherwise
+ * raw little endian PCM. The emulation only copies samples into blocks of
+ * a ring; a writer thread does all the I/O, so a job records as fast as it
+ * runs. Unlike video no samples are ever dropped, a regression check needs
+ * all of them, so when every block is taken the emulation waits for one.
+ *
+ * Each block is flushed as it is written, and a WAV's header is rewritten
+ * with the sizes after it, so a file left by a crash is valid up to the
+ * last block, and repair_wav() takes it up to the last sample.
+ */
+class AudioSink
+{
+public:
+    static const u32 BLOCK_SAMPLES = 4096;
+    static const u32 BLOCKS = 16;
+
+    /**
+     * Starts the writer thread, which opens the files.
+     *
+     * @param paths: Where each stream goes.
+     */
+    AudioSink(const std::vector<std::string> &paths, u32 sample_rate);
+
+    /**
+     * Closes the files, see close().
+     */
+    ~AudioSink(void);
+
+    AudioSink(const AudioSink &) = delete;
+    AudioSink &operator=(const AudioSink &) = delete;
+
+    /**
+     * Queues samples of every stream, waiting for the writer if the ring is
+     * full. Samples pushed after close() or a write error are thrown away.
+     * Called by one thread only.
+     *
+     * @param streams: count samples for each path, in order.
+     */
+    void push_samples(const s16 *const *streams, u32 count);
+
+    /**
+     * Queues samples when there is only the one stream.
+     */
+    void push_samples(const s16 *samples, u32 count);
+
+    /**
+     * Writes the samples queued, finishes the files and closes them.
+     *
+     * @return: Whether every sample was written, see get_error().
+     */
+    bool close(void);
+
+    /**
+     * @return: The samples of each stream written so far.
+     */
+    u64 get_written_samples(void) const;
+
+    /**
+     * @return: What went wrong with the files, empty if nothing did. Only
+     * set once close() returns.
+     */
+    const std::string &get_error(void) const;
+
+private:
+    struct Block
+    {
+        u32 count;
+        std::vector<s16> samples;   // BLOCK_SAMPLES of each stream in turn
+    };
+
+    std::vector<std::string> paths;
+    u32 sampleRate;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    std::atomic<u64> written;
+    std::string error;          // the writer's, read after it is joined
+
+    std::unique_ptr<Block[]> blocks;
+    Block *current;             // the block being filled, NULL once closed
+    SpscRing<Block *, BLOCKS> readyBlocks;  // to the writer
+    SpscRing<Block *, BLOCKS> freeBlocks;   // back to the emulation
+
+    void send_block(void);
+    void run(void);
+};
+
+/**
+ * Sets the sizes in a WAV file's header from its length, e.g. for a file
+ * left behind by a crash; a partly written last sample is left out.
+ *
+ * @return: Whether the file could be fixed, error says why not.
+ */
+bool repair_wav(const std::string &path, std::string &error);
+
+#endif
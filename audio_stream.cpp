@@ -0,0 +1,81 @@
+#include <algorithm>
+
+#include "audio_stream.h"
+
+// how far each push moves the average fill towards the current one, about
+// half a second to settle at 60 pushes a second
+static const double FILL_SMOOTHING = 1.0 / 32;
+
+AudioStream::AudioStream(u32 input_rate, u32 output_rate, u32 target_ms,
+        ResamplerKind kind)
+    : outputRate(output_rate), resampler(input_rate, output_rate, kind),
+    dropped(0), playing(false), underruns(0), played(0)
+{
+    u64 samples = static_cast<u64>(output_rate) * target_ms / 1000;
+    target = static_cast<u32>(std::min(samples,
+                static_cast<u64>(RING_SIZE / 2)));
+    target = std::max(target, 1u);
+    averageFill = target;
+}
+
+u32 AudioStream::get_output_rate(void) const
+{
+    return outputRate;
+}
+
+u32 AudioStream::push_samples(const s16 *in, u32 count)
+{
+    // the ring is drained a whole device buffer at a time, so its fill is
+    // averaged over several pushes to leave out the sawtooth that makes
+    averageFill += (ring.size() - averageFill) * FILL_SMOOTHING;
+    double adjust = MAX_ADJUST * (target - averageFill) / target;
+    resampler.set_adjust(std::min(std::max(adjust, -MAX_ADJUST), MAX_ADJUST));
+
+    resampled.resize(resampler.max_output(count, MAX_ADJUST));
+    u32 made = resampler.process(in, count, resampled.data());
+    u32 lost = made - ring.push(resampled.data(), made);
+    dropped += lost;
+    return lost;
+}
+
+void AudioStream::pull_samples(s16 *out, u32 count)
+{
+    u32 got = 0;
+    if (!playing && ring.size() >= target) {
+        playing = true;
+    }
+    if (playing) {
+        got = ring.pop(out, count);
+        if (got < count) {
+            underruns++;
+            playing = false;
+        }
+        played += got;
+    }
+    std::fill(out + got, out + count, 0);
+}
+
+double AudioStream::get_adjust(void) const
+{
+    return resampler.get_adjust();
+}
+
+double AudioStream::get_latency_ms(void) const
+{
+    return ring.size() * 1000.0 / outputRate;
+}
+
+u64 AudioStream::get_underruns(void) const
+{
+    return underruns;
+}
+
+u64 AudioStream::get_played_samples(void) const
+{
+    return played;
+}
+
+u64 AudioStream::get_dropped_samples(void) const
+{
+    return dropped;
+}
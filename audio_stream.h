@@ -0,0 +1,100 @@
+#ifndef AUDIO_STREAM_H
+#define AUDIO_STREAM_H
+
+#include "utils.h"
+#include "resampler.h"
+#include "spsc_ring.h"
+#include <atomic>
+#include <vector>
+
+/**
+ * Carries samples from the emulation thread to the thread playing them:
+ * push_samples() resamples them to the output rate into a lock-free ring,
+ * pull_samples(), e.g. from an audio callback, takes them out. Neither side
+ * ever waits for the other.
+ *
+ * The emulated NES and the sound card run off different clocks, so the
+ * ring would slowly fill up or run dry. Instead of blocking the emulation
+ * when it is full, every push looks at how full the ring has been and
+ * makes the resampler give a little more or less output, at most 0.5%,
+ * which can't be heard, to keep it around the target. If it does run dry,
+ * the gap is filled with silence, counted as an underrun, and playing
+ * waits until the ring is back up to the target.
+ */
+class AudioStream
+{
+public:
+    // samples at the output rate, a third of a second at 48 kHz
+    static const u32 RING_SIZE = 16384;
+    static constexpr double MAX_ADJUST = 0.005;
+
+    /**
+     * @param input_rate: The rate samples are pushed at, e.g. the Apu's.
+     * @param target_ms: How much audio the ring is kept at, the latency
+     * it adds. At most half the ring.
+     */
+    AudioStream(u32 input_rate, u32 output_rate = 48000, u32 target_ms = 50,
+            ResamplerKind kind = best_resampler_kind());
+    ~AudioStream(void) {}
+
+    AudioStream(const AudioStream &) = delete;
+    AudioStream &operator=(const AudioStream &) = delete;
+
+    u32 get_output_rate(void) const;
+
+    /**
+     * Resamples the samples into the ring. Called by the producer only.
+     *
+     * @return: How many output samples didn't fit and were dropped.
+     */
+    u32 push_samples(const s16 *in, u32 count);
+
+    /**
+     * Fills out with the oldest samples, or silence while the ring fills
+     * up. Called by the consumer only.
+     */
+    void pull_samples(s16 *out, u32 count);
+
+    /**
+     * @return: The resampler's adjustment from the last push, positive when
+     * the ring was short and output is being stretched.
+     */
+    double get_adjust(void) const;
+
+    /**
+     * @return: How long the audio in the ring takes to play, the delay it
+     * adds to what is pushed now.
+     */
+    double get_latency_ms(void) const;
+
+    /**
+     * @return: How many times the ring ran dry while playing.
+     */
+    u64 get_underruns(void) const;
+
+    /**
+     * @return: The samples pulled out of the ring, not counting silence.
+     */
+    u64 get_played_samples(void) const;
+
+    /**
+     * @return: The output samples that didn't fit in the ring.
+     */
+    u64 get_dropped_samples(void) const;
+
+private:
+    u32 outputRate;
+    u32 target;             // the fill the rate control aims for
+    double averageFill;
+    Resampler resampler;
+    std::vector<s16> resampled;
+    u64 dropped;
+    SpscRing<s16, RING_SIZE> ring;
+
+    // the consumer's side
+    bool playing;
+    std::atomic<u64> underruns;
+    std::atomic<u64> played;
+};
+
+#endif
@@ -0,0 +1,749 @@
+#include "batch.h"
+#include "cartridge.h"
+#include "mapper.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "apu.h"
+#include "audio_sink.h"
+#include "thread_pool.h"
+#include "video_sink.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <csignal>
+#include <mutex>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+const u32 RAM_SIZE = 0x800;
+const u32 AUDIO_RATE = 48000;
+const u64 FNV_BASIS = 0xcbf29ce484222325ull;
+
+/**
+ * The memory a job's cartridge is mapped from and the mapper switching its
+ * banks. The Cpu and the Ppu have to outlive it, the mapper unmaps itself
+ * from them when it is destroyed.
+ */
+struct JobMemory
+{
+    u8 ram[RAM_SIZE];
+    Cartridge cart;
+    std::unique_ptr<Mapper> mapper;
+};
+
+bool read_file(const std::string &path, std::vector<u8> &data)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    u8 buffer[0x4000];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + read);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+/**
+ * Maps a loaded cartridge: 2KB of RAM mirrored up to $2000, and the rest
+ * through the mapper its header asks for. The cpu starts at the reset
+ * vector.
+ */
+bool map_cartridge(Cpu &cpu, Ppu &ppu, JobMemory &memory, std::string &error)
+{
+    memory.mapper = Mapper::create(cpu, ppu, memory.cart, error);
+    if (!memory.mapper) {
+        return false;
+    }
+    Bus &bus = cpu.get_bus();
+    bus.map(0x0000, 0x2000, memory.ram, RAM_SIZE, true);
+    cpu.set_pc(bus.read(0xfffc) | (bus.read(0xfffd) << 8));
+    return true;
+}
+
+/**
+ * @return: Whether the cpu sits on a jump to itself or a branch with a
+ * displacement of -2, which it can never leave.
+ */
+bool is_halted(Cpu &cpu)
+{
+    u16 pc = cpu.get_pc();
+    u8 op = cpu.read_memory(pc);
+    if (op == 0x4c) {
+        u16 target = cpu.read_memory(pc + 1) | (cpu.read_memory(pc + 2) << 8);
+        return target == pc;
+    }
+    return (op & 0x1f) == 0x10 && cpu.read_memory(pc + 1) == 0xfe;
+}
+
+/**
+ * blargg's test ROMs put DE B0 61 at $6001 once $6000 holds their status,
+ * which stays at $80 while the test runs. The message is a C string at
+ * $6004.
+ */
+bool blargg_finished(Cpu &cpu, u8 *status, std::string &message)
+{
+    if (cpu.read_memory(0x6001) != 0xde || cpu.read_memory(0x6002) != 0xb0
+            || cpu.read_memory(0x6003) != 0x61) {
+        return false;
+    }
+    *status = cpu.read_memory(0x6000);
+    if (*status >= 0x80) {
+        return false;
+    }
+    message.clear();
+    for (u16 address = 0x6004; address < 0x7000; address++) {
+        u8 c = cpu.read_memory(address);
+        if (!c) {
+            break;
+        }
+        message += static_cast<char>(c);
+    }
+    return true;
+}
+
+/**
+ * @return: The exit condition that holds, NULL if none does.
+ */
+const ExitCondition *check_exits(Cpu &cpu, const BatchJob &job,
+        BatchResult &result)
+{
+    for (const ExitCondition &exit : job.exits) {
+        u8 status;
+        switch (exit.type) {
+        case ExitCondition::HALT:
+            if (is_halted(cpu)) {
+                result.exit = "halt";
+                return &exit;
+            }
+            break;
+        case ExitCondition::BLARGG:
+            if (blargg_finished(cpu, &status, result.message)) {
+                result.exit = "blargg";
+                result.status = status;
+                return &exit;
+            }
+            break;
+        case ExitCondition::MEMORY:
+            if (cpu.read_memory(exit.address) == exit.value) {
+                result.exit = "mem";
+                return &exit;
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * FNV-1a, carrying on from hash for data that comes in parts.
+ */
+u64 hash_bytes(const u8 *data, size_t size, u64 hash = FNV_BASIS)
+{
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+u64 hash_ram(Cpu &cpu)
+{
+    u8 ram[RAM_SIZE];
+    for (u16 address = 0; address < RAM_SIZE; address++) {
+        ram[address] = cpu.read_memory(address);
+    }
+    return hash_bytes(ram, RAM_SIZE);
+}
+
+/**
+ * Converts the PPU's last frame, filters it if the job has a post filter,
+ * hashes it and saves it to the job's frame directory as raw pixels, in
+ * <rom name>.<format> or <rom name>.<filter>.<format>.
+ */
+bool capture_frame(const BatchJob &job, const Ppu &ppu, BatchResult &result)
+{
+    FrameConverter converter(job.frameFormat);
+    u32 pitch = Ppu::WIDTH * converter.get_pixel_size();
+    std::vector<u8> pixels(pitch * Ppu::HEIGHT);
+    converter.convert_frame(ppu, pixels.data(), pitch);
+    if (job.postFilter) {
+        // the jobs already run in parallel, so the filter gets one thread
+        PostFilter filter(job.filter, Ppu::WIDTH, Ppu::HEIGHT);
+        std::vector<u8> filtered(filter.get_width() * filter.get_height() * 4);
+        filter.apply(pixels.data(), pitch, filtered.data(),
+                filter.get_width() * 4);
+        pixels.swap(filtered);
+    }
+    result.hasFrame = true;
+    result.frameHash = hash_bytes(pixels.data(), pixels.size());
+    if (job.frameDir.empty()) {
+        return true;
+    }
+
+    fs::path path = fs::path(job.frameDir) / fs::path(job.rom).stem();
+    if (job.postFilter) {
+        path += std::string(".") + filter_type_name(job.filter);
+    }
+    path += std::string(".") + pixel_format_name(job.frameFormat);
+    FILE *fp = fopen(path.string().c_str(), "wb");
+    bool written = fp && fwrite(pixels.data(), 1, pixels.size(), fp)
+        == pixels.size();
+    if (fp && fclose(fp)) {
+        written = false;
+    }
+    if (!written) {
+        result.error = "failed to write " + path.string();
+    }
+    return written;
+}
+
+/**
+ * The files a job's audio is saved to: <rom name>.wav for the mix, then
+ * <rom name>.<channel>.wav for each channel if it saves them, or .raw.
+ */
+std::vector<std::string> audio_paths(const BatchJob &job)
+{
+    std::string base = (fs::path(job.audioDir) / fs::path(job.rom).stem())
+        .string();
+    const char *extension = job.audioRaw ? ".raw" : ".wav";
+    std::vector<std::string> paths = {base + extension};
+    for (u32 i = 0; job.audioChannels && i < Apu::CHANNEL_COUNT; i++) {
+        paths.push_back(base + "." + Apu::channel_name(
+                    static_cast<Apu::Channel>(i)) + extension);
+    }
+    return paths;
+}
+
+/**
+ * Hashes the samples the APU has made since the last call and queues them
+ * to the job's files, if it has any.
+ */
+void capture_audio(Apu &apu, AudioSink *sink, BatchResult &result)
+{
+    u32 count = apu.samples_available();
+    if (!count) {
+        return;
+    }
+    std::vector<s16> samples((1 + Apu::CHANNEL_COUNT) * count);
+    s16 *streams[1 + Apu::CHANNEL_COUNT];
+    for (u32 i = 0; i <= Apu::CHANNEL_COUNT; i++) {
+        streams[i] = &samples[i * count];
+    }
+    apu.read_samples(streams[0], count,
+            apu.get_channel_capture() ? streams + 1 : NULL);
+
+    std::vector<u8> bytes(count * 2);
+    for (u32 i = 0; i < count; i++) {
+        bytes[i * 2] = static_cast<u8>(samples[i]);
+        bytes[i * 2 + 1] = static_cast<u8>(static_cast<u16>(samples[i]) >> 8);
+    }
+    result.audioHash = hash_bytes(bytes.data(), bytes.size(),
+            result.audioHash);
+    result.audioSamples += count;
+    if (sink) {
+        sink->push_samples(streams, count);
+    }
+}
+
+bool parse_number(const std::string &text, int base, u64 *val)
+{
+    if (text.empty()) {
+        return false;
+    }
+    char *end;
+    *val = strtoull(text.c_str(), &end, base);
+    return *end == '\0';
+}
+
+/**
+ * Applies a frames=N, cycles=N or exit=COND setting to a job.
+ */
+bool parse_setting(const std::string &setting, BatchJob &job)
+{
+    size_t split = setting.find('=');
+    if (split == std::string::npos) {
+        return false;
+    }
+    std::string key = setting.substr(0, split);
+    std::string val = setting.substr(split + 1);
+    if (key == "frames") {
+        return parse_number(val, 10, &job.frames);
+    } else if (key == "cycles") {
+        return parse_number(val, 10, &job.cycles);
+    } else if (key == "exit") {
+        ExitCondition exit;
+        if (!parse_exit_condition(val, &exit)) {
+            return false;
+        }
+        job.exits.push_back(exit);
+        return true;
+    }
+    return false;
+}
+
+bool load_manifest(const fs::path &path, const BatchJob &defaults,
+        std::vector<BatchJob> &jobs, std::string &error)
+{
+    std::vector<u8> data;
+    if (!read_file(path.string(), data)) {
+        error = "failed to read " + path.string();
+        return false;
+    }
+    std::istringstream manifest(std::string(data.begin(), data.end()));
+    std::string line;
+    for (u32 number = 1; std::getline(manifest, line); number++) {
+        std::istringstream words(line);
+        std::string rom;
+        if (!(words >> rom) || rom[0] == '#') {
+            continue;
+        }
+        BatchJob job = defaults;
+        job.rom = (path.parent_path() / rom).string();
+        std::string setting;
+        while (words >> setting) {
+            if (!parse_setting(setting, job)) {
+                error = path.string() + ":" + std::to_string(number)
+                    + ": bad setting " + setting;
+                return false;
+            }
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+void write_string(FILE *fp, const std::string &text)
+{
+    fputc('"', fp);
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (static_cast<u8>(c) < 0x20) {
+            fprintf(fp, "\\u%04x", static_cast<u8>(c));
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+void usage(void)
+{
+    fprintf(stderr,
+            "usage: nesEmulator --batch <directory|manifest> [options]\n"
+            "  --frames N     frame limit per job (default 600, 0 for none)\n"
+            "  --cycles N     cycle limit per job (default none)\n"
+            "  --exit COND    halt, blargg or mem:ADDR=VAL, repeatable\n"
+            "  --threads N    worker threads (default one per core)\n"
+            "  --out FILE     where the JSON results go (default stdout)\n"
+            "  --jit          run the jobs on the JIT\n"
+            "  --tile-cache   decode CHR tiles through the tile cache\n"
+            "  --render-interval N\n"
+            "                 only render every Nth frame, and the last one\n"
+            "  --frame-format FMT\n"
+            "                 hash each job's last frame as rgba8, rgb565,\n"
+            "                 gray8 or index pixels\n"
+            "  --frame-dir DIR\n"
+            "                 also save the last frames there, as raw pixels\n"
+            "  --post-filter NAME\n"
+            "                 run the last rgba8 frames through ntsc, nearest2,\n"
+            "                 nearest3, nearest4 or scale2x\n"
+            "  --video PATH   stream the frames of a single iNES job as Y4M to\n"
+            "                 a file, a FIFO or - for stdout\n"
+            "  --audio-hash   run the APU of iNES jobs and hash its samples\n"
+            "  --audio-dir DIR\n"
+            "                 also save them there, as <rom name>.wav\n"
+            "  --audio-raw    save raw 16 bit little endian PCM, .raw\n"
+            "  --audio-channels\n"
+            "                 also save each channel on its own, as\n"
+            "                 <rom name>.<channel>.wav\n");
+}
+
+} // namespace
+
+bool parse_exit_condition(const std::string &text, ExitCondition *exit)
+{
+    if (text == "halt") {
+        exit->type = ExitCondition::HALT;
+        return true;
+    } else if (text == "blargg") {
+        exit->type = ExitCondition::BLARGG;
+        return true;
+    } else if (text.compare(0, 4, "mem:") == 0) {
+        size_t split = text.find('=');
+        u64 address, val;
+        if (split == std::string::npos
+                || !parse_number(text.substr(4, split - 4), 16, &address)
+                || !parse_number(text.substr(split + 1), 16, &val)
+                || address > 0xffff || val > 0xff) {
+            return false;
+        }
+        exit->type = ExitCondition::MEMORY;
+        exit->address = static_cast<u16>(address);
+        exit->value = static_cast<u8>(val);
+        return true;
+    }
+    return false;
+}
+
+bool load_batch_jobs(const std::string &path, const BatchJob &defaults,
+        std::vector<BatchJob> &jobs, std::string &error)
+{
+    std::error_code ec;
+    if (!fs::is_directory(path, ec)) {
+        return load_manifest(path, defaults, jobs, error);
+    }
+
+    std::vector<std::string> roms;
+    for (const fs::directory_entry &entry : fs::directory_iterator(path, ec)) {
+        std::string extension = entry.path().extension().string();
+        if (entry.is_regular_file() && (extension == ".nes"
+                    || extension == ".bin")) {
+            roms.push_back(entry.path().string());
+        }
+    }
+    if (ec) {
+        error = "failed to list " + path + ": " + ec.message();
+        return false;
+    }
+    // directory order is arbitrary, keep the results comparable between runs
+    std::sort(roms.begin(), roms.end());
+    for (const std::string &rom : roms) {
+        BatchJob job = defaults;
+        job.rom = rom;
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+BatchResult run_batch_job(const BatchJob &job)
+{
+    BatchResult result = {};
+    auto start = std::chrono::steady_clock::now();
+
+    std::unique_ptr<Cpu> cpu(new Cpu(true));
+    std::unique_ptr<Ppu> ppu;
+    // declared after the Ppu so it is destroyed before it, and before the
+    // Cpu whose bus the mapper unmaps
+    std::unique_ptr<JobMemory> memory(new JobMemory());
+    cpu->init();
+    // jobs of the same ROM share its mapping
+    std::shared_ptr<const RomFile> file = RomFile::open(job.rom,
+            result.error);
+    if (!file) {
+        result.exit = "error";
+        return result;
+    }
+    if (file->get_size() >= RomHeader::SIZE
+            && !memcmp(file->get_data(), "NES\x1a", 4)) {
+        ppu.reset(new Ppu(*cpu));
+        ppu->set_tile_cache(job.tileCache);
+        if (memory->cart.load(file, result.error)) {
+            map_cartridge(*cpu, *ppu, *memory, result.error);
+        }
+    } else {
+        // a raw binary runs from $0000, like testCpu()
+        std::vector<u8> data(file->get_data(),
+                file->get_data() + file->get_size());
+        cpu->load(data, 0);
+        cpu->set_pc(0);
+    }
+    if (!result.error.empty()) {
+        result.exit = "error";
+        return result;
+    }
+    std::unique_ptr<VideoSink> video;
+    if (ppu && !job.video.empty()) {
+        video.reset(new VideoSink(job.video));
+    }
+    std::unique_ptr<Apu> apu;
+    std::unique_ptr<AudioSink> audio;
+    if (ppu && job.captureAudio) {
+        // after the Ppu, whose OAM DMA register is on the APU's page
+        apu.reset(new Apu(*cpu, AUDIO_RATE));
+        result.hasAudio = true;
+        result.audioHash = FNV_BASIS;
+        if (!job.audioDir.empty()) {
+            apu->set_channel_capture(job.audioChannels);
+            audio.reset(new AudioSink(audio_paths(job), AUDIO_RATE));
+        }
+    }
+    if (job.jit) {
+        cpu->set_jit(true);
+    } else {
+        cpu->set_block_cache(true);
+    }
+
+    result.exit = "limit";
+    while (!job.frames || result.frames < job.frames) {
+        if (job.cycles && cpu->get_cycles() >= job.cycles) {
+            break;
+        }
+        if (ppu) {
+            u64 frame = result.frames + 1;
+            ppu->set_skip_rendering(job.renderInterval > 1
+                    && frame % job.renderInterval && frame != job.frames);
+            if (!ppu->run_frame(job.cycles ? job.cycles : UINT64_MAX)) {
+                // the cycle limit fell in the middle of the frame
+                check_exits(*cpu, job, result);
+                break;
+            }
+            // frames that aren't drawn are filled in by the writer
+            if (video && !ppu->get_skip_rendering()) {
+                video->push_frame(*ppu);
+            }
+            if (apu) {
+                capture_audio(*apu, audio.get(), result);
+            }
+        } else {
+            s32 cycles = Cpu::CYCLES_PER_FRAME;
+            if (job.cycles) {
+                cycles = std::min<u64>(cycles, job.cycles - cpu->get_cycles());
+            }
+            cpu->run_cycles(cycles);
+        }
+        result.frames++;
+        if (check_exits(*cpu, job, result)) {
+            break;
+        }
+    }
+
+    result.ok = true;
+    if (video) {
+        if (!video->close()) {
+            result.ok = false;
+            result.exit = "error";
+            result.error = video->get_error();
+        }
+        result.videoFrames = video->get_written_frames();
+        result.videoDropped = video->get_dropped_frames();
+    }
+    if (audio && !audio->close()) {
+        result.ok = false;
+        result.exit = "error";
+        result.error = audio->get_error();
+    }
+    result.cycles = cpu->get_cycles();
+    result.ramHash = hash_ram(*cpu);
+    result.pc = cpu->get_pc();
+    if (ppu) {
+        result.tiles = ppu->get_tile_cache_stats();
+        if (job.captureFrame && !capture_frame(job, *ppu, result)) {
+            result.ok = false;
+            result.exit = "error";
+        }
+    }
+    result.wallMs = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+void write_batch_results(FILE *fp, const std::vector<BatchJob> &jobs,
+        const std::vector<BatchResult> &results)
+{
+    fprintf(fp, "{\n  \"jobs\": [");
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const BatchResult &result = results[i];
+        fprintf(fp, "%s\n    {\"rom\": ", i ? "," : "");
+        write_string(fp, jobs[i].rom);
+        fprintf(fp, ", \"ok\": %s, \"exit\": ", result.ok ? "true" : "false");
+        write_string(fp, result.exit);
+        if (!result.ok) {
+            fprintf(fp, ", \"error\": ");
+            write_string(fp, result.error);
+            fprintf(fp, "}");
+            continue;
+        }
+        if (result.exit == "blargg") {
+            fprintf(fp, ", \"status\": %u, \"message\": ", result.status);
+            write_string(fp, result.message);
+        }
+        // the hash is a string, JSON numbers lose precision past 2^53
+        fprintf(fp, ", \"frames\": %llu, \"cycles\": %llu, "
+                "\"wall_ms\": %.3f, \"ram_hash\": \"%016llx\", \"pc\": %u",
+                static_cast<unsigned long long>(result.frames),
+                static_cast<unsigned long long>(result.cycles),
+                result.wallMs,
+                static_cast<unsigned long long>(result.ramHash), result.pc);
+        if (result.hasFrame) {
+            fprintf(fp, ", \"frame_hash\": \"%016llx\"",
+                    static_cast<unsigned long long>(result.frameHash));
+        }
+        if (result.hasAudio) {
+            fprintf(fp, ", \"audio_samples\": %llu, \"audio_hash\": "
+                    "\"%016llx\"",
+                    static_cast<unsigned long long>(result.audioSamples),
+                    static_cast<unsigned long long>(result.audioHash));
+        }
+        if (!jobs[i].video.empty()) {
+            fprintf(fp, ", \"video_frames\": %llu, \"video_dropped\": %llu",
+                    static_cast<unsigned long long>(result.videoFrames),
+                    static_cast<unsigned long long>(result.videoDropped));
+        }
+        if (jobs[i].tileCache) {
+            const TileCacheStats &tiles = result.tiles;
+            fprintf(fp, ", \"tile_hits\": %llu, \"tile_misses\": %llu, "
+                    "\"tile_invalidations\": %llu",
+                    static_cast<unsigned long long>(tiles.hits),
+                    static_cast<unsigned long long>(tiles.misses),
+                    static_cast<unsigned long long>(tiles.writeInvalidations
+                        + tiles.bankInvalidations));
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+}
+
+int run_batch(int argc, char **argv)
+{
+    BatchJob defaults = {};
+    defaults.frames = 600;
+    std::string path;
+    std::string out;
+    u64 threads = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--batch" && hasValue) {
+            path = argv[++i];
+        } else if (arg == "--frames" && hasValue
+                && parse_number(argv[i + 1], 10, &defaults.frames)) {
+            i++;
+        } else if (arg == "--cycles" && hasValue
+                && parse_number(argv[i + 1], 10, &defaults.cycles)) {
+            i++;
+        } else if (arg == "--threads" && hasValue
+                && parse_number(argv[i + 1], 10, &threads)) {
+            i++;
+        } else if (arg == "--exit" && hasValue) {
+            ExitCondition exit;
+            if (!parse_exit_condition(argv[++i], &exit)) {
+                fprintf(stderr, "bad exit condition %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            defaults.exits.push_back(exit);
+        } else if (arg == "--out" && hasValue) {
+            out = argv[++i];
+        } else if (arg == "--jit") {
+            defaults.jit = true;
+        } else if (arg == "--tile-cache") {
+            defaults.tileCache = true;
+        } else if (arg == "--render-interval" && hasValue
+                && parse_number(argv[i + 1], 10, &defaults.renderInterval)) {
+            i++;
+        } else if (arg == "--frame-format" && hasValue) {
+            if (!parse_pixel_format(argv[++i], &defaults.frameFormat)) {
+                fprintf(stderr, "bad pixel format %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            defaults.captureFrame = true;
+        } else if (arg == "--frame-dir" && hasValue) {
+            defaults.frameDir = argv[++i];
+            defaults.captureFrame = true;
+        } else if (arg == "--post-filter" && hasValue) {
+            if (!parse_filter_type(argv[++i], &defaults.filter)) {
+                fprintf(stderr, "bad post filter %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            defaults.postFilter = true;
+            defaults.captureFrame = true;
+        } else if (arg == "--video" && hasValue) {
+            defaults.video = argv[++i];
+        } else if (arg == "--audio-hash") {
+            defaults.captureAudio = true;
+        } else if (arg == "--audio-dir" && hasValue) {
+            defaults.audioDir = argv[++i];
+            defaults.captureAudio = true;
+        } else if (arg == "--audio-raw") {
+            defaults.audioRaw = true;
+        } else if (arg == "--audio-channels") {
+            defaults.audioChannels = true;
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (path.empty()) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (defaults.postFilter && defaults.frameFormat != PIXEL_RGBA8) {
+        fprintf(stderr, "--post-filter needs rgba8 frames\n");
+        return EXIT_FAILURE;
+    }
+    if ((defaults.audioRaw || defaults.audioChannels)
+            && defaults.audioDir.empty()) {
+        fprintf(stderr, "--audio-raw and --audio-channels need --audio-dir\n");
+        return EXIT_FAILURE;
+    }
+    if (defaults.video == "-" && out.empty()) {
+        fprintf(stderr, "--video - needs --out, the results go to stdout\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<BatchJob> jobs;
+    std::string error;
+    if (!load_batch_jobs(path, defaults, jobs, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return EXIT_FAILURE;
+    }
+    for (const BatchJob &job : jobs) {
+        if (!job.frames && !job.cycles && job.exits.empty()) {
+            fprintf(stderr, "%s has no frame limit, cycle limit or exit "
+                    "condition\n", job.rom.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+    if (!defaults.video.empty()) {
+        if (jobs.size() != 1) {
+            fprintf(stderr, "--video takes a single job, not %zu\n",
+                    jobs.size());
+            return EXIT_FAILURE;
+        }
+#ifdef SIGPIPE
+        // an encoder that quits early is a write error, not a crash
+        signal(SIGPIPE, SIG_IGN);
+#endif
+    }
+
+    std::vector<BatchResult> results(jobs.size());
+    std::mutex progressLock;
+    size_t finished = 0;
+    {
+        ThreadPool pool(static_cast<u32>(threads));
+        for (size_t i = 0; i < jobs.size(); i++) {
+            pool.submit([&, i] {
+                results[i] = run_batch_job(jobs[i]);
+                std::lock_guard<std::mutex> guard(progressLock);
+                fprintf(stderr, "[%zu/%zu] %s: %s\n", ++finished, jobs.size(),
+                        jobs[i].rom.c_str(), results[i].exit.c_str());
+            });
+        }
+        pool.wait();
+    }
+
+    FILE *fp = out.empty() ? stdout : openFile(out.c_str(), "w");
+    write_batch_results(fp, jobs, results);
+    if (fp != stdout) {
+        closeFile(fp);
+    }
+
+    for (const BatchResult &result : results) {
+        if (!result.ok) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
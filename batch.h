@@ -0,0 +1,114 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "utils.h"
+#include "tile_cache.h"
+#include "frame_converter.h"
+#include "post_filter.h"
+#include <string>
+#include <vector>
+
+/**
+ * A condition that ends a job before its frame or cycle limit. Exit
+ * conditions are checked at the end of every frame.
+ */
+struct ExitCondition
+{
+    enum Type
+    {
+        HALT,   // the cpu sits on a jump or branch to itself
+        BLARGG, // blargg's test status protocol at $6000 reports a result
+        MEMORY, // the byte at address equals value
+    };
+
+    Type type;
+    u16 address;
+    u8  value;
+};
+
+struct BatchJob
+{
+    std::string rom;
+    u64 frames;     // 0 for no frame limit
+    u64 cycles;     // 0 for no cycle limit, can stop in the middle of a frame
+    std::vector<ExitCondition> exits;
+    bool jit;
+    bool tileCache;
+    u64 renderInterval;     // render every Nth frame and the last, 0 for all
+    bool captureFrame;      // hash the last frame in frameFormat
+    PixelFormat frameFormat;
+    std::string frameDir;   // where the last frame is saved, if anywhere
+    bool postFilter;        // run the last rgba8 frame through filter
+    FilterType filter;
+    std::string video;      // where the frames are streamed as Y4M, if anywhere
+    bool captureAudio;      // run the APU and hash its samples
+    std::string audioDir;   // where the samples are saved, if anywhere
+    bool audioRaw;          // as raw PCM rather than WAV
+    bool audioChannels;     // each channel to a file of its own as well
+};
+
+struct BatchResult
+{
+    bool ok;
+    std::string error;
+    std::string exit;   // what ended the job: limit, halt, blargg or mem
+    u8 status;          // blargg's result code, 0 is a pass
+    std::string message;
+    u64 frames;
+    u64 cycles;
+    double wallMs;
+    u64 ramHash;        // FNV-1a of $0000-$07FF
+    u16 pc;
+    TileCacheStats tiles;   // all zero without the tile cache
+    bool hasFrame;
+    u64 frameHash;          // FNV-1a of the last frame's pixels
+    u64 videoFrames;        // frames in the video stream, repeats included
+    u64 videoDropped;       // frames the video writer couldn't keep up with
+    bool hasAudio;
+    u64 audioSamples;       // at 48 kHz
+    u64 audioHash;          // FNV-1a of the samples, 16 bit little endian
+};
+
+/**
+ * Parses an exit condition: "halt", "blargg" or "mem:ADDR=VAL" with hex
+ * ADDR and VAL.
+ *
+ * @return: Whether the text was a valid condition.
+ */
+bool parse_exit_condition(const std::string &text, ExitCondition *exit);
+
+/**
+ * Builds the jobs for a directory of ROMs (every .nes and .bin file in it)
+ * or a manifest. A manifest has one ROM per line, optionally followed by
+ * frames=N, cycles=N and exit=COND settings that override the defaults.
+ * Blank lines and lines starting with # are skipped. Relative paths are
+ * relative to the manifest.
+ *
+ * @param path: The directory or manifest.
+ * @param defaults: The settings of jobs that don't override them.
+ * @param jobs: The jobs are appended here.
+ * @param error: Set to what went wrong on failure.
+ * @return: Whether the jobs could be read.
+ */
+bool load_batch_jobs(const std::string &path, const BatchJob &defaults,
+        std::vector<BatchJob> &jobs, std::string &error);
+
+/**
+ * Loads and runs a single job on a fresh Cpu.
+ */
+BatchResult run_batch_job(const BatchJob &job);
+
+/**
+ * Writes the results as a JSON document, one object per job in job order.
+ */
+void write_batch_results(FILE *fp, const std::vector<BatchJob> &jobs,
+        const std::vector<BatchResult> &results);
+
+/**
+ * The --batch command line mode.
+ *
+ * @return: The exit status, EXIT_FAILURE if a job failed to run.
+ */
+int run_batch(int argc, char **argv);
+
+#endif
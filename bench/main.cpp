@@ -0,0 +1,850 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../cpu.h"
+#include "../instructions.h"
+#include "../ppu.h"
+#include "../tile_decoder.h"
+#include "../frame_converter.h"
+#include "../post_filter.h"
+#include "../resampler.h"
+#include "../render_thread.h"
+#include "../apu.h"
+
+/**
+ * The ways the cpu can be set up to run code, every workload is measured on
+ * each of them.
+ */
+struct Config
+{
+    const char *name;
+    bool lazyFlags;
+    bool blockCache;
+    bool jit;
+};
+
+static const Config configs[] = {
+    { "interpreter",             false, false, false },
+    { "interpreter lazy",        true,  false, false },
+    { "block cache",             false, true,  false },
+    { "block cache lazy",        true,  true,  false },
+    { "jit",                     true,  true,  true  },
+};
+
+static const char *mode_names[ADDRESS_MODE_COUNT] = {
+    "implied", "accumulator", "immediate", "zero page", "zero page,x",
+    "zero page,y", "relative", "absolute", "absolute,x", "absolute,y",
+    "indirect", "(indirect,x)", "(indirect),y",
+};
+
+/**
+ * A memory image to run. The code starts at entry and loops back to loop,
+ * one pass from loop back to loop is what the instruction count is taken
+ * from.
+ */
+struct Program
+{
+    std::string name;
+    std::vector<u8> memory;
+    u16 entry;
+    u16 loop;
+};
+
+struct Measurement
+{
+    double nsPerInstruction;
+    double nsPerFrame;
+    double mhz;
+    double cyclesPerInstruction;
+};
+
+static const u16 PROLOGUE = 0x0600;
+static const u16 KERNEL = 0x0400;
+static const u16 DATA = 0x0300;
+static const u32 KERNEL_REPEATS = 64;
+
+static Program make_program(const std::string &name, u16 loop,
+        const std::vector<u8> &code)
+{
+    Program program;
+    program.name = name;
+    program.memory.assign(0x10000, 0);
+    program.entry = PROLOGUE;
+    program.loop = loop;
+    // LDX #$10; LDY #$10; LDA #$10; JMP loop
+    const u8 prologue[] = {0xa2, 0x10, 0xa0, 0x10, 0xa9, 0x10, 0x4c,
+        static_cast<u8>(loop), static_cast<u8>(loop >> 8)};
+    memcpy(&program.memory[PROLOGUE], prologue, sizeof(prologue));
+    memcpy(&program.memory[loop], code.data(), code.size());
+    // ($20,X) and ($22),Y both point at DATA
+    program.memory[0x20] = program.memory[0x22] = DATA & 0xff;
+    program.memory[0x21] = program.memory[0x23] = DATA >> 8;
+    return program;
+}
+
+/**
+ * Builds a loop that runs a single opcode over and over. Most opcodes are
+ * repeated KERNEL_REPEATS times followed by a JMP back, with operands that
+ * never cross a page. The ones that change the flow of control jump back
+ * to themselves instead, so the loop is that one instruction.
+ */
+static Program make_opcode_program(const OpCode &opcode)
+{
+    std::string name = opcode.name;
+    std::vector<u8> code;
+    switch (opcode.op) {
+    case 0x4c: // JMP $0400
+        return make_program(name, KERNEL, {0x4c, 0x00, 0x04});
+    case 0x20: // JSR $0400
+        return make_program(name, KERNEL, {0x20, 0x00, 0x04});
+    case 0x6c: { // JMP ($0302)
+        Program program = make_program(name, KERNEL, {0x6c, 0x02, 0x03});
+        program.memory[DATA + 2] = KERNEL & 0xff;
+        program.memory[DATA + 3] = KERNEL >> 8;
+        return program;
+    }
+    case 0x00: { // BRK with the IRQ vector pointing back at it
+        Program program = make_program(name, KERNEL, {0x00, 0x00});
+        program.memory[0xfffe] = KERNEL & 0xff;
+        program.memory[0xffff] = KERNEL >> 8;
+        return program;
+    }
+    case 0x40:   // RTI
+    case 0x60: { // RTS
+        // with the whole stack page set to $04 RTI returns to $0404 and RTS
+        // to $0405
+        u16 loop = opcode.op == 0x40 ? 0x0404 : 0x0405;
+        Program program = make_program(name, loop, {opcode.op});
+        memset(&program.memory[0x0100], 0x04, 0x100);
+        return program;
+    }
+    }
+
+    for (u32 i = 0; i < KERNEL_REPEATS; i++) {
+        code.push_back(opcode.op);
+        switch (opcode.address_mode) {
+        case IMMEDIATE:
+            code.push_back(0x10);
+            break;
+        case ZERO_PAGE:
+        case ZERO_PAGE_X:
+        case ZERO_PAGE_Y:
+            code.push_back(0x30);
+            break;
+        case RELATIVE:
+            // taken or not, the branch lands on the next instruction
+            code.push_back(0x00);
+            break;
+        case INDEXED_INDIRECT:
+            code.push_back(0x10);
+            break;
+        case INDIRECT_INDEXED:
+            code.push_back(0x22);
+            break;
+        case ABSOLUTE:
+        case ABSOLUTE_X:
+        case ABSOLUTE_Y:
+            code.push_back(DATA & 0xff);
+            code.push_back(DATA >> 8);
+            break;
+        }
+    }
+    code.insert(code.end(), {0x4c, KERNEL & 0xff, KERNEL >> 8});
+    return make_program(name, KERNEL, code);
+}
+
+/**
+ * An ALU heavy loop, almost every instruction writes flags that the next
+ * one overwrites before anything reads them.
+ */
+static Program make_alu_loop(void)
+{
+    return make_program("alu loop", KERNEL, {
+        0xa9, 0x37,         // LDA #$37
+        0x69, 0x15,         // ADC #$15
+        0xe9, 0x03,         // SBC #$03
+        0x29, 0x7f,         // AND #$7F
+        0x09, 0x10,         // ORA #$10
+        0x49, 0x55,         // EOR #$55
+        0xc9, 0x20,         // CMP #$20
+        0x2a,               // ROL A
+        0x4a,               // LSR A
+        0xaa,               // TAX
+        0xe8,               // INX
+        0x88,               // DEY
+        0xd0, 0xeb,         // BNE $0400
+        0x4c, 0x00, 0x04,   // JMP $0400
+    });
+}
+
+/**
+ * Straight line ALU code with no memory operands, which leaves little but
+ * fetching and dispatching the opcodes. The interpreter rows are what the
+ * switch over opcodes was measured against when the table replaced it.
+ */
+static Program make_dispatch_loop(void)
+{
+    return make_program("dispatch loop", KERNEL, {
+        0xa9, 0x01,         // LDA #$01
+        0x69, 0x02,         // ADC #$02
+        0xaa,               // TAX
+        0xe8,               // INX
+        0xca,               // DEX
+        0xa8,               // TAY
+        0x29, 0x0f,         // AND #$0F
+        0x09, 0x01,         // ORA #$01
+        0x49, 0x03,         // EOR #$03
+        0x18,               // CLC
+        0x38,               // SEC
+        0xc8,               // INY
+        0x88,               // DEY
+        0x8a,               // TXA
+        0x98,               // TYA
+        0xea,               // NOP
+        0x4c, 0x00, 0x04,   // JMP $0400
+    });
+}
+
+/**
+ * The countdown loop main.cpp runs, over the full range of X.
+ */
+static Program make_countdown_loop(void)
+{
+    return make_program("countdown loop", KERNEL, {
+        0xa2, 0x00,         // LDX #$00
+        0xca,               // loop: DEX
+        0x8e, 0x00, 0x02,   // STX $0200
+        0xe0, 0x00,         // CPX #$00
+        0xd0, 0xf8,         // BNE loop
+        0x8e, 0x01, 0x02,   // STX $0201
+        0x4c, 0x00, 0x04,   // JMP $0400
+    });
+}
+
+/**
+ * A mix of what games spend a frame on: filling a table with indexed
+ * stores, summing it through a pointer and calling a subroutine that
+ * shifts memory around.
+ */
+static Program make_mixed_loop(void)
+{
+    return make_program("mixed", KERNEL, {
+        0xa2, 0x00,         // LDX #$00
+        0x8a,               // fill: TXA
+        0x9d, 0x00, 0x03,   // STA $0300,X
+        0xe8,               // INX
+        0xd0, 0xf9,         // BNE fill
+        0xa0, 0x00,         // LDY #$00
+        0x18,               // CLC
+        0x98,               // TYA
+        0x71, 0x22,         // sum: ADC ($22),Y
+        0xc8,               // INY
+        0xd0, 0xfb,         // BNE sum
+        0x85, 0x12,         // STA $12
+        0x20, 0x1a, 0x04,   // JSR sub
+        0x4c, 0x00, 0x04,   // JMP $0400
+        0xa2, 0x20,         // sub: LDX #$20
+        0xa5, 0x12,         // shift: LDA $12
+        0x0a,               // ASL A
+        0x66, 0x13,         // ROR $13
+        0x26, 0x12,         // ROL $12
+        0xca,               // DEX
+        0xd0, 0xf6,         // BNE shift
+        0x60,               // RTS
+    });
+}
+
+static void load_program(Cpu &cpu, const Program &program)
+{
+    cpu.load(program.memory, 0);
+    cpu.set_pc(program.entry);
+}
+
+/**
+ * Steps through one pass of the program's loop on the interpreter.
+ *
+ * @return: The average number of cycles per instruction.
+ */
+static double calibrate(const Program &program)
+{
+    Cpu *cpu = new Cpu();
+    load_program(*cpu, program);
+    while (cpu->get_pc() != program.loop) {
+        cpu->step();
+    }
+    u64 instructions = 0;
+    u64 cycles = 0;
+    do {
+        cycles += cpu->step();
+        instructions++;
+    } while (cpu->get_pc() != program.loop && instructions < 1000000);
+    delete cpu;
+    return static_cast<double>(cycles) / instructions;
+}
+
+/**
+ * Runs the program a frame at a time for at least the given number of
+ * cycles, after a couple of frames to warm up the caches.
+ */
+static Measurement measure(const Program &program, const Config &config,
+        double cyclesPerInstruction, u64 cycles)
+{
+    Cpu *cpu = new Cpu(config.lazyFlags);
+    cpu->set_block_cache(config.blockCache);
+    cpu->set_jit(config.jit);
+    load_program(*cpu, program);
+    cpu->run_frame();
+    cpu->run_frame();
+
+    u64 startCycles = cpu->get_cycles();
+    u64 frames = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (cpu->get_cycles() - startCycles < cycles) {
+        cpu->run_frame();
+        frames++;
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    u64 ran = cpu->get_cycles() - startCycles;
+    delete cpu;
+
+    Measurement result;
+    result.cyclesPerInstruction = cyclesPerInstruction;
+    result.nsPerInstruction = elapsed.count() * cyclesPerInstruction / ran;
+    result.nsPerFrame = elapsed.count() / frames;
+    result.mhz = ran / elapsed.count() * 1e3;
+    return result;
+}
+
+// how the PPU draws the frames while a workload runs
+enum PpuMode
+{
+    PPU_RENDER,
+    PPU_SKIP,
+    PPU_THREAD,
+    PPU_BANDS,      // on a render thread, in bands across the cores
+    PPU_APU,        // rendering, with every APU channel playing
+    PPU_MODE_COUNT,
+};
+
+static const char *const PPU_MODE_NAMES[] = {
+    "mixed + ppu",
+    "mixed + skip",
+    "mixed + thread",
+    "mixed + bands",
+    "mixed + apu",
+};
+
+/**
+ * Runs the program with a PPU rendering a blank screen alongside it,
+ * skipping the rendering or rendering on a RenderThread, in bands or not.
+ * The frames of the render thread are taken as they come, and the last one
+ * is waited for. With the APU its samples are read out every frame.
+ *
+ * @return: The average time a frame took, in ns.
+ */
+static double measure_ppu_frames(const Program &program, const Config &config,
+        u64 frames, PpuMode mode)
+{
+    Cpu *cpu = new Cpu(config.lazyFlags);
+    cpu->set_block_cache(config.blockCache);
+    cpu->set_jit(config.jit);
+    Ppu *ppu = new Ppu(*cpu);
+    ppu->set_skip_rendering(mode == PPU_SKIP);
+    load_program(*cpu, program);
+    // background and sprites on
+    cpu->write_memory(0x2001, 0x1e);
+    ppu->run_frame();
+    ppu->run_frame();
+    RenderThread *renderer = NULL;
+    if (mode == PPU_THREAD || mode == PPU_BANDS) {
+        renderer = new RenderThread(*ppu, mode == PPU_BANDS ? 0 : 1);
+    }
+    Apu *apu = NULL;
+    std::vector<s16> samples;
+    if (mode == PPU_APU) {
+        apu = new Apu(*cpu);
+        samples.resize(apu->get_sample_rate());
+        // both pulses, the triangle and noise at a steady volume, the DMC
+        // looping a sample
+        const u8 writes[][2] = {
+            {0x15, 0x1f}, {0x00, 0xbf}, {0x02, 0xfd}, {0x03, 0x08},
+            {0x04, 0x7f}, {0x06, 0x7e}, {0x07, 0x08}, {0x08, 0xff},
+            {0x0a, 0x80}, {0x0b, 0x08}, {0x0c, 0x3f}, {0x0e, 0x04},
+            {0x0f, 0x08}, {0x10, 0x4f}, {0x12, 0x00}, {0x13, 0xff},
+            {0x15, 0x1f},
+        };
+        for (const u8 (&write)[2] : writes) {
+            cpu->write_memory(0x4000 | write[0], write[1]);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (u64 i = 0; i < frames; i++) {
+        ppu->run_frame();
+        if (apu) {
+            apu->read_samples(samples.data(), samples.size());
+        }
+        while (const RenderThread::Frame *frame =
+                renderer ? renderer->acquire_frame() : NULL) {
+            renderer->release_frame(frame);
+        }
+    }
+    if (renderer) {
+        const RenderThread::Frame *frame = renderer->wait_frame();
+        if (frame) {
+            renderer->release_frame(frame);
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    delete renderer;
+    delete apu;
+    delete ppu;
+    delete cpu;
+    return elapsed.count() / frames;
+}
+
+// keeps the decoded and converted pixels from being thrown away
+static volatile u32 decoderSink;
+
+/**
+ * Decodes whole lines of background tiles, 33 of them as with a fine scroll.
+ *
+ * @return: The average time a line took, in ns.
+ */
+static double measure_tile_decoder(TileDecoder decoder, u64 lines)
+{
+    const u32 TILES = 33;
+    u8 low[TILES], high[TILES], palette[TILES];
+    for (u32 i = 0; i < TILES; i++) {
+        low[i] = static_cast<u8>(i * 73);
+        high[i] = static_cast<u8>(i * 151);
+        palette[i] = (i & 3) << 2;
+    }
+    u8 out[TILES * 8];
+    u32 sum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (u64 i = 0; i < lines; i++) {
+        low[i % TILES]++;
+        decoder(low, high, palette, TILES, out);
+        sum += out[i % sizeof(out)];
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    decoderSink = sum;
+    return elapsed.count() / lines;
+}
+
+/**
+ * Converts a whole frame of colour indices, the emphasis changing every
+ * line.
+ *
+ * @return: The average time a frame took, in ns.
+ */
+static double measure_converter(const FrameConverter &converter, u64 frames)
+{
+    std::vector<u8> indices(Ppu::WIDTH * Ppu::HEIGHT);
+    for (size_t i = 0; i < indices.size(); i++) {
+        indices[i] = static_cast<u8>((i * 29 + i / 7) & 63);
+    }
+    u32 pitch = Ppu::WIDTH * converter.get_pixel_size();
+    std::vector<u8> out(pitch * Ppu::HEIGHT);
+
+    auto start = std::chrono::steady_clock::now();
+    for (u64 i = 0; i < frames; i++) {
+        for (u32 line = 0; line < Ppu::HEIGHT; line++) {
+            converter.convert_line(&indices[line * Ppu::WIDTH], line + i,
+                    Ppu::WIDTH, &out[line * pitch]);
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    decoderSink = out[frames % out.size()];
+    return elapsed.count() / frames;
+}
+
+/**
+ * Filters a whole RGBA8 frame of colour bars.
+ *
+ * @return: The average time a frame took, in ns.
+ */
+static double measure_filter(PostFilter &filter, u64 frames)
+{
+    std::vector<u8> in(Ppu::WIDTH * Ppu::HEIGHT * 4);
+    for (size_t i = 0; i < in.size(); i++) {
+        in[i] = static_cast<u8>((i & 3) == 3 ? 0xff : (i / 4 % 97) * (i & 3));
+    }
+    u32 pitch = filter.get_width() * 4;
+    std::vector<u8> out(pitch * filter.get_height());
+
+    auto start = std::chrono::steady_clock::now();
+    for (u64 i = 0; i < frames; i++) {
+        filter.apply(in.data(), Ppu::WIDTH * 4, out.data(), pitch);
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    decoderSink = out[frames % out.size()];
+    return elapsed.count() / frames;
+}
+
+/**
+ * @return: ns per output sample resampling a second of the APU's samples at
+ * an NES clock over 32 to 48 kHz, with the ratio adjusted every frame like
+ * an AudioStream does.
+ */
+static double measure_resampler(ResamplerKind kind, u64 seconds)
+{
+    const u32 RATE = Apu::CLOCK_RATE / 32;
+    std::vector<s16> in(RATE / 60);
+    for (size_t i = 0; i < in.size(); i++) {
+        in[i] = static_cast<s16>((i / 64 % 2 ? 3000 : -3000) + i % 97);
+    }
+    Resampler resampler(RATE, 48000, kind);
+    std::vector<s16> out(resampler.max_output(in.size(), 0.005));
+
+    u64 made = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (u64 frame = 0; frame < seconds * 60; frame++) {
+        resampler.set_adjust(frame % 2 ? 0.001 : -0.001);
+        made += resampler.process(in.data(), in.size(), out.data());
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    decoderSink = static_cast<u8>(out[made % out.size()]);
+    return elapsed.count() / made;
+}
+
+static void write_measurement(FILE *fp, const Measurement &m)
+{
+    fprintf(fp, "\"ns_per_instruction\": %.4f, \"ns_per_frame\": %.1f, "
+            "\"mhz\": %.2f, \"cycles_per_instruction\": %.3f",
+            m.nsPerInstruction, m.nsPerFrame, m.mhz, m.cyclesPerInstruction);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: benchNesEmulator [options]\n"
+            "  --cycles N     cycles per opcode measurement (default 2000000),\n"
+            "                 the loops run ten times as long\n"
+            "  --out FILE     write the results as JSON\n"
+            "  --label TEXT   stored in the JSON, e.g. the commit measured\n"
+            "  --opcodes      print every opcode, not just the averages\n");
+}
+
+int main(int argc, char **argv)
+{
+    u64 cycles = 2000000;
+    const char *out = NULL;
+    const char *label = "";
+    bool printOpcodes = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--cycles") && i + 1 < argc) {
+            cycles = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            out = argv[++i];
+        } else if (!strcmp(argv[i], "--label") && i + 1 < argc) {
+            label = argv[++i];
+        } else if (!strcmp(argv[i], "--opcodes")) {
+            printOpcodes = true;
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<Config> active;
+    for (const Config &config : configs) {
+        if (!config.jit || Jit::is_supported()) {
+            active.push_back(config);
+        }
+    }
+
+    printf("%-16s", "");
+    for (const Config &config : active) {
+        printf("%20s", config.name);
+    }
+    printf("\n");
+
+    // the workloads, in emulated MHz and ns per instruction
+    // mixed last, the PPU rows run it
+    std::vector<Program> workloads = {make_alu_loop(), make_dispatch_loop(),
+        make_countdown_loop(), make_mixed_loop()};
+    std::vector<std::vector<Measurement>> workloadResults;
+    for (const Program &program : workloads) {
+        double cpi = calibrate(program);
+        workloadResults.emplace_back();
+        printf("%-16s", program.name.c_str());
+        for (const Config &config : active) {
+            Measurement m = measure(program, config, cpi, cycles * 10);
+            workloadResults.back().push_back(m);
+            printf("%8.1f MHz %5.2fns", m.mhz, m.nsPerInstruction);
+        }
+        printf("\n");
+    }
+
+    // whole frames of the mixed workload
+    printf("%-16s", "mixed frame");
+    for (const Measurement &m : workloadResults.back()) {
+        printf("%17.1f us", m.nsPerFrame / 1e3);
+    }
+    printf("\n");
+
+    // the same with the PPU running
+    u64 ppuFrames = std::max<u64>(cycles * 10 / Cpu::CYCLES_PER_FRAME, 1);
+    std::vector<double> ppuResults[PPU_MODE_COUNT];
+    for (u32 mode = 0; mode < PPU_MODE_COUNT; mode++) {
+        printf("%-16s", PPU_MODE_NAMES[mode]);
+        for (const Config &config : active) {
+            ppuResults[mode].push_back(measure_ppu_frames(workloads.back(),
+                        config, ppuFrames, static_cast<PpuMode>(mode)));
+            printf("%17.1f us", ppuResults[mode].back() / 1e3);
+        }
+        printf("\n");
+    }
+
+    // the background tile decoders, per scanline
+    std::vector<TileDecoderKind> decoders;
+    std::vector<double> decoderResults;
+    for (u32 kind = 0; kind < TILE_DECODER_COUNT; kind++) {
+        TileDecoder decoder =
+            get_tile_decoder(static_cast<TileDecoderKind>(kind));
+        if (!decoder) {
+            continue;
+        }
+        decoders.push_back(static_cast<TileDecoderKind>(kind));
+        decoderResults.push_back(measure_tile_decoder(decoder, cycles));
+        std::string name = std::string("tiles ") +
+            tile_decoder_name(decoders.back());
+        printf("%-16s%17.1f ns per line\n", name.c_str(),
+                decoderResults.back());
+    }
+    printf("\n");
+
+    // converting frames to each pixel format, per frame
+    std::vector<ConverterKind> converters;
+    for (u32 kind = 0; kind < CONVERTER_COUNT; kind++) {
+        if (converter_supported(static_cast<ConverterKind>(kind))) {
+            converters.push_back(static_cast<ConverterKind>(kind));
+        }
+    }
+    printf("%-16s", "");
+    for (ConverterKind kind : converters) {
+        printf("%20s", converter_name(kind));
+    }
+    printf("\n");
+    u64 convertFrames = std::max<u64>(cycles / 20000, 1);
+    std::vector<std::vector<double>> converterResults;
+    for (u32 format = 0; format < PIXEL_FORMAT_COUNT; format++) {
+        std::string name = std::string("to ") +
+            pixel_format_name(static_cast<PixelFormat>(format));
+        printf("%-16s", name.c_str());
+        converterResults.emplace_back();
+        for (ConverterKind kind : converters) {
+            FrameConverter converter(static_cast<PixelFormat>(format), kind);
+            converterResults.back().push_back(measure_converter(converter,
+                        convertFrames));
+            printf("%17.1f us", converterResults.back().back() / 1e3);
+        }
+        printf("\n");
+    }
+    printf("\n");
+
+    // post filters on each kernel, then the fastest split over every core
+    std::vector<FilterKind> filterKinds;
+    for (u32 kind = 0; kind < FILTER_KIND_COUNT; kind++) {
+        if (filter_supported(static_cast<FilterKind>(kind))) {
+            filterKinds.push_back(static_cast<FilterKind>(kind));
+        }
+    }
+    std::string threadedName = std::string(filter_kind_name(
+                best_filter_kind())) + " threads";
+    printf("%-16s", "");
+    for (FilterKind kind : filterKinds) {
+        printf("%20s", filter_kind_name(kind));
+    }
+    printf("%20s\n", threadedName.c_str());
+    std::vector<std::vector<double>> filterResults;
+    for (u32 type = 0; type < FILTER_TYPE_COUNT; type++) {
+        std::string name = std::string("filter ") +
+            filter_type_name(static_cast<FilterType>(type));
+        printf("%-16s", name.c_str());
+        filterResults.emplace_back();
+        for (u32 k = 0; k <= filterKinds.size(); k++) {
+            bool threaded = k == filterKinds.size();
+            PostFilter filter(static_cast<FilterType>(type), Ppu::WIDTH,
+                    Ppu::HEIGHT, threaded ? 0 : 1,
+                    threaded ? best_filter_kind() : filterKinds[k]);
+            filterResults.back().push_back(measure_filter(filter,
+                        convertFrames));
+            printf("%17.1f us", filterResults.back().back() / 1e3);
+        }
+        printf("\n");
+    }
+    printf("\n");
+
+    // resampling audio for the sound card on each kernel
+    std::vector<ResamplerKind> resamplers;
+    std::vector<double> resamplerResults;
+    u64 audioSeconds = std::max<u64>(cycles / 1000000, 1);
+    for (u32 kind = 0; kind < RESAMPLER_KIND_COUNT; kind++) {
+        if (!resampler_supported(static_cast<ResamplerKind>(kind))) {
+            continue;
+        }
+        resamplers.push_back(static_cast<ResamplerKind>(kind));
+        resamplerResults.push_back(measure_resampler(resamplers.back(),
+                    audioSeconds));
+        std::string name = std::string("resample ") +
+            resampler_kind_name(resamplers.back());
+        printf("%-16s%17.1f ns per sample\n", name.c_str(),
+                resamplerResults.back());
+    }
+    printf("\n");
+
+    // every official opcode, averaged per addressing mode
+    std::vector<Program> programs;
+    std::vector<std::vector<Measurement>> opcodeResults;
+    std::vector<u8> measured;
+    std::vector<std::vector<double>> modeTotals(ADDRESS_MODE_COUNT,
+            std::vector<double>(active.size(), 0));
+    std::vector<u32> modeCounts(ADDRESS_MODE_COUNT, 0);
+    for (u32 op = 0; op < 0x100; op++) {
+        const OpCode &opcode = opcodes[op];
+        if (opcode.instruction == INST_ILLEGAL) {
+            continue;
+        }
+        Program program = make_opcode_program(opcode);
+        double cpi = calibrate(program);
+        measured.push_back(op);
+        opcodeResults.emplace_back();
+        if (printOpcodes) {
+            printf("%s %-12s", opcode.name, mode_names[opcode.address_mode]);
+        }
+        for (size_t c = 0; c < active.size(); c++) {
+            Measurement m = measure(program, active[c], cpi, cycles);
+            opcodeResults.back().push_back(m);
+            modeTotals[opcode.address_mode][c] += m.nsPerInstruction;
+            if (printOpcodes) {
+                printf("%18.2fns", m.nsPerInstruction);
+            }
+        }
+        modeCounts[opcode.address_mode]++;
+        if (printOpcodes) {
+            printf("\n");
+        }
+    }
+    if (printOpcodes) {
+        printf("\n");
+    }
+    for (u32 mode = 0; mode < ADDRESS_MODE_COUNT; mode++) {
+        printf("%-16s", mode_names[mode]);
+        for (size_t c = 0; c < active.size(); c++) {
+            printf("%18.2fns", modeTotals[mode][c] / modeCounts[mode]);
+        }
+        printf("\n");
+    }
+
+    if (!out) {
+        return EXIT_SUCCESS;
+    }
+    FILE *fp = fopen(out, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s\n", out);
+        return EXIT_FAILURE;
+    }
+    fprintf(fp, "{\n  \"label\": \"");
+    for (const char *c = label; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', fp);
+        }
+        if (static_cast<u8>(*c) >= 0x20) {
+            fputc(*c, fp);
+        }
+    }
+    fprintf(fp, "\",\n  \"cycles\": %llu,\n  \"results\": [",
+            static_cast<unsigned long long>(cycles));
+    const char *separator = "\n";
+    for (size_t w = 0; w < workloads.size(); w++) {
+        for (size_t c = 0; c < active.size(); c++) {
+            fprintf(fp, "%s    {\"kind\": \"workload\", \"name\": \"%s\", "
+                    "\"config\": \"%s\", ", separator,
+                    workloads[w].name.c_str(), active[c].name);
+            write_measurement(fp, workloadResults[w][c]);
+            fprintf(fp, "}");
+            separator = ",\n";
+        }
+    }
+    for (u32 mode = 0; mode < PPU_MODE_COUNT; mode++) {
+        for (size_t c = 0; c < active.size(); c++) {
+            fprintf(fp, ",\n    {\"kind\": \"ppu frame\", \"name\": \"%s\", "
+                    "\"config\": \"%s\", \"skip_rendering\": %s, "
+                    "\"render_thread\": %s, \"bands\": %s, \"apu\": %s, "
+                    "\"ns_per_frame\": %.1f}",
+                    workloads.back().name.c_str(), active[c].name,
+                    mode == PPU_SKIP ? "true" : "false",
+                    mode == PPU_THREAD || mode == PPU_BANDS ? "true" : "false",
+                    mode == PPU_BANDS ? "true" : "false",
+                    mode == PPU_APU ? "true" : "false",
+                    ppuResults[mode][c]);
+        }
+    }
+    for (size_t i = 0; i < decoders.size(); i++) {
+        fprintf(fp, ",\n    {\"kind\": \"tile decoder\", \"name\": \"%s\", "
+                "\"ns_per_line\": %.2f}", tile_decoder_name(decoders[i]),
+                decoderResults[i]);
+    }
+    for (u32 format = 0; format < PIXEL_FORMAT_COUNT; format++) {
+        for (size_t k = 0; k < converters.size(); k++) {
+            fprintf(fp, ",\n    {\"kind\": \"converter\", \"format\": \"%s\", "
+                    "\"name\": \"%s\", \"ns_per_frame\": %.1f}",
+                    pixel_format_name(static_cast<PixelFormat>(format)),
+                    converter_name(converters[k]),
+                    converterResults[format][k]);
+        }
+    }
+    for (u32 type = 0; type < FILTER_TYPE_COUNT; type++) {
+        for (size_t k = 0; k <= filterKinds.size(); k++) {
+            bool threaded = k == filterKinds.size();
+            fprintf(fp, ",\n    {\"kind\": \"filter\", \"filter\": \"%s\", "
+                    "\"name\": \"%s\", \"threaded\": %s, "
+                    "\"ns_per_frame\": %.1f}",
+                    filter_type_name(static_cast<FilterType>(type)),
+                    filter_kind_name(threaded ? best_filter_kind()
+                        : filterKinds[k]),
+                    threaded ? "true" : "false", filterResults[type][k]);
+        }
+    }
+    for (size_t i = 0; i < resamplers.size(); i++) {
+        fprintf(fp, ",\n    {\"kind\": \"resampler\", \"name\": \"%s\", "
+                "\"ns_per_sample\": %.2f}", resampler_kind_name(resamplers[i]),
+                resamplerResults[i]);
+    }
+    for (size_t i = 0; i < measured.size(); i++) {
+        const OpCode &opcode = opcodes[measured[i]];
+        for (size_t c = 0; c < active.size(); c++) {
+            fprintf(fp, ",\n    {\"kind\": \"opcode\", \"op\": %u, "
+                    "\"name\": \"%s\", \"mode\": \"%s\", \"config\": \"%s\", ",
+                    opcode.op, opcode.name, mode_names[opcode.address_mode],
+                    active[c].name);
+            write_measurement(fp, opcodeResults[i][c]);
+            fprintf(fp, "}");
+        }
+    }
+    for (u32 mode = 0; mode < ADDRESS_MODE_COUNT; mode++) {
+        for (size_t c = 0; c < active.size(); c++) {
+            fprintf(fp, ",\n    {\"kind\": \"mode\", \"name\": \"%s\", "
+                    "\"config\": \"%s\", \"ns_per_instruction\": %.4f}",
+                    mode_names[mode], active[c].name,
+                    modeTotals[mode][c] / modeCounts[mode]);
+        }
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+	return EXIT_SUCCESS;
+}
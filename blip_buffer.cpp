@@ -0,0 +1,122 @@
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+#include "blip_buffer.h"
+
+static const u32 FRACTION_BITS = 32;
+// the leak of the integrator, a high-pass around 15 Hz at 48 kHz
+static const u32 BASS_SHIFT = 9;
+
+BlipBuffer::BlipBuffer(u32 clock_rate, u32 sample_rate, u32 capacity)
+    : sampleRate(sample_rate), capacity(capacity)
+{
+    factor = (static_cast<u64>(sample_rate) << FRACTION_BITS) / clock_rate;
+    deltas.resize(capacity + KERNEL_SIZE);
+    offset = 0;
+    clear();
+
+    // the step is a sinc cut off a little below the output's Nyquist rate,
+    // under a Blackman window, sampled at each phase. Every phase is scaled
+    // to add up to exactly 1 << DELTA_BITS so a step never leaves the level
+    // a little off, which would drift.
+    const double PI = 3.14159265358979323846;
+    const double CUTOFF = 0.45;
+    for (u32 phase = 0; phase < PHASES; phase++) {
+        double taps[KERNEL_SIZE];
+        double sum = 0;
+        for (u32 i = 0; i < KERNEL_SIZE; i++) {
+            double x = i - (KERNEL_SIZE / 2 - 1)
+                - (phase + 0.5) / PHASES;
+            double sinc = x == 0 ? 1 : std::sin(2 * PI * CUTOFF * x)
+                / (2 * PI * CUTOFF * x);
+            double w = (x + KERNEL_SIZE / 2.0) / KERNEL_SIZE;
+            double window = 0.42 - 0.5 * std::cos(2 * PI * w)
+                + 0.08 * std::cos(4 * PI * w);
+            taps[i] = sinc * window;
+            sum += taps[i];
+        }
+        s32 total = 0;
+        for (u32 i = 0; i < KERNEL_SIZE; i++) {
+            kernel[phase][i] = static_cast<s16>(std::lround(
+                        taps[i] / sum * (1 << DELTA_BITS)));
+            total += kernel[phase][i];
+        }
+        // the rounding error goes on the middle tap
+        kernel[phase][KERNEL_SIZE / 2 - 1] += (1 << DELTA_BITS) - total;
+    }
+}
+
+u32 BlipBuffer::get_sample_rate(void) const
+{
+    return sampleRate;
+}
+
+void BlipBuffer::add_delta(u64 clock, s32 delta)
+{
+    u64 position = offset + clock * factor;
+    u32 index = static_cast<u32>(position >> FRACTION_BITS);
+    u32 phase = static_cast<u32>(position >> (FRACTION_BITS - PHASE_BITS))
+        & (PHASES - 1);
+    if (index >= capacity) {
+        return;
+    }
+    written = std::max(written, index + KERNEL_SIZE);
+    s32 *out = &deltas[index];
+    const s16 *taps = kernel[phase];
+    for (u32 i = 0; i < KERNEL_SIZE; i++) {
+        out[i] += taps[i] * delta;
+    }
+}
+
+void BlipBuffer::end_frame(u64 clocks)
+{
+    offset += clocks * factor;
+    // a frame too long for the buffer loses its end rather than overflowing
+    offset = std::min(offset, static_cast<u64>(capacity) << FRACTION_BITS);
+}
+
+u32 BlipBuffer::count_samples(u64 frame_clocks) const
+{
+    u64 end = offset + frame_clocks * factor;
+    return static_cast<u32>((end >> FRACTION_BITS)
+            - (offset >> FRACTION_BITS));
+}
+
+u32 BlipBuffer::samples_available(void) const
+{
+    return static_cast<u32>(offset >> FRACTION_BITS);
+}
+
+u32 BlipBuffer::read_samples(s16 *out, u32 count)
+{
+    count = std::min(count, samples_available());
+    s32 sum = integrator;
+    for (u32 i = 0; i < count; i++) {
+        s32 sample = sum >> DELTA_BITS;
+        sum += deltas[i];
+        sum -= sample * (1 << (DELTA_BITS - BASS_SHIFT));
+        if (out) {
+            out[i] = static_cast<s16>(std::min(std::max(sample, -32768),
+                        32767));
+        }
+    }
+    integrator = sum;
+
+    // the deltas of later samples, those of the frame being added to
+    // included, move to the front, everything past them is still 0
+    u32 left = written > count ? written - count : 0;
+    memmove(&deltas[0], &deltas[count], left * sizeof(s32));
+    std::fill(deltas.begin() + left, deltas.begin() + written, 0);
+    written = left;
+    offset -= static_cast<u64>(count) << FRACTION_BITS;
+    return count;
+}
+
+void BlipBuffer::clear(void)
+{
+    offset &= (static_cast<u64>(1) << FRACTION_BITS) - 1;
+    integrator = 0;
+    written = 0;
+    std::fill(deltas.begin(), deltas.end(), 0);
+}
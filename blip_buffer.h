@@ -0,0 +1,89 @@
+#ifndef BLIP_BUFFER_H
+#define BLIP_BUFFER_H
+
+#include "utils.h"
+#include <vector>
+
+/**
+ * Turns a signal given as the times its level changes into samples, without
+ * the aliasing a plain resample of a square wave has. Every change adds a
+ * band-limited step, taken from a table of windowed sincs at 32 sub-sample
+ * phases, to a buffer of deltas that reading integrates. So a channel that
+ * changes level a thousand times a frame costs a thousand adds of 16 taps,
+ * however many clocks the frame has. The integrator leaks a little, which
+ * takes out DC like the high-pass on the NES's output.
+ *
+ * Time is counted in clocks from the end of the last frame; end_frame()
+ * makes the samples up to a point available to read.
+ */
+class BlipBuffer
+{
+public:
+    static const u32 KERNEL_SIZE = 16;
+    static const u32 PHASE_BITS = 5;
+    static const u32 PHASES = 1 << PHASE_BITS;
+    // a delta of 1 is a step of 1 in the 16 bit samples
+    static const u32 DELTA_BITS = 15;
+
+    /**
+     * @param clock_rate: The clocks per second of the times given.
+     * @param sample_rate: The samples per second read out.
+     * @param capacity: The most samples that can be waiting to be read,
+     * including those of the frame being added to.
+     */
+    BlipBuffer(u32 clock_rate, u32 sample_rate, u32 capacity);
+    ~BlipBuffer(void) {}
+
+    u32 get_sample_rate(void) const;
+
+    /**
+     * Adds a change of level.
+     *
+     * @param clock: When, in clocks since the end of the last frame.
+     * @param delta: By how much, in 16 bit sample units.
+     */
+    void add_delta(u64 clock, s32 delta);
+
+    /**
+     * Ends the frame, the samples before its end can be read.
+     *
+     * @param clocks: How long the frame was, every change added has to be
+     * before its end.
+     */
+    void end_frame(u64 clocks);
+
+    /**
+     * @return: How many samples frame_clocks more clocks would add, for
+     * making sure the buffer has room.
+     */
+    u32 count_samples(u64 frame_clocks) const;
+
+    u32 samples_available(void) const;
+
+    /**
+     * Reads the oldest samples out of the buffer.
+     *
+     * @param out: Where the samples go, NULL to throw them away.
+     * @return: How many were read, at most count.
+     */
+    u32 read_samples(s16 *out, u32 count);
+
+    /**
+     * Throws away everything, the level goes back to 0. Time carries on
+     * from the fraction of a sample it was into the next, so a copy of a
+     * buffer cleared stays in step with it.
+     */
+    void clear(void);
+
+private:
+    u64 factor;     // samples per clock, with 32 fraction bits
+    u64 offset;     // where the frame starts, in samples with 32 fractions
+    u32 sampleRate;
+    u32 capacity;
+    s32 integrator;
+    u32 written;    // past the last delta added to, everything after is 0
+    std::vector<s32> deltas;
+    s16 kernel[PHASES][KERNEL_SIZE];
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include <string.h>
+
+#include "block_cache.h"
+
+double BlockCacheStats::hit_rate(void) const
+{
+    u64 lookups = hits + misses;
+    return lookups ? static_cast<double>(hits) / lookups : 0.0;
+}
+
+BlockCache::BlockCache(Bus &b) : bus(b)
+{
+    for (u32 i = 0; i < Bus::PAGE_COUNT; i++) {
+        pages[i] = NULL;
+        selfModifying[i] = false;
+    }
+    generation = 0;
+    reset_stats();
+}
+
+BlockCache::~BlockCache(void)
+{
+    clear();
+    free_retired();
+}
+
+Block *BlockCache::lookup(u16 address)
+{
+    u8 page = address >> Bus::PAGE_SHIFT;
+    CachedPage *cached = pages[page];
+    if (cached && (cached->source != bus.get_read_page(page)
+                || (bus.get_write_storage(page) == cached->source
+                    && bus.get_watched_page(page) != cached->source))) {
+        // the page was bank switched since its blocks were decoded, or
+        // remapped in a way that ended the watch on its writes
+        stats.remapInvalidations++;
+        drop_page(page);
+        cached = NULL;
+    }
+
+    Block *block = cached ? cached->blocks[address & Bus::PAGE_MASK] : NULL;
+    if (block) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+    }
+    return block;
+}
+
+void BlockCache::insert(Block *block, const u8 *source)
+{
+    u8 page = block->start >> Bus::PAGE_SHIFT;
+    CachedPage *cached = pages[page];
+    if (!cached) {
+        cached = new CachedPage;
+        cached->source = source;
+        memset(cached->blocks, 0, sizeof(cached->blocks));
+        pages[page] = cached;
+        // ROM pages have nothing to watch
+        bus.watch_writes(page, this);
+    }
+
+    Block *&slot = cached->blocks[block->start & Bus::PAGE_MASK];
+    if (slot) {
+        retired.push_back(slot);
+    }
+    slot = block;
+    stats.blocksDecoded++;
+}
+
+void BlockCache::clear(void)
+{
+    for (u32 i = 0; i < Bus::PAGE_COUNT; i++) {
+        if (pages[i]) {
+            drop_page(i);
+        }
+    }
+}
+
+bool BlockCache::is_self_modifying(u8 page) const
+{
+    return selfModifying[page];
+}
+
+const BlockCacheStats &BlockCache::get_stats(void) const
+{
+    return stats;
+}
+
+void BlockCache::reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+u8 BlockCache::io_read(u16 address)
+{
+    // reads of watched pages never leave the bus
+    return static_cast<u8>(address >> 8);
+}
+
+/**
+ * A write to RAM that holds decoded code. Every page decoded from the same
+ * storage is dropped, whichever mirror the write went through, and the
+ * write goes through once the watch is lifted.
+ */
+void BlockCache::io_write(u16 address, u8 val)
+{
+    u8 page = address >> Bus::PAGE_SHIFT;
+    const u8 *storage = bus.get_watched_page(page);
+    bus.unwatch_writes(page);
+
+    for (u32 i = 0; i < Bus::PAGE_COUNT; i++) {
+        if (pages[i] && pages[i]->source == storage) {
+            selfModifying[i] = true;
+            drop_page(i);
+        }
+    }
+    stats.writeInvalidations++;
+
+    bus.write(address, val);
+}
+
+void BlockCache::drop_page(u8 page)
+{
+    CachedPage *cached = pages[page];
+    for (u32 i = 0; i < Bus::PAGE_SIZE; i++) {
+        if (cached->blocks[i]) {
+            retired.push_back(cached->blocks[i]);
+        }
+    }
+    delete cached;
+    pages[page] = NULL;
+    // the watch covers every mirror of the storage, it stays for as long as
+    // one of them still has blocks
+    const u8 *watched = bus.get_watched_page(page);
+    bool mirrored = false;
+    for (u32 i = 0; i < Bus::PAGE_COUNT && !mirrored; i++) {
+        mirrored = pages[i] && pages[i]->source == watched;
+    }
+    if (!mirrored) {
+        bus.unwatch_writes(page);
+    }
+    generation++;
+}
+
+void BlockCache::free_retired(void)
+{
+    for (Block *block : retired) {
+        delete block;
+    }
+    retired.clear();
+}
@@ -0,0 +1,143 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include "utils.h"
+#include "bus.h"
+#include <vector>
+
+class Cpu;
+
+// A block compiled to native code, see Jit.
+typedef u32 (*NativeCode)(void);
+
+/**
+ * An instruction decoded ahead of time: the handler that runs it with its
+ * operand already fetched, the operand bytes and the base cycle cost.
+ */
+struct DecodedInstruction
+{
+    u32 (Cpu::*run)(void);
+    u16 operand;
+    u8  op;
+    u8  length;
+    u8  cycles;
+};
+
+/**
+ * A run of straight line code. A block ends with the first instruction that
+ * can change the flow of control, or before an instruction that would cross
+ * into the next page, so all of a block's bytes come from a single page.
+ */
+struct Block
+{
+    static const u32 MAX_INSTRUCTIONS = 32;
+
+    u16 start;
+    u16 end;        // the address past the last instruction
+    u32 cycles;     // base cycle cost of the whole block, without penalties
+    u32 count;
+    u32 runs;
+    NativeCode native;  // NULL until the block is compiled
+    u32 maxCycles;      // the most cycles the native code can take
+    DecodedInstruction instructions[MAX_INSTRUCTIONS];
+};
+
+struct BlockCacheStats
+{
+    u64 hits;
+    u64 misses;
+    u64 blocksDecoded;
+    u64 writeInvalidations; // code in RAM that was written to
+    u64 remapInvalidations; // code pages that were bank switched away
+
+    /**
+     * @return: The fraction of lookups that found a block.
+     */
+    double hit_rate(void) const;
+};
+
+/**
+ * Decoded blocks, keyed by the pc they start at. Blocks are kept per page,
+ * together with the storage the page was read from when they were decoded.
+ * A bank switch is caught on lookup, when the page reads from different
+ * storage, and a write to RAM that holds code is caught by watching the
+ * writes to its pages on the bus. Either drops every block of the page, as
+ * does finding a page of RAM without its watch, e.g. after it was mapped
+ * read only for a while, since writes to it could go unseen.
+ */
+class BlockCache : public IoDevice
+{
+public:
+    BlockCache(Bus &b);
+    ~BlockCache(void);
+
+    /**
+     * @return: The block starting at the given address, NULL if there is
+     * none.
+     */
+    Block *lookup(u16 address);
+
+    /**
+     * Adds a block to the cache, which takes ownership of it.
+     *
+     * @param block: The block.
+     * @param source: The storage the block's page was decoded from.
+     */
+    void insert(Block *block, const u8 *source);
+
+    /**
+     * Drops every block, e.g. after memory was changed behind the bus' back.
+     */
+    void clear(void);
+
+    /**
+     * Frees the blocks that were dropped. A block can be dropped while it is
+     * running, so this is only safe to call between blocks.
+     */
+    void collect(void)
+    {
+        if (!retired.empty()) {
+            free_retired();
+        }
+    }
+
+    /**
+     * @return: A counter that changes whenever blocks are dropped.
+     */
+    u32 get_generation(void) const
+    {
+        return generation;
+    }
+
+    /**
+     * @return: Whether code in the given page has been written to while it
+     * was cached.
+     */
+    bool is_self_modifying(u8 page) const;
+
+    const BlockCacheStats &get_stats(void) const;
+    void reset_stats(void);
+
+    // gets the writes to watched pages
+    u8 io_read(u16 address) override;
+    void io_write(u16 address, u8 val) override;
+
+private:
+    struct CachedPage
+    {
+        const u8 *source;
+        Block *blocks[Bus::PAGE_SIZE];
+    };
+
+    Bus &bus;
+    CachedPage *pages[Bus::PAGE_COUNT];
+    bool selfModifying[Bus::PAGE_COUNT];
+    std::vector<Block *> retired;
+    u32 generation;
+    BlockCacheStats stats;
+
+    void drop_page(u8 page);
+    void free_retired(void);
+};
+
+#endif
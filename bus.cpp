@@ -0,0 +1,169 @@
+#include "bus.h"
+
+Bus::Bus(void)
+{
+    generation = 0;
+    for (u32 i = 0; i < PAGE_COUNT; i++) {
+        watchedPages[i] = NULL;
+    }
+    unmap(0, 0x10000);
+}
+
+void Bus::map(u16 address, u32 size, u8 *storage, u32 storage_size,
+        bool writable)
+{
+    u32 first = address >> PAGE_SHIFT;
+    generation++;
+    for (u32 i = 0; i < (size >> PAGE_SHIFT); i++) {
+        u8 *page = storage + ((i << PAGE_SHIFT) % storage_size);
+        if (writable && watchedPages[first + i] == page) {
+            // mapped again onto the same storage, e.g. a mapper re-enabling
+            // its PRG RAM, the watcher keeps getting its writes
+            readPages[first + i] = page;
+            continue;
+        }
+        release_watch(first + i);
+        readPages[first + i] = page;
+        writePages[first + i] = writable ? page : NULL;
+        devices[first + i] = NULL;
+        if (writable) {
+            inherit_watch(first + i);
+        }
+    }
+}
+
+void Bus::map_rom(u16 address, u32 size, const u8 *storage, u32 storage_size)
+{
+    u32 first = address >> PAGE_SHIFT;
+    generation++;
+    for (u32 i = 0; i < (size >> PAGE_SHIFT); i++) {
+        release_watch(first + i);
+        readPages[first + i] = storage + ((i << PAGE_SHIFT) % storage_size);
+        writePages[first + i] = NULL;
+    }
+}
+
+void Bus::map_io(u16 address, u32 size, IoDevice *device)
+{
+    u32 first = address >> PAGE_SHIFT;
+    generation++;
+    for (u32 i = 0; i < (size >> PAGE_SHIFT); i++) {
+        release_watch(first + i);
+        readPages[first + i] = NULL;
+        writePages[first + i] = NULL;
+        devices[first + i] = device;
+    }
+}
+
+void Bus::map_write_io(u16 address, u32 size, IoDevice *device)
+{
+    u32 first = address >> PAGE_SHIFT;
+    generation++;
+    for (u32 i = 0; i < (size >> PAGE_SHIFT); i++) {
+        release_watch(first + i);
+        writePages[first + i] = NULL;
+        devices[first + i] = device;
+    }
+}
+
+void Bus::unmap(u16 address, u32 size)
+{
+    u32 first = address >> PAGE_SHIFT;
+    generation++;
+    for (u32 i = 0; i < (size >> PAGE_SHIFT); i++) {
+        release_watch(first + i);
+        readPages[first + i] = NULL;
+        writePages[first + i] = NULL;
+        devices[first + i] = NULL;
+    }
+}
+
+const u8 *Bus::get_read_page(u8 page) const
+{
+    return readPages[page];
+}
+
+IoDevice *Bus::get_device(u8 page) const
+{
+    return devices[page];
+}
+
+void Bus::watch_writes(u8 page, IoDevice *watcher)
+{
+    u8 *storage = writePages[page];
+    if (!storage) {
+        return;
+    }
+    for (u32 i = 0; i < PAGE_COUNT; i++) {
+        if (writePages[i] == storage) {
+            watchedPages[i] = storage;
+            writePages[i] = NULL;
+            devices[i] = watcher;
+        }
+    }
+}
+
+void Bus::unwatch_writes(u8 page)
+{
+    u8 *storage = watchedPages[page];
+    if (!storage) {
+        return;
+    }
+    for (u32 i = 0; i < PAGE_COUNT; i++) {
+        if (watchedPages[i] == storage) {
+            release_watch(i);
+            writePages[i] = storage;
+        }
+    }
+}
+
+const u8 *Bus::get_watched_page(u8 page) const
+{
+    return watchedPages[page];
+}
+
+/**
+ * Watches a freshly mapped page if its storage is already watched through
+ * another page.
+ */
+void Bus::inherit_watch(u32 page)
+{
+    for (u32 i = 0; i < PAGE_COUNT; i++) {
+        if (watchedPages[i] && watchedPages[i] == writePages[page]) {
+            watchedPages[page] = writePages[page];
+            writePages[page] = NULL;
+            devices[page] = devices[i];
+            return;
+        }
+    }
+}
+
+/**
+ * Drops the watch on a single page, it is left without a write pointer.
+ */
+void Bus::release_watch(u32 page)
+{
+    if (watchedPages[page]) {
+        watchedPages[page] = NULL;
+        devices[page] = NULL;
+    }
+}
+
+u8 Bus::io_read(u16 address)
+{
+    IoDevice *device = devices[address >> PAGE_SHIFT];
+    if (device) {
+        return device->io_read(address);
+    }
+    // open bus, the last value on the data bus is usually the high byte of
+    // the address
+    return static_cast<u8>(address >> 8);
+}
+
+void Bus::io_write(u16 address, u8 val)
+{
+    IoDevice *device = devices[address >> PAGE_SHIFT];
+    if (device) {
+        device->io_write(address, val);
+    }
+}
@@ -0,0 +1,177 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include "utils.h"
+
+/**
+ * A device with memory mapped registers, e.g. the PPU at $2000-$2007 or a
+ * mapper's bank registers. It gets every access to the pages it is mapped
+ * on.
+ */
+class IoDevice
+{
+public:
+    virtual ~IoDevice(void) {}
+
+    virtual u8 io_read(u16 address) = 0;
+    virtual void io_write(u16 address, u8 val) = 0;
+};
+
+/**
+ * The cpu address space, split into 256 byte pages. Every page either points
+ * straight at its backing storage, in which case an access is a single load,
+ * or at the IoDevice that handles it. Mirroring is done by pointing several
+ * pages at the same storage and bank switching by swapping page pointers.
+ */
+class Bus
+{
+public:
+    static const u32 PAGE_SHIFT = 8;
+    static const u32 PAGE_SIZE = 1 << PAGE_SHIFT;
+    static const u32 PAGE_MASK = PAGE_SIZE - 1;
+    static const u32 PAGE_COUNT = 0x10000 >> PAGE_SHIFT;
+
+    Bus(void);
+    ~Bus(void) {}
+
+    inline u8 read(u16 address)
+    {
+        const u8 *page = readPages[address >> PAGE_SHIFT];
+        if (likely(page)) {
+            return page[address & PAGE_MASK];
+        }
+        return io_read(address);
+    }
+
+    inline void write(u16 address, u8 val)
+    {
+        u8 *page = writePages[address >> PAGE_SHIFT];
+        if (likely(page)) {
+            page[address & PAGE_MASK] = val;
+            return;
+        }
+        io_write(address, val);
+    }
+
+    /**
+     * Maps storage onto a range of the address space. If the storage is
+     * smaller than the range it is mirrored across it.
+     *
+     * @param address: The start of the range, must be page aligned.
+     * @param size: The size of the range, must be a multiple of the page size.
+     * @param storage: The backing storage.
+     * @param storage_size: The size of the storage, a multiple of the page size.
+     * @param writable: Whether writes go to the storage. Writes to read only
+     * storage go to the IoDevice of the page if there is one, otherwise they
+     * are dropped. A page mapped writable onto the storage it already had,
+     * with its writes watched, stays watched.
+     */
+    void map(u16 address, u32 size, u8 *storage, u32 storage_size,
+            bool writable);
+
+    /**
+     * Maps read only storage, for ROM.
+     */
+    void map_rom(u16 address, u32 size, const u8 *storage, u32 storage_size);
+
+    /**
+     * Hands every access to a range of the address space to the given device.
+     *
+     * @param address: The start of the range, must be page aligned.
+     * @param size: The size of the range, must be a multiple of the page size.
+     * @param device: The device handling the accesses.
+     */
+    void map_io(u16 address, u32 size, IoDevice *device);
+
+    /**
+     * Sets the device that gets writes to a read only range, e.g. the bank
+     * registers of a mapper that sit on top of PRG ROM. Reads still go
+     * straight to the storage.
+     */
+    void map_write_io(u16 address, u32 size, IoDevice *device);
+
+    /**
+     * Unmaps a range, reads return open bus and writes are dropped.
+     */
+    void unmap(u16 address, u32 size);
+
+    /**
+     * @return: The storage the given page reads from, NULL if the page is
+     * handled by a device.
+     */
+    const u8 *get_read_page(u8 page) const;
+
+    /**
+     * @return: The device handling the given page, NULL if there is none.
+     */
+    IoDevice *get_device(u8 page) const;
+
+    /**
+     * @return: The page tables, for code that accesses memory without going
+     * through read() and write(), i.e. the JIT.
+     */
+    const u8 *const *get_read_pages(void) const
+    {
+        return readPages;
+    }
+
+    u8 *const *get_write_pages(void) const
+    {
+        return writePages;
+    }
+
+    /**
+     * @return: The writable storage behind a page, watched or not, NULL if
+     * there is none.
+     */
+    u8 *get_write_storage(u8 page) const
+    {
+        return writePages[page] ? writePages[page] : watchedPages[page];
+    }
+
+    /**
+     * Hands the writes to the storage behind a writable page to the given
+     * device instead, on every page the storage is mapped to. Reads are not
+     * affected. This lets the block cache see writes to RAM that holds
+     * decoded code without slowing down writes to any other page. The watch
+     * ends with unwatch_writes() or when the pages are remapped.
+     *
+     * @param page: A page the storage is mapped to.
+     * @param watcher: The device that gets the writes.
+     */
+    void watch_writes(u8 page, IoDevice *watcher);
+
+    /**
+     * Sends the writes to a watched storage straight to it again.
+     */
+    void unwatch_writes(u8 page);
+
+    /**
+     * @return: The storage behind the given page if its writes are watched,
+     * NULL otherwise.
+     */
+    const u8 *get_watched_page(u8 page) const;
+
+    /**
+     * @return: A counter that changes whenever a page is mapped or unmapped,
+     * so a bank switch can be noticed by comparing two values.
+     */
+    u32 get_generation(void) const
+    {
+        return generation;
+    }
+
+private:
+    const u8    *readPages[PAGE_COUNT];
+    u8          *writePages[PAGE_COUNT];
+    IoDevice    *devices[PAGE_COUNT];
+    u8          *watchedPages[PAGE_COUNT];
+    u32         generation;
+
+    void inherit_watch(u32 page);
+    void release_watch(u32 page);
+    u8 io_read(u16 address);
+    void io_write(u16 address, u8 val);
+};
+
+#endif
@@ -0,0 +1,362 @@
+#include <string.h>
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <mutex>
+
+#include "cartridge.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const u32 PRG_UNIT = 0x4000;
+static const u32 CHR_UNIT = 0x2000;
+static const u32 PRG_RAM_UNIT = 0x2000;
+
+//-----------------------------------------------------------------------------
+// RomFile
+//-----------------------------------------------------------------------------
+
+/**
+ * @return: What tells a file apart from others and from itself before it was
+ * changed, empty if it can't be looked at.
+ */
+static std::string file_key(const std::string &path)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path canonical = fs::canonical(path, ec);
+    if (ec) {
+        return "";
+    }
+    u64 size = fs::file_size(canonical, ec);
+    if (ec) {
+        return "";
+    }
+    auto modified = fs::last_write_time(canonical, ec);
+    if (ec) {
+        return "";
+    }
+    return canonical.string() + "|" + std::to_string(size) + "|"
+        + std::to_string(modified.time_since_epoch().count());
+}
+
+RomFile::RomFile(void) : data(NULL), size(0), mapping(NULL)
+{
+}
+
+RomFile::~RomFile(void)
+{
+    if (!mapping) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(mapping);
+#else
+    munmap(mapping, size);
+#endif
+}
+
+std::shared_ptr<const RomFile> RomFile::open(const std::string &path,
+        std::string &error)
+{
+    // every file open in the process, expired once nothing uses it
+    static std::mutex lock;
+    static std::map<std::string, std::weak_ptr<const RomFile>> files;
+
+    std::string key = file_key(path);
+    if (key.empty()) {
+        error = "failed to open " + path;
+        return NULL;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = files.begin(); it != files.end();) {
+        it = it->second.expired() ? files.erase(it) : std::next(it);
+    }
+    // the last user may let go on another thread after the sweep, then the
+    // file is opened again
+    auto found = files.find(key);
+    if (found != files.end()) {
+        if (std::shared_ptr<const RomFile> shared = found->second.lock()) {
+            return shared;
+        }
+    }
+
+    std::shared_ptr<RomFile> file(new RomFile());
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER length;
+    if (handle != INVALID_HANDLE_VALUE && GetFileSizeEx(handle, &length)
+            && length.QuadPart > 0) {
+        // the view keeps the mapping and the file open
+        HANDLE section = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0,
+                0, NULL);
+        if (section) {
+            file->mapping = MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(section);
+        }
+        file->size = static_cast<size_t>(length.QuadPart);
+    }
+    if (handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(handle);
+    }
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd >= 0 && !fstat(fd, &info) && info.st_size > 0) {
+        // shared, so every process mapping the file reads the same pages
+        void *address = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd,
+                0);
+        if (address != MAP_FAILED) {
+            file->mapping = address;
+            file->size = info.st_size;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+
+    if (file->mapping) {
+        file->data = static_cast<const u8 *>(file->mapping);
+    } else {
+        // empty, or somewhere that can't be mapped
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (!fp) {
+            error = "failed to open " + path;
+            return NULL;
+        }
+        u8 buffer[0x4000];
+        size_t read;
+        while ((read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+            file->copy.insert(file->copy.end(), buffer, buffer + read);
+        }
+        bool failed = ferror(fp);
+        fclose(fp);
+        if (failed) {
+            error = "failed to read " + path;
+            return NULL;
+        }
+        file->data = file->copy.data();
+        file->size = file->copy.size();
+    }
+    files[key] = file;
+    return file;
+}
+
+const u8 *RomFile::get_data(void) const
+{
+    return data;
+}
+
+size_t RomFile::get_size(void) const
+{
+    return size;
+}
+
+bool RomFile::is_mapped(void) const
+{
+    return mapping != NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Headers
+//-----------------------------------------------------------------------------
+
+/**
+ * A NES 2.0 ROM size: the LSB and MSB as a count of units, or with an MSB
+ * of $F the LSB as 2^E * (2M + 1) bytes.
+ */
+static u64 rom_size(u8 lsb, u8 msb, u32 unit)
+{
+    if (msb == 0x0f) {
+        u32 exponent = lsb >> 2;
+        // no ROM is that big, and the shift would overflow
+        if (exponent > 40) {
+            return ~0ull;
+        }
+        return (1ull << exponent) * ((lsb & 3) * 2 + 1);
+    }
+    return static_cast<u64>((msb << 8) | lsb) * unit;
+}
+
+/**
+ * A NES 2.0 RAM size, 64 << n bytes, 0 for none.
+ */
+static u32 shift_size(u8 shift)
+{
+    return shift ? 64u << shift : 0;
+}
+
+bool parse_rom_header(const u8 *data, size_t size, RomHeader *header,
+        std::string &error)
+{
+    if (size < RomHeader::SIZE || memcmp(data, "NES\x1a", 4)) {
+        error = "not an iNES image";
+        return false;
+    }
+    RomHeader h = {};
+    h.trainer = data[6] & 0x04;
+    h.battery = data[6] & 0x02;
+    if (data[6] & 0x08) {
+        h.mirroring = Ppu::FOUR_SCREEN;
+    } else {
+        h.mirroring = (data[6] & 0x01) ? Ppu::VERTICAL : Ppu::HORIZONTAL;
+    }
+    h.mapper = data[6] >> 4;
+
+    u64 prg, chr;
+    if ((data[7] & 0x0c) == 0x08) {
+        h.format = ROM_NES2;
+        h.mapper |= (data[7] & 0xf0) | ((data[8] & 0x0f) << 8);
+        h.submapper = data[8] >> 4;
+        prg = rom_size(data[4], data[9] & 0x0f, PRG_UNIT);
+        chr = rom_size(data[5], data[9] >> 4, CHR_UNIT);
+        h.prgRamSize = shift_size(data[10] & 0x0f);
+        h.prgNvramSize = shift_size(data[10] >> 4);
+        h.chrRamSize = shift_size(data[11] & 0x0f);
+        h.chrNvramSize = shift_size(data[11] >> 4);
+        h.timing = static_cast<RomTiming>(data[12] & 0x03);
+    } else {
+        h.format = ROM_INES;
+        // old tools left their name in bytes 7-15, e.g. "DiskDude!"
+        bool junk = data[12] || data[13] || data[14] || data[15];
+        if (!junk) {
+            h.mapper |= data[7] & 0xf0;
+        }
+        prg = static_cast<u64>(data[4]) * PRG_UNIT;
+        chr = static_cast<u64>(data[5]) * CHR_UNIT;
+        // hardly anything sets byte 8, 0 is the usual 8KB
+        u32 ram = (!junk && data[8] ? data[8] : 1) * PRG_RAM_UNIT;
+        if (h.battery) {
+            h.prgNvramSize = ram;
+        } else {
+            h.prgRamSize = ram;
+        }
+        h.chrRamSize = chr ? 0 : CHR_UNIT;
+        h.timing = !junk && (data[9] & 0x01) ? TIMING_PAL : TIMING_NTSC;
+    }
+
+    // the PPU maps CHR in 1KB banks, the cpu PRG in 256 byte pages
+    if (!prg || prg % PRG_RAM_UNIT || chr % 0x400) {
+        error = "bad ROM sizes in iNES header";
+        return false;
+    }
+    u64 needed = RomHeader::SIZE + (h.trainer ? RomHeader::TRAINER_SIZE : 0)
+        + prg + chr;
+    if (needed > size) {
+        error = "truncated iNES image";
+        return false;
+    }
+    h.prgSize = static_cast<u32>(prg);
+    h.chrSize = static_cast<u32>(chr);
+    *header = h;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Cartridge
+//-----------------------------------------------------------------------------
+
+Cartridge::Cartridge(void) : header(), prg(NULL), chr(NULL)
+{
+}
+
+bool Cartridge::load(const std::string &path, std::string &error)
+{
+    std::shared_ptr<const RomFile> file = RomFile::open(path, error);
+    return file && load(file, error);
+}
+
+bool Cartridge::load(std::shared_ptr<const RomFile> file, std::string &error)
+{
+    const u8 *data = file->get_data();
+    RomHeader parsed;
+    if (!parse_rom_header(data, file->get_size(), &parsed, error)) {
+        return false;
+    }
+    header = parsed;
+    this->file = file;
+    prg = data + RomHeader::SIZE
+        + (header.trainer ? RomHeader::TRAINER_SIZE : 0);
+    chr = header.chrSize ? prg + header.prgSize : NULL;
+
+    // the bus maps RAM in whole 256 byte pages
+    u32 ramSize = header.prgRamSize + header.prgNvramSize;
+    prgRam.assign(ramSize ? std::max<u32>(ramSize, 0x100) : 0, 0);
+    if (header.trainer && prgRam.size() >= PRG_RAM_UNIT) {
+        memcpy(&prgRam[0x1000], data + RomHeader::SIZE,
+                RomHeader::TRAINER_SIZE);
+    }
+    // a cartridge without CHR ROM always has some RAM, even if a NES 2.0
+    // header forgot to say
+    u32 chrRamSize = header.chrRamSize + header.chrNvramSize;
+    if (!chr) {
+        chrRamSize = std::max(chrRamSize, CHR_UNIT);
+    }
+    chrRam.assign(chrRamSize ? std::max<u32>(chrRamSize, 0x400) : 0, 0);
+    return true;
+}
+
+const RomHeader &Cartridge::get_header(void) const
+{
+    return header;
+}
+
+const u8 *Cartridge::get_prg(void) const
+{
+    return prg;
+}
+
+u32 Cartridge::get_prg_size(void) const
+{
+    return header.prgSize;
+}
+
+const u8 *Cartridge::get_chr(void) const
+{
+    return chr;
+}
+
+u32 Cartridge::get_chr_size(void) const
+{
+    return header.chrSize;
+}
+
+u8 *Cartridge::get_prg_ram(void)
+{
+    return prgRam.empty() ? NULL : prgRam.data();
+}
+
+u32 Cartridge::get_prg_ram_size(void) const
+{
+    return static_cast<u32>(prgRam.size());
+}
+
+u8 *Cartridge::get_chr_ram(void)
+{
+    return chrRam.empty() ? NULL : chrRam.data();
+}
+
+u32 Cartridge::get_chr_ram_size(void) const
+{
+    return static_cast<u32>(chrRam.size());
+}
+
+const u8 *Cartridge::get_prg_bank(u32 index, u32 size) const
+{
+    return prg + static_cast<u64>(index) * size % header.prgSize;
+}
+
+const u8 *Cartridge::get_chr_bank(u32 index, u32 size) const
+{
+    return chr ? chr + static_cast<u64>(index) * size % header.chrSize : NULL;
+}
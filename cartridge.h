@@ -0,0 +1,171 @@
+#ifndef CARTRIDGE_H
+#define CARTRIDGE_H
+
+#include "utils.h"
+#include "ppu.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * A file mapped into memory read only. Mappings are shared: opening a file
+ * that is already open in the process gives the same mapping, and between
+ * processes the pages are the OS's page cache, so a thousand sessions of a
+ * ROM cost one copy of it. A file that can't be mapped, e.g. an empty one,
+ * is read into memory instead.
+ */
+class RomFile
+{
+public:
+    /**
+     * @return: The file's mapping, NULL if it couldn't be opened.
+     */
+    static std::shared_ptr<const RomFile> open(const std::string &path,
+            std::string &error);
+
+    ~RomFile(void);
+
+    RomFile(const RomFile &) = delete;
+    RomFile &operator=(const RomFile &) = delete;
+
+    const u8 *get_data(void) const;
+    size_t get_size(void) const;
+
+    /**
+     * @return: Whether the data is a mapping of the file, not a copy.
+     */
+    bool is_mapped(void) const;
+
+private:
+    const u8 *data;
+    size_t size;
+    void *mapping;          // the OS's handle or address, NULL for a copy
+    std::vector<u8> copy;
+
+    RomFile(void);
+};
+
+enum RomFormat
+{
+    ROM_INES,
+    ROM_NES2,
+};
+
+enum RomTiming
+{
+    TIMING_NTSC,
+    TIMING_PAL,
+    TIMING_MULTI,   // runs on either
+    TIMING_DENDY,
+};
+
+/**
+ * What an iNES or NES 2.0 header says about a cartridge. Sizes are in
+ * bytes, RAM that is battery backed is counted apart.
+ */
+struct RomHeader
+{
+    RomFormat format;
+    u16 mapper;
+    u8 submapper;           // 0 for iNES
+    u32 prgSize;
+    u32 chrSize;            // 0 for CHR RAM
+    u32 prgRamSize;
+    u32 prgNvramSize;
+    u32 chrRamSize;
+    u32 chrNvramSize;
+    bool trainer;           // 512 bytes for $7000 before the PRG ROM
+    bool battery;
+    Ppu::Mirroring mirroring;   // HORIZONTAL, VERTICAL or FOUR_SCREEN
+    RomTiming timing;
+
+    static const u32 SIZE = 16;
+    static const u32 TRAINER_SIZE = 0x200;
+};
+
+/**
+ * Parses the header of an iNES or NES 2.0 image. Old iNES dumps with junk
+ * in bytes 7-15 have it ignored, as emulators have always done.
+ *
+ * @param size: The size of the whole image, the ROM has to fit in it.
+ * @return: Whether it was a valid image, error says why not.
+ */
+bool parse_rom_header(const u8 *data, size_t size, RomHeader *header,
+        std::string &error);
+
+/**
+ * A cartridge loaded from an iNES or NES 2.0 image. The PRG and CHR ROM
+ * are never copied: they point into the file's RomFile mapping, which the
+ * cartridge keeps alive, so mapping a bank onto the bus or the PPU is just
+ * a pointer into it. Only the cartridge's RAM is its own.
+ */
+class Cartridge
+{
+public:
+    Cartridge(void);
+    ~Cartridge(void) {}
+
+    Cartridge(const Cartridge &) = delete;
+    Cartridge &operator=(const Cartridge &) = delete;
+
+    /**
+     * Loads an image from a file, mapping it or sharing its mapping.
+     *
+     * @return: False if it couldn't be read or isn't an image, see error.
+     */
+    bool load(const std::string &path, std::string &error);
+
+    /**
+     * Loads an image from a file already open, e.g. to tell images and
+     * other files apart without opening them twice.
+     */
+    bool load(std::shared_ptr<const RomFile> file, std::string &error);
+
+    const RomHeader &get_header(void) const;
+
+    const u8 *get_prg(void) const;
+    u32 get_prg_size(void) const;
+
+    /**
+     * @return: The CHR ROM, NULL if the cartridge has CHR RAM instead.
+     */
+    const u8 *get_chr(void) const;
+    u32 get_chr_size(void) const;
+
+    /**
+     * @return: The PRG RAM at $6000, battery backed or not, with the
+     * trainer at $7000 if there is one. NULL if there is none.
+     */
+    u8 *get_prg_ram(void);
+    u32 get_prg_ram_size(void) const;
+
+    /**
+     * @return: The CHR RAM, NULL for CHR ROM.
+     */
+    u8 *get_chr_ram(void);
+    u32 get_chr_ram_size(void) const;
+
+    /**
+     * @return: A bank of PRG ROM, wrapping around past its end like the
+     * address lines of a smaller chip.
+     *
+     * @param size: The bank size, a power of two.
+     */
+    const u8 *get_prg_bank(u32 index, u32 size) const;
+
+    /**
+     * @return: A bank of CHR ROM, wrapping around the same way, NULL for
+     * CHR RAM.
+     */
+    const u8 *get_chr_bank(u32 index, u32 size) const;
+
+private:
+    std::shared_ptr<const RomFile> file;
+    RomHeader header;
+    const u8 *prg;
+    const u8 *chr;
+    std::vector<u8> prgRam;
+    std::vector<u8> chrRam;
+};
+
+#endif
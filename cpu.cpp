@@ -1,1746 +1,1645 @@
 #include <string.h>
+#include <algorithm>
 
 #include "cpu.h"
-#include "debugger.h"
-
-namespace Cpu {
-
-// Time saving macros
-#define tick2() tick();tick();
-#define tick3() tick();tick();tick();
-#define tick4() tick();tick();tick();tick();
-#define tick5() tick();tick();tick();tick();tick();
-#define tick6() tick();tick();tick();tick();tick();tick();
-#define tick7() tick();tick();tick();tick();tick();tick();tick();
-
-//-----------------------------------------------------------------------------
-// Load/Store Operations
-//-----------------------------------------------------------------------------
-
-// Load accumulator instructions
-#define LDA_IMM		0xA9
-#define LDA_ZP		0xA5
-#define LDA_ZP_X	0xB5
-#define LDA_ABS		0xAD
-#define LDA_ABS_X	0xBD
-#define LDA_ABS_Y	0xB9
-#define LDA_IND_X	0xA1
-#define LDA_IND_Y	0xB1
-
-// Load X instructions
-#define LDX_IMM		0xA2
-#define LDX_ZP		0xA6
-#define LDX_ZP_Y	0xB6
-#define LDX_ABS		0xAE
-#define LDX_ABS_Y	0xBE
-
-// Load Y instructions
-#define LDY_IMM		0xA0
-#define LDY_ZP		0xA4
-#define LDY_ZP_X	0xB4
-#define LDY_ABS		0xAC
-#define LDY_ABS_X	0xBC
-
-// Store accumulator instructions
-#define STA_ZP		0x85
-#define STA_ZP_X	0x95
-#define STA_ABS		0x8D
-#define STA_ABS_X	0x9D
-#define STA_ABS_Y	0x99
-#define STA_IND_X	0x81
-#define STA_IND_Y	0x91
-
-// Store X instructions
-#define STX_ZP		0x86
-#define STX_ZP_Y	0x96
-#define STX_ABS		0x8E
-
-// Store Y instructions
-#define STY_ZP		0x84
-#define STY_ZP_X	0x94
-#define STY_ABS		0x8C
-
-//-----------------------------------------------------------------------------
-// Register Transfer instructions
-//-----------------------------------------------------------------------------
-#define TAX			0xAA
-#define TAY			0xA8
-#define TXA			0x8A
-#define TYA			0x98
-
-//-----------------------------------------------------------------------------
-// Stack operations
-//-----------------------------------------------------------------------------
-#define TSX			0xBA
-#define TXS			0x9A
-#define PHA			0x48
-#define PHP			0x08
-#define PLA			0x68
-#define PLP			0x28
-
-//-----------------------------------------------------------------------------
-// Logical operations
-//-----------------------------------------------------------------------------
-
-// Logical AND instructions
-#define AND_IMM		0x29
-#define AND_ZP		0x25
-#define AND_ZP_X	0x35
-#define AND_ABS		0x2D
-#define AND_ABS_X	0x3D
-#define AND_ABS_Y	0x39
-#define AND_IND_X	0x21
-#define AND_IND_Y	0x31
-
-// Logical exclusive or instructions
-#define EOR_IMM		0x49
-#define EOR_ZP		0x45
-#define EOR_ZP_X	0x55
-#define EOR_ABS		0x4D
-#define EOR_ABS_X	0x5D
-#define EOR_ABS_Y	0x59
-#define EOR_IND_X	0x41
-#define EOR_IND_Y	0x51
-
-// Logical or instructions
-#define ORA_IMM		0x09
-#define ORA_ZP		0x05
-#define ORA_ZP_X	0x15
-#define ORA_ABS		0x0D
-#define ORA_ABS_X	0x1D
-#define ORA_ABS_Y	0x19
-#define ORA_IND_X	0x01
-#define ORA_IND_Y	0x11
-
-//-----------------------------------------------------------------------------
-// Bit test instructions 
-//-----------------------------------------------------------------------------
-#define BIT_ZP		0x24
-#define BIT_ABS		0x2C
-
-//-----------------------------------------------------------------------------
-// Arithmetic instructions
-//-----------------------------------------------------------------------------
-
-// Add with carry instructions
-#define ADC_IMM		0x69
-#define ADC_ZP		0x65
-#define ADC_ZP_X	0x75
-#define ADC_ABS		0x6D
-#define ADC_ABS_X	0x7D
-#define ADC_ABS_Y	0x79
-#define ADC_IND_X	0x61
-#define ADC_IND_Y	0x71
-
-// Subtract with carry instructions
-#define SBC_IMM		0xE9
-#define SBC_ZP		0xE5
-#define SBC_ZP_X	0xF5
-#define SBC_ABS		0xED
-#define SBC_ABS_X	0xFD
-#define SBC_ABS_Y	0xF9
-#define SBC_IND_X	0xE1
-#define SBC_IND_Y	0xF1
-
-//-----------------------------------------------------------------------------
-// Compare instructions
-//-----------------------------------------------------------------------------
-#define CMP_IMM		0xC9
-#define CMP_ZP		0xC5
-#define CMP_ZP_X	0xD5
-#define CMP_ABS		0xCD
-#define CMP_ABS_X	0xDD
-#define CMP_ABS_Y	0xD9
-#define CMP_IND_X	0xC1
-#define CMP_IND_Y	0xD1
-
-// Compare X Register instructions
-#define CPX_IMM		0xE0
-#define CPX_ZP		0xE4
-#define CPX_ABS		0xEC
-
-// Compare Y Register instructions
-#define CPY_IMM		0xC0
-#define CPY_ZP		0xC4
-#define CPY_ABS		0xCC
-
-//-----------------------------------------------------------------------------
-// Increment and Decrement instructions
-//-----------------------------------------------------------------------------
-
-// Increment memory location instructions
-#define INC_ZP		0xE6
-#define INC_ZP_X	0xF6
-#define INC_ABS		0xEE
-#define INC_ABS_X	0xFE
-
-// Increment X register instructions
-#define INX			0xE8
-
-// Increment Y register instructions
-#define INY			0xC8
-
-// Decrement memory location instructions
-#define DEC_ZP		0xC6
-#define DEC_ZP_X	0xD6
-#define DEC_ABS		0xCE
-#define DEC_ABS_X	0xDE
-
-// Decrement X register instructions
-#define DEX			0xCA
-
-// Decrement Y register instructions
-#define DEY			0x88
+#include "instructions.h"
 
 //-----------------------------------------------------------------------------
-// Shift instructions
-//-----------------------------------------------------------------------------
-
-// Arithmetic shift left instructions
-#define ASL_ACC		0x0A
-#define ASL_ZP		0x06
-#define ASL_ZP_X	0x16
-#define ASL_ABS		0x0E
-#define ASL_ABS_X	0x1E
-
-// Logical shift right instructions
-#define LSR_ACC		0x4A
-#define LSR_ZP		0x46
-#define LSR_ZP_X	0x56
-#define LSR_ABS		0x4E
-#define LSR_ABS_X	0x5E
-
-// Rotate left instructions
-#define ROL_ACC		0x2A
-#define ROL_ZP		0x26
-#define ROL_ZP_X	0x36
-#define ROL_ABS		0x2E
-#define ROL_ABS_X	0x3E
-
-// Rotate right instructions
-#define ROR_ACC		0x6A
-#define ROR_ZP		0x66
-#define ROR_ZP_X	0x76
-#define ROR_ABS		0x6E
-#define ROR_ABS_X	0x7E
-
+// Stack helpers
 //-----------------------------------------------------------------------------
-// Jump and call instructions
-//-----------------------------------------------------------------------------
-
-// Jump instructions
-#define JMP_ABS		0x4C
-#define JMP_IND		0x6C
-
-// Jump to subroutine instructions
-#define JSR			0x20
-
-// return from subroutine instructions
-#define RTS			0x60
-
-//-----------------------------------------------------------------------------
-// Branch instructions
-//-----------------------------------------------------------------------------
-
-// Branch if carry clear
-#define BCC			0x90
-
-// Branch if carry set
-#define BCS			0xB0
-
-// Branch if equal
-#define BEQ			0xF0
-
-// Branch if minus
-#define BMI			0x30
-
-// Branch if not equal
-#define BNE			0xD0
-
-// Branch if positive
-#define BPL			0x10
-
-// Branch if overflow clear
-#define BVC			0x50
-
-// Branch if overflow set
-#define BVS			0x70
-
-//-----------------------------------------------------------------------------
-// Status flag change instructions
-//-----------------------------------------------------------------------------
-
-// Clear carry flag
-#define CLC			0x18
-
-// Clear decimal mode flag
-#define CLD			0xD8
-
-// Clear interrupt disable flag
-#define CLI			0x58
-
-// Clear overflow flag
-#define CLV			0xB8
-
-// Set carry flag
-#define SEC			0x38
-
-// Set decimal mode flag
-#define SED			0xF8
+void Cpu::push(u8 val)
+{
+    write(0x0100 + sp, val);
+    sp--;
+}
 
-// Set interrupt disable flag
-#define SEI			0x78
+u8 Cpu::pop(void)
+{
+    sp++;
+    return read(0x0100 + sp);
+}
 
 //-----------------------------------------------------------------------------
-// System Functions
+// Load/Store Operations
 //-----------------------------------------------------------------------------
 
-// Force an interrupt
-#define BRK			0x00
-
-// No operation instruction
-#define NOP			0xEA
-
-// Return from interrupt
-#define RTI			0x40
-
-// General purpose registers
-static	u8 	A;
-static	u8 	X;
-static	u8 	Y;
-
-// Special purpose registers
-static	u8 	sp;
-static	u8 	status;
-static	u16 pc;
-
-static	u8 memory[0x10000]; // for now allocate the entire address space for th emulator
-
-static	const s32 CYCLES_PER_FRAME = 29834;
-static	s32 remainingCycles; //borrowed from github/AndreaOrru/LaiNES 
-
-
-
-
 /**
- * Performs the load accumulator instruction with the given addressing mode.
- *
- * @param mode: The addressing mode function, used to get the operand for
- * the store instruction.
+ * Performs the load accumulator instruction. The addressing mode comes from
+ * the opcodes[] entry of OP, so it is resolved at compile time.
  */
-void lda_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::lda_op(void)
 {
-	A = memory[mode()];
-	set_zero(A);
-	set_negative(A);
+	A = read_operand<OP>();
+	set_zero<LAZY>(A);
+	set_negative<LAZY>(A);
 }
 
-void ldx_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::ldx_op(void)
 {
-	X = memory[mode()];
-	set_zero(X);
-	set_negative(X);
+	X = read_operand<OP>();
+	set_zero<LAZY>(X);
+	set_negative<LAZY>(X);
 }
 
-void ldy_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::ldy_op(void)
 {
-	Y = memory[mode()];
-	set_zero(Y);
-	set_negative(Y);
+	Y = read_operand<OP>();
+	set_zero<LAZY>(Y);
+	set_negative<LAZY>(Y);
 }
 
-void sta_op(address_mode mode)
+template <u8 OP>
+void Cpu::sta_op(void)
 {
-	memory[mode()] = A;
+	write(operand_address<OP>(), A);
 }
 
-void stx_op(address_mode mode)
+template <u8 OP>
+void Cpu::stx_op(void)
 {
-	memory[mode()] = X;
+	write(operand_address<OP>(), X);
 }
 
-void sty_op(address_mode mode)
+template <u8 OP>
+void Cpu::sty_op(void)
 {
-	memory[mode()] = Y;
+	write(operand_address<OP>(), Y);
 }
 
 //--------------------------------------------------------------------------
 // Register Transfer instructions
 //--------------------------------------------------------------------------
-void tax_op(void)
+template <bool LAZY>
+void Cpu::tax_op(void)
 {
 	X = A;
-    set_zero(X);
-    set_negative(Y);
-    pc++;
+    set_zero<LAZY>(X);
+    set_negative<LAZY>(X);
 }
 
-void tay_op(void)
+template <bool LAZY>
+void Cpu::tay_op(void)
 {
     Y = A;
-    set_zero(Y);
-    set_negative(Y);
-    pc++;
+    set_zero<LAZY>(Y);
+    set_negative<LAZY>(Y);
 }
 
-void txa_op(void)
+template <bool LAZY>
+void Cpu::txa_op(void)
 {
     A = X;
-    set_zero(A);
-    set_negative(A);
-    pc++;
+    set_zero<LAZY>(A);
+    set_negative<LAZY>(A);
 }
 
-void tya_op(void)
+template <bool LAZY>
+void Cpu::tya_op(void)
 {
 	A = Y;
-    set_zero(A);
-    set_negative(A);
-    pc++;
+    set_zero<LAZY>(A);
+    set_negative<LAZY>(A);
 }
 
 //--------------------------------------------------------------------------
 // Stack operations
 //--------------------------------------------------------------------------
 
-void tsx_op(void)
+template <bool LAZY>
+void Cpu::tsx_op(void)
 {
 	X = sp;
-    set_zero(X);
-    set_negative(Y);
-    pc++;
+    set_zero<LAZY>(X);
+    set_negative<LAZY>(X);
 }
 
-void txs_op(void)
+void Cpu::txs_op(void)
 {
-	sp = X;    
-    pc++;
+	sp = X;
 }
 
-void pha_op(void)
+void Cpu::pha_op(void)
 {
-    memory[0x0100 + sp] = A;
-    sp--;
-    pc++;
+    push(A);
 }
 
-void php_op(void)
+template <bool LAZY>
+void Cpu::php_op(void)
 {
-    memory[0x0100 + sp] = status;
-    sp--;
-    pc++;
+    push(pack_status<LAZY>() | BREAK_FLAG | UNUSED_FLAG);
 }
 
-void pla_op(void)
+template <bool LAZY>
+void Cpu::pla_op(void)
 {
-    sp++;
-    A = memory[0x0100 + sp];
-    set_zero(A);
-    set_negative(A);
-    pc++;
+    A = pop();
+    set_zero<LAZY>(A);
+    set_negative<LAZY>(A);
 }
 
-void plp_op(void)
+template <bool LAZY>
+void Cpu::plp_op(void)
 {
-    sp++;
-    status = memory[0x0100 + sp];
-    pc++;
+    unpack_status<LAZY>((pop() & ~BREAK_FLAG) | UNUSED_FLAG);
 }
 
 //-----------------------------------------------------------------------------
 // Logical operations
 //-----------------------------------------------------------------------------
-void and_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::and_op(void)
 {
-    A &= memory[mode()];
-    set_zero(A);
-    set_negative(A);
+    A &= read_operand<OP>();
+    set_zero<LAZY>(A);
+    set_negative<LAZY>(A);
 }
 
-void eor_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::eor_op(void)
 {
-    A ^= memory[mode()];
-    set_zero(A);
-    set_negative(A);
+    A ^= read_operand<OP>();
+    set_zero<LAZY>(A);
+    set_negative<LAZY>(A);
 }
 
-void ora_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::ora_op(void)
 {
-    A |= memory[mode()];
-    set_zero(A);
-    set_negative(A);
+    A |= read_operand<OP>();
+    set_zero<LAZY>(A);
+    set_negative<LAZY>(A);
 }
 
-void bit_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::bit_op(void)
 {
-    u8 temp = A & memory[mode()];
-    set_zero(temp);
-    set_overflow(temp);
-    set_negative(temp);
+    u8 val = read_operand<OP>();
+    set_zero<LAZY>(A & val);
+    set_overflow<LAZY>(val & OVERFLOW_FLAG);
+    set_negative<LAZY>(val);
 }
 
 //-----------------------------------------------------------------------------
 // Arithmetic instructions
 //-----------------------------------------------------------------------------
+
 /**
- * Performs the add with carry instruction with the given addressing mode.
+ * Adds the given value and the carry to the accumulator, setting the carry,
+ * overflow, zero and negative flags. The NES 6502 has no decimal mode, so
+ * this is shared by ADC and SBC.
  *
- * @param mode: The addressing mode function, used to get the operand for
- * the addition.
+ * @param val: The value to add.
  */
-void adc_op(address_mode mode)
+template <bool LAZY>
+void Cpu::add_with_carry(u8 val)
+{
+    u16 sum = A + val + get_flag<LAZY>(CARRY_FLAG);
+    set_carry<LAZY>(sum > 0xFF);
+    if (LAZY) {
+        flagVa = A;
+        flagVb = val;
+        flagVr = static_cast<u8>(sum);
+    } else {
+        set_overflow<LAZY>(~(A ^ val) & (A ^ sum) & NEGATIVE_FLAG);
+    }
+    A = static_cast<u8>(sum);
+    set_zero<LAZY>(A);
+    set_negative<LAZY>(A);
+}
+
+/**
+ * Performs the add with carry instruction with the addressing mode of OP.
+ */
+template <bool LAZY, u8 OP>
+void Cpu::adc_op(void)
 {
-	u8 preAdd = A;
-	u8 carry = status & CARRY_FLAG;
-	A += memory[mode()] + carry;
-	set_carry(preAdd);
-	set_zero(A);
-	set_overflow(A);
-    set_negative(A);
+    add_with_carry<LAZY>(read_operand<OP>());
 }
 
 
-void sbc_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::sbc_op(void)
 {
-	u8 pre_sub = A;
-    u8 carry = status & CARRY_FLAG;
-    A -= memory[mode()] - (1 - carry);
-    set_carry(pre_sub);
-	set_zero(A);
-	set_overflow(A);
-    set_negative(A);
+    add_with_carry<LAZY>(~read_operand<OP>());
 }
 
-	
+
 //-----------------------------------------------------------------------------
 // Compare instructions
 //-----------------------------------------------------------------------------
-void cmp_op(address_mode mode)
+template <bool LAZY>
+void Cpu::compare(u8 reg, u8 val)
 {
-    if (A >= memory[mode()]) {
-        status |= CARRY_FLAG;
-    }
-    set_zero(A);
-    set_negative(A);
+    set_carry<LAZY>(reg >= val);
+    set_zero<LAZY>(reg - val);
+    set_negative<LAZY>(reg - val);
 }
 
-void cpx_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::cmp_op(void)
 {
-    if (X >= memory[mode()]) {
-        status |= CARRY_FLAG;
-    }
-    set_zero(X);
-    set_negative(X);
+    compare<LAZY>(A, read_operand<OP>());
 }
 
-void cpy_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::cpx_op(void)
 {
-    if (Y >= memory[mode()]) {
-        status |= CARRY_FLAG;
-    }
-    set_zero(Y);
-    set_negative(Y);
+    compare<LAZY>(X, read_operand<OP>());
+}
+
+template <bool LAZY, u8 OP>
+void Cpu::cpy_op(void)
+{
+    compare<LAZY>(Y, read_operand<OP>());
 }
 
 //-----------------------------------------------------------------------------
 // Increment and Decrement instructions
 //-----------------------------------------------------------------------------
-void inc_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::inc_op(void)
 {
-    memory[mode()] += 1;
-    set_zero(memory[mode()]);
-    set_negative(memory[mode()]);
+    u16 address = operand_address<OP>();
+    u8 val = read(address) + 1;
+    write(address, val);
+    set_zero<LAZY>(val);
+    set_negative<LAZY>(val);
 }
 
-void inx_op(void)
+template <bool LAZY>
+void Cpu::inx_op(void)
 {
     X++;
-    set_zero(X);
-    set_negative(X);
-    pc++;
+    set_zero<LAZY>(X);
+    set_negative<LAZY>(X);
 }
 
-void iny_op(void)
+template <bool LAZY>
+void Cpu::iny_op(void)
 {
     Y++;
-    set_zero(Y);
-    set_negative(Y);
-    pc++;
+    set_zero<LAZY>(Y);
+    set_negative<LAZY>(Y);
 }
 
-void dec_op(address_mode mode)
+template <bool LAZY, u8 OP>
+void Cpu::dec_op(void)
 {
-    memory[mode()] -= 1;
-    set_zero(memory[mode()]);
-    set_negative(memory[mode()]);
+    u16 address = operand_address<OP>();
+    u8 val = read(address) - 1;
+    write(address, val);
+    set_zero<LAZY>(val);
+    set_negative<LAZY>(val);
 }
 
-void dex_op(void)
+template <bool LAZY>
+void Cpu::dex_op(void)
 {
     X--;
-    set_zero(X);
-    set_negative(X);
-    pc++;
+    set_zero<LAZY>(X);
+    set_negative<LAZY>(X);
 }
 
-void dey_op(void)
+template <bool LAZY>
+void Cpu::dey_op(void)
 {
     Y--;
-    set_zero(Y);
-    set_negative(Y);
-    pc++;
+    set_zero<LAZY>(Y);
+    set_negative<LAZY>(Y);
 }
 
 //-----------------------------------------------------------------------------
 // Shift instructions
 //-----------------------------------------------------------------------------
 
-// Just gonna implement the accumulator version in the run() function
-void asl_op(address_mode mode)
+/**
+ * Applies the given shift to either the accumulator or the value in memory,
+ * depending on the addressing mode of OP.
+ *
+ * SHIFT: The shift to apply, it also sets the flags.
+ */
+template <bool LAZY, u8 OP, Cpu::shift_fn SHIFT>
+void Cpu::shift_op(void)
+{
+    if constexpr (opcodes[OP].address_mode == ACCUMULATOR) {
+        A = (this->*SHIFT)(A);
+    } else {
+        u16 address = operand_address<OP>();
+        write(address, (this->*SHIFT)(read(address)));
+    }
+}
+
+template <bool LAZY>
+u8 Cpu::asl(u8 val)
 {
-    u8 val = memory[mode()];
-    // set carry flag
-    status |= (NEGATIVE_FLAG & val) >> 7;
+    set_carry<LAZY>(val & NEGATIVE_FLAG);
     val <<= 1;
-    set_negative(val);
-    set_zero(val);
-    memory[mode()] = val;
+    set_zero<LAZY>(val);
+    set_negative<LAZY>(val);
+    return val;
 }
 
-void lsr_op(address_mode mode)
+template <bool LAZY>
+u8 Cpu::lsr(u8 val)
 {
-    u8 val = memory[mode()];
-    // set carry flag
-    status |= CARRY_FLAG & val;
+    set_carry<LAZY>(val & CARRY_FLAG);
     val >>= 1;
-    set_negative(val);
-    memory[mode()] = val;
+    set_zero<LAZY>(val);
+    set_negative<LAZY>(val);
+    return val;
 }
 
-void rol_op(address_mode mode)
+template <bool LAZY>
+u8 Cpu::rol(u8 val)
 {
-	u8 val = memory[mode()];    
-	u8 new_carry = val & 0x08;
-	val = (status & CARRY_FLAG) << 1;
-	set_carry(new_carry);
-	set_negative(val);
-	set_zero(val);
-	memory[mode()] = val;
+    u8 carry = get_flag<LAZY>(CARRY_FLAG);
+    set_carry<LAZY>(val & NEGATIVE_FLAG);
+    val = (val << 1) | carry;
+    set_zero<LAZY>(val);
+    set_negative<LAZY>(val);
+    return val;
 }
 
-void ror_op(address_mode mode)
+template <bool LAZY>
+u8 Cpu::ror(u8 val)
 {
-	u8 val = memory[mode()];    
-	u8 new_carry = val & 0x08;
-	val = (status & CARRY_FLAG) >> 1;
-	set_carry(new_carry);
-	set_negative(val);
-	set_zero(val);
-	memory[mode()] = val;
+    u8 carry = get_flag<LAZY>(CARRY_FLAG);
+    set_carry<LAZY>(val & CARRY_FLAG);
+    val = (val >> 1) | (carry << 7);
+    set_zero<LAZY>(val);
+    set_negative<LAZY>(val);
+    return val;
+}
+
+template <bool LAZY, u8 OP>
+void Cpu::asl_op(void)
+{
+    shift_op<LAZY, OP, &Cpu::asl<LAZY>>();
+}
+
+template <bool LAZY, u8 OP>
+void Cpu::lsr_op(void)
+{
+    shift_op<LAZY, OP, &Cpu::lsr<LAZY>>();
+}
+
+template <bool LAZY, u8 OP>
+void Cpu::rol_op(void)
+{
+    shift_op<LAZY, OP, &Cpu::rol<LAZY>>();
+}
+
+template <bool LAZY, u8 OP>
+void Cpu::ror_op(void)
+{
+    shift_op<LAZY, OP, &Cpu::ror<LAZY>>();
 }
 
 //-----------------------------------------------------------------------------
 // Jump and call instructions
 //-----------------------------------------------------------------------------
-void jmp_op(address_mode mode)
+template <u8 OP>
+void Cpu::jmp_op(void)
 {
-    pc = memory[mode()];        
+    pc = operand_address<OP>();
 }
 
-void jsr_op(void)
+template <u8 OP>
+void Cpu::jsr_op(void)
 {
-    memory[0x0100 + sp] = memory[get_absolute()] - 1;
-    sp--;
+    u16 target = operand_address<OP>();
+    u16 ret = pc - 1;
+    push(static_cast<u8>(ret >> 8));
+    push(static_cast<u8>(ret));
+    pc = target;
 }
 
-void rts_op(void)
+void Cpu::rts_op(void)
 {
-    sp++;
-    pc = memory[0x0100 + sp];
-    pc += 6;
+    pc = pop();
+    pc |= pop() << 8;
+    pc++;
 }
 
 //-----------------------------------------------------------------------------
 // Branch instructions
 //-----------------------------------------------------------------------------
-void bcc_op(void)
+template <bool LAZY>
+void Cpu::bcc_op(void)
 {
-    s8 displacement = static_cast<s8>(get_immediate());    
-    do_branch(displacement, !(status & CARRY_FLAG)); 
+    s8 displacement = static_cast<s8>(operand);
+    do_branch(displacement, !get_flag<LAZY>(CARRY_FLAG));
 }
 
-void bcs_op(void)
+template <bool LAZY>
+void Cpu::bcs_op(void)
 {
-    s8 displacement = static_cast<s8>(get_immediate());    
-    do_branch(displacement, (status & CARRY_FLAG)); 
+    s8 displacement = static_cast<s8>(operand);
+    do_branch(displacement, get_flag<LAZY>(CARRY_FLAG));
 }
 
-void beq_op(void)
+template <bool LAZY>
+void Cpu::beq_op(void)
 {
-    s8 displacement = static_cast<s8>(get_immediate());    
-    do_branch(displacement, (status & ZERO_FLAG)); 
+    s8 displacement = static_cast<s8>(operand);
+    do_branch(displacement, get_flag<LAZY>(ZERO_FLAG));
 }
 
-void bmi_op(void)
+template <bool LAZY>
+void Cpu::bmi_op(void)
 {
-    s8 displacement = static_cast<s8>(get_immediate());    
-    do_branch(displacement, (status & NEGATIVE_FLAG)); 
+    s8 displacement = static_cast<s8>(operand);
+    do_branch(displacement, get_flag<LAZY>(NEGATIVE_FLAG));
 }
 
-void bne_op(void)
+template <bool LAZY>
+void Cpu::bne_op(void)
 {
-    s8 displacement = static_cast<s8>(get_immediate());    
-    do_branch(displacement, !(status & ZERO_FLAG)); 
-    printf("%d\n", !(status & ZERO_FLAG));
+    s8 displacement = static_cast<s8>(operand);
+    do_branch(displacement, !get_flag<LAZY>(ZERO_FLAG));
 }
 
-void bpl_op(void)
+template <bool LAZY>
+void Cpu::bpl_op(void)
 {
-    s8 displacement = static_cast<s8>(get_immediate());    
-    do_branch(displacement, !(status & NEGATIVE_FLAG)); 
+    s8 displacement = static_cast<s8>(operand);
+    do_branch(displacement, !get_flag<LAZY>(NEGATIVE_FLAG));
 }
 
-void bvc_op(void)
+template <bool LAZY>
+void Cpu::bvc_op(void)
 {
-    s8 displacement = static_cast<s8>(get_immediate());    
-    do_branch(displacement, !(status & OVERFLOW_FLAG)); 
+    s8 displacement = static_cast<s8>(operand);
+    do_branch(displacement, !get_flag<LAZY>(OVERFLOW_FLAG));
 }
 
-void bvs_op(void)
+template <bool LAZY>
+void Cpu::bvs_op(void)
 {
-    s8 displacement = static_cast<s8>(get_immediate());    
-    do_branch(displacement, (status & OVERFLOW_FLAG)); 
+    s8 displacement = static_cast<s8>(operand);
+    do_branch(displacement, get_flag<LAZY>(OVERFLOW_FLAG));
 }
 
 //-----------------------------------------------------------------------------
 // Status flag change instructions
 //-----------------------------------------------------------------------------
-void clc_op(void)
+template <bool LAZY>
+void Cpu::clc_op(void)
 {
-    status &= ~CARRY_FLAG;    
-    pc++;
+    set_carry<LAZY>(false);
 }
 
-void cld_op(void)
+void Cpu::cld_op(void)
 {
-    status &= ~DECIMAL_MODE_FLAG;    
-    pc++;
+    status &= ~DECIMAL_MODE_FLAG;
 }
 
-void cli_op(void)
+void Cpu::cli_op(void)
 {
     status &= ~INTERRUPT_DISSABLE_FLAG;
-    pc++;
 }
 
-void clv_op(void)
+template <bool LAZY>
+void Cpu::clv_op(void)
 {
-    status &= ~OVERFLOW_FLAG;
-    pc++;
+    set_overflow<LAZY>(false);
 }
 
-void sec_op(void)
+template <bool LAZY>
+void Cpu::sec_op(void)
 {
-    status |= CARRY_FLAG;
-    pc++;
+    set_carry<LAZY>(true);
 }
 
-void sed_op(void)
+void Cpu::sed_op(void)
 {
     status |= DECIMAL_MODE_FLAG;
-    pc++;
 }
 
-void sei_op(void)
+void Cpu::sei_op(void)
 {
     status |= INTERRUPT_DISSABLE_FLAG;
-    pc++;
 }
 
 //-----------------------------------------------------------------------------
 // System Functions
 //-----------------------------------------------------------------------------
-void brk_op(void)
+template <bool LAZY>
+void Cpu::brk_op(void)
 {
-    status |= BREAK_FLAG;
-    memory[sp + 0x0100] = static_cast<u8>(0x0F & pc);
-    sp--;
-    memory[sp + 0x0100] = static_cast<u8>((0xF0 & pc) >> 8);
-    sp--;
-    memory[sp + 0x0100] = status;
-    sp--;
+    // BRK has a padding byte after the opcode which is skipped on return.
+    pc++;
+    push(static_cast<u8>(pc >> 8));
+    push(static_cast<u8>(pc));
+    push(pack_status<LAZY>() | BREAK_FLAG | UNUSED_FLAG);
+    status |= INTERRUPT_DISSABLE_FLAG;
     // Load the IRQ vector
-    pc = memory[0xFFFE] << 8;
-    pc |= memory[0xFFF];
+    pc = read(0xFFFE);
+    pc |= read(0xFFFF) << 8;
 }
 
-void nop_op(void)
+void Cpu::nop_op(void)
 {
-	pc++;
-	tick();
-	tick();
 }
 
-void rti_op(void)
+template <bool LAZY>
+void Cpu::rti_op(void)
 {
-    sp++;
-    status = memory[sp + 0x0100];
-    sp++;
-    pc = memory[sp + 0x0100] << 8;
-    sp++;
-    pc |= memory[sp + 0x0100];
+    unpack_status<LAZY>((pop() & ~BREAK_FLAG) | UNUSED_FLAG);
+    pc = pop();
+    pc |= pop() << 8;
+}
+
+/**
+ * Unofficial opcodes are not emulated, they are treated as a one byte NOP.
+ */
+void Cpu::illegal_op(void)
+{
+}
+
+//-----------------------------------------------------------------------------
+// Dispatch table
+//-----------------------------------------------------------------------------
+
+/**
+ * Resolves the effective address of OP's operand. The addressing mode and
+ * whether a page cross costs a cycle come from the opcodes[] entry of OP, so
+ * this compiles down to the one addressing mode that applies.
+ *
+ * @return: The effective address.
+ */
+template <u8 OP>
+u16 Cpu::operand_address(void)
+{
+    constexpr u8 mode = opcodes[OP].address_mode;
+    constexpr bool penalty = opcodes[OP].page_penalty;
+
+    if constexpr (mode == ZERO_PAGE) {
+        return get_zero_page();
+    } else if constexpr (mode == ZERO_PAGE_X) {
+        return get_zero_page_x();
+    } else if constexpr (mode == ZERO_PAGE_Y) {
+        return get_zero_page_y();
+    } else if constexpr (mode == ABSOLUTE) {
+        return get_absolute();
+    } else if constexpr (mode == ABSOLUTE_X) {
+        return get_absolute_X_index<penalty>();
+    } else if constexpr (mode == ABSOLUTE_Y) {
+        return get_absolute_Y_index<penalty>();
+    } else if constexpr (mode == INDIRECT) {
+        return get_indirect();
+    } else if constexpr (mode == INDEXED_INDIRECT) {
+        return get_indexed_indirect();
+    } else if constexpr (mode == INDIRECT_INDEXED) {
+        return get_indirect_indexed<penalty>();
+    } else {
+        static_assert(OP != OP, "opcode has no memory operand");
+    }
+}
+
+/**
+ * Reads the operand bytes of OP into operand and moves the program counter
+ * past them.
+ */
+template <u8 OP>
+void Cpu::fetch_operand(void)
+{
+    constexpr u8 bytes = opcodes[OP].bytes;
+
+    if constexpr (bytes == 2) {
+        operand = read(pc++);
+    } else if constexpr (bytes == 3) {
+        operand = read(pc++);
+        operand |= read(pc++) << 8;
+    }
+}
+
+/**
+ * Reads the value OP operates on, an immediate operand is the value itself.
+ *
+ * @return: The value.
+ */
+template <u8 OP>
+u8 Cpu::read_operand(void)
+{
+    if constexpr (opcodes[OP].address_mode == IMMEDIATE) {
+        return static_cast<u8>(operand);
+    } else {
+        return read(operand_address<OP>());
+    }
+}
+
+/**
+ * Fetches the operand of opcode OP and performs the instruction, with eager
+ * or lazy flags depending on LAZY.
+ *
+ * @return: The number of cycles the instruction took.
+ */
+template <u8 OP, bool LAZY>
+u32 Cpu::execute(void)
+{
+    fetch_operand<OP>();
+    return run<OP, LAZY>();
+}
+
+/**
+ * Performs the instruction of opcode OP on an operand that was already
+ * fetched, with the program counter pointing past the instruction.
+ *
+ * @return: The number of cycles the instruction took.
+ */
+template <u8 OP, bool LAZY>
+u32 Cpu::run(void)
+{
+    constexpr u8 inst = opcodes[OP].instruction;
+    extraCycles = 0;
+
+    if constexpr (inst == INST_ADC) {
+        adc_op<LAZY, OP>();
+    } else if constexpr (inst == INST_AND) {
+        and_op<LAZY, OP>();
+    } else if constexpr (inst == INST_ASL) {
+        asl_op<LAZY, OP>();
+    } else if constexpr (inst == INST_BCC) {
+        bcc_op<LAZY>();
+    } else if constexpr (inst == INST_BCS) {
+        bcs_op<LAZY>();
+    } else if constexpr (inst == INST_BEQ) {
+        beq_op<LAZY>();
+    } else if constexpr (inst == INST_BIT) {
+        bit_op<LAZY, OP>();
+    } else if constexpr (inst == INST_BMI) {
+        bmi_op<LAZY>();
+    } else if constexpr (inst == INST_BNE) {
+        bne_op<LAZY>();
+    } else if constexpr (inst == INST_BPL) {
+        bpl_op<LAZY>();
+    } else if constexpr (inst == INST_BRK) {
+        brk_op<LAZY>();
+    } else if constexpr (inst == INST_BVC) {
+        bvc_op<LAZY>();
+    } else if constexpr (inst == INST_BVS) {
+        bvs_op<LAZY>();
+    } else if constexpr (inst == INST_CLC) {
+        clc_op<LAZY>();
+    } else if constexpr (inst == INST_CLD) {
+        cld_op();
+    } else if constexpr (inst == INST_CLI) {
+        cli_op();
+    } else if constexpr (inst == INST_CLV) {
+        clv_op<LAZY>();
+    } else if constexpr (inst == INST_CMP) {
+        cmp_op<LAZY, OP>();
+    } else if constexpr (inst == INST_CPX) {
+        cpx_op<LAZY, OP>();
+    } else if constexpr (inst == INST_CPY) {
+        cpy_op<LAZY, OP>();
+    } else if constexpr (inst == INST_DEC) {
+        dec_op<LAZY, OP>();
+    } else if constexpr (inst == INST_DEX) {
+        dex_op<LAZY>();
+    } else if constexpr (inst == INST_DEY) {
+        dey_op<LAZY>();
+    } else if constexpr (inst == INST_EOR) {
+        eor_op<LAZY, OP>();
+    } else if constexpr (inst == INST_INC) {
+        inc_op<LAZY, OP>();
+    } else if constexpr (inst == INST_INX) {
+        inx_op<LAZY>();
+    } else if constexpr (inst == INST_INY) {
+        iny_op<LAZY>();
+    } else if constexpr (inst == INST_JMP) {
+        jmp_op<OP>();
+    } else if constexpr (inst == INST_JSR) {
+        jsr_op<OP>();
+    } else if constexpr (inst == INST_LDA) {
+        lda_op<LAZY, OP>();
+    } else if constexpr (inst == INST_LDX) {
+        ldx_op<LAZY, OP>();
+    } else if constexpr (inst == INST_LDY) {
+        ldy_op<LAZY, OP>();
+    } else if constexpr (inst == INST_LSR) {
+        lsr_op<LAZY, OP>();
+    } else if constexpr (inst == INST_NOP) {
+        nop_op();
+    } else if constexpr (inst == INST_ORA) {
+        ora_op<LAZY, OP>();
+    } else if constexpr (inst == INST_PHA) {
+        pha_op();
+    } else if constexpr (inst == INST_PHP) {
+        php_op<LAZY>();
+    } else if constexpr (inst == INST_PLA) {
+        pla_op<LAZY>();
+    } else if constexpr (inst == INST_PLP) {
+        plp_op<LAZY>();
+    } else if constexpr (inst == INST_ROL) {
+        rol_op<LAZY, OP>();
+    } else if constexpr (inst == INST_ROR) {
+        ror_op<LAZY, OP>();
+    } else if constexpr (inst == INST_RTI) {
+        rti_op<LAZY>();
+    } else if constexpr (inst == INST_RTS) {
+        rts_op();
+    } else if constexpr (inst == INST_SBC) {
+        sbc_op<LAZY, OP>();
+    } else if constexpr (inst == INST_SEC) {
+        sec_op<LAZY>();
+    } else if constexpr (inst == INST_SED) {
+        sed_op();
+    } else if constexpr (inst == INST_SEI) {
+        sei_op();
+    } else if constexpr (inst == INST_STA) {
+        sta_op<OP>();
+    } else if constexpr (inst == INST_STX) {
+        stx_op<OP>();
+    } else if constexpr (inst == INST_STY) {
+        sty_op<OP>();
+    } else if constexpr (inst == INST_TAX) {
+        tax_op<LAZY>();
+    } else if constexpr (inst == INST_TAY) {
+        tay_op<LAZY>();
+    } else if constexpr (inst == INST_TSX) {
+        tsx_op<LAZY>();
+    } else if constexpr (inst == INST_TXA) {
+        txa_op<LAZY>();
+    } else if constexpr (inst == INST_TXS) {
+        txs_op();
+    } else if constexpr (inst == INST_TYA) {
+        tya_op<LAZY>();
+    } else {
+        illegal_op();
+    }
+
+    return opcodes[OP].cycle_count + extraCycles;
+}
+
+/**
+ * Builds the dispatch table, one execute() specialization per opcode. The
+ * table is shared by every Cpu instance and is constant initialized.
+ *
+ * @return: The 256 entry dispatch table.
+ */
+template <bool LAZY, size_t... OPS>
+const Cpu::handler *Cpu::make_dispatch(std::index_sequence<OPS...>)
+{
+    static const handler table[] = { &Cpu::execute<static_cast<u8>(OPS), LAZY>... };
+    return table;
+}
+
+template <bool LAZY>
+const Cpu::handler *Cpu::get_dispatch(void)
+{
+    return make_dispatch<LAZY>(std::make_index_sequence<0x100>());
+}
+
+/**
+ * Builds the table of run() specializations, the handlers decoded
+ * instructions point at.
+ */
+template <bool LAZY, size_t... OPS>
+const Cpu::handler *Cpu::make_decoded_dispatch(std::index_sequence<OPS...>)
+{
+    static const handler table[] = { &Cpu::run<static_cast<u8>(OPS), LAZY>... };
+    return table;
+}
+
+template <bool LAZY>
+const Cpu::handler *Cpu::get_decoded_dispatch(void)
+{
+    return make_decoded_dispatch<LAZY>(std::make_index_sequence<0x100>());
+}
+
+void Cpu::select_dispatch(void)
+{
+    dispatch = lazyFlags ? get_dispatch<true>() : get_dispatch<false>();
+    decodedDispatch = lazyFlags ? get_decoded_dispatch<true>() :
+        get_decoded_dispatch<false>();
+}
+
+Cpu::Cpu(bool lazy_flags) : lazyFlags(lazy_flags)
+{
+    select_dispatch();
+    jitVerify = false;
+    memset(memory, 0, sizeof(memory));
+    bus.map(0, sizeof(memory), memory, sizeof(memory), true);
+    pc = 0;
+    extraCycles = 0;
+    operand = 0;
+    currentOp = 0;
+    nextEvent = UINT64_MAX;
+    nmiPending = false;
+    running = false;
+    init();
+}
+
+void Cpu::set_lazy_flags(bool lazy)
+{
+    if (lazy == lazyFlags) {
+        return;
+    }
+    u8 val = get_status();
+    lazyFlags = lazy;
+    if (!lazyFlags) {
+        // native code keeps the flags in their lazy form
+        jit.reset();
+    }
+    select_dispatch();
+    if (blockCache) {
+        // the cached blocks point at handlers of the old mode
+        blockCache->clear();
+    }
+    if (lazyFlags) {
+        unpack_status<true>(val);
+    } else {
+        unpack_status<false>(val);
+    }
+}
+
+bool Cpu::get_lazy_flags(void) const
+{
+    return lazyFlags;
+}
+
+void Cpu::set_block_cache(bool enabled)
+{
+    if (enabled && !blockCache) {
+        blockCache.reset(new BlockCache(bus));
+    } else if (!enabled) {
+        jit.reset();
+        blockCache.reset();
+    }
 }
 
-void init(void)
+bool Cpu::get_block_cache(void) const
+{
+    return blockCache != NULL;
+}
+
+BlockCacheStats Cpu::get_block_cache_stats(void) const
+{
+    BlockCacheStats stats = {};
+    if (blockCache) {
+        stats = blockCache->get_stats();
+    }
+    return stats;
+}
+
+bool Cpu::set_jit(bool enabled)
+{
+    if (!enabled || !Jit::is_supported()) {
+        if (jit) {
+            // the blocks point at code that is about to go away
+            blockCache->clear();
+            jit.reset();
+        }
+        return false;
+    }
+    if (!jit) {
+        set_lazy_flags(true);
+        set_block_cache(true);
+        jit.reset(new Jit(*this));
+    }
+    return true;
+}
+
+bool Cpu::get_jit(void) const
+{
+    return jit != NULL;
+}
+
+void Cpu::set_jit_verify(bool verify)
+{
+    jitVerify = verify;
+}
+
+JitStats Cpu::get_jit_stats(void) const
+{
+    JitStats stats = {};
+    if (jit) {
+        stats = jit->get_stats();
+    }
+    return stats;
+}
+
+void Cpu::init(void)
 {
 	A = 0;
 	X = 0;
 	Y = 0;
 	//TODO: set SP and PC
-	status = 0;
+	if (lazyFlags) {
+		unpack_status<true>(0);
+	} else {
+		unpack_status<false>(0);
+	}
 	sp = 0xff;
-	remainingCycles = CYCLES_PER_FRAME;
-}
-
-void step(void)
-{
-	switch (memory[pc]) {
-
-    case LDA_IMM:
-        lda_op(get_immediate);
-        tick2();
-        break;
-    case LDA_ZP:
-        lda_op(get_zero_page);
-        tick3();
-        break;
-    case LDA_ZP_X:
-        lda_op(get_zero_page_x);
-        tick4();
-        break;
-    case LDA_ABS:
-        lda_op(get_absolute);
-        tick4();
-        break;
-    case LDA_ABS_X:
-        lda_op(get_absolute_X_index);
-        tick4();
-        break;
-    case LDA_ABS_Y:
-        lda_op(get_absolute_Y_index);
-        tick4();
-        break;
-    case LDA_IND_X:
-        lda_op(get_indexed_indirect);
-        tick6();
-        break;
-    case LDA_IND_Y:
-        lda_op(get_indirect_indexed);
-        tick5();
-        break;
-
-    case LDX_IMM:
-        ldx_op(get_immediate);
-        tick2();
-        break;
-    case LDX_ZP:
-        ldx_op(get_zero_page);
-        tick3();
-        break;
-    case LDX_ZP_Y:
-        ldx_op(get_zero_page_y);
-        tick4();
-        break;
-    case LDX_ABS:
-        ldx_op(get_absolute);
-        tick4();
-        break;
-    case LDX_ABS_Y:
-        ldx_op(get_absolute_Y_index);
-        tick4();
-        break;
-
-
-    case LDY_IMM: 
-        ldy_op(get_immediate);
-        tick2();
-        break;
-    case LDY_ZP:	 
-        ldy_op(get_zero_page);
-        tick3();
-        break;
-    case LDY_ZP_X: 
-        ldy_op(get_zero_page_x);
-        tick4();
-        break;
-    case LDY_ABS:	 
-        ldy_op(get_absolute);
-        tick4();
-        break;
-    case LDY_ABS_X:
-        ldy_op(get_absolute_X_index);
-        tick4();
-        break;
-
-    case STA_ZP:
-        sta_op(get_zero_page);
-        tick3();
-        break;
-    case STA_ZP_X:
-        sta_op(get_zero_page_x);
-        tick4();
-        break;
-    case STA_ABS:	 
-        sta_op(get_absolute);
-        tick4();
-        break;
-    case STA_ABS_X:
-        sta_op(get_absolute_X_index);
-        tick5();
-        break;
-    case STA_ABS_Y:
-        sta_op(get_absolute_Y_index);
-        tick5();
-        break;
-    case STA_IND_X:
-        sta_op(get_indexed_indirect);
-        tick6();
-        break;
-    case STA_IND_Y:
-        sta_op(get_indirect_indexed);
-        tick6();
-        break;
-
-    case STX_ZP:	
-        stx_op(get_zero_page);
-        tick3();
-        break;
-    case STX_ZP_Y:
-        stx_op(get_zero_page_y);
-        tick4();
-        break;
-    case STX_ABS:	
-        stx_op(get_absolute);
-        tick4();
-        break;
-
-    case STY_ZP:	
-        sty_op(get_zero_page);
-        tick3();
-        break;
-    case STY_ZP_X:
-        sty_op(get_zero_page_x);
-        tick4();
-        break;
-    case STY_ABS:	
-        sty_op(get_absolute);
-        tick4();
-        break;
-
-    case TAX:
-        tax_op();
-        tick2();
-        break;
-    case TAY:
-        tay_op();
-        tick2();
-        break;
-    case TXA:
-        txa_op();
-        tick2();
-        break;
-    case TYA:
-        tya_op();
-        tick2();
-        break;
-
-    case TSX:
-        tsx_op();
-        tick2();
-        break;
-    case TXS:
-        txs_op();
-        tick2();
-        break;
-    case PHA:
-        pha_op();
-        tick3();
-        break;
-    case PHP:
-        php_op();
-        tick3();    
-        break;
-    case PLA:
-        pla_op();
-        tick4();
-        break;
-    case PLP:
-        plp_op();
-        tick4();
-        break;
-
-    case AND_IMM:	 
-        and_op(get_immediate);
-        tick2();
-        break;
-    case AND_ZP:	 
-        and_op(get_zero_page);
-        tick3();
-        break;
-    case AND_ZP_X: 
-        and_op(get_zero_page_x);
-        tick4();
-        break;
-    case AND_ABS:	 
-        and_op(get_absolute);
-        tick4();
-        break;
-    case AND_ABS_X:
-        and_op(get_absolute_X_index);
-        tick4();
-        break;
-    case AND_ABS_Y:
-        and_op(get_absolute_Y_index);
-        tick4();
-        break;
-    case AND_IND_X:
-        and_op(get_indexed_indirect);
-        tick6();
-        break;
-    case AND_IND_Y:
-        and_op(get_indirect_indexed);
-        tick5();
-        break;
-
-    case EOR_IMM:	 
-        eor_op(get_immediate);
-        tick2();
-        break;
-    case EOR_ZP:	 
-        eor_op(get_zero_page);
-        tick3();
-        break;
-    case EOR_ZP_X: 
-        eor_op(get_zero_page_x);
-        tick4();
-        break;
-    case EOR_ABS:	 
-        eor_op(get_absolute);
-        tick4();
-        break;
-    case EOR_ABS_X:
-        eor_op(get_absolute_X_index);
-        tick4();
-        break;
-    case EOR_ABS_Y:
-        eor_op(get_absolute_Y_index);
-        tick4();
-        break;
-    case EOR_IND_X:
-        eor_op(get_indexed_indirect);
-        tick6();
-        break;
-    case EOR_IND_Y:
-        eor_op(get_indirect_indexed);
-        tick5();
-        break;
-
-    case ORA_IMM:	 
-        ora_op(get_immediate);
-        tick2();
-        break;
-    case ORA_ZP:	 
-        ora_op(get_zero_page);
-        tick3();
-        break;
-    case ORA_ZP_X: 
-        ora_op(get_zero_page_x);
-        tick4();
-        break;
-    case ORA_ABS:	 
-        ora_op(get_absolute);
-        tick4();
-        break;
-    case ORA_ABS_X:
-        ora_op(get_absolute_X_index);
-        tick4();
-        break;
-    case ORA_ABS_Y:
-        ora_op(get_absolute_Y_index);
-        tick4();
-        break;
-    case ORA_IND_X:
-        ora_op(get_indexed_indirect);
-        tick6();
-        break;
-    case ORA_IND_Y:
-        ora_op(get_indirect_indexed);
-        tick5();
-        break;
-
-
-    case BIT_ZP: 
-        bit_op(get_zero_page);
-        tick3();
-        break;
-    case BIT_ABS:
-        bit_op(get_absolute);
-        tick4();
-        break;
-
-	case ADC_IMM:
-		adc_op(get_immediate);
-		tick2();
-		break;
-
-	case ADC_ZP:
-		adc_op(get_zero_page);
-		tick3();
-		break;
-
-	case ADC_ZP_X:
-		adc_op(get_zero_page_x);
-		tick4();
-		break;
-
-	case ADC_ABS:
-		adc_op(get_absolute);
-		tick4();
-		break;
-
-	case ADC_ABS_X:
-		adc_op(get_absolute_X_index);
-		tick4();
-		break;
-
-	case ADC_ABS_Y:
-		adc_op(get_absolute_Y_index);
-		tick4();
-		break;
-
-	case ADC_IND_X:
-		adc_op(get_indexed_indirect);
-		tick6();
-		break;
-
-	case ADC_IND_Y:
-		adc_op(get_indirect_indexed);
-		tick5();
-		break;
-
-    case SBC_IMM:	 
-        sbc_op(get_immediate);
-        tick2();
-        break;
-    case SBC_ZP:	 
-        sbc_op(get_zero_page);
-        tick3();
-        break;
-    case SBC_ZP_X: 
-        sbc_op(get_zero_page_x);
-        tick4();
-        break;
-    case SBC_ABS:	 
-        sbc_op(get_absolute);
-        tick4();
-        break;
-    case SBC_ABS_X:
-        sbc_op(get_absolute_X_index);
-        tick4();
-        break;
-    case SBC_ABS_Y:
-        sbc_op(get_absolute_Y_index);
-        tick4();
-        break;
-    case SBC_IND_X:
-        sbc_op(get_indexed_indirect);
-        tick6();
-        break;
-    case SBC_IND_Y:
-        sbc_op(get_indirect_indexed);
-        tick5();
-        break;
-
-    case CMP_IMM:	 
-        sbc_op(get_immediate);
-        tick2();
-        break;
-    case CMP_ZP:	 
-        sbc_op(get_zero_page);
-        tick3();
-        break;
-    case CMP_ZP_X: 
-        sbc_op(get_zero_page_x);
-        tick4();
-        break;
-    case CMP_ABS:	 
-        sbc_op(get_absolute);
-        tick4();
-        break;
-    case CMP_ABS_X:
-        sbc_op(get_absolute_X_index);
-        tick4();
-        break;
-    case CMP_ABS_Y:
-        sbc_op(get_absolute_Y_index);
-        tick4();
-        break;
-    case CMP_IND_X:
-        sbc_op(get_indexed_indirect);
-        tick6();
-        break;
-    case CMP_IND_Y:
-        sbc_op(get_indirect_indexed);
-        tick5();
-        break;
-
-    case CPX_IMM:
-        cpx_op(get_immediate);
-        tick2();
-        break;
-    case CPX_ZP: 
-        cpx_op(get_zero_page);
-        tick3();
-        break;
-    case CPX_ABS:
-        cpx_op(get_absolute);
-        tick4();
-        break;
-
-    case CPY_IMM:
-        cpy_op(get_immediate);
-        tick2();
-        break;
-    case CPY_ZP: 
-        cpy_op(get_zero_page);
-        tick3();
-        break;
-    case CPY_ABS:
-        cpy_op(get_absolute);
-        tick4();
-        break;
-
-    case INC_ZP:	 
-        inc_op(get_zero_page);
-        tick5();
-        break;
-    case INC_ZP_X: 
-        inc_op(get_zero_page_x);
-        tick6();
-        break;
-    case INC_ABS:	 
-        inc_op(get_absolute);
-        tick6();
-        break;
-    case INC_ABS_X:
-        inc_op(get_absolute_X_index);
-        tick7();
-        break;
-
-    case INX:
-        inx_op();
-        tick2();
-        break;
-
-    case INY:
-        iny_op();
-        tick2();
-        break;
-
-    case DEC_ZP:	 
-        dec_op(get_zero_page);
-        tick5();
-        break;
-    case DEC_ZP_X: 
-        dec_op(get_zero_page_x);
-        tick6();
-        break;
-    case DEC_ABS:	 
-        dec_op(get_absolute);
-        tick6();
-        break;
-    case DEC_ABS_X:
-        dec_op(get_absolute_X_index);
-        tick7();
-        break;
-
-    case DEX:
-        dex_op();
-        tick2();
-        break;
-
-    case DEY:
-        dey_op();
-        tick2();
-        break;
-
-    case ASL_ACC:	 
-        asl_op(get_accumulator);
-        tick2();
-        break;
-    case ASL_ZP:	 
-        asl_op(get_zero_page);
-        tick5();
-        break;
-    case ASL_ZP_X: 
-        asl_op(get_zero_page_x);
-        tick6();
-        break;
-    case ASL_ABS:	 
-        asl_op(get_absolute);
-        tick6();
-        break;
-    case ASL_ABS_X:
-        asl_op(get_absolute_X_index);
-        tick7();
-        break;
-
-    case LSR_ACC:	 
-        lsr_op(get_accumulator);
-        tick2();
-        break;
-    case LSR_ZP:	 
-        lsr_op(get_zero_page);
-        tick5();
-        break;
-    case LSR_ZP_X: 
-        lsr_op(get_zero_page_x);
-        tick6();
-        break;
-    case LSR_ABS:	 
-        lsr_op(get_absolute);
-        tick6();
-        break;
-    case LSR_ABS_X:
-        lsr_op(get_absolute_X_index);
-        tick7();
-        break;
-
-    case ROL_ACC:	 
-        rol_op(get_accumulator);
-        tick2();
-        break;
-    case ROL_ZP:	 
-        rol_op(get_zero_page);
-        tick5();
-        break;
-    case ROL_ZP_X: 
-        rol_op(get_zero_page_x);
-        tick6();
-        break;
-    case ROL_ABS:	 
-        rol_op(get_absolute);
-        tick6();
-        break;
-    case ROL_ABS_X:
-        rol_op(get_absolute_X_index);
-        tick7();
-        break;
-
-    case ROR_ACC:	 
-        ror_op(get_accumulator);
-        tick2();
-        break;
-    case ROR_ZP:	 
-        ror_op(get_zero_page);
-        tick5();
-        break;
-    case ROR_ZP_X: 
-        ror_op(get_zero_page_x);
-        tick6();
-        break;
-    case ROR_ABS:	 
-        ror_op(get_absolute);
-        tick6();
-        break;
-    case ROR_ABS_X:
-        ror_op(get_absolute_X_index);
-        tick7();
-        break;
-
-    case JMP_ABS:
-        jmp_op(get_absolute);
-        tick3();
-        break;
-    case JMP_IND:
-        jmp_op(get_indirect);
-        tick5();
-        break;
-
-    case JSR:
-        jsr_op();
-        tick6();
-        break;
-
-    case RTS:
-        rts_op();
-        tick6();
-        break;
-
-    case BCC:
-        bcc_op();
-        tick2();
-        break;
-
-    case BCS:
-        bcs_op();
-        tick2();
-        break;
-
-    case BEQ:
-        beq_op();
-        tick2();
-        break;
-
-    case BMI:
-        bmi_op();
-        tick2();
-        break;
-
-    case BNE:
-        bne_op();
-        tick2();
-        break;
-
-    case BPL:			
-        bpl_op();
-        tick2();
-        break;
-
-    case BVC:
-        bvc_op();
-        tick2();
-        break;
-
-    case BVS:
-        bvs_op();
-        tick2();
-        break;
-
-    case CLC:
-        clc_op();
-        tick2();
-        break;
-
-    case CLD:
-        cld_op();
-        tick2();
-        break;
+	remainingCycles = 0;
+	totalCycles = 0;
+}
 
-    case CLI:
-        cli_op();
-        tick2();
-        break;
+u32 Cpu::step(void)
+{
+    if (totalCycles >= nextEvent || nmiPending) {
+        run_events();
+    }
+    return interpret();
+}
 
-    case CLV:
-        clv_op();
-        tick2();
-        break;
+u32 Cpu::interpret(void)
+{
+    currentOp = read(pc++);
+    u32 cycles = (this->*dispatch[currentOp])();
+    tick(cycles);
+    return cycles;
+}
 
-    case SEC:
-        sec_op();
-        tick2();
-        break;
+/**
+ * The budget is run in slices that end at the next device event, so the
+ * devices are only caught up when they asked for it. A device can cut the
+ * running slice short with schedule() or trigger_nmi().
+ */
+s32 Cpu::run_cycles(s32 cycles)
+{
+    u64 start = totalCycles;
+    // an instruction that overshot the last budget is paid for out of this one
+    u64 end = totalCycles + static_cast<s64>(remainingCycles) + cycles;
+    running = true;
+    while (static_cast<s64>(end - totalCycles) > 0) {
+        if (totalCycles >= nextEvent || nmiPending) {
+            run_events();
+        }
+        u64 stop = std::min(end, std::max(nextEvent, totalCycles + 1));
+        remainingCycles = static_cast<s32>(stop - totalCycles);
+        if (blockCache) {
+            while (remainingCycles > 0) {
+                run_block();
+            }
+        } else {
+            while (remainingCycles > 0) {
+                interpret();
+            }
+        }
+    }
+    running = false;
+    remainingCycles = static_cast<s32>(static_cast<s64>(end - totalCycles));
+    return static_cast<s32>(totalCycles - start);
+}
 
-    case SED:
-        sed_op();
-        tick2();
-        break;
+/**
+ * Catches up the devices whose events are due and takes a pending NMI.
+ */
+void Cpu::run_events(void)
+{
+    nextEvent = UINT64_MAX;
+    for (ClockedEntry &entry : clocked) {
+        if (entry.next <= totalCycles) {
+            entry.next = entry.device->catch_up(totalCycles);
+        }
+        nextEvent = std::min(nextEvent, entry.next);
+    }
+    if (nmiPending) {
+        nmiPending = false;
+        nmi();
+    }
+}
 
-    case SEI:
-        sei_op();
-        tick2();
-        break;
+void Cpu::nmi(void)
+{
+    push(static_cast<u8>(pc >> 8));
+    push(static_cast<u8>(pc));
+    push((get_status() & ~BREAK_FLAG) | UNUSED_FLAG);
+    status |= INTERRUPT_DISSABLE_FLAG;
+    pc = read(0xFFFA);
+    pc |= read(0xFFFB) << 8;
+    tick(7);
+}
 
-    case BRK:
-        brk_op();
-        tick7();
-        break;
+void Cpu::attach(ClockedDevice *device)
+{
+    ClockedEntry entry = {device, device->catch_up(totalCycles)};
+    clocked.push_back(entry);
+    nextEvent = std::min(nextEvent, entry.next);
+}
 
-    case RTI:
-        rti_op();
-        tick6();
-        break;
+void Cpu::detach(ClockedDevice *device)
+{
+    nextEvent = UINT64_MAX;
+    for (auto it = clocked.begin(); it != clocked.end();) {
+        if (it->device == device) {
+            it = clocked.erase(it);
+            continue;
+        }
+        nextEvent = std::min(nextEvent, it->next);
+        ++it;
+    }
+}
 
-    case NOP:
-        nop_op();
-        break;
-	
+void Cpu::schedule(ClockedDevice *device, u64 cycle)
+{
+    for (ClockedEntry &entry : clocked) {
+        if (entry.device == device) {
+            entry.next = std::min(entry.next, cycle);
+        }
+    }
+    if (cycle >= nextEvent) {
+        return;
+    }
+    nextEvent = cycle;
+    if (running) {
+        s64 left = cycle > totalCycles ? cycle - totalCycles : 0;
+        if (left < remainingCycles) {
+            remainingCycles = static_cast<s32>(left);
+        }
+    }
+}
+
+void Cpu::trigger_nmi(void)
+{
+    nmiPending = true;
+    if (running && remainingCycles > 0) {
+        remainingCycles = 0;
+    }
+}
+
+void Cpu::cancel_nmi(void)
+{
+    nmiPending = false;
+}
+
+u64 Cpu::get_access_cycle(void) const
+{
+    return totalCycles + opcodes[currentOp].cycle_count - 1;
+}
+
+/**
+ * Whether an instruction can change the flow of control, which ends a block.
+ */
+static bool ends_block(const OpCode &info)
+{
+    switch (info.instruction) {
+    case INST_BRK:
+    case INST_JMP:
+    case INST_JSR:
+    case INST_RTI:
+    case INST_RTS:
+        return true;
     default:
-        break;
-	}
+        return info.address_mode == RELATIVE;
+    }
+}
+
+/**
+ * Decodes the block starting at the given address and adds it to the cache.
+ *
+ * @return: The block, NULL if no block can start there because the code is
+ * in a page handled by an IoDevice or its first instruction crosses into the
+ * next page.
+ */
+Block *Cpu::decode_block(u16 address)
+{
+    const u8 *source = bus.get_read_page(address >> Bus::PAGE_SHIFT);
+    if (!source) {
+        return NULL;
+    }
+
+    Block *block = new Block;
+    block->start = address;
+    block->cycles = 0;
+    block->count = 0;
+    block->runs = 0;
+    block->native = NULL;
+    block->maxCycles = 0;
+
+    u32 offset = address & Bus::PAGE_MASK;
+    while (block->count < Block::MAX_INSTRUCTIONS) {
+        const OpCode &info = opcodes[source[offset]];
+        if (offset + info.bytes > Bus::PAGE_SIZE) {
+            break;
+        }
+
+        DecodedInstruction &inst = block->instructions[block->count++];
+        inst.run = decodedDispatch[info.op];
+        inst.op = info.op;
+        inst.operand = 0;
+        if (info.bytes > 1) {
+            inst.operand = source[offset + 1];
+        }
+        if (info.bytes > 2) {
+            inst.operand |= source[offset + 2] << 8;
+        }
+        inst.length = info.bytes;
+        inst.cycles = info.cycle_count;
+        block->cycles += info.cycle_count;
+        offset += info.bytes;
+
+        if (ends_block(info)) {
+            break;
+        }
+    }
+
+    if (!block->count) {
+        delete block;
+        return NULL;
+    }
+    block->end = (address & ~Bus::PAGE_MASK) + offset;
+    blockCache->insert(block, source);
+    return block;
+}
+
+/**
+ * Runs the block at pc, decoding it first if it is not cached. Like step()
+ * the clock is advanced after every instruction and the block is left as
+ * soon as the budget runs out, so timing matches the interpreter exactly.
+ * A write that drops cached code or a bank switch also ends the block, the
+ * rest of it may no longer be what is in memory.
+ */
+void Cpu::run_block(void)
+{
+    blockCache->collect();
+    Block *block = blockCache->lookup(pc);
+    if (!block) {
+        block = decode_block(pc);
+        if (!block) {
+            interpret();
+            return;
+        }
+    }
+
+    u32 first = 0;
+    if (jit) {
+        if (!block->native && ++block->runs == JIT_THRESHOLD) {
+            compile_block(block);
+        }
+        // the interpreter would stop part way through a block that can
+        // overrun the budget, so those blocks are left to it
+        if (block->native &&
+                remainingCycles > static_cast<s32>(block->maxCycles)) {
+            first = jitVerify ? run_native_verified(block) :
+                run_native(block);
+            if (first == block->count) {
+                return;
+            }
+        }
+    }
+
+    u32 cacheGeneration = blockCache->get_generation();
+    u32 busGeneration = bus.get_generation();
+    for (u32 i = first; i < block->count; i++) {
+        run_decoded(block->instructions[i]);
+        if (remainingCycles <= 0 ||
+                cacheGeneration != blockCache->get_generation() ||
+                busGeneration != bus.get_generation()) {
+            break;
+        }
+    }
+}
+
+s32 Cpu::run_frame(void)
+{
+    return run_cycles(CYCLES_PER_FRAME);
 }
 
 
-u8 get_regA(void)
+/**
+ * Compiles a hot block. Code in pages that write to themselves is left to
+ * the interpreter, it would only be compiled to be thrown away again.
+ */
+void Cpu::compile_block(Block *block)
+{
+    if (blockCache->is_self_modifying(block->start >> Bus::PAGE_SHIFT)) {
+        return;
+    }
+    if (!jit->compile(block) && jit->is_full()) {
+        // start over, every block pointing into the code buffer goes
+        blockCache->clear();
+        jit->reset();
+    }
+}
+
+/**
+ * Runs the native code of a block and charges the cycles it took.
+ *
+ * @return: The index of the instruction the interpreter has to carry on
+ * at, the block's count if the whole block ran.
+ */
+u32 Cpu::run_native(Block *block)
+{
+    JitStats &stats = jit->get_stats();
+    u32 result = block->native();
+    tick(result & 0xffff);
+    stats.nativeRuns++;
+    if (result >> 16) {
+        stats.fallbacks++;
+        return (result >> 16) - 1;
+    }
+    return block->count;
+}
+
+/**
+ * Runs a block natively, then rewinds and runs the same instructions on the
+ * interpreter. The interpreter's result is kept, a mismatch is counted.
+ */
+u32 Cpu::run_native_verified(Block *block)
+{
+    struct State
+    {
+        u8 A, X, Y, sp, status, flagN, flagZ, flagC, flagVa, flagVb, flagVr;
+        u16 pc;
+        s32 remainingCycles;
+        u64 totalCycles;
+    };
+    auto save = [this](State &state) {
+        state = State{A, X, Y, sp, status, flagN, flagZ, flagC, flagVa,
+            flagVb, flagVr, pc, remainingCycles, totalCycles};
+    };
+    auto snapshot = [this](std::vector<u8> &mem) {
+        mem.resize(0x10000);
+        for (u32 i = 0; i < Bus::PAGE_COUNT; i++) {
+            const u8 *storage = bus.get_write_storage(i);
+            if (storage) {
+                memcpy(&mem[i << Bus::PAGE_SHIFT], storage, Bus::PAGE_SIZE);
+            }
+        }
+    };
+
+    State before;
+    std::vector<u8> memBefore;
+    save(before);
+    snapshot(memBefore);
+
+    u32 first = run_native(block);
+    State native;
+    std::vector<u8> memNative;
+    save(native);
+    u8 nativeStatus = get_status();
+    snapshot(memNative);
+
+    A = before.A;
+    X = before.X;
+    Y = before.Y;
+    sp = before.sp;
+    status = before.status;
+    flagN = before.flagN;
+    flagZ = before.flagZ;
+    flagC = before.flagC;
+    flagVa = before.flagVa;
+    flagVb = before.flagVb;
+    flagVr = before.flagVr;
+    pc = before.pc;
+    remainingCycles = before.remainingCycles;
+    totalCycles = before.totalCycles;
+    for (u32 i = 0; i < Bus::PAGE_COUNT; i++) {
+        u8 *storage = bus.get_write_storage(i);
+        if (storage) {
+            memcpy(storage, &memBefore[i << Bus::PAGE_SHIFT], Bus::PAGE_SIZE);
+        }
+    }
+
+    for (u32 i = 0; i < first; i++) {
+        run_decoded(block->instructions[i]);
+    }
+
+    std::vector<u8> memInterpreted;
+    snapshot(memInterpreted);
+    JitStats &stats = jit->get_stats();
+    stats.verifiedRuns++;
+    if (A != native.A || X != native.X || Y != native.Y ||
+            sp != native.sp || pc != native.pc ||
+            get_status() != nativeStatus ||
+            totalCycles != native.totalCycles ||
+            memInterpreted != memNative) {
+        stats.verifyMismatches++;
+        stats.lastMismatchPc = block->start;
+    }
+    return first;
+}
+
+u8 Cpu::get_regA(void) const
 {
     return A;
 }
 
-u8 get_regX(void)
+u8 Cpu::get_regX(void) const
 {
     return X;
 }
 
-u8 get_regY(void)
+u8 Cpu::get_regY(void) const
 {
     return Y;
 }
 
-u8 get_status(void)
+u8 Cpu::get_status(void) const
 {
-    return status;
+    return lazyFlags ? pack_status<true>() : pack_status<false>();
 }
 
-u8 get_sp(void)
+u8 Cpu::get_sp(void) const
 {
     return sp;
 }
 
-u16 get_pc(void)
+u16 Cpu::get_pc(void) const
 {
     return pc;
 }
 
+u64 Cpu::get_cycles(void) const
+{
+    return totalCycles;
+}
+
+void Cpu::set_pc(u16 address)
+{
+    pc = address;
+}
+
+u8 Cpu::read_memory(u16 address)
+{
+    return bus.read(address);
+}
+
+void Cpu::write_memory(u16 address, u8 val)
+{
+    bus.write(address, val);
+}
+
+Bus &Cpu::get_bus(void)
+{
+    return bus;
+}
 
-void testCpu(const std::vector<u8> &code) 
+void Cpu::load(const std::vector<u8> &code, u16 address)
 {
-	memcpy(memory, code.data(), code.size());
+    u32 size = code.size();
+    if (address + size > sizeof(memory)) {
+        size = sizeof(memory) - address;
+    }
+    memcpy(memory + address, code.data(), size);
+    if (blockCache) {
+        blockCache->clear();
+    }
+}
+
+
+void Cpu::testCpu(const std::vector<u8> &code)
+{
+	load(code, 0);
 	while (pc < code.size()) {
 		printf("___________________________________________\n");
-		printf("PC: 0x%X | op_code: 0x%X\n", pc, memory[pc]);
+		printf("PC: 0x%X | op_code: 0x%X\n", pc, read(pc));
 		printf("A: 0x%X | X: 0x%X | Y: 0x%X | sp: 0x%X\n", A, X, Y, sp);
 		printf("___________________________________________\n");
 
 		step();
 	}
 		printf("___________________________________________\n");
-		printf("PC: 0x%X | op_code: 0x%X\n", pc, memory[pc]);
+		printf("PC: 0x%X | op_code: 0x%X\n", pc, read(pc));
 		printf("A: 0x%X | X: 0x%X | Y: 0x%X | sp: 0x%X\n", A, X, Y, sp);
 		printf("___________________________________________\n");
 }
 
 /**
- * Run the Cpu for a cycle.
+ * Advance the clock by the given number of cycles.
  */
-void tick(void)
+void Cpu::tick(u32 cycles)
 {
-	// TODO: call ppu three times since it runs at 3 x the 6502 clock speed
-	// NOTE: the cpu runs at 1.79 MHz which comes down to roughly 29834 cycles
-	// per frame
-	remainingCycles--;
+	// the ppu and the other devices catch up lazily, see run_cycles()
+	remainingCycles -= cycles;
+	totalCycles += cycles;
 }
 
 
 // memory access methods
-// All memory access methods grab the address from the opCode's operands.
-// In otherwords, once an opcode is read the memory methods will increment
-// the program counter and then use the new value in the program counter
-// to get the value that will be used for accessing memory.
-
-u16 get_accumulator(void)
-{
-    return A;
-}
+// By the time an instruction runs its operand bytes have been fetched into
+// operand, either by execute() or from a decoded block. The memory methods
+// turn the operand into the effective address of the instruction.
 
 /**
- * Grabs the immediate value from the next byte in program memory.
+ * Uses the operand as an address in the zero page.
  *
- * @return: The value found at the next byte.
+ * @return: The address in the zero page.
  */
-u16 get_immediate(void)
+u16 Cpu::get_zero_page(void)
 {
-	Cpu::pc++;
-	u16 ret = pc;
-	Cpu::pc++;
-	return ret;
+	return static_cast<u8>(operand);
 }
 
 /**
- * Grabs the next byte from program memory and uses that to retrieve a 
- * value from the zero page.
+ * Adds the operand to the value found in the X register, wrapping around
+ * within the zero page.
  *
- * @return: The value found in the zero page.
+ * @return: The address in the zero page.
  */
-u16 get_zero_page(void)
+u16 Cpu::get_zero_page_x(void)
 {
-	return get_immediate();
+	return static_cast<u8>(operand + X);
 }
 
-/**
- * Grabs the next byte from program memory and adds that to the value found
- * in the X register and uses that new value to retrieve a value from the
- * zero page.
- *
- * @return: The value found in the zero page.
- */
-u16 get_zero_page_x(void)
+u16 Cpu::get_zero_page_y(void)
 {
-	return get_immediate() + X;
-}
-
-u16 get_zero_page_y(void)
-{
-    return get_immediate() + Y;
+    return static_cast<u8>(operand + Y);
 }
 
 /**
- * Grabs the 16 bit address from the next two bytes and uses that to access
- * a value in memory.
+ * Uses the 16 bit operand as the address.
  *
- * @return: The value found at the absolute address.
+ * @return: The absolute address.
  */
-u16 get_absolute(void)
+u16 Cpu::get_absolute(void)
 {
-	pc++;
-	u16 loc = memory[pc] << 8;
-	pc++;
-	loc |= memory[pc];
-	pc++;
-
-	return loc;
+	return operand;
 }
 
 /**
- * Grabs the 16 bit address from the next two bytes and adds it to the 
- * value found in the X register and uses the calculated value to fetch a
- * value from memory.
+ * Adds the 16 bit operand to the value found in the X register.
  *
- * @return: The value found in memory.
+ * @return: The indexed address.
  */
-u16 get_absolute_X_index(void)
+template <bool PENALTY>
+u16 Cpu::get_absolute_X_index(void)
 {
-	// TODO: refractor out the duplicate code
-	pc++;
-	u16 loc = memory[pc] << 8;
-	pc++;
-	loc |= memory[pc];
-	pc++;
+	u16 loc = operand;
 
-    if ((loc & 0x00FF) + X > 0x00FF) {
-        tick();	// handle page cross
+    if (PENALTY) {
+        extraCycles += (loc & 0x00FF) + X > 0x00FF;	// handle page cross
     }
 
 	return loc + X;
 }
 
 /**
- * Grabs the 16 bit address from the next two bytes and adds it to the 
- * value found in the y register and uses the calculated value to fetch a
- * value from memory.
+ * Adds the 16 bit operand to the value found in the y register.
  *
- * @return: The value found in memory.
+ * @return: The indexed address.
  */
-u16 get_absolute_Y_index(void)
+template <bool PENALTY>
+u16 Cpu::get_absolute_Y_index(void)
 {
-	// TODO: refractor out the duplicate code
-	pc++;
-	u16 loc = memory[pc];
-	pc++;
-	loc |= memory[pc] << 8;
-	pc++;
+	u16 loc = operand;
 
-    if ((loc & 0x00FF) + Y > 0x00FF) {
-        tick();	// handle page cross
+    if (PENALTY) {
+        extraCycles += (loc & 0x00FF) + Y > 0x00FF;	// handle page cross
     }
 
 	return loc + Y;
 }
 
-u16 get_indirect(void)
+/**
+ * Reads the 16 bit pointer at the absolute address. Like the real 6502 the
+ * high byte is fetched from the start of the same page when the pointer
+ * sits on a page boundary.
+ *
+ * @return: The address the pointer points to.
+ */
+u16 Cpu::get_indirect(void)
 {
-    u16 loc = get_absolute();
-    u16 dest = memory[loc];
-    dest |= memory[loc + 1] << 8;
+    u16 loc = operand;
+    u16 dest = read(loc);
+    dest |= read((loc & 0xFF00) | static_cast<u8>(loc + 1)) << 8;
     return dest;
 }
 
 /**
- * The value in the X register is added to the next byte. This result is
- * used to grab a 16 bit value from the zero page which is then used to
- * access a value in memory.
+ * The value in the X register is added to the operand. This result is
+ * used to grab a 16 bit value from the zero page which is the effective
+ * address.
  *
- * @return: The value found in memory.
+ * @return: The effective address.
  */
-u16 get_indexed_indirect(void)
+u16 Cpu::get_indexed_indirect(void)
 {
-	u8 zp = get_immediate() + X;
-	u16 ret = memory[zp];
-	ret |= memory[zp + 1] << 8;
+	u8 zp = static_cast<u8>(operand) + X;
+	u16 ret = read(zp);
+	ret |= read(static_cast<u8>(zp + 1)) << 8;
 	return ret;
 }
 
 /**
- * Takes the value in the next byte, uses that to retrieve a 16 bit value
- * from the zero page and adds the value in the Y register to that. The 
- * result is then used to access a value in memory.
+ * Uses the operand to retrieve a 16 bit value from the zero page and adds
+ * the value in the Y register to that.
  *
- * @return: The value found in memory.
+ * @return: The effective address.
  */
-u16 get_indirect_indexed(void)
-{
-	u8 zp = get_immediate();
-	u16 address = memory[zp] << 8;
-	address |= memory[zp + 1];
-	address += Y;
-    
-    if ((address & 0x00FF) + Y > 0x00FF) {
-        tick();	// handle page cross
+template <bool PENALTY>
+u16 Cpu::get_indirect_indexed(void)
+{
+	u8 zp = static_cast<u8>(operand);
+	u16 address = read(zp);
+	address |= read(static_cast<u8>(zp + 1)) << 8;
+
+    if (PENALTY) {
+        extraCycles += (address & 0x00FF) + Y > 0x00FF;	// handle page cross
     }
 
-    return address;
+    return address + Y;
 }
 
-// TODO: consider converting these to macros
 // Flag operations
-void set_carry(u8 preAdd)
+// In eager mode the flags live in status and are updated by every
+// instruction. In lazy mode instructions only store the values the flags
+// are derived from (flagN, flagZ, flagC and the operands of the last
+// addition); the flags are worked out when a branch, PHP, BRK or
+// get_status() reads them. The interrupt and decimal flags always live in
+// status.
+template <bool LAZY>
+void Cpu::set_carry(bool set)
+{
+    if (LAZY) {
+        flagC = set;
+    } else {
+        status = set ? (status | CARRY_FLAG) : (status & ~CARRY_FLAG);
+    }
+}
+
+template <bool LAZY>
+void Cpu::set_zero(u8 reg)
 {
-    // NOTE: this probably only works for addition, also there may be a
-    // simpler method to do this
-	if (preAdd > A) {
-        status |= CARRY_FLAG;
+    if (LAZY) {
+        flagZ = reg;
+    } else {
+        status = reg ? (status & ~ZERO_FLAG) : (status | ZERO_FLAG);
     }
 }
 
-void set_zero(u8 reg)
+template <bool LAZY>
+void Cpu::set_overflow(bool set)
 {
-    if (!reg) {
-        status |= ZERO_FLAG;
+    if (LAZY) {
+        // operands for which the addition overflow check gives the flag
+        flagVa = 0;
+        flagVb = 0;
+        flagVr = set ? NEGATIVE_FLAG : 0;
+    } else {
+        status = set ? (status | OVERFLOW_FLAG) : (status & ~OVERFLOW_FLAG);
     }
 }
 
-void set_overflow(u8 reg)
+template <bool LAZY>
+void Cpu::set_negative(u8 reg)
 {
-    if ((status & CARRY_FLAG) && (reg & NEGATIVE_FLAG)) {
-        status |= OVERFLOW_FLAG;
+    if (LAZY) {
+        flagN = reg;
+    } else {
+        status = (status & ~NEGATIVE_FLAG) | (reg & NEGATIVE_FLAG);
     }
 }
 
-void set_negative(u8 reg)
+template <bool LAZY>
+bool Cpu::get_flag(u8 flag) const
 {
-	if (reg & NEGATIVE_FLAG) {
-		status |= NEGATIVE_FLAG;
-	}
+    if (!LAZY) {
+        return status & flag;
+    }
+    switch (flag) {
+    case CARRY_FLAG:    return flagC;
+    case ZERO_FLAG:     return !flagZ;
+    case NEGATIVE_FLAG: return flagN & NEGATIVE_FLAG;
+    case OVERFLOW_FLAG: return ~(flagVa ^ flagVb) & (flagVa ^ flagVr) & NEGATIVE_FLAG;
+    default:            return status & flag;
+    }
 }
 
-void new_page_cycle(u16 old_pc)
+template <bool LAZY>
+u8 Cpu::pack_status(void) const
 {
-    if (pc - old_pc > 100) {
-        printf("%d - %d = %d\n", old_pc + 100, pc,(old_pc + 100) - pc);
-        tick2();
+    if (!LAZY) {
+        return status;
+    }
+    u8 ret = status & ~(CARRY_FLAG | ZERO_FLAG | OVERFLOW_FLAG | NEGATIVE_FLAG);
+    ret |= get_flag<LAZY>(CARRY_FLAG) ? CARRY_FLAG : 0;
+    ret |= get_flag<LAZY>(ZERO_FLAG) ? ZERO_FLAG : 0;
+    ret |= get_flag<LAZY>(OVERFLOW_FLAG) ? OVERFLOW_FLAG : 0;
+    ret |= get_flag<LAZY>(NEGATIVE_FLAG) ? NEGATIVE_FLAG : 0;
+    return ret;
+}
+
+template <bool LAZY>
+void Cpu::unpack_status(u8 val)
+{
+    status = val;
+    if (LAZY) {
+        set_carry<LAZY>(val & CARRY_FLAG);
+        set_zero<LAZY>(~val & ZERO_FLAG);
+        set_overflow<LAZY>(val & OVERFLOW_FLAG);
+        set_negative<LAZY>(val);
     }
 }
 
-//TODO: have to redo how the displacement works
-void do_branch(s8 displacement, bool exp)
+void Cpu::new_page_cycle(u16 old_pc)
+{
+    extraCycles += (pc & 0xFF00) != (old_pc & 0xFF00);
+}
+
+void Cpu::do_branch(s8 displacement, bool exp)
 {
     u16 old_pc = pc;
-        printf("%d\n", pc);
     if (exp) {
-        pc = displacement;
-        printf("%d\n", pc);
-        tick();
+        pc += displacement;
+        extraCycles++;
         new_page_cycle(old_pc);
     }
 }
-}
@@ -2,132 +2,452 @@
 #define CPU_H
 
 #include "utils.h"
+#include "bus.h"
+#include "block_cache.h"
+#include "jit.h"
+#include <memory>
+#include <utility>
 #include <vector>
 
-namespace Cpu {
+/**
+ * A component that runs off the cpu clock, e.g. the PPU. Rather than being
+ * stepped every cycle it is caught up in batches: when the cpu reaches the
+ * cycle the device asked for, and whenever the device itself decides to,
+ * e.g. when one of its registers is accessed.
+ */
+class ClockedDevice
+{
+public:
+    virtual ~ClockedDevice(void) {}
 
+    /**
+     * Runs the device up to the given cpu cycle.
+     *
+     * @return: The cycle the cpu has to stop at so the device can catch up
+     * again, e.g. because it may raise an interrupt then.
+     */
+    virtual u64 catch_up(u64 cycle) = 0;
+};
+
+/**
+ * The 6502 core of the NES. All emulator state lives in the instance, so any
+ * number of Cpus can run side by side, each on its own thread.
+ */
+class Cpu
+{
+public:
     enum FLAGS 
     {
 	    CARRY_FLAG = 1,
 	    ZERO_FLAG = 2,
 	    INTERRUPT_DISSABLE_FLAG = 4,
 	    DECIMAL_MODE_FLAG = 8,
-        BREAK_FLAG = 32,
+        BREAK_FLAG = 16,
+        UNUSED_FLAG = 32,
 	    OVERFLOW_FLAG = 64,
 	    NEGATIVE_FLAG = 128,
     };
 
-    typedef u16 (*address_mode)(void);
+    // the cpu runs at 1.79 MHz which comes down to roughly 29834 cycles per
+    // frame, a Ppu keeps its own, exact frame time
+    static const s32 CYCLES_PER_FRAME = 29834;
+
+    /**
+     * @param lazy_flags: Whether N, Z, C and V are worked out lazily, only
+     * when something reads them, instead of after every instruction.
+     */
+    Cpu(bool lazy_flags = false);
+    ~Cpu(void) {}
+
+    void set_lazy_flags(bool lazy);
+    bool get_lazy_flags(void) const;
+
+    /**
+     * Turns the block cache on or off. With the cache on, run_cycles()
+     * executes pre-decoded blocks of straight line code instead of fetching
+     * and decoding every instruction. Code in pages handled by an IoDevice
+     * always goes through the interpreter.
+     */
+    void set_block_cache(bool enabled);
+    bool get_block_cache(void) const;
+
+    /**
+     * @return: The hit rate and invalidation counts of the block cache, all
+     * zero while it is off.
+     */
+    BlockCacheStats get_block_cache_stats(void) const;
+
+    /**
+     * Turns the x86-64 recompiler on or off. Blocks that run often enough
+     * are compiled to native code. The JIT works on top of the block cache
+     * and with lazy flags, so turning it on turns those on as well.
+     *
+     * @return: Whether the JIT is on, it is only available on x86-64 hosts.
+     */
+    bool set_jit(bool enabled);
+    bool get_jit(void) const;
+
+    /**
+     * Runs every native block a second time on the interpreter, from the
+     * same state, and counts the blocks where the two disagree. Slow, this
+     * is for testing the JIT.
+     */
+    void set_jit_verify(bool verify);
+
+    /**
+     * @return: What the JIT has been up to, all zero while it is off.
+     */
+    JitStats get_jit_stats(void) const;
 
     void init(void);
-    void step(void);
+
+    /**
+     * Runs a device off the cpu clock, see ClockedDevice. Devices are
+     * attached after init() and stay attached until they are detached.
+     */
+    void attach(ClockedDevice *device);
+
+    /**
+     * Stops running a device off the cpu clock, e.g. as it is destroyed.
+     * Not to be called from inside run_cycles().
+     */
+    void detach(ClockedDevice *device);
+
+    /**
+     * Makes the cpu stop for the given device no later than the given
+     * cycle, so it can be caught up. Pulling an event forward in the middle
+     * of an instruction stops the cpu after that instruction.
+     */
+    void schedule(ClockedDevice *device, u64 cycle);
+
+    /**
+     * Raises an NMI, which the cpu takes before its next instruction, or
+     * withdraws one that has not been taken yet.
+     */
+    void trigger_nmi(void);
+    void cancel_nmi(void);
+
+    /**
+     * @return: The cycle the memory access of the current instruction falls
+     * on, the last cycle of the instruction. Devices use it to catch up to
+     * the exact time they are accessed.
+     */
+    u64 get_access_cycle(void) const;
+
+    /**
+     * Executes a single instruction and advances the clock once by its full
+     * cost, including page cross and branch penalties. Due device events and
+     * a pending NMI are handled first.
+     *
+     * @return: The number of cycles the instruction took.
+     */
+    u32 step(void);
+
+    /**
+     * Executes instructions until the given cycle budget is spent. An
+     * instruction that overshoots the budget is charged to the next call.
+     *
+     * @param cycles: The number of cycles to run for.
+     * @return: The number of cycles actually executed.
+     */
+    s32 run_cycles(s32 cycles);
+
+    /**
+     * Runs the cpu for one frame worth of cycles (CYCLES_PER_FRAME).
+     *
+     * @return: The number of cycles actually executed.
+     */
+    s32 run_frame(void);
 
     // getters for the cpu registers.
-    u8 get_regA(void);
-    u8 get_regX(void);
-    u8 get_regY(void);
-    u8 get_status(void);
-    u8 get_sp(void);
-    u16 get_pc(void);
+    u8 get_regA(void) const;
+    u8 get_regX(void) const;
+    u8 get_regY(void) const;
+    u8 get_status(void) const;
+    u8 get_sp(void) const;
+    u16 get_pc(void) const;
 
-    void testCpu(const std::vector<u8> &code);
+    /**
+     * @return: The total number of cycles executed since init().
+     */
+    u64 get_cycles(void) const;
+
+    void set_pc(u16 address);
+
+    u8 read_memory(u16 address);
+    void write_memory(u16 address, u8 val);
 
     /**
-     * Run the Cpu for a cycle.
+     * @return: The bus the cpu accesses memory through. By default the whole
+     * address space is mapped to the cpu's flat backing memory.
      */
-    void tick(void);
+    Bus &get_bus(void);
 
-    // memory access methods
-    // All memory access methods grab the address from the opCode's operands.
-    // Once an opcode is read the memory methods will increment
-    // the program counter and then use the new value in the program counter
-    // to get the value that will be used for accessing memory.
+    /**
+     * Copies the given code into the cpu's flat backing memory.
+     *
+     * @param code: The bytes to copy.
+     * @param address: Where in memory the first byte goes.
+     */
+    void load(const std::vector<u8> &code, u16 address);
 
-    //TODO: write better method descriptions.
+    void testCpu(const std::vector<u8> &code);
 
-    u16 get_accumulator(void);
     /**
-     * Grabs the immediate value from the next byte in program memory.
+     * Advance the clock by the given number of cycles. This is the one place
+     * other components get to catch up with the cpu.
      *
-     * @return: The value found at the next byte.
+     * @param cycles: The number of cycles that passed.
      */
-    u16 get_immediate(void);
+    void tick(u32 cycles);
+
+private:
+    friend class Jit;
+
+    // Blocks are compiled once they have run this many times.
+    static const u32 JIT_THRESHOLD = 8;
+
+    // An entry of the dispatch table, returns the cycles the instruction took.
+    typedef u32 (Cpu::*handler)(void);
+    typedef u8 (Cpu::*shift_fn)(u8 val);
+
+    // General purpose registers
+    u8 	A;
+    u8 	X;
+    u8 	Y;
+
+    // Special purpose registers
+    u8 	sp;
+    u8 	status;
+    u16 pc;
+
+    Bus bus;
+    u8 memory[0x10000]; // for now allocate the entire address space for th emulator
+
+    s32 remainingCycles; //borrowed from github/AndreaOrru/LaiNES
+    u64 totalCycles;
+
+    // Devices caught up off the clock, and the next cycle any of them needs
+    // the cpu to stop at.
+    struct ClockedEntry
+    {
+        ClockedDevice *device;
+        u64 next;
+    };
+    std::vector<ClockedEntry> clocked;
+    u64 nextEvent;
+    bool nmiPending;
+    bool running;   // inside run_cycles(), remainingCycles is a slice
+    u8  currentOp;
+
+    // Cycles the current instruction takes on top of its base cycle count.
+    u8 	extraCycles;
+
+    // The operand bytes of the current instruction, little endian.
+    u16 operand;
+
+    // Lazy flag state, the flags are derived from these when read.
+    bool lazyFlags;
+    u8  flagN;  // bit 7 is the negative flag
+    u8  flagZ;  // the zero flag is set when this is zero
+    u8  flagC;
+    u8  flagVa; // operands and result of the last addition, for overflow
+    u8  flagVb;
+    u8  flagVr;
+
+    const handler *dispatch;
+    const handler *decodedDispatch; // run(), for instructions in a block
+
+    std::unique_ptr<BlockCache> blockCache;
+    std::unique_ptr<Jit> jit;
+    bool jitVerify;
+
+    template <bool LAZY> static const handler *get_dispatch(void);
+    template <bool LAZY, size_t... OPS>
+    static const handler *make_dispatch(std::index_sequence<OPS...>);
+    template <bool LAZY> static const handler *get_decoded_dispatch(void);
+    template <bool LAZY, size_t... OPS>
+    static const handler *make_decoded_dispatch(std::index_sequence<OPS...>);
+    void select_dispatch(void);
+
+    u32 interpret(void);
+    void run_events(void);
+    void nmi(void);
+    void run_block(void);
+    Block *decode_block(u16 address);
+    void compile_block(Block *block);
+    u32 run_native(Block *block);
+    u32 run_native_verified(Block *block);
+
+    inline void run_decoded(const DecodedInstruction &inst)
+    {
+        operand = inst.operand;
+        currentOp = inst.op;
+        pc += inst.length;
+        tick((this->*inst.run)());
+    }
+    template <u8 OP, bool LAZY> u32 execute(void);
+    template <u8 OP, bool LAZY> u32 run(void);
+    template <u8 OP> void fetch_operand(void);
+    template <u8 OP> u8 read_operand(void);
+    template <u8 OP> u16 operand_address(void);
+
+    inline u8 read(u16 address)
+    {
+        return bus.read(address);
+    }
+
+    inline void write(u16 address, u8 val)
+    {
+        bus.write(address, val);
+    }
+
+    // memory access methods
+    // All memory access methods work on the operand of the current
+    // instruction, which has already been fetched into operand, and return
+    // the effective address of the instruction.
+    // The indexed modes take PENALTY, whether crossing a page costs the
+    // instruction an extra cycle.
 
     /**
-     * Grabs the next byte from program memory and uses that to retrieve a 
-     * value from the zero page.
+     * Uses the operand as an address in the zero page.
      *
-     * @return: The value found in the zero page.
+     * @return: The address in the zero page.
      */
     u16 get_zero_page(void);
 
     /**
-     * Grabs the next byte from program memory and adds that to the value found
-     * in the X register and uses that new value to retrieve a value from the
-     * zero page.
+     * Adds the operand to the value found in the X register, wrapping around
+     * within the zero page.
      *
-     * @return: The value found in the zero page.
+     * @return: The address in the zero page.
      */
     u16 get_zero_page_x(void);
 
     u16 get_zero_page_y(void);
 
     /**
-     * Grabs the 16 bit address from the next two bytes and uses that to access
-     * a value in memory.
+     * Uses the 16 bit operand as the address.
      *
-     * @return: The value found at the absolute address.
+     * @return: The absolute address.
      */
     u16 get_absolute(void);
 
     /**
-     * Grabs the 16 bit address from the next two bytes and adds it to the 
-     * value found in the X register and uses the calculated value to fetch a
-     * value from memory.
+     * Adds the 16 bit operand to the value found in the X register.
      *
-     * @return: The value found in memory.
+     * @return: The indexed address.
      */
-    u16 get_absolute_X_index(void);
+    template <bool PENALTY> u16 get_absolute_X_index(void);
 
     /**
-     * Grabs the 16 bit address from the next two bytes and adds it to the 
-     * value found in the y register and uses the calculated value to fetch a
-     * value from memory.
+     * Adds the 16 bit operand to the value found in the y register.
      *
-     * @return: The value found in memory.
+     * @return: The indexed address.
      */
-    u16 get_absolute_Y_index(void);
+    template <bool PENALTY> u16 get_absolute_Y_index(void);
 
     u16 get_indirect(void);
 
     /**
-     * The value in the X register is added to the next byte. This result is
-     * used to grab a 16 bit value from the zero page which is then used to
-     * access a value in memory.
+     * The value in the X register is added to the operand. This result is
+     * used to grab a 16 bit value from the zero page which is the effective
+     * address.
      *
-     * @return: The value found in memory.
+     * @return: The effective address.
      */
     u16 get_indexed_indirect(void);
 
     /**
-     * Takes the value in the next byte, uses that to retrieve a 16 bit value
-     * from the zero page and adds the value in the Y register to that. The 
-     * result is then used to access a value in memory.
+     * Uses the operand to retrieve a 16 bit value from the zero page and adds
+     * the value in the Y register to that.
      *
-     * @return: The value found in memory.
+     * @return: The effective address.
      */
-    u16 get_indirect_indexed(void);
+    template <bool PENALTY> u16 get_indirect_indexed(void);
 
     // Flag operations
 
-    void set_carry(u8 preAdd);
-    void set_zero(u8 reg);
-    void set_overflow(u8 reg);
-    void set_negative(u8 reg);
+    template <bool LAZY> void set_carry(bool set);
+    template <bool LAZY> void set_zero(u8 reg);
+    template <bool LAZY> void set_overflow(bool set);
+    template <bool LAZY> void set_negative(u8 reg);
+    template <bool LAZY> bool get_flag(u8 flag) const;
+    template <bool LAZY> u8 pack_status(void) const;
+    template <bool LAZY> void unpack_status(u8 val);
 
     void new_page_cycle(u16 old_pc);
     void do_branch(s8 displacement, bool exp);
 
-}	
+    // Helpers shared by the instructions
+    void push(u8 val);
+    u8 pop(void);
+    template <bool LAZY> void add_with_carry(u8 val);
+    template <bool LAZY> void compare(u8 reg, u8 val);
+    template <bool LAZY, u8 OP, shift_fn SHIFT> void shift_op(void);
+    template <bool LAZY> u8 asl(u8 val);
+    template <bool LAZY> u8 lsr(u8 val);
+    template <bool LAZY> u8 rol(u8 val);
+    template <bool LAZY> u8 ror(u8 val);
+
+    // Instructions
+    template <bool LAZY, u8 OP> void adc_op(void);
+    template <bool LAZY, u8 OP> void and_op(void);
+    template <bool LAZY, u8 OP> void asl_op(void);
+    template <bool LAZY> void bcc_op(void);
+    template <bool LAZY> void bcs_op(void);
+    template <bool LAZY> void beq_op(void);
+    template <bool LAZY, u8 OP> void bit_op(void);
+    template <bool LAZY> void bmi_op(void);
+    template <bool LAZY> void bne_op(void);
+    template <bool LAZY> void bpl_op(void);
+    template <bool LAZY> void brk_op(void);
+    template <bool LAZY> void bvc_op(void);
+    template <bool LAZY> void bvs_op(void);
+    template <bool LAZY> void clc_op(void);
+    void cld_op(void);
+    void cli_op(void);
+    template <bool LAZY> void clv_op(void);
+    template <bool LAZY, u8 OP> void cmp_op(void);
+    template <bool LAZY, u8 OP> void cpx_op(void);
+    template <bool LAZY, u8 OP> void cpy_op(void);
+    template <bool LAZY, u8 OP> void dec_op(void);
+    template <bool LAZY> void dex_op(void);
+    template <bool LAZY> void dey_op(void);
+    template <bool LAZY, u8 OP> void eor_op(void);
+    template <bool LAZY, u8 OP> void inc_op(void);
+    template <bool LAZY> void inx_op(void);
+    template <bool LAZY> void iny_op(void);
+    template <u8 OP> void jmp_op(void);
+    template <u8 OP> void jsr_op(void);
+    template <bool LAZY, u8 OP> void lda_op(void);
+    template <bool LAZY, u8 OP> void ldx_op(void);
+    template <bool LAZY, u8 OP> void ldy_op(void);
+    template <bool LAZY, u8 OP> void lsr_op(void);
+    void nop_op(void);
+    template <bool LAZY, u8 OP> void ora_op(void);
+    void pha_op(void);
+    template <bool LAZY> void php_op(void);
+    template <bool LAZY> void pla_op(void);
+    template <bool LAZY> void plp_op(void);
+    template <bool LAZY, u8 OP> void rol_op(void);
+    template <bool LAZY, u8 OP> void ror_op(void);
+    template <bool LAZY> void rti_op(void);
+    void rts_op(void);
+    template <bool LAZY, u8 OP> void sbc_op(void);
+    template <bool LAZY> void sec_op(void);
+    void sed_op(void);
+    void sei_op(void);
+    template <u8 OP> void sta_op(void);
+    template <u8 OP> void stx_op(void);
+    template <u8 OP> void sty_op(void);
+    template <bool LAZY> void tax_op(void);
+    template <bool LAZY> void tay_op(void);
+    template <bool LAZY> void tsx_op(void);
+    template <bool LAZY> void txa_op(void);
+    void txs_op(void);
+    template <bool LAZY> void tya_op(void);
+    void illegal_op(void);
+};
 
 #endif
@@ -2,6 +2,7 @@
 #define DEBUGGER_H
 
 #include "utils.h"
+#include "cpu.h"
 #include <vector>
 #include <string>
 
@@ -13,23 +14,18 @@ class Debugger
         RUN,
         QUIT,
     };
+    Cpu                 &cpu;
     std::vector<u8>     instructions;
     std::vector<u16>    break_points;
-    static std::string  lookup[0xff];
-    static bool         initialized;
 
 
 public:
-    Debugger(void) {} 
-    Debugger(const std::vector<u8> &inst) : instructions(inst) {}
+    Debugger(Cpu &c) : cpu(c) {}
+    Debugger(Cpu &c, const std::vector<u8> &inst) : cpu(c), instructions(inst) {}
     ~Debugger(void) {}
 
     void do_command(u32 command);
 private:
-    /**
-     * Initializes the instruction lookup table.
-     */
-    static void init_lookup(void);
     /**
      * Dissasembles the given instruction.
      *
@@ -0,0 +1,365 @@
+#include <string.h>
+#include <cmath>
+
+#include "frame_converter.h"
+#include "ppu.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define FRAME_CONVERTER_X86
+#include <immintrin.h>
+#endif
+
+// the 2C02's colours as RGB
+static const u32 NES_PALETTE[64] = {
+    0x7c7c7c, 0x0000fc, 0x0000bc, 0x4428bc, 0x940084, 0xa80020, 0xa81000,
+    0x881400, 0x503000, 0x007800, 0x006800, 0x005800, 0x004058, 0x000000,
+    0x000000, 0x000000,
+    0xbcbcbc, 0x0078f8, 0x0058f8, 0x6844fc, 0xd800cc, 0xe40058, 0xf83800,
+    0xe45c10, 0xac7c00, 0x00b800, 0x00a800, 0x00a844, 0x008888, 0x000000,
+    0x000000, 0x000000,
+    0xf8f8f8, 0x3cbcfc, 0x6888fc, 0x9878f8, 0xf878f8, 0xf85898, 0xf87858,
+    0xfca044, 0xf8b800, 0xb8f818, 0x58d854, 0x58f898, 0x00e8d8, 0x787878,
+    0x000000, 0x000000,
+    0xfcfcfc, 0xa4e4fc, 0xb8b8f8, 0xd8b8f8, 0xf8b8f8, 0xf8a4c0, 0xf0d0b0,
+    0xfce0a8, 0xf8d878, 0xd8f878, 0xb8f8b8, 0xb8f8d8, 0x00fcfc, 0xf8d8f8,
+    0x000000, 0x000000,
+};
+
+// how much an emphasis bit dims the two colours it doesn't emphasize
+static const double EMPHASIS_ATTENUATION = 0.816328;
+
+template <u32 PLANES>
+static void lookup_scalar(const u8 *indices, u32 count, const u8 *tables,
+        u8 *out)
+{
+    for (u32 i = 0; i < count; i++, out += PLANES) {
+        u8 index = indices[i] & 63;
+        for (u32 plane = 0; plane < PLANES; plane++) {
+            out[plane] = tables[plane * 64 + index];
+        }
+    }
+}
+
+#ifdef FRAME_CONVERTER_X86
+
+/**
+ * @return: The bytes of a pixel that need looking up, the fourth byte of a
+ * 4 byte pixel is the alpha, which is always 0xff.
+ */
+static constexpr u32 lookups(u32 planes)
+{
+    return planes == 4 ? 3 : planes;
+}
+
+/**
+ * pshufb only looks up 16 entries, so each 64 entry table is 4 of them. An
+ * index is steered to its quarter by xoring the quarter's base away and
+ * adding 0x70 with saturation: inside the quarter that leaves bit 7 clear
+ * and the entry in the low nibble, outside it sets bit 7, which makes
+ * pshufb return 0, so the 4 lookups can be ored together.
+ */
+template <u32 PLANES>
+__attribute__((target("ssse3")))
+static void lookup_ssse3(const u8 *indices, u32 count, const u8 *tables,
+        u8 *out)
+{
+    const u32 LOOKUPS = lookups(PLANES);
+    __m128i table[PLANES][4];
+    for (u32 plane = 0; plane < LOOKUPS; plane++) {
+        for (u32 quarter = 0; quarter < 4; quarter++) {
+            table[plane][quarter] = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(
+                        tables + plane * 64 + quarter * 16));
+        }
+    }
+    const __m128i bias = _mm_set1_epi8(0x70);
+
+    u32 i = 0;
+    for (; i + 16 <= count; i += 16, out += 16 * PLANES) {
+        __m128i index = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(indices + i));
+        __m128i select[4];
+        for (u32 quarter = 0; quarter < 4; quarter++) {
+            select[quarter] = _mm_adds_epu8(_mm_xor_si128(index,
+                        _mm_set1_epi8(static_cast<char>(quarter * 16))), bias);
+        }
+        __m128i bytes[PLANES];
+        for (u32 plane = 0; plane < LOOKUPS; plane++) {
+            bytes[plane] = _mm_shuffle_epi8(table[plane][0], select[0]);
+            for (u32 quarter = 1; quarter < 4; quarter++) {
+                bytes[plane] = _mm_or_si128(bytes[plane],
+                        _mm_shuffle_epi8(table[plane][quarter],
+                            select[quarter]));
+            }
+        }
+
+        __m128i *dest = reinterpret_cast<__m128i *>(out);
+        if constexpr (PLANES == 1) {
+            _mm_storeu_si128(dest, bytes[0]);
+        } else if constexpr (PLANES == 2) {
+            _mm_storeu_si128(dest, _mm_unpacklo_epi8(bytes[0], bytes[1]));
+            _mm_storeu_si128(dest + 1, _mm_unpackhi_epi8(bytes[0], bytes[1]));
+        } else {
+            bytes[3] = _mm_set1_epi8(-1);
+            __m128i low[2] = {_mm_unpacklo_epi8(bytes[0], bytes[1]),
+                _mm_unpacklo_epi8(bytes[2], bytes[3])};
+            __m128i high[2] = {_mm_unpackhi_epi8(bytes[0], bytes[1]),
+                _mm_unpackhi_epi8(bytes[2], bytes[3])};
+            _mm_storeu_si128(dest, _mm_unpacklo_epi16(low[0], low[1]));
+            _mm_storeu_si128(dest + 1, _mm_unpackhi_epi16(low[0], low[1]));
+            _mm_storeu_si128(dest + 2, _mm_unpacklo_epi16(high[0], high[1]));
+            _mm_storeu_si128(dest + 3, _mm_unpackhi_epi16(high[0], high[1]));
+        }
+    }
+    lookup_scalar<PLANES>(indices + i, count - i, tables, out);
+}
+
+/**
+ * The same as lookup_ssse3(), 32 pixels at a time. The unpacks work on each
+ * 128 bit half on its own, so the halves are put back in order at the end.
+ */
+template <u32 PLANES>
+__attribute__((target("avx2")))
+static void lookup_avx2(const u8 *indices, u32 count, const u8 *tables,
+        u8 *out)
+{
+    const u32 LOOKUPS = lookups(PLANES);
+    __m256i table[PLANES][4];
+    for (u32 plane = 0; plane < LOOKUPS; plane++) {
+        for (u32 quarter = 0; quarter < 4; quarter++) {
+            table[plane][quarter] = _mm256_broadcastsi128_si256(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                            tables + plane * 64 + quarter * 16)));
+        }
+    }
+    const __m256i bias = _mm256_set1_epi8(0x70);
+
+    u32 i = 0;
+    for (; i + 32 <= count; i += 32, out += 32 * PLANES) {
+        __m256i index = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(indices + i));
+        __m256i select[4];
+        for (u32 quarter = 0; quarter < 4; quarter++) {
+            select[quarter] = _mm256_adds_epu8(_mm256_xor_si256(index,
+                        _mm256_set1_epi8(static_cast<char>(quarter * 16))),
+                    bias);
+        }
+        __m256i bytes[PLANES];
+        for (u32 plane = 0; plane < LOOKUPS; plane++) {
+            bytes[plane] = _mm256_shuffle_epi8(table[plane][0], select[0]);
+            for (u32 quarter = 1; quarter < 4; quarter++) {
+                bytes[plane] = _mm256_or_si256(bytes[plane],
+                        _mm256_shuffle_epi8(table[plane][quarter],
+                            select[quarter]));
+            }
+        }
+
+        __m256i *dest = reinterpret_cast<__m256i *>(out);
+        if constexpr (PLANES == 1) {
+            _mm256_storeu_si256(dest, bytes[0]);
+        } else if constexpr (PLANES == 2) {
+            __m256i low = _mm256_unpacklo_epi8(bytes[0], bytes[1]);
+            __m256i high = _mm256_unpackhi_epi8(bytes[0], bytes[1]);
+            _mm256_storeu_si256(dest, _mm256_permute2x128_si256(low, high,
+                        0x20));
+            _mm256_storeu_si256(dest + 1, _mm256_permute2x128_si256(low,
+                        high, 0x31));
+        } else {
+            bytes[3] = _mm256_set1_epi8(-1);
+            __m256i low[2] = {_mm256_unpacklo_epi8(bytes[0], bytes[1]),
+                _mm256_unpacklo_epi8(bytes[2], bytes[3])};
+            __m256i high[2] = {_mm256_unpackhi_epi8(bytes[0], bytes[1]),
+                _mm256_unpackhi_epi8(bytes[2], bytes[3])};
+            __m256i pixels[4] = {
+                _mm256_unpacklo_epi16(low[0], low[1]),
+                _mm256_unpackhi_epi16(low[0], low[1]),
+                _mm256_unpacklo_epi16(high[0], high[1]),
+                _mm256_unpackhi_epi16(high[0], high[1]),
+            };
+            _mm256_storeu_si256(dest, _mm256_permute2x128_si256(pixels[0],
+                        pixels[1], 0x20));
+            _mm256_storeu_si256(dest + 1, _mm256_permute2x128_si256(
+                        pixels[2], pixels[3], 0x20));
+            _mm256_storeu_si256(dest + 2, _mm256_permute2x128_si256(
+                        pixels[0], pixels[1], 0x31));
+            _mm256_storeu_si256(dest + 3, _mm256_permute2x128_si256(
+                        pixels[2], pixels[3], 0x31));
+        }
+    }
+    lookup_scalar<PLANES>(indices + i, count - i, tables, out);
+}
+
+#endif
+
+u32 pixel_size(PixelFormat format)
+{
+    static const u32 sizes[PIXEL_FORMAT_COUNT] = {4, 2, 1, 1};
+    return sizes[format];
+}
+
+static const char *format_names[PIXEL_FORMAT_COUNT] = {
+    "rgba8", "rgb565", "gray8", "index",
+};
+
+const char *pixel_format_name(PixelFormat format)
+{
+    return format < PIXEL_FORMAT_COUNT ? format_names[format] : "unknown";
+}
+
+bool parse_pixel_format(const std::string &text, PixelFormat *format)
+{
+    for (u32 i = 0; i < PIXEL_FORMAT_COUNT; i++) {
+        if (text == format_names[i]) {
+            *format = static_cast<PixelFormat>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool converter_supported(ConverterKind kind)
+{
+    switch (kind) {
+    case CONVERTER_SCALAR:
+        return true;
+#ifdef FRAME_CONVERTER_X86
+    case CONVERTER_SSSE3:
+        return __builtin_cpu_supports("ssse3");
+    case CONVERTER_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+ConverterKind best_converter(void)
+{
+    if (converter_supported(CONVERTER_AVX2)) {
+        return CONVERTER_AVX2;
+    } else if (converter_supported(CONVERTER_SSSE3)) {
+        return CONVERTER_SSSE3;
+    }
+    return CONVERTER_SCALAR;
+}
+
+const char *converter_name(ConverterKind kind)
+{
+    static const char *names[CONVERTER_COUNT] = {"scalar", "ssse3", "avx2"};
+    return kind < CONVERTER_COUNT ? names[kind] : "unknown";
+}
+
+typedef void (*LookupKernel)(const u8 *indices, u32 count, const u8 *tables,
+        u8 *out);
+
+template <u32 PLANES>
+static LookupKernel pick_lookup(ConverterKind kind)
+{
+#ifdef FRAME_CONVERTER_X86
+    if (kind == CONVERTER_AVX2) {
+        return lookup_avx2<PLANES>;
+    } else if (kind == CONVERTER_SSSE3) {
+        return lookup_ssse3<PLANES>;
+    }
+#endif
+    (void) kind;
+    return lookup_scalar<PLANES>;
+}
+
+FrameConverter::FrameConverter(PixelFormat f, ConverterKind kind)
+{
+    format = f;
+    pixelSize = pixel_size(format);
+    if (!converter_supported(kind)) {
+        kind = CONVERTER_SCALAR;
+    }
+    switch (pixelSize) {
+    case 1:
+        lookup = pick_lookup<1>(kind);
+        break;
+    case 2:
+        lookup = pick_lookup<2>(kind);
+        break;
+    default:
+        lookup = pick_lookup<4>(kind);
+        break;
+    }
+
+    memset(tables, 0, sizeof(tables));
+    for (u32 emphasis = 0; emphasis < 8; emphasis++) {
+        // bit 0 emphasizes red, bit 1 green and bit 2 blue
+        double scale[3];
+        for (u32 channel = 0; channel < 3; channel++) {
+            scale[channel] = 1.0;
+            for (u32 bit = 0; bit < 3; bit++) {
+                if ((emphasis & (1 << bit)) && bit != channel) {
+                    scale[channel] *= EMPHASIS_ATTENUATION;
+                }
+            }
+        }
+
+        for (u32 colour = 0; colour < 64; colour++) {
+            u32 rgb = NES_PALETTE[colour];
+            u32 r = static_cast<u32>(std::lround(((rgb >> 16) & 0xff)
+                        * scale[0]));
+            u32 g = static_cast<u32>(std::lround(((rgb >> 8) & 0xff)
+                        * scale[1]));
+            u32 b = static_cast<u32>(std::lround((rgb & 0xff) * scale[2]));
+            u8 (&bytes)[4][64] = tables[emphasis];
+            switch (format) {
+            case PIXEL_RGBA8:
+                bytes[0][colour] = r;
+                bytes[1][colour] = g;
+                bytes[2][colour] = b;
+                bytes[3][colour] = 0xff;
+                break;
+            case PIXEL_RGB565: {
+                u16 pixel = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+                bytes[0][colour] = pixel & 0xff;
+                bytes[1][colour] = pixel >> 8;
+                break;
+            }
+            case PIXEL_GRAY8:
+                bytes[0][colour] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+                break;
+            default:
+                bytes[0][colour] = colour;
+                break;
+            }
+        }
+    }
+}
+
+PixelFormat FrameConverter::get_format(void) const
+{
+    return format;
+}
+
+u32 FrameConverter::get_pixel_size(void) const
+{
+    return pixelSize;
+}
+
+void FrameConverter::convert_line(const u8 *indices, u8 emphasis, u32 count,
+        u8 *out) const
+{
+    lookup(indices, count, &tables[emphasis & 7][0][0], out);
+}
+
+void FrameConverter::convert_frame(const Ppu &ppu, u8 *out, u32 pitch) const
+{
+    const u8 *frame = ppu.get_frame();
+    for (u32 line = 0; line < Ppu::HEIGHT; line++) {
+        convert_line(frame + line * Ppu::WIDTH, ppu.get_emphasis(line),
+                Ppu::WIDTH, out + line * pitch);
+    }
+}
+
+void FrameConverter::convert_frame(const u8 *frame, const u8 *emphasis,
+        u8 *out, u32 pitch) const
+{
+    for (u32 line = 0; line < Ppu::HEIGHT; line++) {
+        convert_line(frame + line * Ppu::WIDTH, emphasis[line], Ppu::WIDTH,
+                out + line * pitch);
+    }
+}
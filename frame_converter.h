@@ -0,0 +1,97 @@
+#ifndef FRAME_CONVERTER_H
+#define FRAME_CONVERTER_H
+
+#include "utils.h"
+#include <string>
+
+class Ppu;
+
+enum PixelFormat
+{
+    PIXEL_RGBA8,    // R, G, B, A bytes
+    PIXEL_RGB565,   // little endian 16 bit, red in the top bits
+    PIXEL_GRAY8,    // the luma of the colour
+    PIXEL_INDEX,    // the NES colour index, 0-63, without emphasis
+    PIXEL_FORMAT_COUNT,
+};
+
+enum ConverterKind
+{
+    CONVERTER_SCALAR,
+    CONVERTER_SSSE3,
+    CONVERTER_AVX2,
+    CONVERTER_COUNT,
+};
+
+u32 pixel_size(PixelFormat format);
+const char *pixel_format_name(PixelFormat format);
+
+/**
+ * @return: Whether the text named a format, e.g. "rgba8".
+ */
+bool parse_pixel_format(const std::string &text, PixelFormat *format);
+
+/**
+ * @return: Whether the host cpu can run the given kind of converter.
+ */
+bool converter_supported(ConverterKind kind);
+
+/**
+ * @return: The fastest kind of converter the host cpu can run.
+ */
+ConverterKind best_converter(void);
+
+const char *converter_name(ConverterKind kind);
+
+/**
+ * Turns the PPU's frames of NES colour indices into pixels of one format,
+ * picked when the converter is made. Every format is a table lookup per
+ * byte of the pixel, done 16 or 32 pixels at a time with pshufb, with a set
+ * of tables for each of the 8 combinations of the colour emphasis bits, so
+ * a line goes through the same code whatever its format or emphasis.
+ */
+class FrameConverter
+{
+public:
+    FrameConverter(PixelFormat format, ConverterKind kind = best_converter());
+    ~FrameConverter(void) {}
+
+    PixelFormat get_format(void) const;
+    u32 get_pixel_size(void) const;
+
+    /**
+     * Converts a run of colour indices, 0-63.
+     *
+     * @param emphasis: The emphasis bits, see Ppu::get_emphasis().
+     * @param out: Where the count pixels go.
+     */
+    void convert_line(const u8 *indices, u8 emphasis, u32 count, u8 *out)
+        const;
+
+    /**
+     * Converts the PPU's last frame.
+     *
+     * @param pitch: The bytes from one line of out to the next.
+     */
+    void convert_frame(const Ppu &ppu, u8 *out, u32 pitch) const;
+
+    /**
+     * Converts a frame kept apart from its PPU, e.g. a RenderThread::Frame.
+     *
+     * @param frame: Ppu::WIDTH x Ppu::HEIGHT colour indices.
+     * @param emphasis: The emphasis bits of each line.
+     */
+    void convert_frame(const u8 *frame, const u8 *emphasis, u8 *out,
+            u32 pitch) const;
+
+private:
+    typedef void (*Lookup)(const u8 *indices, u32 count, const u8 *tables,
+            u8 *out);
+
+    PixelFormat format;
+    u32 pixelSize;
+    Lookup lookup;
+    u8 tables[8][4][64];    // by emphasis, byte of the pixel and colour
+};
+
+#endif
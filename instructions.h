@@ -4,13 +4,37 @@
 #include "utils.h"
 
 enum ADDRESS_MODES : u8{
+    IMPLIED,
+    ACCUMULATOR,
     IMMEDIATE,
     ZERO_PAGE,
     ZERO_PAGE_X,
+    ZERO_PAGE_Y,
+    RELATIVE,
     ABSOLUTE,
+    ABSOLUTE_X,
     ABSOLUTE_Y,
+    INDIRECT,
     INDEXED_INDIRECT, // (Indirect, X)
     INDIRECT_INDEXED, // (Indirect), Y
+    ADDRESS_MODE_COUNT,
+};
+
+/**
+ * The instruction an opcode performs, independent of its addressing mode.
+ * Unofficial opcodes all map to INST_ILLEGAL.
+ */
+enum INSTRUCTIONS : u8 {
+    INST_ADC, INST_AND, INST_ASL, INST_BCC, INST_BCS, INST_BEQ, INST_BIT,
+    INST_BMI, INST_BNE, INST_BPL, INST_BRK, INST_BVC, INST_BVS, INST_CLC,
+    INST_CLD, INST_CLI, INST_CLV, INST_CMP, INST_CPX, INST_CPY, INST_DEC,
+    INST_DEX, INST_DEY, INST_EOR, INST_INC, INST_INX, INST_INY, INST_JMP,
+    INST_JSR, INST_LDA, INST_LDX, INST_LDY, INST_LSR, INST_NOP, INST_ORA,
+    INST_PHA, INST_PHP, INST_PLA, INST_PLP, INST_ROL, INST_ROR, INST_RTI,
+    INST_RTS, INST_SBC, INST_SEC, INST_SED, INST_SEI, INST_STA, INST_STX,
+    INST_STY, INST_TAX, INST_TAY, INST_TSX, INST_TXA, INST_TXS, INST_TYA,
+    INST_ILLEGAL,
+    INSTRUCTION_COUNT,
 };
 
 struct OpCode {
@@ -19,6 +43,273 @@ struct OpCode {
     u8 bytes;
     u8 address_mode;
     u8 cycle_count;
+    u8 page_penalty; // extra cycle taken when indexing crosses a page
+    u8 instruction;
+};
+
+/**
+ * The table of all 256 opcodes, indexed by the opcode byte. This is the only
+ * place opcode metadata lives; the cpu dispatch table and the debugger are
+ * both built from it. It is constexpr so the cpu can specialize each opcode's
+ * handler on its addressing mode at compile time.
+ */
+inline constexpr OpCode opcodes[0x100] = {
+    { "BRK", 0x0, 1, IMPLIED, 7, 0, INST_BRK },
+    { "ORA", 0x1, 2, INDEXED_INDIRECT, 6, 0, INST_ORA },
+    { "???", 0x2, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x3, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x4, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "ORA", 0x5, 2, ZERO_PAGE, 3, 0, INST_ORA },
+    { "ASL", 0x6, 2, ZERO_PAGE, 5, 0, INST_ASL },
+    { "???", 0x7, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "PHP", 0x8, 1, IMPLIED, 3, 0, INST_PHP },
+    { "ORA", 0x9, 2, IMMEDIATE, 2, 0, INST_ORA },
+    { "ASL", 0xA, 1, ACCUMULATOR, 2, 0, INST_ASL },
+    { "???", 0xB, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xC, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "ORA", 0xD, 3, ABSOLUTE, 4, 0, INST_ORA },
+    { "ASL", 0xE, 3, ABSOLUTE, 6, 0, INST_ASL },
+    { "???", 0xF, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "BPL", 0x10, 2, RELATIVE, 2, 0, INST_BPL },
+    { "ORA", 0x11, 2, INDIRECT_INDEXED, 5, 1, INST_ORA },
+    { "???", 0x12, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x13, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x14, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "ORA", 0x15, 2, ZERO_PAGE_X, 4, 0, INST_ORA },
+    { "ASL", 0x16, 2, ZERO_PAGE_X, 6, 0, INST_ASL },
+    { "???", 0x17, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CLC", 0x18, 1, IMPLIED, 2, 0, INST_CLC },
+    { "ORA", 0x19, 3, ABSOLUTE_Y, 4, 1, INST_ORA },
+    { "???", 0x1A, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x1B, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x1C, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "ORA", 0x1D, 3, ABSOLUTE_X, 4, 1, INST_ORA },
+    { "ASL", 0x1E, 3, ABSOLUTE_X, 7, 0, INST_ASL },
+    { "???", 0x1F, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "JSR", 0x20, 3, ABSOLUTE, 6, 0, INST_JSR },
+    { "AND", 0x21, 2, INDEXED_INDIRECT, 6, 0, INST_AND },
+    { "???", 0x22, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x23, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "BIT", 0x24, 2, ZERO_PAGE, 3, 0, INST_BIT },
+    { "AND", 0x25, 2, ZERO_PAGE, 3, 0, INST_AND },
+    { "ROL", 0x26, 2, ZERO_PAGE, 5, 0, INST_ROL },
+    { "???", 0x27, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "PLP", 0x28, 1, IMPLIED, 4, 0, INST_PLP },
+    { "AND", 0x29, 2, IMMEDIATE, 2, 0, INST_AND },
+    { "ROL", 0x2A, 1, ACCUMULATOR, 2, 0, INST_ROL },
+    { "???", 0x2B, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "BIT", 0x2C, 3, ABSOLUTE, 4, 0, INST_BIT },
+    { "AND", 0x2D, 3, ABSOLUTE, 4, 0, INST_AND },
+    { "ROL", 0x2E, 3, ABSOLUTE, 6, 0, INST_ROL },
+    { "???", 0x2F, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "BMI", 0x30, 2, RELATIVE, 2, 0, INST_BMI },
+    { "AND", 0x31, 2, INDIRECT_INDEXED, 5, 1, INST_AND },
+    { "???", 0x32, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x33, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x34, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "AND", 0x35, 2, ZERO_PAGE_X, 4, 0, INST_AND },
+    { "ROL", 0x36, 2, ZERO_PAGE_X, 6, 0, INST_ROL },
+    { "???", 0x37, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "SEC", 0x38, 1, IMPLIED, 2, 0, INST_SEC },
+    { "AND", 0x39, 3, ABSOLUTE_Y, 4, 1, INST_AND },
+    { "???", 0x3A, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x3B, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x3C, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "AND", 0x3D, 3, ABSOLUTE_X, 4, 1, INST_AND },
+    { "ROL", 0x3E, 3, ABSOLUTE_X, 7, 0, INST_ROL },
+    { "???", 0x3F, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "RTI", 0x40, 1, IMPLIED, 6, 0, INST_RTI },
+    { "EOR", 0x41, 2, INDEXED_INDIRECT, 6, 0, INST_EOR },
+    { "???", 0x42, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x43, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x44, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "EOR", 0x45, 2, ZERO_PAGE, 3, 0, INST_EOR },
+    { "LSR", 0x46, 2, ZERO_PAGE, 5, 0, INST_LSR },
+    { "???", 0x47, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "PHA", 0x48, 1, IMPLIED, 3, 0, INST_PHA },
+    { "EOR", 0x49, 2, IMMEDIATE, 2, 0, INST_EOR },
+    { "LSR", 0x4A, 1, ACCUMULATOR, 2, 0, INST_LSR },
+    { "???", 0x4B, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "JMP", 0x4C, 3, ABSOLUTE, 3, 0, INST_JMP },
+    { "EOR", 0x4D, 3, ABSOLUTE, 4, 0, INST_EOR },
+    { "LSR", 0x4E, 3, ABSOLUTE, 6, 0, INST_LSR },
+    { "???", 0x4F, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "BVC", 0x50, 2, RELATIVE, 2, 0, INST_BVC },
+    { "EOR", 0x51, 2, INDIRECT_INDEXED, 5, 1, INST_EOR },
+    { "???", 0x52, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x53, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x54, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "EOR", 0x55, 2, ZERO_PAGE_X, 4, 0, INST_EOR },
+    { "LSR", 0x56, 2, ZERO_PAGE_X, 6, 0, INST_LSR },
+    { "???", 0x57, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CLI", 0x58, 1, IMPLIED, 2, 0, INST_CLI },
+    { "EOR", 0x59, 3, ABSOLUTE_Y, 4, 1, INST_EOR },
+    { "???", 0x5A, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x5B, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x5C, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "EOR", 0x5D, 3, ABSOLUTE_X, 4, 1, INST_EOR },
+    { "LSR", 0x5E, 3, ABSOLUTE_X, 7, 0, INST_LSR },
+    { "???", 0x5F, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "RTS", 0x60, 1, IMPLIED, 6, 0, INST_RTS },
+    { "ADC", 0x61, 2, INDEXED_INDIRECT, 6, 0, INST_ADC },
+    { "???", 0x62, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x63, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x64, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "ADC", 0x65, 2, ZERO_PAGE, 3, 0, INST_ADC },
+    { "ROR", 0x66, 2, ZERO_PAGE, 5, 0, INST_ROR },
+    { "???", 0x67, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "PLA", 0x68, 1, IMPLIED, 4, 0, INST_PLA },
+    { "ADC", 0x69, 2, IMMEDIATE, 2, 0, INST_ADC },
+    { "ROR", 0x6A, 1, ACCUMULATOR, 2, 0, INST_ROR },
+    { "???", 0x6B, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "JMP", 0x6C, 3, INDIRECT, 5, 0, INST_JMP },
+    { "ADC", 0x6D, 3, ABSOLUTE, 4, 0, INST_ADC },
+    { "ROR", 0x6E, 3, ABSOLUTE, 6, 0, INST_ROR },
+    { "???", 0x6F, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "BVS", 0x70, 2, RELATIVE, 2, 0, INST_BVS },
+    { "ADC", 0x71, 2, INDIRECT_INDEXED, 5, 1, INST_ADC },
+    { "???", 0x72, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x73, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x74, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "ADC", 0x75, 2, ZERO_PAGE_X, 4, 0, INST_ADC },
+    { "ROR", 0x76, 2, ZERO_PAGE_X, 6, 0, INST_ROR },
+    { "???", 0x77, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "SEI", 0x78, 1, IMPLIED, 2, 0, INST_SEI },
+    { "ADC", 0x79, 3, ABSOLUTE_Y, 4, 1, INST_ADC },
+    { "???", 0x7A, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x7B, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x7C, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "ADC", 0x7D, 3, ABSOLUTE_X, 4, 1, INST_ADC },
+    { "ROR", 0x7E, 3, ABSOLUTE_X, 7, 0, INST_ROR },
+    { "???", 0x7F, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x80, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "STA", 0x81, 2, INDEXED_INDIRECT, 6, 0, INST_STA },
+    { "???", 0x82, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x83, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "STY", 0x84, 2, ZERO_PAGE, 3, 0, INST_STY },
+    { "STA", 0x85, 2, ZERO_PAGE, 3, 0, INST_STA },
+    { "STX", 0x86, 2, ZERO_PAGE, 3, 0, INST_STX },
+    { "???", 0x87, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "DEY", 0x88, 1, IMPLIED, 2, 0, INST_DEY },
+    { "???", 0x89, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "TXA", 0x8A, 1, IMPLIED, 2, 0, INST_TXA },
+    { "???", 0x8B, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "STY", 0x8C, 3, ABSOLUTE, 4, 0, INST_STY },
+    { "STA", 0x8D, 3, ABSOLUTE, 4, 0, INST_STA },
+    { "STX", 0x8E, 3, ABSOLUTE, 4, 0, INST_STX },
+    { "???", 0x8F, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "BCC", 0x90, 2, RELATIVE, 2, 0, INST_BCC },
+    { "STA", 0x91, 2, INDIRECT_INDEXED, 6, 0, INST_STA },
+    { "???", 0x92, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x93, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "STY", 0x94, 2, ZERO_PAGE_X, 4, 0, INST_STY },
+    { "STA", 0x95, 2, ZERO_PAGE_X, 4, 0, INST_STA },
+    { "STX", 0x96, 2, ZERO_PAGE_Y, 4, 0, INST_STX },
+    { "???", 0x97, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "TYA", 0x98, 1, IMPLIED, 2, 0, INST_TYA },
+    { "STA", 0x99, 3, ABSOLUTE_Y, 5, 0, INST_STA },
+    { "TXS", 0x9A, 1, IMPLIED, 2, 0, INST_TXS },
+    { "???", 0x9B, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x9C, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "STA", 0x9D, 3, ABSOLUTE_X, 5, 0, INST_STA },
+    { "???", 0x9E, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0x9F, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "LDY", 0xA0, 2, IMMEDIATE, 2, 0, INST_LDY },
+    { "LDA", 0xA1, 2, INDEXED_INDIRECT, 6, 0, INST_LDA },
+    { "LDX", 0xA2, 2, IMMEDIATE, 2, 0, INST_LDX },
+    { "???", 0xA3, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "LDY", 0xA4, 2, ZERO_PAGE, 3, 0, INST_LDY },
+    { "LDA", 0xA5, 2, ZERO_PAGE, 3, 0, INST_LDA },
+    { "LDX", 0xA6, 2, ZERO_PAGE, 3, 0, INST_LDX },
+    { "???", 0xA7, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "TAY", 0xA8, 1, IMPLIED, 2, 0, INST_TAY },
+    { "LDA", 0xA9, 2, IMMEDIATE, 2, 0, INST_LDA },
+    { "TAX", 0xAA, 1, IMPLIED, 2, 0, INST_TAX },
+    { "???", 0xAB, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "LDY", 0xAC, 3, ABSOLUTE, 4, 0, INST_LDY },
+    { "LDA", 0xAD, 3, ABSOLUTE, 4, 0, INST_LDA },
+    { "LDX", 0xAE, 3, ABSOLUTE, 4, 0, INST_LDX },
+    { "???", 0xAF, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "BCS", 0xB0, 2, RELATIVE, 2, 0, INST_BCS },
+    { "LDA", 0xB1, 2, INDIRECT_INDEXED, 5, 1, INST_LDA },
+    { "???", 0xB2, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xB3, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "LDY", 0xB4, 2, ZERO_PAGE_X, 4, 0, INST_LDY },
+    { "LDA", 0xB5, 2, ZERO_PAGE_X, 4, 0, INST_LDA },
+    { "LDX", 0xB6, 2, ZERO_PAGE_Y, 4, 0, INST_LDX },
+    { "???", 0xB7, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CLV", 0xB8, 1, IMPLIED, 2, 0, INST_CLV },
+    { "LDA", 0xB9, 3, ABSOLUTE_Y, 4, 1, INST_LDA },
+    { "TSX", 0xBA, 1, IMPLIED, 2, 0, INST_TSX },
+    { "???", 0xBB, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "LDY", 0xBC, 3, ABSOLUTE_X, 4, 1, INST_LDY },
+    { "LDA", 0xBD, 3, ABSOLUTE_X, 4, 1, INST_LDA },
+    { "LDX", 0xBE, 3, ABSOLUTE_Y, 4, 1, INST_LDX },
+    { "???", 0xBF, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CPY", 0xC0, 2, IMMEDIATE, 2, 0, INST_CPY },
+    { "CMP", 0xC1, 2, INDEXED_INDIRECT, 6, 0, INST_CMP },
+    { "???", 0xC2, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xC3, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CPY", 0xC4, 2, ZERO_PAGE, 3, 0, INST_CPY },
+    { "CMP", 0xC5, 2, ZERO_PAGE, 3, 0, INST_CMP },
+    { "DEC", 0xC6, 2, ZERO_PAGE, 5, 0, INST_DEC },
+    { "???", 0xC7, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "INY", 0xC8, 1, IMPLIED, 2, 0, INST_INY },
+    { "CMP", 0xC9, 2, IMMEDIATE, 2, 0, INST_CMP },
+    { "DEX", 0xCA, 1, IMPLIED, 2, 0, INST_DEX },
+    { "???", 0xCB, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CPY", 0xCC, 3, ABSOLUTE, 4, 0, INST_CPY },
+    { "CMP", 0xCD, 3, ABSOLUTE, 4, 0, INST_CMP },
+    { "DEC", 0xCE, 3, ABSOLUTE, 6, 0, INST_DEC },
+    { "???", 0xCF, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "BNE", 0xD0, 2, RELATIVE, 2, 0, INST_BNE },
+    { "CMP", 0xD1, 2, INDIRECT_INDEXED, 5, 1, INST_CMP },
+    { "???", 0xD2, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xD3, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xD4, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CMP", 0xD5, 2, ZERO_PAGE_X, 4, 0, INST_CMP },
+    { "DEC", 0xD6, 2, ZERO_PAGE_X, 6, 0, INST_DEC },
+    { "???", 0xD7, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CLD", 0xD8, 1, IMPLIED, 2, 0, INST_CLD },
+    { "CMP", 0xD9, 3, ABSOLUTE_Y, 4, 1, INST_CMP },
+    { "???", 0xDA, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xDB, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xDC, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CMP", 0xDD, 3, ABSOLUTE_X, 4, 1, INST_CMP },
+    { "DEC", 0xDE, 3, ABSOLUTE_X, 7, 0, INST_DEC },
+    { "???", 0xDF, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CPX", 0xE0, 2, IMMEDIATE, 2, 0, INST_CPX },
+    { "SBC", 0xE1, 2, INDEXED_INDIRECT, 6, 0, INST_SBC },
+    { "???", 0xE2, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xE3, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CPX", 0xE4, 2, ZERO_PAGE, 3, 0, INST_CPX },
+    { "SBC", 0xE5, 2, ZERO_PAGE, 3, 0, INST_SBC },
+    { "INC", 0xE6, 2, ZERO_PAGE, 5, 0, INST_INC },
+    { "???", 0xE7, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "INX", 0xE8, 1, IMPLIED, 2, 0, INST_INX },
+    { "SBC", 0xE9, 2, IMMEDIATE, 2, 0, INST_SBC },
+    { "NOP", 0xEA, 1, IMPLIED, 2, 0, INST_NOP },
+    { "???", 0xEB, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "CPX", 0xEC, 3, ABSOLUTE, 4, 0, INST_CPX },
+    { "SBC", 0xED, 3, ABSOLUTE, 4, 0, INST_SBC },
+    { "INC", 0xEE, 3, ABSOLUTE, 6, 0, INST_INC },
+    { "???", 0xEF, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "BEQ", 0xF0, 2, RELATIVE, 2, 0, INST_BEQ },
+    { "SBC", 0xF1, 2, INDIRECT_INDEXED, 5, 1, INST_SBC },
+    { "???", 0xF2, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xF3, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xF4, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "SBC", 0xF5, 2, ZERO_PAGE_X, 4, 0, INST_SBC },
+    { "INC", 0xF6, 2, ZERO_PAGE_X, 6, 0, INST_INC },
+    { "???", 0xF7, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "SED", 0xF8, 1, IMPLIED, 2, 0, INST_SED },
+    { "SBC", 0xF9, 3, ABSOLUTE_Y, 4, 1, INST_SBC },
+    { "???", 0xFA, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xFB, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "???", 0xFC, 1, IMPLIED, 2, 0, INST_ILLEGAL },
+    { "SBC", 0xFD, 3, ABSOLUTE_X, 4, 1, INST_SBC },
+    { "INC", 0xFE, 3, ABSOLUTE_X, 7, 0, INST_INC },
+    { "???", 0xFF, 1, IMPLIED, 2, 0, INST_ILLEGAL }
 };
 
 /**
@@ -0,0 +1,902 @@
+#include <string.h>
+#include <initializer_list>
+#include <vector>
+
+#include "jit.h"
+#include "cpu.h"
+#include "instructions.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X64 1
+#endif
+
+#ifdef JIT_X64
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace {
+
+enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11 };
+
+// condition codes, the low nibble of jcc and setcc
+enum Cond { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5 };
+
+// the /digit of the group 1 ALU instructions
+enum Alu { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6 };
+
+struct Mem
+{
+    int base;
+    int index;  // -1 for none
+    int scale;  // log2
+    s32 disp;
+};
+
+/**
+ * Just enough of an x86-64 assembler for the code the JIT emits. Memory
+ * operands always use a 32 bit displacement.
+ */
+class Emitter
+{
+public:
+    std::vector<u8> code;
+
+    void byte(u8 b)
+    {
+        code.push_back(b);
+    }
+
+    void word(u16 w)
+    {
+        byte(static_cast<u8>(w));
+        byte(static_cast<u8>(w >> 8));
+    }
+
+    void dword(u32 d)
+    {
+        word(static_cast<u16>(d));
+        word(static_cast<u16>(d >> 16));
+    }
+
+    u32 size(void) const
+    {
+        return code.size();
+    }
+
+    // movzx r32, byte [m]
+    void movzx(int dst, const Mem &m) { mem({0x0f, 0xb6}, dst, m, false, false); }
+    // movzx r32, r8
+    void movzx(int dst, int src) { rr({0x0f, 0xb6}, dst, src, false, true); }
+    // mov byte [m], r8
+    void store8(const Mem &m, int src) { mem({0x88}, src, m, false, true); }
+    void store8(const Mem &m, u8 imm) { mem({0xc6}, 0, m, false, false); byte(imm); }
+    // mov word [m], r16
+    void store16(const Mem &m, int src) { byte(0x66); mem({0x89}, src, m, false, false); }
+    void store16(const Mem &m, u16 imm) { byte(0x66); mem({0xc7}, 0, m, false, false); word(imm); }
+    // mov r64, [m]
+    void load64(int dst, const Mem &m) { mem({0x8b}, dst, m, true, false); }
+    // op byte [m], imm8
+    void alu8(Alu op, const Mem &m, u8 imm) { mem({0x80}, op, m, false, false); byte(imm); }
+    // op r32, r32
+    void alu(Alu op, int dst, int src) { rr({static_cast<u8>(op * 8 + 1)}, src, dst, false, false); }
+    // op r32, imm32
+    void alu(Alu op, int dst, u32 imm) { rr({0x81}, op, dst, false, false); dword(imm); }
+    void shl(int dst, u8 n) { rr({0xc1}, 4, dst, false, false); byte(n); }
+    void shr(int dst, u8 n) { rr({0xc1}, 5, dst, false, false); byte(n); }
+    void mov(int dst, int src) { rr({0x89}, src, dst, false, false); }
+    void mov(int dst, u32 imm) { rex(false, 0, -1, dst, false); byte(0xb8 + (dst & 7)); dword(imm); }
+    void test32(int r) { rr({0x85}, r, r, false, false); }
+    void test64(int r) { rr({0x85}, r, r, true, false); }
+    void setcc(Cond cc, int dst) { rr({0x0f, static_cast<u8>(0x90 + cc)}, 0, dst, false, true); }
+    // lea r32, [base + disp]
+    void lea(int dst, int base, s32 disp) { mem({0x8d}, dst, Mem{base, -1, 0, disp}, false, false); }
+    void push_rbx(void) { byte(0x53); }
+    void pop_rbx(void) { byte(0x5b); }
+    void ret(void) { byte(0xc3); }
+
+    // movabs rbx, imm64
+    void load_rbx(u64 imm)
+    {
+        byte(0x48);
+        byte(0xbb);
+        dword(static_cast<u32>(imm));
+        dword(static_cast<u32>(imm >> 32));
+    }
+
+    /**
+     * Emits a conditional jump to be patched later.
+     *
+     * @return: The position of the displacement.
+     */
+    u32 jcc(Cond cc)
+    {
+        byte(0x0f);
+        byte(0x80 + cc);
+        dword(0);
+        return size() - 4;
+    }
+
+    void patch(u32 at, u32 target)
+    {
+        u32 rel = target - (at + 4);
+        memcpy(&code[at], &rel, 4);
+    }
+
+private:
+    void rex(bool w, int reg, int index, int base, bool force)
+    {
+        u8 r = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) |
+            ((index >= 0 && (index & 8)) ? 2 : 0) | ((base & 8) ? 1 : 0);
+        if (r != 0x40 || force) {
+            byte(r);
+        }
+    }
+
+    void mem(std::initializer_list<u8> opcode, int reg, const Mem &m, bool w,
+            bool byte_reg)
+    {
+        rex(w, reg, m.index, m.base, byte_reg && reg >= RSP && reg <= RDI);
+        for (u8 b : opcode) {
+            byte(b);
+        }
+        if (m.index >= 0 || (m.base & 7) == RSP) {
+            byte(0x84 | ((reg & 7) << 3));
+            int index = m.index >= 0 ? m.index : RSP;
+            byte((m.scale << 6) | ((index & 7) << 3) | (m.base & 7));
+        } else {
+            byte(0x80 | ((reg & 7) << 3) | (m.base & 7));
+        }
+        dword(static_cast<u32>(m.disp));
+    }
+
+    void rr(std::initializer_list<u8> opcode, int reg, int rm, bool w,
+            bool byte_rm)
+    {
+        rex(w, reg, -1, rm, byte_rm && rm >= RSP && rm <= RDI);
+        for (u8 b : opcode) {
+            byte(b);
+        }
+        byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+};
+
+/**
+ * Whether the JIT handles an instruction. The ones left out are rare enough
+ * that the interpreter can have them: BRK, RTI, PHP, PLP and JMP ($nnnn).
+ */
+bool is_supported(const OpCode &info)
+{
+    switch (info.instruction) {
+    case INST_BRK:
+    case INST_RTI:
+    case INST_PHP:
+    case INST_PLP:
+        return false;
+    case INST_JMP:
+        return info.address_mode == ABSOLUTE;
+    default:
+        return true;
+    }
+}
+
+/**
+ * Turns one block into native code.
+ *
+ * Register use: rbx points at the Cpu, edx holds effective addresses, eax
+ * the value being worked on, rcx and r11 page pointers, r8 the offset into
+ * a page, r9d the penalty cycles of the instructions done so far and r10d
+ * the penalty of the current instruction, added once it can't bail out.
+ */
+class Compiler
+{
+public:
+    Compiler(const Block &b, const void *cpu, const s32 *o) :
+        block(b), base(cpu), offsets(o)
+    {
+    }
+
+    Emitter e;
+
+    void compile(u32 count, u32 *max_cycles);
+
+private:
+    struct Bailout
+    {
+        u32 at;
+        u32 index;
+    };
+
+    const Block &block;
+    const void *base;
+    const s32 *offsets;
+    std::vector<Bailout> bailouts;
+    u32 index;      // the instruction being compiled
+    u16 address;    // and its address
+    u32 cycles;     // base cycles of the instructions before it
+
+    enum Field { A, X, Y, SP, STATUS, PC, N, Z, C, VA, VB, VR, READ, WRITE };
+
+    Mem field(Field f, s32 extra = 0) const
+    {
+        return Mem{RBX, -1, 0, offsets[f] + extra};
+    }
+
+    void bail_if(Cond cc)
+    {
+        bailouts.push_back(Bailout{e.jcc(cc), index});
+    }
+
+    void set_nz(int reg)
+    {
+        e.store8(field(N), reg);
+        e.store8(field(Z), reg);
+    }
+
+    void exit(u16 pc, u32 cycle_count, u32 resume);
+    void page_pointer(int dst, Field table, int page);
+    void read(int page);
+    void effective_address(const OpCode &info, u16 operand, int *page);
+    void read_operand(const OpCode &info, u16 operand);
+    void instruction(const OpCode &info, u16 operand, u16 next);
+};
+
+/**
+ * Stores pc and returns the cycles spent so far.
+ *
+ * @param resume: One more than the instruction to resume the interpreter
+ * at, 0 if the block ran to its end.
+ */
+void Compiler::exit(u16 pc, u32 cycle_count, u32 resume)
+{
+    e.store16(field(PC), pc);
+    e.lea(RAX, R9, cycle_count);
+    if (resume) {
+        e.alu(ALU_OR, RAX, resume << 16);
+    }
+    e.pop_rbx();
+    e.ret();
+}
+
+/**
+ * Loads the page pointer for the address in edx, or for a page known at
+ * compile time, and bails out if the page has no storage behind it.
+ */
+void Compiler::page_pointer(int dst, Field table, int page)
+{
+    if (page < 0) {
+        e.mov(dst, RDX);
+        e.shr(dst, 8);
+        e.load64(dst, Mem{RBX, dst, 3, offsets[table]});
+    } else {
+        e.load64(dst, field(table, page * 8));
+    }
+    e.test64(dst);
+    bail_if(CC_E);
+    e.movzx(R8, RDX);
+}
+
+/**
+ * Reads the byte at the address in edx into eax.
+ */
+void Compiler::read(int page)
+{
+    page_pointer(RCX, READ, page);
+    e.movzx(RAX, Mem{RCX, R8, 0, 0});
+}
+
+/**
+ * Works out the effective address into edx, and the page cross penalty
+ * into r10d for the indexed modes.
+ *
+ * @param page: Set to the page of the address if it is known at compile
+ * time, -1 otherwise.
+ */
+void Compiler::effective_address(const OpCode &info, u16 operand, int *page)
+{
+    *page = -1;
+    switch (info.address_mode) {
+    case ZERO_PAGE:
+        e.mov(RDX, static_cast<u32>(operand & 0xff));
+        *page = 0;
+        break;
+    case ZERO_PAGE_X:
+    case ZERO_PAGE_Y:
+        e.movzx(RDX, field(info.address_mode == ZERO_PAGE_X ? X : Y));
+        e.alu(ALU_ADD, RDX, static_cast<u32>(operand));
+        e.alu(ALU_AND, RDX, 0xffu);
+        *page = 0;
+        break;
+    case ABSOLUTE:
+        e.mov(RDX, static_cast<u32>(operand));
+        *page = operand >> 8;
+        break;
+    case ABSOLUTE_X:
+    case ABSOLUTE_Y:
+        e.movzx(RDX, field(info.address_mode == ABSOLUTE_X ? X : Y));
+        e.alu(ALU_ADD, RDX, static_cast<u32>(operand));
+        if (info.page_penalty) {
+            // the high byte changed iff bit 8 differs from the base address
+            e.mov(R10, RDX);
+            e.alu(ALU_XOR, R10, static_cast<u32>(operand));
+            e.shr(R10, 8);
+            e.alu(ALU_AND, R10, 1u);
+        }
+        e.alu(ALU_AND, RDX, 0xffffu);
+        break;
+    case INDEXED_INDIRECT:
+        e.movzx(RDX, field(X));
+        e.alu(ALU_ADD, RDX, static_cast<u32>(operand));
+        e.alu(ALU_AND, RDX, 0xffu);
+        read(0);
+        e.mov(R11, RAX);
+        e.alu(ALU_ADD, RDX, 1u);
+        e.alu(ALU_AND, RDX, 0xffu);
+        read(0);
+        e.shl(RAX, 8);
+        e.alu(ALU_OR, RAX, R11);
+        e.mov(RDX, RAX);
+        break;
+    case INDIRECT_INDEXED:
+        e.mov(RDX, static_cast<u32>(operand & 0xff));
+        read(0);
+        e.mov(R11, RAX);
+        e.mov(RDX, static_cast<u32>((operand + 1) & 0xff));
+        read(0);
+        e.shl(RAX, 8);
+        e.alu(ALU_OR, RAX, R11);
+        e.movzx(RDX, field(Y));
+        e.alu(ALU_ADD, RDX, RAX);
+        if (info.page_penalty) {
+            e.mov(R10, RDX);
+            e.alu(ALU_XOR, R10, RAX);
+            e.shr(R10, 8);
+            e.alu(ALU_AND, R10, 1u);
+        }
+        e.alu(ALU_AND, RDX, 0xffffu);
+        break;
+    }
+}
+
+/**
+ * Puts the value the instruction works on into eax.
+ */
+void Compiler::read_operand(const OpCode &info, u16 operand)
+{
+    if (info.address_mode == IMMEDIATE) {
+        e.mov(RAX, static_cast<u32>(operand & 0xff));
+        return;
+    }
+    int page;
+    effective_address(info, operand, &page);
+    read(page);
+    if (info.page_penalty) {
+        e.alu(ALU_ADD, R9, R10);
+    }
+}
+
+void Compiler::instruction(const OpCode &info, u16 operand, u16 next)
+{
+    int page;
+
+    switch (info.instruction) {
+    case INST_LDA:
+    case INST_LDX:
+    case INST_LDY:
+        read_operand(info, operand);
+        e.store8(field(info.instruction == INST_LDA ? A :
+                    info.instruction == INST_LDX ? X : Y), RAX);
+        set_nz(RAX);
+        break;
+
+    case INST_STA:
+    case INST_STX:
+    case INST_STY:
+        effective_address(info, operand, &page);
+        page_pointer(RCX, WRITE, page);
+        e.movzx(RAX, field(info.instruction == INST_STA ? A :
+                    info.instruction == INST_STX ? X : Y));
+        e.store8(Mem{RCX, R8, 0, 0}, RAX);
+        break;
+
+    case INST_TAX:
+    case INST_TAY:
+    case INST_TXA:
+    case INST_TYA:
+    case INST_TSX:
+    case INST_TXS: {
+        Field from = info.instruction == INST_TAX || info.instruction == INST_TAY ? A :
+            info.instruction == INST_TXA || info.instruction == INST_TXS ? X :
+            info.instruction == INST_TYA ? Y : SP;
+        Field to = info.instruction == INST_TXA || info.instruction == INST_TYA ? A :
+            info.instruction == INST_TAX || info.instruction == INST_TSX ? X :
+            info.instruction == INST_TAY ? Y : SP;
+        e.movzx(RAX, field(from));
+        e.store8(field(to), RAX);
+        if (info.instruction != INST_TXS) {
+            set_nz(RAX);
+        }
+        break;
+    }
+
+    case INST_INX:
+    case INST_INY:
+    case INST_DEX:
+    case INST_DEY: {
+        Field reg = info.instruction == INST_INX || info.instruction == INST_DEX ? X : Y;
+        e.movzx(RAX, field(reg));
+        e.alu(info.instruction == INST_INX || info.instruction == INST_INY ?
+                ALU_ADD : ALU_SUB, RAX, 1u);
+        e.store8(field(reg), RAX);
+        set_nz(RAX);
+        break;
+    }
+
+    case INST_AND:
+    case INST_ORA:
+    case INST_EOR:
+        read_operand(info, operand);
+        e.movzx(RCX, field(A));
+        e.alu(info.instruction == INST_AND ? ALU_AND :
+                info.instruction == INST_ORA ? ALU_OR : ALU_XOR, RCX, RAX);
+        e.store8(field(A), RCX);
+        set_nz(RCX);
+        break;
+
+    case INST_ADC:
+    case INST_SBC:
+        read_operand(info, operand);
+        if (info.instruction == INST_SBC) {
+            e.alu(ALU_XOR, RAX, 0xffu);
+        }
+        e.movzx(RCX, field(A));
+        e.store8(field(VA), RCX);
+        e.store8(field(VB), RAX);
+        e.movzx(RDX, field(C));
+        e.alu(ALU_ADD, RCX, RAX);
+        e.alu(ALU_ADD, RCX, RDX);
+        e.store8(field(VR), RCX);
+        e.store8(field(A), RCX);
+        set_nz(RCX);
+        e.shr(RCX, 8);
+        e.store8(field(C), RCX);
+        break;
+
+    case INST_CMP:
+    case INST_CPX:
+    case INST_CPY:
+        read_operand(info, operand);
+        e.movzx(RCX, field(info.instruction == INST_CMP ? A :
+                    info.instruction == INST_CPX ? X : Y));
+        e.alu(ALU_SUB, RCX, RAX);
+        e.setcc(CC_AE, RDX);
+        e.store8(field(C), RDX);
+        set_nz(RCX);
+        break;
+
+    case INST_BIT:
+        read_operand(info, operand);
+        e.movzx(RCX, field(A));
+        e.alu(ALU_AND, RCX, RAX);
+        e.store8(field(Z), RCX);
+        e.store8(field(N), RAX);
+        e.mov(RDX, RAX);
+        e.shl(RDX, 1);
+        e.alu(ALU_AND, RDX, 0x80u);
+        e.store8(field(VA), static_cast<u8>(0));
+        e.store8(field(VB), static_cast<u8>(0));
+        e.store8(field(VR), RDX);
+        break;
+
+    case INST_ASL:
+    case INST_LSR:
+    case INST_ROL:
+    case INST_ROR:
+    case INST_INC:
+    case INST_DEC:
+        if (info.address_mode == ACCUMULATOR) {
+            e.movzx(RAX, field(A));
+        } else {
+            // both pointers are checked before anything changes
+            effective_address(info, operand, &page);
+            page_pointer(R11, WRITE, page);
+            read(page);
+        }
+        switch (info.instruction) {
+        case INST_ASL:
+            e.mov(RCX, RAX);
+            e.shr(RCX, 7);
+            e.store8(field(C), RCX);
+            e.shl(RAX, 1);
+            break;
+        case INST_LSR:
+            e.mov(RCX, RAX);
+            e.alu(ALU_AND, RCX, 1u);
+            e.store8(field(C), RCX);
+            e.shr(RAX, 1);
+            break;
+        case INST_ROL:
+            e.movzx(RDX, field(C));
+            e.mov(RCX, RAX);
+            e.shr(RCX, 7);
+            e.store8(field(C), RCX);
+            e.shl(RAX, 1);
+            e.alu(ALU_OR, RAX, RDX);
+            break;
+        case INST_ROR:
+            e.movzx(RDX, field(C));
+            e.mov(RCX, RAX);
+            e.alu(ALU_AND, RCX, 1u);
+            e.store8(field(C), RCX);
+            e.shr(RAX, 1);
+            e.shl(RDX, 7);
+            e.alu(ALU_OR, RAX, RDX);
+            break;
+        case INST_INC:
+            e.alu(ALU_ADD, RAX, 1u);
+            break;
+        case INST_DEC:
+            e.alu(ALU_SUB, RAX, 1u);
+            break;
+        }
+        if (info.address_mode == ACCUMULATOR) {
+            e.store8(field(A), RAX);
+        } else {
+            e.store8(Mem{R11, R8, 0, 0}, RAX);
+        }
+        set_nz(RAX);
+        break;
+
+    case INST_PHA:
+        e.movzx(RDX, field(SP));
+        page_pointer(RCX, WRITE, 1);
+        e.movzx(RAX, field(A));
+        e.store8(Mem{RCX, R8, 0, 0}, RAX);
+        e.alu(ALU_SUB, RDX, 1u);
+        e.store8(field(SP), RDX);
+        break;
+
+    case INST_PLA:
+        e.movzx(RDX, field(SP));
+        e.alu(ALU_ADD, RDX, 1u);
+        e.alu(ALU_AND, RDX, 0xffu);
+        read(1);
+        e.store8(field(SP), RDX);
+        e.store8(field(A), RAX);
+        set_nz(RAX);
+        break;
+
+    case INST_CLC:
+    case INST_SEC:
+        e.store8(field(C), static_cast<u8>(info.instruction == INST_SEC));
+        break;
+
+    case INST_CLV:
+        e.store8(field(VA), static_cast<u8>(0));
+        e.store8(field(VB), static_cast<u8>(0));
+        e.store8(field(VR), static_cast<u8>(0));
+        break;
+
+    case INST_CLD:
+        e.alu8(ALU_AND, field(STATUS), static_cast<u8>(~Cpu::DECIMAL_MODE_FLAG));
+        break;
+    case INST_SED:
+        e.alu8(ALU_OR, field(STATUS), Cpu::DECIMAL_MODE_FLAG);
+        break;
+    case INST_CLI:
+        e.alu8(ALU_AND, field(STATUS), static_cast<u8>(~Cpu::INTERRUPT_DISSABLE_FLAG));
+        break;
+    case INST_SEI:
+        e.alu8(ALU_OR, field(STATUS), Cpu::INTERRUPT_DISSABLE_FLAG);
+        break;
+
+    case INST_JMP:
+        exit(operand, cycles + info.cycle_count, 0);
+        break;
+
+    case INST_JSR: {
+        u16 ret = next - 1;
+        e.movzx(RDX, field(SP));
+        page_pointer(RCX, WRITE, 1);
+        e.store8(Mem{RCX, R8, 0, 0}, static_cast<u8>(ret >> 8));
+        e.alu(ALU_SUB, RDX, 1u);
+        e.movzx(R8, RDX);
+        e.store8(Mem{RCX, R8, 0, 0}, static_cast<u8>(ret));
+        e.alu(ALU_SUB, RDX, 1u);
+        e.store8(field(SP), RDX);
+        exit(operand, cycles + info.cycle_count, 0);
+        break;
+    }
+
+    case INST_RTS:
+        e.movzx(RDX, field(SP));
+        e.alu(ALU_ADD, RDX, 1u);
+        e.alu(ALU_AND, RDX, 0xffu);
+        read(1);
+        e.mov(R11, RAX);
+        e.alu(ALU_ADD, RDX, 1u);
+        e.alu(ALU_AND, RDX, 0xffu);
+        e.movzx(R8, RDX);
+        e.movzx(RAX, Mem{RCX, R8, 0, 0});
+        e.store8(field(SP), RDX);
+        e.shl(RAX, 8);
+        e.alu(ALU_OR, RAX, R11);
+        e.alu(ALU_ADD, RAX, 1u);
+        e.store16(field(PC), RAX);
+        e.lea(RAX, R9, cycles + info.cycle_count);
+        e.pop_rbx();
+        e.ret();
+        break;
+
+    case INST_BCC:
+    case INST_BCS:
+    case INST_BEQ:
+    case INST_BNE:
+    case INST_BMI:
+    case INST_BPL:
+    case INST_BVC:
+    case INST_BVS: {
+        // the tests leave ZF clear iff the flag the branch looks at is set,
+        // except for the zero flag which is set when flagZ is zero
+        bool taken_on_nz;
+        switch (info.instruction) {
+        case INST_BCC:
+        case INST_BCS:
+            e.movzx(RAX, field(C));
+            e.test32(RAX);
+            taken_on_nz = info.instruction == INST_BCS;
+            break;
+        case INST_BEQ:
+        case INST_BNE:
+            e.movzx(RAX, field(Z));
+            e.test32(RAX);
+            taken_on_nz = info.instruction == INST_BNE;
+            break;
+        case INST_BMI:
+        case INST_BPL:
+            e.movzx(RAX, field(N));
+            e.alu(ALU_AND, RAX, 0x80u);
+            taken_on_nz = info.instruction == INST_BMI;
+            break;
+        default:
+            e.movzx(RAX, field(VA));
+            e.movzx(RCX, field(VB));
+            e.movzx(RDX, field(VR));
+            e.alu(ALU_XOR, RCX, RAX);
+            e.alu(ALU_XOR, RDX, RAX);
+            e.alu(ALU_XOR, RCX, 0xffffffffu);
+            e.alu(ALU_AND, RCX, RDX);
+            e.alu(ALU_AND, RCX, 0x80u);
+            taken_on_nz = info.instruction == INST_BVS;
+            break;
+        }
+        u32 skip = e.jcc(taken_on_nz ? CC_E : CC_NE);
+        u16 target = next + static_cast<s8>(operand);
+        u32 taken = cycles + info.cycle_count + 1 +
+            ((target & 0xff00) != (next & 0xff00));
+        exit(target, taken, 0);
+        e.patch(skip, e.size());
+        exit(next, cycles + info.cycle_count, 0);
+        break;
+    }
+
+    default:
+        // NOP and the unofficial opcodes
+        break;
+    }
+}
+
+/**
+ * Compiles the first count instructions of the block.
+ *
+ * @param max_cycles: Set to the most cycles the compiled code can take.
+ */
+void Compiler::compile(u32 count, u32 *max_cycles)
+{
+    e.push_rbx();
+    e.load_rbx(reinterpret_cast<u64>(base));
+    e.alu(ALU_XOR, R9, R9);
+
+    cycles = 0;
+    u32 penalties = 0;
+    address = block.start;
+    bool ended = false;
+    for (index = 0; index < count; index++) {
+        const DecodedInstruction &inst = block.instructions[index];
+        const OpCode &info = opcodes[inst.op];
+        u16 next = address + inst.length;
+        instruction(info, inst.operand, next);
+        penalties += info.page_penalty;
+        if (info.address_mode == RELATIVE) {
+            penalties += 2;
+        }
+        ended = info.address_mode == RELATIVE || info.instruction == INST_JMP ||
+            info.instruction == INST_JSR || info.instruction == INST_RTS;
+        cycles += info.cycle_count;
+        address = next;
+    }
+    *max_cycles = cycles + penalties;
+
+    if (!ended) {
+        // either the block falls through into the next one or the
+        // interpreter has to take over at an unsupported instruction
+        exit(address, cycles, count < block.count ? count + 1 : 0);
+    }
+
+    // bail outs leave before the instruction that needed the slow path
+    u32 bailout = 0;
+    while (bailout < bailouts.size()) {
+        u32 target = e.size();
+        u32 i = bailouts[bailout].index;
+        u16 pc = block.start;
+        u32 spent = 0;
+        for (u32 j = 0; j < i; j++) {
+            pc += block.instructions[j].length;
+            spent += block.instructions[j].cycles;
+        }
+        for (; bailout < bailouts.size() && bailouts[bailout].index == i;
+                bailout++) {
+            e.patch(bailouts[bailout].at, target);
+        }
+        exit(pc, spent, i + 1);
+    }
+}
+
+} // namespace
+
+Jit::Jit(Cpu &c) : cpu(c)
+{
+    const u8 *base = reinterpret_cast<const u8 *>(&cpu);
+    auto offset = [base](const void *member) {
+        return static_cast<s32>(reinterpret_cast<const u8 *>(member) - base);
+    };
+    offsets.A = offset(&cpu.A);
+    offsets.X = offset(&cpu.X);
+    offsets.Y = offset(&cpu.Y);
+    offsets.sp = offset(&cpu.sp);
+    offsets.status = offset(&cpu.status);
+    offsets.pc = offset(&cpu.pc);
+    offsets.flagN = offset(&cpu.flagN);
+    offsets.flagZ = offset(&cpu.flagZ);
+    offsets.flagC = offset(&cpu.flagC);
+    offsets.flagVa = offset(&cpu.flagVa);
+    offsets.flagVb = offset(&cpu.flagVb);
+    offsets.flagVr = offset(&cpu.flagVr);
+    offsets.readPages = offset(cpu.bus.get_read_pages());
+    offsets.writePages = offset(cpu.bus.get_write_pages());
+
+    buffer = NULL;
+    used = 0;
+    full = false;
+    memset(&stats, 0, sizeof(stats));
+}
+
+Jit::~Jit(void)
+{
+#ifdef JIT_X64
+    if (buffer) {
+#ifdef _WIN32
+        VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+        munmap(buffer, BUFFER_SIZE);
+#endif
+    }
+#endif
+}
+
+bool Jit::is_supported(void)
+{
+#ifdef JIT_X64
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef JIT_X64
+/**
+ * Switches the pages of the code buffer that [start, end) is on between
+ * writable and executable, never both, which hardened kernels refuse.
+ */
+static bool protect_code(u8 *buffer, u32 start, u32 end, bool writable)
+{
+    const u32 PAGE_SIZE = 0x1000;
+    u32 first = start & ~(PAGE_SIZE - 1);
+    u32 length = ((end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) - first;
+#ifdef _WIN32
+    DWORD old;
+    return VirtualProtect(buffer + first, length,
+            writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old);
+#else
+    return !mprotect(buffer + first, length,
+            writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+#endif
+}
+#endif
+
+bool Jit::compile(Block *block)
+{
+#ifdef JIT_X64
+    u32 count = 0;
+    while (count < block->count &&
+            ::is_supported(opcodes[block->instructions[count].op])) {
+        count++;
+    }
+    if (!count) {
+        return false;
+    }
+
+    if (!buffer) {
+#ifdef _WIN32
+        void *mem = VirtualAlloc(NULL, BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE,
+                PAGE_READWRITE);
+#else
+        void *mem = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            mem = NULL;
+        }
+#endif
+        if (!mem) {
+            full = true;
+            return false;
+        }
+        buffer = static_cast<u8 *>(mem);
+    }
+
+    // the offsets are in the same order as the compiler's fields
+    s32 fields[] = {
+        offsets.A, offsets.X, offsets.Y, offsets.sp, offsets.status,
+        offsets.pc, offsets.flagN, offsets.flagZ, offsets.flagC,
+        offsets.flagVa, offsets.flagVb, offsets.flagVr, offsets.readPages,
+        offsets.writePages,
+    };
+    Compiler compiler(*block, &cpu, fields);
+    u32 max_cycles;
+    compiler.compile(count, &max_cycles);
+
+    u32 size = compiler.e.size();
+    if (used + size > BUFFER_SIZE) {
+        full = true;
+        return false;
+    }
+    // a page can hold the end of the last block as well, which isn't run
+    // while this one is compiled
+    if (!protect_code(buffer, used, used + size, true)) {
+        full = true;
+        return false;
+    }
+    memcpy(buffer + used, compiler.e.code.data(), size);
+    if (!protect_code(buffer, used, used + size, false)) {
+        full = true;
+        return false;
+    }
+    block->native = reinterpret_cast<NativeCode>(buffer + used);
+    block->maxCycles = max_cycles;
+    used += (size + 15) & ~15u;
+    stats.blocksCompiled++;
+    return true;
+#else
+    (void)block;
+    return false;
+#endif
+}
+
+bool Jit::is_full(void) const
+{
+    return full;
+}
+
+void Jit::reset(void)
+{
+    used = 0;
+    full = false;
+}
+
+JitStats &Jit::get_stats(void)
+{
+    return stats;
+}
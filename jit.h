@@ -0,0 +1,82 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "utils.h"
+#include "block_cache.h"
+
+class Cpu;
+
+struct JitStats
+{
+    u64 blocksCompiled;
+    u64 nativeRuns;
+    u64 fallbacks;          // native runs that left the block for the interpreter
+    u64 verifiedRuns;
+    u64 verifyMismatches;
+    u16 lastMismatchPc;     // start of the last block that did not verify
+};
+
+/**
+ * Recompiles hot blocks from the block cache into x86-64 code.
+ *
+ * The native code works on the Cpu's registers in place, with the flags in
+ * their lazy form, so there is nothing to sync when going between native
+ * code and the interpreter. Memory accesses go through the bus' page
+ * tables. An access to a page without storage behind it, i.e. a memory
+ * mapped register, a mapper or RAM that holds cached code, leaves the block
+ * before the instruction and the interpreter carries on from there, so the
+ * device sees the same clock as it would without the JIT.
+ *
+ * A native block returns the cycles it took in the low 16 bits and, when it
+ * left early, one more than the index of the instruction the interpreter has
+ * to resume at in the high 16 bits.
+ */
+class Jit
+{
+public:
+    Jit(Cpu &c);
+    ~Jit(void);
+
+    /**
+     * @return: Whether the JIT can run on this host.
+     */
+    static bool is_supported(void);
+
+    /**
+     * Compiles a block, on success block->native is set.
+     *
+     * @return: false if the block starts with an instruction the JIT does
+     * not handle, or if the code buffer is full, see is_full().
+     */
+    bool compile(Block *block);
+
+    bool is_full(void) const;
+
+    /**
+     * Throws all code away. Every block pointing at it has to be dropped
+     * first.
+     */
+    void reset(void);
+
+    JitStats &get_stats(void);
+
+private:
+    // the fields the native code works on, as offsets from the Cpu
+    struct Offsets
+    {
+        s32 A, X, Y, sp, status, pc;
+        s32 flagN, flagZ, flagC, flagVa, flagVb, flagVr;
+        s32 readPages, writePages;
+    };
+
+    static const u32 BUFFER_SIZE = 4 << 20;
+
+    Cpu     &cpu;
+    Offsets offsets;
+    u8      *buffer;    // writable while a block is copied in, else executable
+    u32     used;
+    bool    full;
+    JitStats stats;
+};
+
+#endif
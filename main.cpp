@@ -1,27 +1,40 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <vector>
+#include "audio_sink.h"
+#include "batch.h"
 #include "cpu.h"
 #include "debugger.h"
 
 int main(int argc, char **argv)
 {
-	(void)argc;
-	(void)argv;
+    if (argc > 1 && !strcmp(argv[1], "--batch")) {
+        return run_batch(argc, argv);
+    }
+    if (argc == 3 && !strcmp(argv[1], "--repair-wav")) {
+        std::string error;
+        if (!repair_wav(argv[2], error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
     std::vector<u8> code;
     code = {
         0xa2, 0x08, 0xca, 0x8e, 0x00, 0x02, 0xe0, 
-        0x03, 0xd0, 0x02, 0x8e, 0x01, 0x02, 
+        0x03, 0xd0, 0xf8, 0x8e, 0x01, 0x02, 
 	};
-    Debugger debugger(code);
+    Cpu cpu;
+    Debugger debugger(cpu, code);
 
 	
-    Cpu::init();
+    cpu.init();
 
     
 
     //printf("%s\n", dissassemble_inst(0xa2).c_str());
 
-	Cpu::testCpu(code);
+	cpu.testCpu(code);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,397 @@
+#include <algorithm>
+
+#include "mapper.h"
+
+static const u32 PRG_RAM_SIZE = 0x2000;
+
+//-----------------------------------------------------------------------------
+// Mapper
+//-----------------------------------------------------------------------------
+
+std::unique_ptr<Mapper> Mapper::create(Cpu &cpu, Ppu &ppu, Cartridge &cart,
+        std::string &error)
+{
+    std::unique_ptr<Mapper> mapper;
+    switch (cart.get_header().mapper) {
+    case 0:
+        mapper.reset(new Nrom(cpu, ppu, cart));
+        break;
+    case 1:
+        mapper.reset(new Mmc1(cpu, ppu, cart));
+        break;
+    case 2:
+        mapper.reset(new Uxrom(cpu, ppu, cart));
+        break;
+    case 3:
+        mapper.reset(new Cnrom(cpu, ppu, cart));
+        break;
+    case 4:
+        mapper.reset(new Mmc3(cpu, ppu, cart));
+        break;
+    default:
+        error = "unsupported mapper "
+            + std::to_string(cart.get_header().mapper);
+        return NULL;
+    }
+    ppu.set_mirroring(cart.get_header().mirroring);
+    mapper->map_prg_ram(true, true);
+    mapper->reset();
+    mapper->bus.map_write_io(0x8000, 0x8000, mapper.get());
+    return mapper;
+}
+
+Mapper::Mapper(Cpu &c, Ppu &p, Cartridge &cart)
+    : cpu(c), bus(c.get_bus()), ppu(p), cart(cart)
+{
+}
+
+Mapper::~Mapper(void)
+{
+    bus.unmap(0x6000, 0xa000);
+    ppu.unmap_chr(0x0000, 0x2000);
+}
+
+bool Mapper::irq_pending(void)
+{
+    return false;
+}
+
+u8 Mapper::io_read(u16 address)
+{
+    return static_cast<u8>(address >> 8);
+}
+
+void Mapper::io_write(u16 address, u8 val)
+{
+    sync_ppu();
+    write_register(address, val);
+}
+
+u32 Mapper::prg_banks(u32 size) const
+{
+    return std::max(cart.get_prg_size() / size, 1u);
+}
+
+void Mapper::map_prg(u16 address, u32 size, u32 bank)
+{
+    const u8 *data = cart.get_prg_bank(bank, size);
+    u32 left = static_cast<u32>(cart.get_prg() + cart.get_prg_size() - data);
+    bus.map_rom(address, size, data, std::min(size, left));
+}
+
+void Mapper::map_chr(u16 address, u32 size, u32 bank)
+{
+    if (cart.get_chr()) {
+        const u8 *data = cart.get_chr_bank(bank, size);
+        u32 left = static_cast<u32>(cart.get_chr() + cart.get_chr_size()
+                - data);
+        ppu.map_chr_rom(address, size, data, std::min(size, left));
+    } else {
+        // CHR RAM is mapped whole, so the PPU's copies keep one version of
+        // it whichever banks are in
+        u32 ramSize = cart.get_chr_ram_size();
+        ppu.map_chr(address, size, cart.get_chr_ram(), ramSize, true,
+                static_cast<u32>(static_cast<u64>(bank) * size % ramSize));
+    }
+}
+
+void Mapper::map_prg_ram(bool enabled, bool writable)
+{
+    if (enabled && cart.get_prg_ram()) {
+        bus.map(0x6000, PRG_RAM_SIZE, cart.get_prg_ram(),
+                std::min(cart.get_prg_ram_size(), PRG_RAM_SIZE), writable);
+    } else {
+        bus.unmap(0x6000, PRG_RAM_SIZE);
+    }
+}
+
+void Mapper::set_mirroring(Ppu::Mirroring mirroring)
+{
+    if (cart.get_header().mirroring != Ppu::FOUR_SCREEN) {
+        ppu.set_mirroring(mirroring);
+    }
+}
+
+void Mapper::sync_ppu(void)
+{
+    ppu.catch_up(cpu.get_access_cycle());
+}
+
+//-----------------------------------------------------------------------------
+// NROM
+//-----------------------------------------------------------------------------
+
+void Nrom::reset(void)
+{
+    map_prg(0x8000, 0x8000, 0);
+    map_chr(0x0000, 0x2000, 0);
+}
+
+u16 Nrom::get_number(void) const
+{
+    return 0;
+}
+
+void Nrom::write_register(u16, u8)
+{
+}
+
+//-----------------------------------------------------------------------------
+// UxROM
+//-----------------------------------------------------------------------------
+
+void Uxrom::reset(void)
+{
+    map_prg(0x8000, 0x4000, 0);
+    map_prg(0xc000, 0x4000, prg_banks(0x4000) - 1);
+    map_chr(0x0000, 0x2000, 0);
+}
+
+u16 Uxrom::get_number(void) const
+{
+    return 2;
+}
+
+void Uxrom::write_register(u16 address, u8 val)
+{
+    if (cart.get_header().submapper == 2) {
+        val &= bus.read(address);
+    }
+    map_prg(0x8000, 0x4000, val);
+}
+
+//-----------------------------------------------------------------------------
+// CNROM
+//-----------------------------------------------------------------------------
+
+void Cnrom::reset(void)
+{
+    map_prg(0x8000, 0x8000, 0);
+    map_chr(0x0000, 0x2000, 0);
+}
+
+u16 Cnrom::get_number(void) const
+{
+    return 3;
+}
+
+void Cnrom::write_register(u16 address, u8 val)
+{
+    if (cart.get_header().submapper == 2) {
+        val &= bus.read(address);
+    }
+    map_chr(0x0000, 0x2000, val);
+}
+
+//-----------------------------------------------------------------------------
+// MMC1
+//-----------------------------------------------------------------------------
+
+void Mmc1::reset(void)
+{
+    shift = 0;
+    shiftCount = 0;
+    // the last PRG bank fixed at $C000, so the reset vector is there
+    control = 0x0c;
+    chrBanks[0] = 0;
+    chrBanks[1] = 0;
+    prgBank = 0;
+    update();
+}
+
+u16 Mmc1::get_number(void) const
+{
+    return 1;
+}
+
+void Mmc1::write_register(u16 address, u8 val)
+{
+    if (val & 0x80) {
+        shift = 0;
+        shiftCount = 0;
+        control |= 0x0c;
+        update();
+        return;
+    }
+    shift = (shift >> 1) | ((val & 0x01) << 4);
+    if (++shiftCount < 5) {
+        return;
+    }
+    // the fifth write picks the register by its address
+    switch ((address >> 13) & 0x03) {
+    case 0:
+        control = shift;
+        break;
+    case 1:
+        chrBanks[0] = shift;
+        break;
+    case 2:
+        chrBanks[1] = shift;
+        break;
+    case 3:
+        prgBank = shift;
+        break;
+    }
+    shift = 0;
+    shiftCount = 0;
+    update();
+}
+
+void Mmc1::update(void)
+{
+    static const Ppu::Mirroring mirrorings[] = {
+        Ppu::SINGLE_LOWER, Ppu::SINGLE_UPPER, Ppu::VERTICAL, Ppu::HORIZONTAL,
+    };
+    set_mirroring(mirrorings[control & 0x03]);
+
+    if (control & 0x10) {
+        map_chr(0x0000, 0x1000, chrBanks[0]);
+        map_chr(0x1000, 0x1000, chrBanks[1]);
+    } else {
+        map_chr(0x0000, 0x2000, chrBanks[0] >> 1);
+    }
+
+    u32 outer = cart.get_prg_size() > 0x40000 ? chrBanks[0] & 0x10 : 0;
+    u32 bank = outer | (prgBank & 0x0f);
+    switch ((control >> 2) & 0x03) {
+    case 0:
+    case 1:
+        map_prg(0x8000, 0x8000, bank >> 1);
+        break;
+    case 2:
+        map_prg(0x8000, 0x4000, outer);
+        map_prg(0xc000, 0x4000, bank);
+        break;
+    case 3:
+        map_prg(0x8000, 0x4000, bank);
+        map_prg(0xc000, 0x4000, outer | 0x0f);
+        break;
+    }
+    map_prg_ram(!(prgBank & 0x10), true);
+}
+
+//-----------------------------------------------------------------------------
+// MMC3
+//-----------------------------------------------------------------------------
+
+Mmc3::Mmc3(Cpu &c, Ppu &p, Cartridge &cart) : Mapper(c, p, cart)
+{
+    ppu.set_line_counter(this);
+}
+
+Mmc3::~Mmc3(void)
+{
+    ppu.set_line_counter(NULL);
+}
+
+void Mmc3::reset(void)
+{
+    bankSelect = 0;
+    // R0-R5 start on different banks, so the pattern tables aren't all one
+    // bank until the game sets them
+    static const u8 power_on[8] = {0, 2, 4, 5, 6, 7, 0, 1};
+    std::copy(power_on, power_on + 8, banks);
+    irqLatch = 0;
+    irqCounter = 0;
+    irqReload = false;
+    irqEnabled = false;
+    irq = false;
+    update_prg();
+    update_chr();
+}
+
+bool Mmc3::irq_pending(void)
+{
+    // polled between instructions, where there is no access cycle
+    ppu.catch_up(cpu.get_cycles());
+    return irq;
+}
+
+u16 Mmc3::get_number(void) const
+{
+    return 4;
+}
+
+void Mmc3::clock_line(void)
+{
+    if (!irqCounter || irqReload) {
+        irqCounter = irqLatch;
+        irqReload = false;
+    } else {
+        irqCounter--;
+    }
+    if (!irqCounter && irqEnabled) {
+        irq = true;
+    }
+}
+
+void Mmc3::write_register(u16 address, u8 val)
+{
+    bool odd = address & 0x01;
+    switch (address & 0xe000) {
+    case 0x8000:
+        if (!odd) {
+            // games write it before every bank, only a mode change remaps
+            u8 changed = bankSelect ^ val;
+            bankSelect = val;
+            if (changed & 0x40) {
+                update_prg();
+            }
+            if (changed & 0x80) {
+                update_chr();
+            }
+            break;
+        }
+        banks[bankSelect & 0x07] = val;
+        if ((bankSelect & 0x07) >= 6) {
+            update_prg();
+        } else {
+            update_chr();
+        }
+        break;
+    case 0xa000:
+        if (!odd) {
+            set_mirroring((val & 0x01) ? Ppu::HORIZONTAL : Ppu::VERTICAL);
+        } else {
+            map_prg_ram(val & 0x80, !(val & 0x40));
+        }
+        break;
+    case 0xc000:
+        if (!odd) {
+            irqLatch = val;
+        } else {
+            irqCounter = 0;
+            irqReload = true;
+        }
+        break;
+    case 0xe000:
+        // $E000 also acknowledges the IRQ
+        irqEnabled = odd;
+        if (!odd) {
+            irq = false;
+        }
+        break;
+    }
+}
+
+void Mmc3::update_prg(void)
+{
+    u32 last = prg_banks(0x2000) - 1;
+    u32 r6 = banks[6] & 0x3f;
+    bool swapped = bankSelect & 0x40;
+    map_prg(0x8000, 0x2000, swapped ? last - 1 : r6);
+    map_prg(0xa000, 0x2000, banks[7] & 0x3f);
+    map_prg(0xc000, 0x2000, swapped ? r6 : last - 1);
+    map_prg(0xe000, 0x2000, last);
+}
+
+void Mmc3::update_chr(void)
+{
+    // A12 inversion swaps the 2KB and the 1KB halves
+    u16 invert = (bankSelect & 0x80) ? 0x1000 : 0;
+    map_chr(invert, 0x800, banks[0] >> 1);
+    map_chr(invert | 0x0800, 0x800, banks[1] >> 1);
+    for (u32 i = 0; i < 4; i++) {
+        map_chr((invert ^ 0x1000) | (i << 10), 0x400, banks[2 + i]);
+    }
+}
@@ -0,0 +1,228 @@
+#ifndef MAPPER_H
+#define MAPPER_H
+
+#include "utils.h"
+#include "bus.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "cartridge.h"
+#include <memory>
+#include <string>
+
+/**
+ * The bank switching hardware of a cartridge. A mapper owns $6000-$FFFF of
+ * the cpu's bus and the PPU's pattern tables: its PRG RAM and the banks of
+ * PRG and CHR it selects are mapped as pages pointing straight into the
+ * cartridge's RAM and its ROM mapping, and the registers on top of the ROM
+ * get the writes. A register write only swaps page pointers, it never
+ * copies a bank, so a switch costs the same whatever the size of the ROM,
+ * and the block cache notices it by the page's storage changing.
+ */
+class Mapper : public IoDevice
+{
+public:
+    /**
+     * Makes the mapper a cartridge's header asks for and maps it in its
+     * power-on state. The cpu, the PPU and the cartridge have to outlive it.
+     *
+     * @return: NULL if the mapper isn't supported, error says which it is.
+     */
+    static std::unique_ptr<Mapper> create(Cpu &cpu, Ppu &ppu, Cartridge &cart,
+            std::string &error);
+
+    /**
+     * Unmaps $6000-$FFFF and the pattern tables, so neither the bus nor the
+     * PPU points at the mapper or the cartridge's memory any more.
+     */
+    virtual ~Mapper(void);
+
+    Mapper(const Mapper &) = delete;
+    Mapper &operator=(const Mapper &) = delete;
+
+    /**
+     * Puts the registers in their power-on state and maps the banks they
+     * select.
+     */
+    virtual void reset(void) = 0;
+
+    /**
+     * @return: Whether the mapper's IRQ is asserted. The cpu has no IRQ line
+     * yet, so like the APU's it has to be polled.
+     */
+    virtual bool irq_pending(void);
+
+    /**
+     * @return: The iNES mapper number.
+     */
+    virtual u16 get_number(void) const = 0;
+
+    /**
+     * Reads never get here, the ROM is mapped under the registers.
+     */
+    u8 io_read(u16 address) override;
+
+    /**
+     * Catches the PPU up first, so bank switches and the IRQ counter take
+     * effect on the dot the write happens on.
+     */
+    void io_write(u16 address, u8 val) override;
+
+protected:
+    Cpu &cpu;
+    Bus &bus;
+    Ppu &ppu;
+    Cartridge &cart;
+
+    Mapper(Cpu &c, Ppu &p, Cartridge &cart);
+
+    /**
+     * Handles a write to $8000-$FFFF.
+     */
+    virtual void write_register(u16 address, u8 val) = 0;
+
+    /**
+     * @return: How many banks of the given size the PRG ROM has.
+     */
+    u32 prg_banks(u32 size) const;
+
+    /**
+     * Maps a bank of PRG ROM, wrapping around the ROM, and mirrored if the
+     * ROM is smaller than the bank.
+     *
+     * @param size: The size of the range and the bank, a multiple of 8KB.
+     * @param bank: Which bank of that size.
+     */
+    void map_prg(u16 address, u32 size, u32 bank);
+
+    /**
+     * Maps a bank of CHR ROM or RAM the same way.
+     *
+     * @param size: A multiple of 1KB.
+     */
+    void map_chr(u16 address, u32 size, u32 bank);
+
+    /**
+     * Maps the PRG RAM at $6000, or leaves open bus there if it is disabled
+     * or the cartridge has none.
+     *
+     * @param writable: Whether writes go through, otherwise they are
+     * dropped.
+     */
+    void map_prg_ram(bool enabled, bool writable);
+
+    /**
+     * Sets the nametable mirroring unless the cartridge has four screens.
+     */
+    void set_mirroring(Ppu::Mirroring mirroring);
+
+    void sync_ppu(void);
+};
+
+/**
+ * Mapper 0: 16 or 32KB of PRG ROM and 8KB of CHR, no registers.
+ */
+class Nrom : public Mapper
+{
+public:
+    Nrom(Cpu &c, Ppu &p, Cartridge &cart) : Mapper(c, p, cart) {}
+
+    void reset(void) override;
+    u16 get_number(void) const override;
+
+protected:
+    void write_register(u16 address, u8 val) override;
+};
+
+/**
+ * Mapper 2: a switchable 16KB PRG bank at $8000 and the last one fixed at
+ * $C000, with 8KB of CHR RAM. NES 2.0 submapper 2 has bus conflicts, the
+ * value written is ANDed with the ROM under it.
+ */
+class Uxrom : public Mapper
+{
+public:
+    Uxrom(Cpu &c, Ppu &p, Cartridge &cart) : Mapper(c, p, cart) {}
+
+    void reset(void) override;
+    u16 get_number(void) const override;
+
+protected:
+    void write_register(u16 address, u8 val) override;
+};
+
+/**
+ * Mapper 3: fixed PRG ROM and a switchable 8KB CHR bank, with bus
+ * conflicts under submapper 2 like UxROM.
+ */
+class Cnrom : public Mapper
+{
+public:
+    Cnrom(Cpu &c, Ppu &p, Cartridge &cart) : Mapper(c, p, cart) {}
+
+    void reset(void) override;
+    u16 get_number(void) const override;
+
+protected:
+    void write_register(u16 address, u8 val) override;
+};
+
+/**
+ * Mapper 1, the MMC1: five registers loaded a bit at a time through a
+ * serial port, selecting 16 or 32KB PRG banks, 4 or 8KB CHR banks and the
+ * mirroring. On 512KB boards (SUROM) bit 4 of the CHR bank picks the 256KB
+ * half of the PRG ROM.
+ */
+class Mmc1 : public Mapper
+{
+public:
+    Mmc1(Cpu &c, Ppu &p, Cartridge &cart) : Mapper(c, p, cart) {}
+
+    void reset(void) override;
+    u16 get_number(void) const override;
+
+protected:
+    void write_register(u16 address, u8 val) override;
+
+private:
+    u8 shift;       // the bits written so far, the last one in bit 4
+    u8 shiftCount;
+    u8 control;
+    u8 chrBanks[2];
+    u8 prgBank;
+
+    void update(void);
+};
+
+/**
+ * Mapper 4, the MMC3: two switchable 8KB PRG banks, two 2KB and four 1KB
+ * CHR banks that can swap halves, and a scanline counter that raises an
+ * IRQ, clocked by the PPU.
+ */
+class Mmc3 : public Mapper, public PpuLineCounter
+{
+public:
+    Mmc3(Cpu &c, Ppu &p, Cartridge &cart);
+    ~Mmc3(void);
+
+    void reset(void) override;
+    bool irq_pending(void) override;
+    u16 get_number(void) const override;
+    void clock_line(void) override;
+
+protected:
+    void write_register(u16 address, u8 val) override;
+
+private:
+    u8 bankSelect;
+    u8 banks[8];
+    u8 irqLatch;
+    u8 irqCounter;
+    bool irqReload;
+    bool irqEnabled;
+    bool irq;
+
+    void update_prg(void);
+    void update_chr(void);
+};
+
+#endif
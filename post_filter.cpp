@@ -0,0 +1,505 @@
+#include <string.h>
+#include <algorithm>
+
+#include "post_filter.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define POST_FILTER_X86
+#include <emmintrin.h>
+#endif
+
+static const char *const type_names[FILTER_TYPE_COUNT] = {
+    "ntsc", "nearest2", "nearest3", "nearest4", "scale2x",
+};
+
+// room either side of a row of the NTSC planes, the chroma filter reaches 2
+// pixels out
+static const u32 PAD = 8;
+
+// the colour subcarrier leaking into luma, cos and sin * 32 of the 3 phases
+// it goes through, a pixel being 2/3 of a cycle
+static const s16 CROSSTALK_COS[3] = {32, -16, -16};
+static const s16 CROSSTALK_SIN[3] = {0, 28, -28};
+
+//-----------------------------------------------------------------------------
+// NTSC
+//
+// The frame is taken to YIQ in fixed point, luma is filtered over 3 pixels
+// and chroma, which a composite signal carries at a much lower bandwidth,
+// over 5, so colours bleed into their neighbours. The subcarrier phase of
+// each pixel puts some of the chroma back into the luma, the dot crawl, and
+// the result goes back to RGB. Every step is done the same way in 16 bits
+// by both kernels so they agree to the bit:
+//   Y = (77R + 150G + 29B + 128) >> 8
+//   I = (76R - 35G - 41B) >> 7
+//   Q = (27R - 67G + 40B) >> 7
+//   Y' = (Y[-1] + 2Y + Y[1] + 2) >> 2
+//   I' = (I[-2] + 2I[-1] + 2I + 2I[1] + I[2] + 4) >> 3, the same for Q'
+//   Y' += (I' cos + Q' sin) >> 7
+//   R = Y' + ((61I' + 40Q') >> 6)
+//   G = Y' - ((17I' + 41Q') >> 6)
+//   B = Y' + ((109Q' - 71I') >> 6)
+//-----------------------------------------------------------------------------
+
+static void yiq_scalar(const u8 *in, u32 count, s16 *y, s16 *i, s16 *q)
+{
+    for (u32 x = 0; x < count; x++, in += 4) {
+        s32 r = in[0], g = in[1], b = in[2];
+        y[x] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+        i[x] = (76 * r - 35 * g - 41 * b) >> 7;
+        q[x] = (27 * r - 67 * g + 40 * b) >> 7;
+    }
+}
+
+static u8 clamp_byte(s32 val)
+{
+    return static_cast<u8>(std::min(std::max(val, 0), 255));
+}
+
+static void rgb_scalar(const s16 *y, const s16 *i, const s16 *q,
+        const s16 *cosine, const s16 *sine, u32 count, u8 *out)
+{
+    for (u32 x = 0; x < count; x++, y++, i++, q++, out += 4) {
+        s32 luma = (y[-1] + 2 * y[0] + y[1] + 2) >> 2;
+        s32 fi = (i[-2] + 2 * (i[-1] + i[0] + i[1]) + i[2] + 4) >> 3;
+        s32 fq = (q[-2] + 2 * (q[-1] + q[0] + q[1]) + q[2] + 4) >> 3;
+        luma += (fi * cosine[x] + fq * sine[x]) >> 7;
+        out[0] = clamp_byte(luma + ((61 * fi + 40 * fq) >> 6));
+        out[1] = clamp_byte(luma - ((17 * fi + 41 * fq) >> 6));
+        out[2] = clamp_byte(luma + ((109 * fq - 71 * fi) >> 6));
+        out[3] = 0xff;
+    }
+}
+
+#ifdef POST_FILTER_X86
+
+static inline __m128i load16(const s16 *src)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+}
+
+static inline void store16(s16 *dest, __m128i val)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dest), val);
+}
+
+/**
+ * Splits 8 RGBA pixels into R, G and B as 16 bit lanes and works out YIQ.
+ */
+static void yiq_sse2(const u8 *in, u32 count, s16 *y, s16 *i, s16 *q)
+{
+    const __m128i byte = _mm_set1_epi32(0xff);
+    u32 x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m128i lo = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(in + x * 4));
+        __m128i hi = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(in + x * 4 + 16));
+        __m128i r = _mm_packs_epi32(_mm_and_si128(lo, byte),
+                _mm_and_si128(hi, byte));
+        __m128i g = _mm_packs_epi32(
+                _mm_and_si128(_mm_srli_epi32(lo, 8), byte),
+                _mm_and_si128(_mm_srli_epi32(hi, 8), byte));
+        __m128i b = _mm_packs_epi32(
+                _mm_and_si128(_mm_srli_epi32(lo, 16), byte),
+                _mm_and_si128(_mm_srli_epi32(hi, 16), byte));
+
+        // up to 65408, which only fits unsigned
+        __m128i luma = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(77)),
+                _mm_mullo_epi16(g, _mm_set1_epi16(150)));
+        luma = _mm_add_epi16(luma, _mm_mullo_epi16(b, _mm_set1_epi16(29)));
+        luma = _mm_srli_epi16(_mm_add_epi16(luma, _mm_set1_epi16(128)), 8);
+        __m128i ci = _mm_sub_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(76)),
+                _mm_mullo_epi16(g, _mm_set1_epi16(35)));
+        ci = _mm_sub_epi16(ci, _mm_mullo_epi16(b, _mm_set1_epi16(41)));
+        __m128i cq = _mm_sub_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(27)),
+                _mm_mullo_epi16(g, _mm_set1_epi16(67)));
+        cq = _mm_add_epi16(cq, _mm_mullo_epi16(b, _mm_set1_epi16(40)));
+        store16(y + x, luma);
+        store16(i + x, _mm_srai_epi16(ci, 7));
+        store16(q + x, _mm_srai_epi16(cq, 7));
+    }
+    yiq_scalar(in + x * 4, count - x, y + x, i + x, q + x);
+}
+
+/**
+ * @return: The 5 tap chroma filter of 8 pixels.
+ */
+static inline __m128i chroma_sse2(const s16 *c)
+{
+    __m128i middle = _mm_add_epi16(_mm_add_epi16(load16(c - 1), load16(c)),
+            load16(c + 1));
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(load16(c - 2), load16(c + 2)),
+            _mm_add_epi16(middle, middle));
+    return _mm_srai_epi16(_mm_add_epi16(sum, _mm_set1_epi16(4)), 3);
+}
+
+static void rgb_sse2(const s16 *y, const s16 *i, const s16 *q,
+        const s16 *cosine, const s16 *sine, u32 count, u8 *out)
+{
+    u32 x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m128i centre = load16(y + x);
+        __m128i luma = _mm_add_epi16(_mm_add_epi16(load16(y + x - 1),
+                    load16(y + x + 1)), _mm_add_epi16(centre, centre));
+        luma = _mm_srai_epi16(_mm_add_epi16(luma, _mm_set1_epi16(2)), 2);
+        __m128i fi = chroma_sse2(i + x);
+        __m128i fq = chroma_sse2(q + x);
+        __m128i leak = _mm_add_epi16(_mm_mullo_epi16(fi, load16(cosine + x)),
+                _mm_mullo_epi16(fq, load16(sine + x)));
+        luma = _mm_add_epi16(luma, _mm_srai_epi16(leak, 7));
+
+        __m128i r = _mm_add_epi16(_mm_mullo_epi16(fi, _mm_set1_epi16(61)),
+                _mm_mullo_epi16(fq, _mm_set1_epi16(40)));
+        r = _mm_add_epi16(luma, _mm_srai_epi16(r, 6));
+        __m128i g = _mm_add_epi16(_mm_mullo_epi16(fi, _mm_set1_epi16(17)),
+                _mm_mullo_epi16(fq, _mm_set1_epi16(41)));
+        g = _mm_sub_epi16(luma, _mm_srai_epi16(g, 6));
+        __m128i b = _mm_sub_epi16(_mm_mullo_epi16(fq, _mm_set1_epi16(109)),
+                _mm_mullo_epi16(fi, _mm_set1_epi16(71)));
+        b = _mm_add_epi16(luma, _mm_srai_epi16(b, 6));
+
+        // saturate to bytes and interleave with an opaque alpha
+        __m128i r8 = _mm_packus_epi16(r, r);
+        __m128i g8 = _mm_packus_epi16(g, g);
+        __m128i b8 = _mm_packus_epi16(b, b);
+        __m128i rg = _mm_unpacklo_epi8(r8, g8);
+        __m128i ba = _mm_unpacklo_epi8(b8, _mm_set1_epi8(-1));
+        __m128i *dest = reinterpret_cast<__m128i *>(out + x * 4);
+        _mm_storeu_si128(dest, _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128(dest + 1, _mm_unpackhi_epi16(rg, ba));
+    }
+    rgb_scalar(y + x, i + x, q + x, cosine + x, sine + x, count - x,
+            out + x * 4);
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Nearest neighbour
+//-----------------------------------------------------------------------------
+
+static void nearest_scalar(const u32 *in, u32 count, u32 scale, u32 *out)
+{
+    for (u32 x = 0; x < count; x++) {
+        for (u32 i = 0; i < scale; i++) {
+            *out++ = in[x];
+        }
+    }
+}
+
+#ifdef POST_FILTER_X86
+
+/**
+ * Repeats 4 pixels at a time with shuffles, for 3x the 12 pixels are
+ * p0 p0 p0 p1, p1 p1 p2 p2, p2 p3 p3 p3.
+ */
+static void nearest_sse2(const u32 *in, u32 count, u32 scale, u32 *out)
+{
+    u32 x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + x));
+        __m128i *dest = reinterpret_cast<__m128i *>(out + x * scale);
+        switch (scale) {
+        case 2:
+            _mm_storeu_si128(dest, _mm_unpacklo_epi32(p, p));
+            _mm_storeu_si128(dest + 1, _mm_unpackhi_epi32(p, p));
+            break;
+        case 3:
+            _mm_storeu_si128(dest, _mm_shuffle_epi32(p, 0x40));
+            _mm_storeu_si128(dest + 1, _mm_shuffle_epi32(p, 0xa5));
+            _mm_storeu_si128(dest + 2, _mm_shuffle_epi32(p, 0xfe));
+            break;
+        default:
+            _mm_storeu_si128(dest, _mm_shuffle_epi32(p, 0x00));
+            _mm_storeu_si128(dest + 1, _mm_shuffle_epi32(p, 0x55));
+            _mm_storeu_si128(dest + 2, _mm_shuffle_epi32(p, 0xaa));
+            _mm_storeu_si128(dest + 3, _mm_shuffle_epi32(p, 0xff));
+            break;
+        }
+    }
+    nearest_scalar(in + x, count - x, scale, out + x * scale);
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Scale2x
+//
+// Each pixel E becomes 4, each taking the colour of the two neighbours on
+// its side when they match and the other two don't, which rounds off the
+// staircase of diagonal edges without blurring:
+//       B         E0 E1
+//     D E F  ->   E2 E3
+//       H
+//-----------------------------------------------------------------------------
+
+/**
+ * Scales the pixels [x0, x1) of a row, the rows above and below are
+ * clamped to the frame by the caller, the sides here.
+ */
+static void scale2x_scalar(const u32 *above, const u32 *row,
+        const u32 *below, u32 x0, u32 x1, u32 width, u32 *top, u32 *bottom)
+{
+    for (u32 x = x0; x < x1; x++) {
+        u32 b = above[x], h = below[x], e = row[x];
+        u32 d = row[x ? x - 1 : 0];
+        u32 f = row[x + 1 < width ? x + 1 : x];
+        top[x * 2] = d == b && b != f && d != h ? d : e;
+        top[x * 2 + 1] = b == f && b != d && f != h ? f : e;
+        bottom[x * 2] = d == h && d != b && h != f ? d : e;
+        bottom[x * 2 + 1] = h == f && d != h && b != f ? f : e;
+    }
+}
+
+#ifdef POST_FILTER_X86
+
+static inline __m128i blend(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static void scale2x_sse2(const u32 *above, const u32 *row, const u32 *below,
+        u32 width, u32 *top, u32 *bottom)
+{
+    // the first pixel and the last few clamp D or F
+    u32 x = 1;
+    scale2x_scalar(above, row, below, 0, 1, width, top, bottom);
+    for (; x + 5 <= width; x += 4) {
+        __m128i b = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(above + x));
+        __m128i h = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(below + x));
+        __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+        __m128i d = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(row + x - 1));
+        __m128i f = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(row + x + 1));
+        __m128i db = _mm_cmpeq_epi32(d, b);
+        __m128i bf = _mm_cmpeq_epi32(b, f);
+        __m128i dh = _mm_cmpeq_epi32(d, h);
+        __m128i hf = _mm_cmpeq_epi32(h, f);
+        __m128i e0 = blend(_mm_andnot_si128(_mm_or_si128(bf, dh), db), d, e);
+        __m128i e1 = blend(_mm_andnot_si128(_mm_or_si128(db, hf), bf), f, e);
+        __m128i e2 = blend(_mm_andnot_si128(_mm_or_si128(db, hf), dh), d, e);
+        __m128i e3 = blend(_mm_andnot_si128(_mm_or_si128(dh, bf), hf), f, e);
+        __m128i *upper = reinterpret_cast<__m128i *>(top + x * 2);
+        __m128i *lower = reinterpret_cast<__m128i *>(bottom + x * 2);
+        _mm_storeu_si128(upper, _mm_unpacklo_epi32(e0, e1));
+        _mm_storeu_si128(upper + 1, _mm_unpackhi_epi32(e0, e1));
+        _mm_storeu_si128(lower, _mm_unpacklo_epi32(e2, e3));
+        _mm_storeu_si128(lower + 1, _mm_unpackhi_epi32(e2, e3));
+    }
+    scale2x_scalar(above, row, below, x, width, width, top, bottom);
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+// PostFilter
+//-----------------------------------------------------------------------------
+
+const char *filter_type_name(FilterType type)
+{
+    return type < FILTER_TYPE_COUNT ? type_names[type] : "unknown";
+}
+
+bool parse_filter_type(const std::string &text, FilterType *type)
+{
+    for (u32 i = 0; i < FILTER_TYPE_COUNT; i++) {
+        if (text == type_names[i]) {
+            *type = static_cast<FilterType>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+u32 filter_scale(FilterType type)
+{
+    switch (type) {
+    case FILTER_NEAREST2:
+    case FILTER_SCALE2X:
+        return 2;
+    case FILTER_NEAREST3:
+        return 3;
+    case FILTER_NEAREST4:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+bool filter_supported(FilterKind kind)
+{
+    switch (kind) {
+    case FILTER_SCALAR:
+        return true;
+#ifdef POST_FILTER_X86
+    case FILTER_SSE2:
+        return __builtin_cpu_supports("sse2");
+#endif
+    default:
+        return false;
+    }
+}
+
+FilterKind best_filter_kind(void)
+{
+    return filter_supported(FILTER_SSE2) ? FILTER_SSE2 : FILTER_SCALAR;
+}
+
+const char *filter_kind_name(FilterKind kind)
+{
+    static const char *names[FILTER_KIND_COUNT] = {"scalar", "sse2"};
+    return kind < FILTER_KIND_COUNT ? names[kind] : "unknown";
+}
+
+PostFilter::PostFilter(FilterType type, u32 width, u32 height, u32 threads,
+        FilterKind kind) : type(type), width(width), height(height)
+{
+    this->kind = filter_supported(kind) ? kind : FILTER_SCALAR;
+    scale = filter_scale(type);
+    frame = 0;
+    bands = 1;
+    if (threads != 1) {
+        pool.reset(new ThreadPool(threads));
+        bands = std::min(pool->get_thread_count(), height);
+    }
+
+    if (type == FILTER_NTSC) {
+        planes.resize(bands, std::vector<s16>(3 * (width + 2 * PAD)));
+        for (u32 phase = 0; phase < 3; phase++) {
+            crosstalk[phase][0].resize(width);
+            crosstalk[phase][1].resize(width);
+            for (u32 x = 0; x < width; x++) {
+                crosstalk[phase][0][x] = CROSSTALK_COS[(2 * x + phase) % 3];
+                crosstalk[phase][1][x] = CROSSTALK_SIN[(2 * x + phase) % 3];
+            }
+        }
+    }
+}
+
+FilterType PostFilter::get_type(void) const
+{
+    return type;
+}
+
+u32 PostFilter::get_width(void) const
+{
+    return width * scale;
+}
+
+u32 PostFilter::get_height(void) const
+{
+    return height * scale;
+}
+
+void PostFilter::apply(const u8 *in, u32 in_pitch, u8 *out, u32 out_pitch)
+{
+    Rows rows = {in, in_pitch, out, out_pitch};
+    if (!pool) {
+        filter_rows(rows, 0, 0, height);
+    } else {
+        for (u32 band = 0; band < bands; band++) {
+            u32 first = height * band / bands;
+            u32 end = height * (band + 1) / bands;
+            pool->submit([this, rows, band, first, end] {
+                filter_rows(rows, band, first, end);
+            });
+        }
+        pool->wait();
+    }
+    frame++;
+}
+
+/**
+ * Filters the input rows [first, end) of a band.
+ */
+void PostFilter::filter_rows(const Rows &rows, u32 band, u32 first, u32 end)
+{
+    for (u32 y = first; y < end; y++) {
+        switch (type) {
+        case FILTER_NTSC:
+            ntsc_row(rows, planes[band].data(), y);
+            break;
+        case FILTER_SCALE2X:
+            scale2x_row(rows, y);
+            break;
+        default:
+            nearest_row(rows, y);
+            break;
+        }
+    }
+}
+
+void PostFilter::ntsc_row(const Rows &rows, s16 *scratch, u32 y)
+{
+    u32 stride = width + 2 * PAD;
+    s16 *luma = scratch + PAD;
+    s16 *i = luma + stride;
+    s16 *q = i + stride;
+    const u8 *in = rows.in + y * rows.inPitch;
+#ifdef POST_FILTER_X86
+    if (kind == FILTER_SSE2) {
+        yiq_sse2(in, width, luma, i, q);
+    } else
+#endif
+    {
+        yiq_scalar(in, width, luma, i, q);
+    }
+    // the edge pixels carry on past the ends for the filter taps
+    for (s16 *plane : {luma, i, q}) {
+        std::fill(plane - PAD, plane, plane[0]);
+        std::fill(plane + width, plane + width + PAD, plane[width - 1]);
+    }
+
+    u32 phase = (y + frame) % 3;
+    const s16 *cosine = crosstalk[phase][0].data();
+    const s16 *sine = crosstalk[phase][1].data();
+    u8 *out = rows.out + y * rows.outPitch;
+#ifdef POST_FILTER_X86
+    if (kind == FILTER_SSE2) {
+        rgb_sse2(luma, i, q, cosine, sine, width, out);
+        return;
+    }
+#endif
+    rgb_scalar(luma, i, q, cosine, sine, width, out);
+}
+
+void PostFilter::nearest_row(const Rows &rows, u32 y)
+{
+    const u32 *in = reinterpret_cast<const u32 *>(rows.in + y * rows.inPitch);
+    u8 *out = rows.out + y * scale * rows.outPitch;
+#ifdef POST_FILTER_X86
+    if (kind == FILTER_SSE2) {
+        nearest_sse2(in, width, scale, reinterpret_cast<u32 *>(out));
+    } else
+#endif
+    {
+        nearest_scalar(in, width, scale, reinterpret_cast<u32 *>(out));
+    }
+    for (u32 i = 1; i < scale; i++) {
+        memcpy(out + i * rows.outPitch, out, width * scale * 4);
+    }
+}
+
+void PostFilter::scale2x_row(const Rows &rows, u32 y)
+{
+    const u8 *in = rows.in + y * rows.inPitch;
+    const u32 *row = reinterpret_cast<const u32 *>(in);
+    const u32 *above = reinterpret_cast<const u32 *>(
+            y ? in - rows.inPitch : in);
+    const u32 *below = reinterpret_cast<const u32 *>(
+            y + 1 < height ? in + rows.inPitch : in);
+    u32 *top = reinterpret_cast<u32 *>(rows.out + y * 2 * rows.outPitch);
+    u32 *bottom = reinterpret_cast<u32 *>(rows.out
+            + (y * 2 + 1) * rows.outPitch);
+#ifdef POST_FILTER_X86
+    if (kind == FILTER_SSE2) {
+        scale2x_sse2(above, row, below, width, top, bottom);
+        return;
+    }
+#endif
+    scale2x_scalar(above, row, below, 0, width, width, top, bottom);
+}
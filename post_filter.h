@@ -0,0 +1,118 @@
+#ifndef POST_FILTER_H
+#define POST_FILTER_H
+
+#include "utils.h"
+#include "thread_pool.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+enum FilterType
+{
+    FILTER_NTSC,        // composite video colour bleed and dot crawl
+    FILTER_NEAREST2,    // every pixel made 2x2
+    FILTER_NEAREST3,
+    FILTER_NEAREST4,
+    FILTER_SCALE2X,     // 2x, rounding off diagonal edges (EPX)
+    FILTER_TYPE_COUNT,
+};
+
+enum FilterKind
+{
+    FILTER_SCALAR,
+    FILTER_SSE2,
+    FILTER_KIND_COUNT,
+};
+
+const char *filter_type_name(FilterType type);
+
+/**
+ * @return: Whether the text named a filter, e.g. "ntsc".
+ */
+bool parse_filter_type(const std::string &text, FilterType *type);
+
+/**
+ * @return: How many times wider and taller the filter makes a frame.
+ */
+u32 filter_scale(FilterType type);
+
+/**
+ * @return: Whether the host cpu can run the given kind of filter kernel.
+ */
+bool filter_supported(FilterKind kind);
+
+/**
+ * @return: The fastest kind of filter kernel the host cpu can run.
+ */
+FilterKind best_filter_kind(void);
+
+const char *filter_kind_name(FilterKind kind);
+
+/**
+ * A filter run over RGBA8 frames after they are converted, e.g. to make a
+ * capture look like the NES on a TV, or to blow it up for a window. Every
+ * row of the output depends only on a few rows of the input, so a frame is
+ * split into bands of rows that are filtered on a pool of threads. All the
+ * scratch space is allocated with the filter and reused for every frame.
+ */
+class PostFilter
+{
+public:
+    /**
+     * @param width: The size of the frames going in.
+     * @param threads: How many threads the rows are split over, 0 for one
+     * per core; with 1 the filter runs on the calling thread.
+     */
+    PostFilter(FilterType type, u32 width, u32 height, u32 threads = 1,
+            FilterKind kind = best_filter_kind());
+    ~PostFilter(void) {}
+
+    FilterType get_type(void) const;
+
+    /**
+     * @return: The size of the frames coming out.
+     */
+    u32 get_width(void) const;
+    u32 get_height(void) const;
+
+    /**
+     * Filters a frame. The NTSC filter's dot crawl moves on with every
+     * frame, like on a TV.
+     *
+     * @param in_pitch: The bytes from one line of in to the next.
+     * @param out: get_width() x get_height() RGBA8 pixels.
+     * @param out_pitch: The bytes from one line of out to the next.
+     */
+    void apply(const u8 *in, u32 in_pitch, u8 *out, u32 out_pitch);
+
+private:
+    struct Rows
+    {
+        const u8 *in;
+        u32 inPitch;
+        u8 *out;
+        u32 outPitch;
+    };
+
+    FilterType type;
+    FilterKind kind;
+    u32 width;
+    u32 height;
+    u32 scale;
+    u64 frame;
+    std::unique_ptr<ThreadPool> pool;   // NULL to run on the caller
+    u32 bands;
+    // each band's rows of luma and chroma for the NTSC filter, with room
+    // for the filter taps on either side
+    std::vector<std::vector<s16>> planes;
+    // how much of I and Q leak into luma along a line, for each of the 3
+    // subcarrier phases a line can start on
+    std::vector<s16> crosstalk[3][2];
+
+    void filter_rows(const Rows &rows, u32 band, u32 first, u32 end);
+    void ntsc_row(const Rows &rows, s16 *scratch, u32 y);
+    void nearest_row(const Rows &rows, u32 y);
+    void scale2x_row(const Rows &rows, u32 y);
+};
+
+#endif
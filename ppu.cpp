@@ -0,0 +1,1298 @@
+#include <string.h>
+#include <algorithm>
+
+#include "ppu.h"
+#include "thread_pool.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PPU_SSE2
+#include <emmintrin.h>
+#endif
+
+// PPUCTRL
+static const u8 CTRL_INCREMENT = 0x04;
+static const u8 CTRL_SPRITE_TABLE = 0x08;
+static const u8 CTRL_BACKGROUND_TABLE = 0x10;
+static const u8 CTRL_TALL_SPRITES = 0x20;
+static const u8 CTRL_NMI = 0x80;
+
+// PPUMASK
+static const u8 MASK_GRAYSCALE = 0x01;
+static const u8 MASK_BACKGROUND_LEFT = 0x02;
+static const u8 MASK_SPRITES_LEFT = 0x04;
+static const u8 MASK_BACKGROUND = 0x08;
+static const u8 MASK_SPRITES = 0x10;
+
+// PPUSTATUS
+static const u8 STATUS_OVERFLOW = 0x20;
+static const u8 STATUS_SPRITE_ZERO = 0x40;
+static const u8 STATUS_VBLANK = 0x80;
+
+// sprite attributes
+static const u8 SPRITE_BEHIND = 0x20;
+static const u8 SPRITE_FLIP_X = 0x40;
+static const u8 SPRITE_FLIP_Y = 0x80;
+
+// a pixel of spriteLine, below these bits is its palette RAM index
+static const u8 LAYER_BEHIND = 0x20;    // behind the background
+static const u8 LAYER_ZERO = 0x40;      // from sprite 0, can hit
+static const u8 LAYER_COLOUR = 0x1f;
+
+// the fewest lines worth handing to a thread of the band pool
+static const u32 MIN_BAND_LINES = 16;
+
+void PpuLog::clear(void)
+{
+    entries.clear();
+    chrMaps.clear();
+    bytes.clear();
+    endDot = 0;
+}
+
+Ppu::Ppu(Cpu &c) : cpu(&c)
+{
+    recorder = NULL;
+    lineCounter = NULL;
+    log = NULL;
+    loggedFrames = 0;
+    replayLog = NULL;
+    replayNext = 0;
+    replayQuiet = 0;
+    bandPool = NULL;
+    bandsEnd = 0;
+    bandLines = 0;
+    ctrl = 0;
+    mask = 0;
+    status = 0;
+    oamAddr = 0;
+    latch = 0;
+    readBuffer = 0;
+    v = 0;
+    t = 0;
+    fineX = 0;
+    w = false;
+
+    memset(vram, 0, sizeof(vram));
+    memset(palette, 0, sizeof(palette));
+    memset(oam, 0, sizeof(oam));
+    memset(openChr, 0, sizeof(openChr));
+    memset(ioPage, 0, sizeof(ioPage));
+    for (u32 i = 0; i < 8; i++) {
+        chr[i] = openChr;
+        chrWrite[i] = NULL;
+        chrStorage[i] = NULL;
+        chrStorageSize[i] = 0;
+    }
+    set_mirroring(HORIZONTAL);
+
+    dotClock = 0;
+    line = 0;
+    dot = 0;
+    oddFrame = false;
+    suppressVblank = false;
+    frameCount = 0;
+    skipRendering = false;
+    skipping = false;
+    frameRendered = false;
+    tileOffset = 0;
+    spriteCount = 0;
+    spriteZeroX = -1;
+    memset(spriteLine, 0, sizeof(spriteLine));
+    spriteListsDirty = true;
+    decodeTiles = get_tile_decoder(best_tile_decoder());
+    memset(frame, 0, sizeof(frame));
+    memset(emphasis, 0, sizeof(emphasis));
+
+    cycleBase = cpu->get_cycles();
+    Bus &bus = cpu->get_bus();
+    bus.map_io(0x2000, 0x2000, this);
+    bus.map_io(0x4000, Bus::PAGE_SIZE, this);
+    cpu->attach(this);
+}
+
+Ppu::~Ppu(void)
+{
+    if (!cpu) {
+        return;
+    }
+    Bus &bus = cpu->get_bus();
+    for (u32 page = 0x20; page <= 0x40; page++) {
+        if (bus.get_device(page) == this) {
+            bus.unmap(page << Bus::PAGE_SHIFT, Bus::PAGE_SIZE);
+        }
+    }
+    cpu->detach(this);
+}
+
+Ppu::Ppu(const Ppu &source) : IoDevice(), ClockedDevice(), cpu(NULL)
+{
+    recorder = NULL;
+    lineCounter = NULL;
+    log = NULL;
+    loggedFrames = 0;
+    replayLog = NULL;
+    replayNext = 0;
+    replayQuiet = 0;
+    bandPool = NULL;
+    bandsEnd = 0;
+    bandLines = 0;
+    cycleBase = 0;
+    ctrl = source.ctrl;
+    mask = source.mask;
+    status = source.status;
+    oamAddr = source.oamAddr;
+    latch = source.latch;
+    readBuffer = source.readBuffer;
+    v = source.v;
+    t = source.t;
+    fineX = source.fineX;
+    w = source.w;
+
+    memcpy(vram, source.vram, sizeof(vram));
+    memcpy(palette, source.palette, sizeof(palette));
+    memcpy(oam, source.oam, sizeof(oam));
+    memset(openChr, 0, sizeof(openChr));
+    memset(ioPage, 0, sizeof(ioPage));
+    for (u32 i = 0; i < 8; i++) {
+        chr[i] = openChr;
+        chrWrite[i] = NULL;
+        chrStorage[i] = NULL;
+        chrStorageSize[i] = 0;
+    }
+    for (u32 i = 0; i < 8; i++) {
+        u8 *storage = source.chrStorage[i];
+        if (!storage) {
+            continue;
+        }
+        u32 size = source.chrStorageSize[i];
+        u32 offset = source.chr[i] - storage;
+        if (source.chrWrite[i]) {
+            storage = shadow_chr(storage, size, storage);
+        }
+        map_chr(i << 10, 0x400, storage, size, source.chrWrite[i] != NULL,
+                offset);
+    }
+    for (u32 i = 0; i < 4; i++) {
+        nametables[i] = vram + (source.nametables[i] - source.vram);
+    }
+
+    dotClock = source.dotClock;
+    line = source.line;
+    dot = source.dot;
+    oddFrame = source.oddFrame;
+    suppressVblank = source.suppressVblank;
+    frameCount = source.frameCount;
+    // a copy is only there to draw
+    skipRendering = false;
+    skipping = false;
+    frameRendered = source.frameRendered;
+    tileOffset = source.tileOffset;
+    spriteCount = source.spriteCount;
+    spriteZeroX = source.spriteZeroX;
+    memcpy(spriteLine, source.spriteLine, sizeof(spriteLine));
+    memcpy(lineSprites, source.lineSprites, sizeof(lineSprites));
+    memcpy(lineSpriteCount, source.lineSpriteCount, sizeof(lineSpriteCount));
+    memcpy(lineOverflow, source.lineOverflow, sizeof(lineOverflow));
+    spriteListsDirty = source.spriteListsDirty;
+    decodeTiles = source.decodeTiles;
+    if (source.tileCache) {
+        tileCache.reset(new TileCache(decodeTiles));
+    }
+    memcpy(frame, source.frame, sizeof(frame));
+    memcpy(emphasis, source.emphasis, sizeof(emphasis));
+}
+
+void Ppu::map_chr(u16 address, u32 size, u8 *storage, u32 storage_size,
+        bool writable, u32 offset)
+{
+    if (log) {
+        PpuLog::ChrMap map = {address, size, storage, storage_size, offset,
+            writable, PpuLog::NO_SNAPSHOT};
+        if (writable && std::find(loggedChr.begin(), loggedChr.end(),
+                    storage) == loggedChr.end()) {
+            // CHR RAM the copies haven't seen, they start off with its
+            // contents
+            map.snapshot = log->bytes.size();
+            log->bytes.insert(log->bytes.end(), storage,
+                    storage + storage_size);
+            loggedChr.push_back(storage);
+        }
+        record(PpuLog::CHR, 0, 0, log->chrMaps.size());
+        log->chrMaps.push_back(map);
+    }
+    for (u32 i = 0; i < size; i += 0x400) {
+        u32 bank = (address + i) >> 10;
+        u8 *data = storage + (offset + i) % storage_size;
+        if (tileCache && chr[bank] != data) {
+            tileCache->invalidate_bank(bank);
+        }
+        chr[bank] = data;
+        chrWrite[bank] = writable ? data : NULL;
+        chrStorage[bank] = storage;
+        chrStorageSize[bank] = storage_size;
+    }
+}
+
+void Ppu::map_chr_rom(u16 address, u32 size, const u8 *storage,
+        u32 storage_size)
+{
+    // not writable, so nothing ever writes through the pointer
+    map_chr(address, size, const_cast<u8 *>(storage), storage_size, false);
+}
+
+void Ppu::unmap_chr(u16 address, u32 size)
+{
+    map_chr_rom(address, size, openChr, sizeof(openChr));
+}
+
+void Ppu::set_mirroring(Mirroring mirroring)
+{
+    static const u8 layouts[][4] = {
+        {0, 0, 1, 1},   // HORIZONTAL
+        {0, 1, 0, 1},   // VERTICAL
+        {0, 0, 0, 0},   // SINGLE_LOWER
+        {1, 1, 1, 1},   // SINGLE_UPPER
+        {0, 1, 2, 3},   // FOUR_SCREEN
+    };
+    if (log) {
+        record(PpuLog::MIRRORING, 0, mirroring);
+    }
+    for (u32 i = 0; i < 4; i++) {
+        nametables[i] = vram + layouts[mirroring][i] * 0x400;
+    }
+}
+
+bool Ppu::set_tile_decoder(TileDecoderKind kind)
+{
+    TileDecoder decoder = get_tile_decoder(kind);
+    if (!decoder) {
+        return false;
+    }
+    decodeTiles = decoder;
+    if (tileCache) {
+        tileCache->set_decoder(decoder);
+    }
+    return true;
+}
+
+void Ppu::set_tile_cache(bool enabled)
+{
+    if (enabled && !tileCache) {
+        tileCache.reset(new TileCache(decodeTiles));
+    } else if (!enabled) {
+        tileCache.reset();
+    }
+}
+
+bool Ppu::get_tile_cache(void) const
+{
+    return tileCache != NULL;
+}
+
+TileCacheStats Ppu::get_tile_cache_stats(void) const
+{
+    TileCacheStats stats = {};
+    if (tileCache) {
+        stats = tileCache->get_stats();
+    }
+    return stats;
+}
+
+bool Ppu::run_frame(u64 end)
+{
+    u64 frames = frameCount;
+    while (frameCount == frames && cpu->get_cycles() < end) {
+        u64 until = std::min(next_event(), end);
+        s64 budget = static_cast<s64>(until - cpu->get_cycles());
+        cpu->run_cycles(static_cast<s32>(std::max<s64>(budget, 1)));
+        run_to((cpu->get_cycles() - cycleBase) * 3);
+    }
+    return frameCount != frames;
+}
+
+const u8 *Ppu::get_frame(void) const
+{
+    return &frame[0][0];
+}
+
+u8 Ppu::get_emphasis(u32 line) const
+{
+    return emphasis[line];
+}
+
+void Ppu::set_skip_rendering(bool skip)
+{
+    skipRendering = skip;
+}
+
+bool Ppu::get_skip_rendering(void) const
+{
+    return skipRendering;
+}
+
+bool Ppu::is_frame_rendered(void) const
+{
+    return frameRendered;
+}
+
+void Ppu::set_line_counter(PpuLineCounter *counter)
+{
+    lineCounter = counter;
+}
+
+void Ppu::set_recorder(PpuRecorder *recorder, PpuLog *log)
+{
+    this->recorder = recorder;
+    this->log = recorder ? log : NULL;
+    loggedFrames = frameCount;
+    loggedChr.clear();
+    if (recorder) {
+        // copies made from here on have their own copy of the mapped CHR RAM
+        for (u32 i = 0; i < 8; i++) {
+            if (chrWrite[i] && std::find(loggedChr.begin(), loggedChr.end(),
+                        chrStorage[i]) == loggedChr.end()) {
+                loggedChr.push_back(chrStorage[i]);
+            }
+        }
+    }
+}
+
+void Ppu::replay(const PpuLog &log)
+{
+    replayLog = &log;
+    replayQuiet = 0;
+    for (replayNext = 0; replayNext < log.entries.size(); replayNext++) {
+        const PpuLog::Entry &entry = log.entries[replayNext];
+        run_to(entry.dot);
+        switch (entry.type) {
+        case PpuLog::WRITE:
+            write_register(entry.address, entry.val);
+            break;
+        case PpuLog::READ:
+            read_register(entry.address);
+            break;
+        case PpuLog::DMA:
+            write_oam_page(&log.bytes[entry.data]);
+            break;
+        case PpuLog::VRAM:
+            store_vram(entry.address, entry.val);
+            break;
+        case PpuLog::CHR: {
+            const PpuLog::ChrMap &map = log.chrMaps[entry.data];
+            u8 *storage = map.storage;
+            if (map.writable) {
+                storage = shadow_chr(storage, map.storageSize,
+                        map.snapshot == PpuLog::NO_SNAPSHOT ? NULL
+                        : &log.bytes[map.snapshot]);
+            }
+            map_chr(map.address, map.size, storage, map.storageSize,
+                    map.writable, map.offset);
+            break;
+        }
+        case PpuLog::MIRRORING:
+            set_mirroring(static_cast<Mirroring>(entry.val));
+            break;
+        }
+    }
+    run_to(log.endDot);
+    replayLog = NULL;
+}
+
+void Ppu::set_band_pool(ThreadPool *pool)
+{
+    bandPool = pool;
+}
+
+u64 Ppu::get_band_line_count(void) const
+{
+    return bandLines;
+}
+
+u64 Ppu::get_frame_count(void) const
+{
+    return frameCount;
+}
+
+u32 Ppu::get_line(void) const
+{
+    return line;
+}
+
+u32 Ppu::get_dot(void) const
+{
+    return dot;
+}
+
+u32 Ppu::palette_index(u16 address)
+{
+    u32 index = address & 0x1f;
+    // the backdrop entries of the sprite palettes mirror the background's
+    if ((index & 0x13) == 0x10) {
+        index &= ~0x10;
+    }
+    return index;
+}
+
+u8 Ppu::read_vram(u16 address) const
+{
+    address &= 0x3fff;
+    if (address < 0x2000) {
+        return chr[address >> 10][address & 0x3ff];
+    } else if (address < 0x3f00) {
+        return nametables[(address >> 10) & 3][address & 0x3ff];
+    }
+    return palette[palette_index(address)];
+}
+
+void Ppu::write_vram(u16 address, u8 val)
+{
+    if (log) {
+        record(PpuLog::VRAM, address, val);
+    }
+    store_vram(address, val);
+}
+
+void Ppu::store_vram(u16 address, u8 val)
+{
+    address &= 0x3fff;
+    if (address < 0x2000) {
+        u8 *bank = chrWrite[address >> 10];
+        if (bank && bank[address & 0x3ff] != val) {
+            bank[address & 0x3ff] = val;
+            if (tileCache) {
+                invalidate_chr(bank + (address & 0x3ff));
+            }
+        }
+    } else if (address < 0x3f00) {
+        nametables[(address >> 10) & 3][address & 0x3ff] = val;
+    } else {
+        palette[palette_index(address)] = val & 0x3f;
+    }
+}
+
+void Ppu::record(PpuLog::Type type, u16 address, u8 val, u32 data)
+{
+    PpuLog::Entry entry = {dotClock, data, address, type, val};
+    log->entries.push_back(entry);
+}
+
+/**
+ * Finds a copy's own version of the source's CHR RAM, making it the first
+ * time it's asked for.
+ *
+ * @param contents: What the new version starts off with, NULL for zeroes.
+ */
+u8 *Ppu::shadow_chr(const u8 *storage, u32 size, const u8 *contents)
+{
+    for (ChrShadow &shadow : chrShadows) {
+        if (shadow.storage == storage) {
+            return shadow.data.data();
+        }
+    }
+    chrShadows.push_back(ChrShadow{storage, std::vector<u8>(size)});
+    u8 *data = chrShadows.back().data.data();
+    if (contents) {
+        memcpy(data, contents, size);
+    }
+    return data;
+}
+
+//-----------------------------------------------------------------------------
+// Timing
+//-----------------------------------------------------------------------------
+
+/**
+ * Catches up to the cycle the cpu accesses the PPU on.
+ */
+void Ppu::sync(void)
+{
+    run_to((cpu->get_access_cycle() - cycleBase) * 3);
+}
+
+u64 Ppu::catch_up(u64 cycle)
+{
+    run_to((cycle - cycleBase) * 3);
+    return next_event();
+}
+
+/**
+ * @return: The cpu cycle by which the PPU has run dot 1 of the vblank line,
+ * where the frame ends and the NMI fires.
+ */
+u64 Ppu::next_event(void) const
+{
+    u64 dots;
+    if (line < VBLANK_LINE || (line == VBLANK_LINE && dot <= 1)) {
+        dots = (VBLANK_LINE - line) * DOTS_PER_LINE + 2 - dot;
+    } else {
+        // the pre-render line may be a dot short, better early than late
+        dots = (LINES_PER_FRAME - line + VBLANK_LINE) * DOTS_PER_LINE + 1
+            - dot;
+    }
+    return cycleBase + (dotClock + dots + 2) / 3;
+}
+
+/**
+ * Runs the PPU up to the given dot, a line or the rest of one at a time.
+ */
+void Ppu::run_to(u64 target)
+{
+    while (dotClock < target) {
+        // the pre-render line of every other frame skips its last dot
+        u32 length = DOTS_PER_LINE;
+        if (line == PRERENDER_LINE && oddFrame && rendering()) {
+            length--;
+        }
+        if (dot >= length) {
+            next_line();
+            continue;
+        }
+        u32 to = dot + static_cast<u32>(std::min<u64>(target - dotClock,
+                    length - dot));
+        run_line(dot, to);
+        dotClock += to - dot;
+        dot = to;
+        if (recorder && loggedFrames != frameCount) {
+            log->endDot = dotClock;
+            log = recorder->frame_logged(log);
+            log->clear();
+            loggedFrames = frameCount;
+        }
+    }
+}
+
+void Ppu::next_line(void)
+{
+    dot = 0;
+    if (++line == LINES_PER_FRAME) {
+        line = 0;
+        oddFrame = !oddFrame;
+    }
+}
+
+/**
+ * Runs dots [from, to) of the current line: renders the pixels output on
+ * them and carries out the events that fall on them.
+ */
+void Ppu::run_line(u32 from, u32 to)
+{
+    if (line == 0 && from == 0) {
+        skipping = skipRendering;
+        bandsEnd = 0;
+    }
+    if (replayLog && bandPool && !skipping && line < HEIGHT && from == 0
+            && line >= bandsEnd) {
+        render_bands();
+    }
+    if (line < HEIGHT && from <= 256 && to > 1) {
+        // pixel x comes out on dot x + 1
+        render_pixels(std::max(from, 1u) - 1, std::min(to, 257u) - 1);
+    }
+
+    if (line < HEIGHT || line == PRERENDER_LINE) {
+        if (line == PRERENDER_LINE && from <= 1 && to > 1) {
+            status &= ~(STATUS_VBLANK | STATUS_SPRITE_ZERO | STATUS_OVERFLOW);
+        }
+        if (rendering()) {
+            if (from <= 256 && to > 256) {
+                v = increment_y(v);
+            }
+            if (from <= 257 && to > 257) {
+                // copy the horizontal bits of t
+                v = (v & ~0x041f) | (t & 0x041f);
+                tileOffset = 0;
+                evaluate_sprites();
+            }
+            if (lineCounter && from <= 260 && to > 260) {
+                lineCounter->clock_line();
+            }
+            if (line == PRERENDER_LINE && from < 305 && to > 280) {
+                // copy the vertical bits of t
+                v = (v & ~0x7be0) | (t & 0x7be0);
+            }
+        } else if (from <= 257 && to > 257) {
+            clear_sprites();
+        }
+    } else if (line == VBLANK_LINE && from <= 1 && to > 1) {
+        start_vblank();
+    }
+}
+
+void Ppu::start_vblank(void)
+{
+    if (!suppressVblank) {
+        status |= STATUS_VBLANK;
+        if (cpu && (ctrl & CTRL_NMI)) {
+            cpu->trigger_nmi();
+        }
+    }
+    suppressVblank = false;
+    frameRendered = !skipping;
+    frameCount++;
+}
+
+/**
+ * @return: The VRAM address moved down a row of pixels, into the nametable
+ * below after the last row of tiles.
+ */
+u16 Ppu::increment_y(u16 address)
+{
+    if ((address & 0x7000) != 0x7000) {
+        return address + 0x1000;
+    }
+    address &= ~0x7000;
+    u16 y = (address & 0x03e0) >> 5;
+    if (y == 29) {
+        y = 0;
+        address ^= 0x0800;
+    } else if (y == 31) {
+        y = 0;
+    } else {
+        y++;
+    }
+    return (address & ~0x03e0) | (y << 5);
+}
+
+/**
+ * @return: What v is at the start of the line after one that started with
+ * the given address, as long as nothing is written in between.
+ */
+u16 Ppu::next_line_address(u16 address) const
+{
+    if (!rendering()) {
+        return address;
+    }
+    return (increment_y(address) & ~0x041f) | (t & 0x041f);
+}
+
+/**
+ * Finds the sprites on every line at once, the way the PPU does on dots
+ * 65-256 of each line. Past the eighth sprite the PPU looks for more with a
+ * pointer that wrongly steps through the bytes of the entries as well as
+ * through the entries, so overflow is both missed and falsely reported;
+ * this does the same. Only OAM and the sprite size change the lists, so
+ * they are built again after either does, usually once a frame after the
+ * OAM DMA.
+ */
+void Ppu::build_sprite_lists(void)
+{
+    memset(lineSpriteCount, 0, sizeof(lineSpriteCount));
+    memset(lineOverflow, 0, sizeof(lineOverflow));
+    u32 height = (ctrl & CTRL_TALL_SPRITES) ? 16 : 8;
+    for (u32 n = 0; n < 64; n++) {
+        // a sprite is found on the line before the one it shows on
+        u32 top = oam[n * 4];
+        u32 bottom = std::min(top + height, static_cast<u32>(HEIGHT));
+        for (u32 y = top; y < bottom; y++) {
+            if (lineSpriteCount[y] < 8) {
+                lineSprites[y][lineSpriteCount[y]++] = n;
+            }
+        }
+    }
+
+    for (u32 y = 0; y < HEIGHT; y++) {
+        if (lineSpriteCount[y] < 8) {
+            continue;
+        }
+        u32 n = lineSprites[y][7] + 1;
+        for (u32 m = 0; n < 64; n++, m = (m + 1) & 3) {
+            if (static_cast<u32>(y - oam[n * 4 + m]) < height) {
+                lineOverflow[y] = true;
+                break;
+            }
+        }
+    }
+    spriteListsDirty = false;
+}
+
+void Ppu::clear_sprites(void)
+{
+    if (spriteCount) {
+        memset(spriteLine, 0, sizeof(spriteLine));
+        spriteCount = 0;
+    }
+    spriteZeroX = -1;
+}
+
+/**
+ * Finds the sprites on the next line and draws them into spriteLine, only
+ * sprite 0 on a skipped frame since its hit is all that is looked at.
+ */
+void Ppu::evaluate_sprites(void)
+{
+    clear_sprites();
+    if (line == PRERENDER_LINE) {
+        // no evaluation happens on the pre-render line, line 0 has no
+        // sprites
+        return;
+    }
+    if (spriteListsDirty) {
+        build_sprite_lists();
+    }
+    if (lineOverflow[line]) {
+        status |= STATUS_OVERFLOW;
+    }
+    if (line + 1 < bandsEnd) {
+        // the next line has been rendered already
+        return;
+    }
+    u32 count = lineSpriteCount[line];
+    if (skipping) {
+        // the lists are in OAM order, sprite 0 is first if it is there
+        count = count && lineSprites[line][0] == 0 ? 1 : 0;
+    }
+    spriteCount = draw_sprites(line, count, spriteLine, &spriteZeroX,
+            tileCache != NULL);
+    // sprite 0 never hits on the last pixel
+    spriteLine[WIDTH - 1] &= ~LAYER_ZERO;
+}
+
+/**
+ * Fetches the pattern rows of the sprites found on a line, which show on the
+ * line after, and draws them into out, lowest priority first so the first
+ * sprite ends up on top where they overlap, whether or not it is behind the
+ * background. Out has to be clear and the sprite lists up to date.
+ *
+ * @param count: How many of the line's sprites to draw, from the first.
+ * @param zeroX: Set to where sprite 0 is, if it is on the line.
+ * @return: The number of sprites drawn.
+ */
+u32 Ppu::draw_sprites(u32 y, u32 count, u8 *out, s32 *zeroX, bool cached)
+{
+    u32 height = (ctrl & CTRL_TALL_SPRITES) ? 16 : 8;
+    for (u32 i = count; i-- > 0;) {
+        u32 n = lineSprites[y][i];
+        const u8 *entry = &oam[n * 4];
+        u32 row = y - entry[0];
+        if (entry[2] & SPRITE_FLIP_Y) {
+            row = height - 1 - row;
+        }
+        u16 address;
+        if (height == 16) {
+            address = ((entry[1] & 1) << 12) | ((entry[1] & 0xfe) << 4)
+                | ((row & 8) << 1) | (row & 7);
+        } else {
+            address = ((ctrl & CTRL_SPRITE_TABLE) << 9) | (entry[1] << 4)
+                | row;
+        }
+
+        u8 pixels[8];
+        if (cached) {
+            memcpy(pixels, cached_row(address, 0), 8);
+        } else {
+            u8 low = read_vram(address);
+            u8 high = read_vram(address + 8);
+            u8 palette = 0;
+            decodeTiles(&low, &high, &palette, 1, pixels);
+        }
+        if (entry[2] & SPRITE_FLIP_X) {
+            std::reverse(pixels, pixels + 8);
+        }
+
+        u8 layer = 0x10 | ((entry[2] & 3) << 2);
+        if (entry[2] & SPRITE_BEHIND) {
+            layer |= LAYER_BEHIND;
+        }
+        if (n == 0) {
+            layer |= LAYER_ZERO;
+            *zeroX = entry[3];
+        }
+        u8 *sprite = out + entry[3];
+        for (u32 column = 0; column < 8; column++) {
+            if (pixels[column]) {
+                sprite[column] = layer | pixels[column];
+            }
+        }
+    }
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+// Rendering
+//-----------------------------------------------------------------------------
+
+/**
+ * Puts the sprite pixels [x0, x1) over the background pixels, 16 at a time
+ * with masks. The background shows where there is no sprite pixel or the
+ * sprite is behind it, and sprite 0 hits wherever its pixel is over an
+ * opaque background pixel, whichever of the two shows.
+ *
+ * @return: Whether sprite 0 hit.
+ */
+static bool composite_sprites(u8 *background, const u8 *sprites, u32 x0,
+        u32 x1)
+{
+    u32 x = x0;
+    bool hit = false;
+#ifdef PPU_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i behindBit = _mm_set1_epi8(LAYER_BEHIND);
+    const __m128i zeroBit = _mm_set1_epi8(LAYER_ZERO);
+    const __m128i colour = _mm_set1_epi8(LAYER_COLOUR);
+    __m128i hits = zero;
+    for (; x + 16 <= x1; x += 16) {
+        __m128i *dest = reinterpret_cast<__m128i *>(background + x);
+        __m128i bg = _mm_loadu_si128(dest);
+        __m128i sprite = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(sprites + x));
+        __m128i noSprite = _mm_cmpeq_epi8(sprite, zero);
+        __m128i noBackground = _mm_cmpeq_epi8(bg, zero);
+        __m128i behind = _mm_cmpeq_epi8(_mm_and_si128(sprite, behindBit),
+                behindBit);
+        __m128i keep = _mm_or_si128(noSprite,
+                _mm_andnot_si128(noBackground, behind));
+        _mm_storeu_si128(dest, _mm_or_si128(_mm_and_si128(keep, bg),
+                    _mm_andnot_si128(keep, _mm_and_si128(sprite, colour))));
+        hits = _mm_or_si128(hits, _mm_andnot_si128(noBackground,
+                    _mm_cmpeq_epi8(_mm_and_si128(sprite, zeroBit), zeroBit)));
+    }
+    hit = _mm_movemask_epi8(hits);
+#endif
+    for (; x < x1; x++) {
+        u8 sprite = sprites[x];
+        if (!sprite) {
+            continue;
+        }
+        if (background[x] && (sprite & LAYER_ZERO)) {
+            hit = true;
+        }
+        if (!background[x] || !(sprite & LAYER_BEHIND)) {
+            background[x] = sprite & LAYER_COLOUR;
+        }
+    }
+    return hit;
+}
+
+/**
+ * Renders the background pixels [x0, x1) of a line as palette RAM indices,
+ * 0 where the background is transparent. The line starts at the tile the
+ * VRAM address points at, fine x pixels in. The tiles are either copied out
+ * of the tile cache or fetched first and then decoded in one go. Fine x is
+ * taken care of by where the pixels are stored, so out needs 8 bytes to
+ * spare on either side of the line.
+ *
+ * @param address: v at the start of the line.
+ * @param offset: The tileOffset the line is fetched with.
+ */
+void Ppu::render_background(u16 address, s32 offset, u32 x0, u32 x1,
+        u8 *out, bool cached)
+{
+    u32 fineY = address >> 12;
+    u32 coarseY = (address >> 5) & 31;
+    u32 table = (ctrl & CTRL_BACKGROUND_TABLE) << 8;
+    u32 first = (x0 + fineX) >> 3;
+    u32 last = (x1 - 1 + fineX) >> 3;
+    u8 *pixels = out + x0 - ((x0 + fineX) & 7);
+    u8 lows[WIDTH / 8 + 1];
+    u8 highs[WIDTH / 8 + 1];
+    u8 palettes[WIDTH / 8 + 1];
+
+    for (u32 tile = first; tile <= last; tile++) {
+        u32 column = ((address & 31) + tile + offset) & 63;
+        u16 nametable = (address & 0x0c00) ^ ((column & 32) << 5);
+        column &= 31;
+        u8 index = read_vram(0x2000 | nametable | (coarseY << 5) | column);
+        u8 attribute = read_vram(0x23c0 | nametable | ((coarseY >> 2) << 3)
+                | (column >> 2));
+        u32 shift = ((coarseY & 2) << 1) | (column & 2);
+        u8 paletteBase = ((attribute >> shift) & 3) << 2;
+        u16 row = table | (index << 4) | fineY;
+        if (cached) {
+            memcpy(pixels + (tile - first) * 8, cached_row(row, paletteBase),
+                    8);
+        } else {
+            palettes[tile - first] = paletteBase;
+            lows[tile - first] = read_vram(row);
+            highs[tile - first] = read_vram(row | 8);
+        }
+    }
+    if (!cached) {
+        decodeTiles(lows, highs, palettes, last - first + 1, pixels);
+    }
+}
+
+/**
+ * @param address: The address of a row of a tile in the pattern tables.
+ * @return: The row's 8 pixels, from the tile cache.
+ */
+const u8 *Ppu::cached_row(u16 address, u8 palette)
+{
+    const u8 *pattern = chr[address >> 10] + (address & 0x3f0);
+    return tileCache->lookup(address >> 4, palette, pattern)
+        + (address & 7) * 8;
+}
+
+/**
+ * Drops the cached tile of every bank the written CHR RAM byte shows up in,
+ * there is more than one when banks are mirrored.
+ */
+void Ppu::invalidate_chr(const u8 *data)
+{
+    uintptr_t written = reinterpret_cast<uintptr_t>(data);
+    for (u32 bank = 0; bank < 8; bank++) {
+        uintptr_t offset = written - reinterpret_cast<uintptr_t>(chr[bank]);
+        if (offset < 0x400) {
+            tileCache->invalidate_tile(bank * 64 + (offset >> 4));
+        }
+    }
+}
+
+/**
+ * Renders the pixels [x0, x1) of the current line into the frame. This is
+ * also where the sprite 0 hit is found, on the pixel it happens on.
+ */
+void Ppu::render_pixels(u32 x0, u32 x1)
+{
+    if (skipping) {
+        find_sprite_zero_hit(x0, x1);
+        return;
+    }
+    if (line < bandsEnd) {
+        return;
+    }
+    if (render_span(line, v, tileOffset, spriteLine, spriteCount, x0, x1,
+                tileCache != NULL)) {
+        status |= STATUS_SPRITE_ZERO;
+    }
+}
+
+/**
+ * Renders the pixels [x0, x1) of a line into the frame, given the state
+ * that changes from line to line. Only the line in the frame is written to,
+ * so lines can be rendered on different threads as long as they leave the
+ * tile cache alone.
+ *
+ * @param address: v at the start of the line.
+ * @param offset: The tileOffset the line is fetched with.
+ * @param sprites: The line's sprite pixels, see draw_sprites().
+ * @return: Whether sprite 0 hit.
+ */
+bool Ppu::render_span(u32 y, u16 address, s32 offset, const u8 *sprites,
+        u32 sprite_count, u32 x0, u32 x1, bool cached)
+{
+    u8 *out = frame[y];
+    u8 colourMask = (mask & MASK_GRAYSCALE) ? 0x30 : 0x3f;
+    emphasis[y] = mask >> 5;
+
+    if (!rendering()) {
+        // with rendering off the backdrop shows, or the palette entry v
+        // points at
+        u8 colour = palette[(address & 0x3f00) == 0x3f00
+            ? palette_index(address) : 0];
+        memset(out + x0, colour & colourMask, x1 - x0);
+        return false;
+    }
+
+    // the decoder may spill up to 7 pixels past either end of the span
+    u8 buffer[WIDTH + 16];
+    u8 *background = buffer + 8;
+    if (mask & MASK_BACKGROUND) {
+        render_background(address, offset, x0, x1, background, cached);
+    } else {
+        memset(background + x0, 0, x1 - x0);
+    }
+    if (!(mask & MASK_BACKGROUND_LEFT)) {
+        for (u32 x = x0; x < std::min(x1, 8u); x++) {
+            background[x] = 0;
+        }
+    }
+
+    bool hit = false;
+    if ((mask & MASK_SPRITES) && sprite_count) {
+        u32 spriteLeft = (mask & MASK_SPRITES_LEFT) ? 0 : 8;
+        hit = composite_sprites(background, sprites, std::max(x0, spriteLeft),
+                x1);
+    }
+    for (u32 x = x0; x < x1; x++) {
+        out[x] = palette[background[x]] & colourMask;
+    }
+    return hit;
+}
+
+/**
+ * Renders the lines from the current one up to the next write in the log
+ * being replayed on the band pool, if there are enough of them to be worth
+ * it. Only whole lines count, a write anywhere in a line may change how the
+ * next one is rendered. The sprite 0 hits of those lines are not looked
+ * for, a copy only replays what the cpu already saw.
+ */
+void Ppu::render_bands(void)
+{
+    const std::vector<PpuLog::Entry> &entries = replayLog->entries;
+    replayQuiet = std::max(replayQuiet, replayNext);
+    while (replayQuiet < entries.size()
+            && entries[replayQuiet].type == PpuLog::READ
+            && entries[replayQuiet].address == 2) {
+        replayQuiet++;
+    }
+    u64 quietEnd = replayQuiet < entries.size() ? entries[replayQuiet].dot
+        : replayLog->endDot;
+    u32 lines = static_cast<u32>(std::min<u64>(
+                (quietEnd - dotClock) / DOTS_PER_LINE, HEIGHT - line));
+    u32 bands = std::min(bandPool->get_thread_count(),
+            lines / MIN_BAND_LINES);
+    if (bands < 2) {
+        return;
+    }
+
+    if (spriteListsDirty) {
+        build_sprite_lists();
+    }
+    u32 first = line;
+    u16 address = v;
+    for (u32 band = 1; band <= bands; band++) {
+        u32 end = line + lines * band / bands;
+        bandPool->submit([this, first, end, address] {
+            render_band(first, end, address);
+        });
+        for (; first < end; first++) {
+            address = next_line_address(address);
+        }
+    }
+    bandPool->wait();
+    bandsEnd = line + lines;
+    bandLines += lines;
+}
+
+/**
+ * Renders the lines [first, end) of a band, on a thread of the band pool.
+ * The current line has its sprites drawn already, the rest draw their own.
+ *
+ * @param address: v at the start of the first line.
+ */
+void Ppu::render_band(u32 first, u32 end, u16 address)
+{
+    u8 sprites[WIDTH + 8];
+    for (u32 y = first; y < end; y++) {
+        if (y == line) {
+            render_span(y, address, tileOffset, spriteLine, spriteCount, 0,
+                    WIDTH, false);
+        } else {
+            memset(sprites, 0, sizeof(sprites));
+            u32 count = 0;
+            s32 zeroX;
+            if (rendering()) {
+                count = draw_sprites(y - 1, lineSpriteCount[y - 1], sprites,
+                        &zeroX, false);
+            }
+            render_span(y, address, 0, sprites, count, 0, WIDTH, false);
+        }
+        address = next_line_address(address);
+    }
+}
+
+/**
+ * Finds the sprite 0 hit in the pixels [x0, x1) of a skipped frame, which
+ * is all of rendering the cpu can see. Only the background under sprite 0
+ * is fetched, and only until the hit is found.
+ */
+void Ppu::find_sprite_zero_hit(u32 x0, u32 x1)
+{
+    const u8 both = MASK_BACKGROUND | MASK_SPRITES;
+    if (spriteZeroX < 0 || (status & STATUS_SPRITE_ZERO)
+            || (mask & both) != both) {
+        return;
+    }
+    u32 left = std::max(x0, static_cast<u32>(spriteZeroX));
+    if (!(mask & MASK_BACKGROUND_LEFT) || !(mask & MASK_SPRITES_LEFT)) {
+        left = std::max(left, 8u);
+    }
+    u32 right = std::min(x1, static_cast<u32>(spriteZeroX) + 8);
+    if (left >= right) {
+        return;
+    }
+
+    u8 buffer[WIDTH + 16];
+    u8 *background = buffer + 8;
+    render_background(v, tileOffset, left, right, background,
+            tileCache != NULL);
+    if (composite_sprites(background, spriteLine, left, right)) {
+        status |= STATUS_SPRITE_ZERO;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Registers
+//-----------------------------------------------------------------------------
+
+u8 Ppu::io_read(u16 address)
+{
+    if (address >= 0x4000) {
+        return ioPage[address & 0xff];
+    }
+
+    sync();
+    u32 reg = address & 7;
+    if (log && (reg == 2 || reg == 7)) {
+        record(PpuLog::READ, reg, 0);
+    }
+    return read_register(reg);
+}
+
+/**
+ * Does what reading a register does, once the PPU has caught up.
+ */
+u8 Ppu::read_register(u32 reg)
+{
+    switch (reg) {
+    case 2: {
+        if (line == VBLANK_LINE && dot == 1) {
+            // read a dot before vblank starts, the flag is never seen and
+            // the NMI never fires
+            suppressVblank = true;
+        } else if (line == VBLANK_LINE && dot <= 3) {
+            // read just as vblank starts, the NMI is lost
+            if (cpu) {
+                cpu->cancel_nmi();
+            }
+        }
+        latch = (status & 0xe0) | (latch & 0x1f);
+        status &= ~STATUS_VBLANK;
+        w = false;
+        break;
+    }
+    case 4:
+        latch = oam[oamAddr];
+        if ((oamAddr & 3) == 2) {
+            // the unused attribute bits do not exist
+            latch &= 0xe3;
+        }
+        break;
+    case 7:
+        latch = read_data();
+        break;
+    }
+    // the write only registers read back what was last on the bus
+    return latch;
+}
+
+void Ppu::io_write(u16 address, u8 val)
+{
+    if (address >= 0x4000) {
+        if (address == 0x4014) {
+            oam_dma(val);
+        } else {
+            ioPage[address & 0xff] = val;
+        }
+        return;
+    }
+
+    sync();
+    if (log) {
+        record(PpuLog::WRITE, address & 7, val);
+    }
+    write_register(address & 7, val);
+}
+
+void Ppu::write_register(u32 reg, u8 val)
+{
+    latch = val;
+    switch (reg) {
+    case 0: {
+        u8 old = ctrl;
+        ctrl = val;
+        if ((old ^ val) & CTRL_TALL_SPRITES) {
+            spriteListsDirty = true;
+        }
+        t = (t & ~0x0c00) | ((val & 3) << 10);
+        if (!cpu) {
+            break;
+        }
+        if (!(old & CTRL_NMI) && (val & CTRL_NMI) && (status & STATUS_VBLANK)) {
+            // turning NMIs on during vblank fires one straight away
+            cpu->trigger_nmi();
+        } else if ((old & CTRL_NMI) && !(val & CTRL_NMI)
+                && line == VBLANK_LINE && dot <= 3) {
+            cpu->cancel_nmi();
+        }
+        break;
+    }
+    case 1:
+        mask = val;
+        break;
+    case 3:
+        oamAddr = val;
+        break;
+    case 4:
+        oam[oamAddr++] = val;
+        spriteListsDirty = true;
+        break;
+    case 5:
+        if (!w) {
+            t = (t & ~0x001f) | (val >> 3);
+            fineX = val & 7;
+        } else {
+            t = (t & ~0x73e0) | ((val & 0xf8) << 2) | ((val & 7) << 12);
+        }
+        w = !w;
+        break;
+    case 6:
+        if (!w) {
+            t = (t & 0x00ff) | ((val & 0x3f) << 8);
+        } else {
+            t = (t & 0xff00) | val;
+            v = t;
+            if (line < HEIGHT && dot >= 1 && dot <= 256 && rendering()) {
+                // the two tiles already fetched still come out first
+                tileOffset = -static_cast<s32>(((dot - 1 + fineX) >> 3) + 2);
+            }
+        }
+        w = !w;
+        break;
+    case 7:
+        write_data(val);
+        break;
+    }
+}
+
+u8 Ppu::read_data(void)
+{
+    u16 address = v & 0x3fff;
+    u8 val;
+    if (address >= 0x3f00) {
+        // palette reads skip the buffer, which gets the nametable byte
+        // underneath instead
+        u8 colourMask = (mask & MASK_GRAYSCALE) ? 0x30 : 0x3f;
+        val = (palette[palette_index(address)] & colourMask) | (latch & 0xc0);
+        readBuffer = read_vram(address & 0x2fff);
+    } else {
+        val = readBuffer;
+        readBuffer = read_vram(address);
+    }
+    v = (v + ((ctrl & CTRL_INCREMENT) ? 32 : 1)) & 0x7fff;
+    return val;
+}
+
+void Ppu::write_data(u8 val)
+{
+    store_vram(v, val);
+    v = (v + ((ctrl & CTRL_INCREMENT) ? 32 : 1)) & 0x7fff;
+}
+
+/**
+ * Copies a page of cpu memory to OAM. The cpu is halted for 513 cycles, 514
+ * if the write landed on an odd cycle.
+ */
+void Ppu::oam_dma(u8 page)
+{
+    sync();
+    u64 cycle = cpu->get_access_cycle();
+    u8 data[0x100];
+    for (u32 i = 0; i < 0x100; i++) {
+        data[i] = cpu->read_memory((page << 8) | i);
+    }
+    if (log) {
+        record(PpuLog::DMA, 0, page, log->bytes.size());
+        log->bytes.insert(log->bytes.end(), data, data + sizeof(data));
+    }
+    write_oam_page(data);
+    cpu->tick(513 + (cycle & 1));
+}
+
+void Ppu::write_oam_page(const u8 *page)
+{
+    for (u32 i = 0; i < 0x100; i++) {
+        oam[(oamAddr + i) & 0xff] = page[i];
+    }
+    spriteListsDirty = true;
+}
@@ -0,0 +1,396 @@
+#ifndef PPU_H
+#define PPU_H
+
+#include "utils.h"
+#include "bus.h"
+#include "cpu.h"
+#include "tile_cache.h"
+#include <memory>
+#include <vector>
+
+class ThreadPool;
+
+/**
+ * Everything done to a PPU during a frame that changes what it draws: the
+ * register accesses with side effects, OAM DMA, direct VRAM writes and CHR
+ * bank switches, each stamped with the dot it happened on. Replaying the log
+ * on a copy of the PPU, see Ppu::replay(), draws the same frame. The vectors
+ * are cleared rather than freed between frames, so a log stops allocating
+ * once it has seen a busy frame.
+ */
+struct PpuLog
+{
+    enum Type : u8
+    {
+        WRITE,      // to a register, $2000-$2007
+        READ,       // of $2002 or $2007, which change w or v
+        DMA,        // data is where the 256 bytes are in bytes
+        VRAM,       // a write_vram()
+        CHR,        // a map_chr(), data indexes chrMaps
+        MIRRORING,  // a set_mirroring(), val is the mirroring
+    };
+
+    struct Entry
+    {
+        u64 dot;        // the PPU's dot clock when it happened
+        u32 data;
+        u16 address;
+        Type type;
+        u8 val;
+    };
+
+    struct ChrMap
+    {
+        u16 address;
+        u32 size;
+        u8 *storage;
+        u32 storageSize;
+        u32 offset;
+        bool writable;
+        u32 snapshot;   // where a copy of CHR RAM is in bytes, or NO_SNAPSHOT
+    };
+
+    static const u32 NO_SNAPSHOT = ~0u;
+
+    std::vector<Entry> entries;
+    std::vector<ChrMap> chrMaps;
+    std::vector<u8> bytes;
+    u64 endDot;     // the frame ends once the PPU has run up to here
+
+    void clear(void);
+};
+
+/**
+ * Takes the logs of a recording PPU, see Ppu::set_recorder().
+ */
+class PpuRecorder
+{
+public:
+    virtual ~PpuRecorder(void) {}
+
+    /**
+     * Called on the emulation thread every time a frame ends.
+     *
+     * @param log: The frame's log, the PPU doesn't touch it again.
+     * @return: An empty log to record the next frame into.
+     */
+    virtual PpuLog *frame_logged(PpuLog *log) = 0;
+};
+
+/**
+ * Counts the PPU's scanlines, e.g. a mapper's IRQ counter, see
+ * Ppu::set_line_counter(). The MMC3 clocks its counter on the rises of PPU
+ * A12, which with the background at $0000 and the sprites at $1000, the
+ * layout its games use, comes once a line as the sprites are fetched.
+ */
+class PpuLineCounter
+{
+public:
+    virtual ~PpuLineCounter(void) {}
+
+    /**
+     * Called at dot 260 of every visible line and the pre-render line
+     * while rendering is on.
+     */
+    virtual void clock_line(void) = 0;
+};
+
+/**
+ * The 2C02 picture processing unit. The PPU is not stepped with the cpu,
+ * it sleeps until it is accessed through $2000-$2007, until the cpu reaches
+ * the start of vblank, where an NMI may fire, or until the frame is asked
+ * for. Then it catches up to the cpu a scanline at a time, rendering the
+ * pixels in between. Everything the cpu can observe happens on the dot it
+ * would on hardware: the vblank flag and NMI at dot 1 of line 241, the
+ * sprite 0 hit on the dot of the first overlapping pixel and the flags being
+ * cleared at dot 1 of the pre-render line.
+ */
+class Ppu : public IoDevice, public ClockedDevice
+{
+public:
+    static const u32 WIDTH = 256;
+    static const u32 HEIGHT = 240;
+    static const u32 DOTS_PER_LINE = 341;
+    static const u32 LINES_PER_FRAME = 262;
+    static const u32 VBLANK_LINE = 241;
+    static const u32 PRERENDER_LINE = 261;
+
+    enum Mirroring
+    {
+        HORIZONTAL,
+        VERTICAL,
+        SINGLE_LOWER,
+        SINGLE_UPPER,
+        FOUR_SCREEN,
+    };
+
+    /**
+     * Maps the PPU registers at $2000-$3FFF and OAM DMA at $4014 on the
+     * cpu's bus and runs the PPU off the cpu's clock, until it is
+     * destroyed. An Apu made after it has to be destroyed first.
+     */
+    Ppu(Cpu &c);
+
+    /**
+     * Makes a detached copy of a PPU, for replaying its logs on another
+     * thread. The copy has no cpu and only runs through replay(). It shares
+     * the source's CHR ROM, which has to outlive it, but gets its own copy
+     * of any CHR RAM.
+     */
+    Ppu(const Ppu &source);
+
+    /**
+     * Unmaps the pages the PPU still handles and detaches it from the cpu.
+     */
+    ~Ppu(void);
+
+    Ppu &operator=(const Ppu &) = delete;
+
+    /**
+     * Maps CHR ROM or RAM onto a range of the pattern tables, in 1KB banks.
+     * If the storage is smaller than the range it is mirrored across it.
+     *
+     * @param offset: Where in the storage the range starts, for a bank of
+     * a larger CHR RAM, which stays one storage for the copies.
+     */
+    void map_chr(u16 address, u32 size, u8 *storage, u32 storage_size,
+            bool writable, u32 offset = 0);
+
+    /**
+     * Maps CHR ROM, e.g. straight from a cartridge's mapped file, which is
+     * never written.
+     */
+    void map_chr_rom(u16 address, u32 size, const u8 *storage,
+            u32 storage_size);
+
+    /**
+     * Unmaps a range of the pattern tables, which reads as zero again.
+     */
+    void unmap_chr(u16 address, u32 size);
+
+    void set_mirroring(Mirroring mirroring);
+
+    /**
+     * Picks the kernel the background tiles are decoded with, by default the
+     * fastest one the host cpu has.
+     *
+     * @return: False if the host cpu can't run it.
+     */
+    bool set_tile_decoder(TileDecoderKind kind);
+
+    /**
+     * Turns the tile cache on or off. With the cache on, tiles are decoded
+     * once and fetched by copying rows out of the cache, see TileCache.
+     */
+    void set_tile_cache(bool enabled);
+    bool get_tile_cache(void) const;
+
+    /**
+     * @return: The hit rate and invalidation counts of the tile cache, all
+     * zero while it is off.
+     */
+    TileCacheStats get_tile_cache_stats(void) const;
+
+    /**
+     * Runs the cpu until the PPU has finished the next frame, which is when
+     * it enters vblank, or until the cpu reaches a cycle, give or take an
+     * instruction.
+     *
+     * @param end: The cycle to stop on if the frame hasn't finished by then.
+     * @return: Whether the frame finished.
+     */
+    bool run_frame(u64 end = UINT64_MAX);
+
+    /**
+     * @return: The last frame, WIDTH x HEIGHT colour indices into the NES
+     * palette, 0-63, with grayscale applied.
+     */
+    const u8 *get_frame(void) const;
+
+    /**
+     * @return: The colour emphasis bits (PPUMASK bits 5-7, shifted down) a
+     * line of the frame was rendered with.
+     */
+    u8 get_emphasis(u32 line) const;
+
+    /**
+     * Skips producing the pixels of frames, from the next frame to start on.
+     * Everything the cpu can see still happens when it would: vblank and the
+     * NMI, sprite overflow and the sprite 0 hit, for which only sprite 0
+     * and the background under it are fetched. Setting it between frames,
+     * e.g. between calls to run_frame(), picks which frames are rendered.
+     */
+    void set_skip_rendering(bool skip);
+    bool get_skip_rendering(void) const;
+
+    /**
+     * @return: Whether the last finished frame was rendered, if not
+     * get_frame() still holds the last one that was.
+     */
+    bool is_frame_rendered(void) const;
+
+    /**
+     * Logs every frame from here on and hands the logs to the recorder as
+     * the frames end, see PpuLog. NULL stops logging.
+     *
+     * @param log: The log to record the rest of this frame into.
+     */
+    void set_recorder(PpuRecorder *recorder, PpuLog *log);
+
+    /**
+     * Clocks the counter as the lines are run, NULL for none. The PPU runs
+     * behind the cpu, so a mapper has to catch it up before it looks at the
+     * count. Copies never clock it.
+     */
+    void set_line_counter(PpuLineCounter *counter);
+
+    /**
+     * Runs a detached copy of a PPU through a frame its source logged. The
+     * copy has to have replayed every log the source made before this one.
+     */
+    void replay(const PpuLog &log);
+
+    /**
+     * Splits the runs of whole lines in which a replayed log has no writes
+     * into bands and renders them on the pool's threads, before running
+     * through them. Reads of $2002 don't break a run, they only change w
+     * and the flags. The rest of the lines are rendered in turn as before.
+     * NULL renders every line in turn.
+     */
+    void set_band_pool(ThreadPool *pool);
+
+    /**
+     * @return: The lines rendered in bands so far.
+     */
+    u64 get_band_line_count(void) const;
+
+    u64 get_frame_count(void) const;
+    u32 get_line(void) const;
+    u32 get_dot(void) const;
+
+    /**
+     * Accesses the PPU address space directly, without the side effects of
+     * going through $2006 and $2007.
+     */
+    u8 read_vram(u16 address) const;
+    void write_vram(u16 address, u8 val);
+
+    u64 catch_up(u64 cycle) override;
+    u8 io_read(u16 address) override;
+    void io_write(u16 address, u8 val) override;
+
+private:
+    struct ChrShadow
+    {
+        const u8 *storage;      // the source's CHR RAM
+        std::vector<u8> data;   // the copy's
+    };
+
+    Cpu *cpu;       // NULL for a detached copy
+    u64 cycleBase;  // the cpu cycle the PPU started on
+
+    // registers
+    u8 ctrl;
+    u8 mask;
+    u8 status;
+    u8 oamAddr;
+    u8 latch;       // the last value on the PPU's data bus
+    u8 readBuffer;
+    u16 v;          // the current VRAM address
+    u16 t;          // the temporary VRAM address
+    u8 fineX;
+    bool w;         // the write toggle of $2005 and $2006
+
+    // memory
+    const u8 *chr[8];
+    u8 *chrWrite[8];    // NULL for CHR ROM
+    u8 *chrStorage[8];  // what each bank was mapped from
+    u32 chrStorageSize[8];
+    u8 *nametables[4];
+    u8 vram[0x1000];
+    u8 palette[0x20];
+    u8 oam[0x100];
+    u8 openChr[0x400];  // the pattern tables read as zero until mapped
+    u8 ioPage[0x100];   // the rest of $4000-$40FF, plain memory for now
+
+    // timing
+    u64 dotClock;   // dots run since the PPU started
+    u32 line;
+    u32 dot;        // the next dot to run
+    bool oddFrame;
+    bool suppressVblank;
+    u64 frameCount;
+    bool skipRendering;
+    bool skipping;          // the frame being run is skipped
+    bool frameRendered;     // the last finished frame was not skipped
+
+    // rendering
+    s32 tileOffset; // moves the tile fetches after v is written mid line
+    u32 spriteCount;    // on the line being rendered
+    s32 spriteZeroX;    // where sprite 0 is on it, -1 if it isn't
+    u8 spriteLine[WIDTH + 8];   // its sprite pixels, see evaluate_sprites()
+
+    // the sprites each line finds, by the line they are evaluated on
+    u8 lineSprites[HEIGHT][8];
+    u8 lineSpriteCount[HEIGHT];
+    bool lineOverflow[HEIGHT];
+    bool spriteListsDirty;  // OAM or the sprite size changed since
+    TileDecoder decodeTiles;
+    std::unique_ptr<TileCache> tileCache;   // NULL while it's off
+    u8 frame[HEIGHT][WIDTH];
+    u8 emphasis[HEIGHT];
+
+    // recording and replaying
+    PpuRecorder *recorder;
+    PpuLineCounter *lineCounter;
+    PpuLog *log;                    // NULL while not recording
+    u64 loggedFrames;               // the frames handed to the recorder
+    std::vector<const u8 *> loggedChr;  // CHR RAM the copies have
+    std::vector<ChrShadow> chrShadows;  // a copy's own CHR RAM
+    const PpuLog *replayLog;        // NULL unless replaying
+    u32 replayNext;                 // the next entry to replay
+    u32 replayQuiet;                // no writes before this entry
+    ThreadPool *bandPool;
+    u32 bandsEnd;                   // the lines before are rendered already
+    u64 bandLines;
+
+    bool rendering(void) const
+    {
+        return mask & 0x18;
+    }
+
+    void sync(void);
+    void run_to(u64 target);
+    void run_line(u32 from, u32 to);
+    void next_line(void);
+    u64 next_event(void) const;
+    void start_vblank(void);
+    static u16 increment_y(u16 address);
+    u16 next_line_address(u16 address) const;
+    void build_sprite_lists(void);
+    void clear_sprites(void);
+    void evaluate_sprites(void);
+    u32 draw_sprites(u32 y, u32 count, u8 *out, s32 *zeroX, bool cached);
+    void render_pixels(u32 x0, u32 x1);
+    bool render_span(u32 y, u16 address, s32 offset, const u8 *sprites,
+            u32 sprite_count, u32 x0, u32 x1, bool cached);
+    void render_bands(void);
+    void render_band(u32 first, u32 end, u16 address);
+    void find_sprite_zero_hit(u32 x0, u32 x1);
+    void render_background(u16 address, s32 offset, u32 x0, u32 x1,
+            u8 *out, bool cached);
+    const u8 *cached_row(u16 address, u8 palette);
+    void invalidate_chr(const u8 *data);
+    static u32 palette_index(u16 address);
+    void store_vram(u16 address, u8 val);
+    void record(PpuLog::Type type, u16 address, u8 val, u32 data = 0);
+    u8 *shadow_chr(const u8 *storage, u32 size, const u8 *contents);
+    u8 read_register(u32 reg);
+    void write_register(u32 reg, u8 val);
+    void write_oam_page(const u8 *page);
+    u8 read_data(void);
+    void write_data(u8 val);
+    void oam_dma(u8 page);
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include <string.h>
+
+#include "render_thread.h"
+
+RenderThread::RenderThread(Ppu &ppu, u32 band_threads) : ppu(ppu),
+    stopping(false), finished(0), dropped(0), logged(0), bandLines(0)
+{
+    skipRendering = ppu.get_skip_rendering();
+    copy.reset(new Ppu(ppu));
+    if (band_threads != 1) {
+        bandPool.reset(new ThreadPool(band_threads));
+        copy->set_band_pool(bandPool.get());
+    }
+    for (u32 i = 1; i < LOGS; i++) {
+        emptyLogs.push(&logs[i]);
+    }
+    frames.reset(new Frame[FRAMES]);
+    for (u32 i = 0; i < FRAMES; i++) {
+        freeFrames.push(&frames[i]);
+    }
+    logs[0].clear();
+    ppu.set_recorder(this, &logs[0]);
+    ppu.set_skip_rendering(true);
+    thread = std::thread(&RenderThread::run, this);
+}
+
+RenderThread::~RenderThread(void)
+{
+    stopping = true;
+    thread.join();
+    ppu.set_recorder(NULL, NULL);
+    ppu.set_skip_rendering(skipRendering);
+}
+
+const RenderThread::Frame *RenderThread::acquire_frame(void)
+{
+    Frame *frame;
+    return readyFrames.pop(frame) ? frame : NULL;
+}
+
+const RenderThread::Frame *RenderThread::wait_frame(void)
+{
+    u32 tries = 0;
+    while (finished.load(std::memory_order_acquire) < logged.load()) {
+        back_off(tries);
+    }
+    return acquire_frame();
+}
+
+void RenderThread::release_frame(const Frame *frame)
+{
+    freeFrames.push(const_cast<Frame *>(frame));
+}
+
+u64 RenderThread::get_dropped_frames(void) const
+{
+    return dropped;
+}
+
+u64 RenderThread::get_band_line_count(void) const
+{
+    return bandLines;
+}
+
+/**
+ * Hands the finished log to the render thread and takes an empty one, which
+ * only has to be waited for when the thread is all the logs behind.
+ */
+PpuLog *RenderThread::frame_logged(PpuLog *log)
+{
+    fullLogs.push(log);
+    logged++;
+    PpuLog *next;
+    u32 tries = 0;
+    while (!emptyLogs.pop(next)) {
+        back_off(tries);
+    }
+    return next;
+}
+
+void RenderThread::run(void)
+{
+    u32 tries = 0;
+    while (!stopping) {
+        PpuLog *log;
+        if (!fullLogs.pop(log)) {
+            back_off(tries);
+            continue;
+        }
+        tries = 0;
+        copy->replay(*log);
+        emptyLogs.push(log);
+        bandLines = copy->get_band_line_count();
+
+        Frame *frame;
+        if (freeFrames.pop(frame)) {
+            frame->number = copy->get_frame_count();
+            memcpy(frame->pixels, copy->get_frame(), sizeof(frame->pixels));
+            for (u32 y = 0; y < Ppu::HEIGHT; y++) {
+                frame->emphasis[y] = copy->get_emphasis(y);
+            }
+            readyFrames.push(frame);
+        } else {
+            dropped++;
+        }
+        finished.fetch_add(1, std::memory_order_release);
+    }
+}
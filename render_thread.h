@@ -0,0 +1,105 @@
+#ifndef RENDER_THREAD_H
+#define RENDER_THREAD_H
+
+#include "utils.h"
+#include "ppu.h"
+#include "spsc_ring.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+
+/**
+ * Draws a PPU's frames on a thread of its own, so the cpu can run the next
+ * frame while the last one is drawn. The PPU stops drawing and only keeps
+ * the timing the cpu sees, while logging what it is told to do, see PpuLog.
+ * At the end of every frame the log goes to the render thread, which
+ * replays it on a copy of the PPU and puts the frame in a ring for the
+ * caller to take. Logs and frames go back and forth through lock-free
+ * rings. The cpu only waits when it is a whole ring of logs ahead, and
+ * frames the caller hasn't made room for are dropped rather than holding up
+ * the cpu.
+ */
+class RenderThread : public PpuRecorder
+{
+public:
+    static const u32 LOGS = 4;
+    static const u32 FRAMES = 4;
+
+    struct Frame
+    {
+        u64 number;     // the PPU's frame count at the end of the frame
+        u8 pixels[Ppu::HEIGHT][Ppu::WIDTH];     // see Ppu::get_frame()
+        u8 emphasis[Ppu::HEIGHT];               // see Ppu::get_emphasis()
+    };
+
+    /**
+     * Starts drawing the PPU's frames, from the one it is on. The PPU's own
+     * frame is not updated while the render thread runs.
+     *
+     * @param band_threads: With more than one, the runs of lines without
+     * writes are split across a pool of that many threads, see
+     * Ppu::set_band_pool(). 0 for one per core.
+     */
+    RenderThread(Ppu &ppu, u32 band_threads = 1);
+
+    /**
+     * Stops the thread, dropping the frames not yet drawn, and lets the PPU
+     * draw again from its next frame.
+     */
+    ~RenderThread(void);
+
+    /**
+     * @return: The oldest drawn frame, or NULL if none is ready. It stays
+     * valid until it is released.
+     */
+    const Frame *acquire_frame(void);
+
+    /**
+     * Blocks until the frame the PPU last finished is drawn.
+     *
+     * @return: The oldest drawn frame, NULL if that frame was dropped.
+     */
+    const Frame *wait_frame(void);
+
+    /**
+     * Hands a frame back, frames have to be released in the order they were
+     * acquired.
+     */
+    void release_frame(const Frame *frame);
+
+    /**
+     * @return: The frames dropped because all the buffers were taken.
+     */
+    u64 get_dropped_frames(void) const;
+
+    /**
+     * @return: The lines drawn in bands across the pool so far.
+     */
+    u64 get_band_line_count(void) const;
+
+    PpuLog *frame_logged(PpuLog *log) override;
+
+private:
+    Ppu &ppu;
+    bool skipRendering;     // the PPU's, to put back
+    std::unique_ptr<Ppu> copy;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    std::atomic<u64> finished;  // frames drawn or dropped
+    std::atomic<u64> dropped;
+    std::atomic<u64> logged;    // frames handed to the thread
+    std::atomic<u64> bandLines;
+    std::unique_ptr<ThreadPool> bandPool;   // NULL to draw lines in turn
+
+    PpuLog logs[LOGS];
+    SpscRing<PpuLog *, LOGS> fullLogs;      // to the render thread
+    SpscRing<PpuLog *, LOGS> emptyLogs;     // back to the PPU
+    std::unique_ptr<Frame[]> frames;
+    SpscRing<Frame *, FRAMES> readyFrames;  // to the caller
+    SpscRing<Frame *, FRAMES> freeFrames;   // back to the render thread
+
+    void run(void);
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+#include "resampler.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define RESAMPLER_X86
+#include <immintrin.h>
+#endif
+
+static const u32 FRACTION_BITS = 32;
+
+static float dot_scalar(const float *in, const float *taps)
+{
+    float sum = 0;
+    for (u32 i = 0; i < Resampler::TAPS; i++) {
+        sum += in[i] * taps[i];
+    }
+    return sum;
+}
+
+#ifdef RESAMPLER_X86
+
+static float dot_sse2(const float *in, const float *taps)
+{
+    // two sums, so each add doesn't wait for the one before it
+    __m128 a = _mm_setzero_ps();
+    __m128 b = _mm_setzero_ps();
+    for (u32 i = 0; i < Resampler::TAPS; i += 8) {
+        a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(in + i),
+                    _mm_loadu_ps(taps + i)));
+        b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(in + i + 4),
+                    _mm_loadu_ps(taps + i + 4)));
+    }
+    a = _mm_add_ps(a, b);
+    a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+    a = _mm_add_ss(a, _mm_shuffle_ps(a, a, 1));
+    return _mm_cvtss_f32(a);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *in, const float *taps)
+{
+    __m256 a = _mm256_setzero_ps();
+    __m256 b = _mm256_setzero_ps();
+    for (u32 i = 0; i < Resampler::TAPS; i += 16) {
+        a = _mm256_fmadd_ps(_mm256_loadu_ps(in + i),
+                _mm256_loadu_ps(taps + i), a);
+        b = _mm256_fmadd_ps(_mm256_loadu_ps(in + i + 8),
+                _mm256_loadu_ps(taps + i + 8), b);
+    }
+    a = _mm256_add_ps(a, b);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(a),
+            _mm256_extractf128_ps(a, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+#endif
+
+bool resampler_supported(ResamplerKind kind)
+{
+    switch (kind) {
+    case RESAMPLER_SCALAR:
+        return true;
+#ifdef RESAMPLER_X86
+    case RESAMPLER_SSE2:
+        // part of x86-64
+        return true;
+    case RESAMPLER_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    default:
+        return false;
+    }
+}
+
+ResamplerKind best_resampler_kind(void)
+{
+    static const ResamplerKind order[] = {RESAMPLER_AVX2, RESAMPLER_SSE2};
+    for (ResamplerKind kind : order) {
+        if (resampler_supported(kind)) {
+            return kind;
+        }
+    }
+    return RESAMPLER_SCALAR;
+}
+
+const char *resampler_kind_name(ResamplerKind kind)
+{
+    static const char *names[RESAMPLER_KIND_COUNT] = {
+        "scalar", "sse2", "avx2",
+    };
+    return kind < RESAMPLER_KIND_COUNT ? names[kind] : "unknown";
+}
+
+Resampler::Resampler(u32 input_rate, u32 output_rate, ResamplerKind kind)
+{
+    this->kind = resampler_supported(kind) ? kind : RESAMPLER_SCALAR;
+    dot = dot_scalar;
+#ifdef RESAMPLER_X86
+    if (this->kind == RESAMPLER_SSE2) {
+        dot = dot_sse2;
+    } else if (this->kind == RESAMPLER_AVX2) {
+        dot = dot_avx2;
+    }
+#endif
+    baseStep = static_cast<double>(input_rate) / output_rate;
+    set_adjust(0);
+    clear();
+
+    // row p is the sinc for an output p / PHASES of the way from input tap
+    // TAPS / 2 - 1 to the next, cut off a little below the lower Nyquist
+    // rate, in cycles per input sample, under a Blackman window. The extra
+    // row is the next input's phase 0, for interpolating the last phase.
+    const double PI = 3.14159265358979323846;
+    double cutoff = 0.45 * std::min(1.0, 1 / baseStep);
+    table.resize((PHASES + 1) * TAPS);
+    for (u32 phase = 0; phase <= PHASES; phase++) {
+        float *row = &table[phase * TAPS];
+        double sum = 0;
+        double taps[TAPS];
+        for (u32 i = 0; i < TAPS; i++) {
+            double x = i - (TAPS / 2.0 - 1) - static_cast<double>(phase)
+                / PHASES;
+            double arg = 2 * PI * cutoff * x;
+            double sinc = x == 0 ? 1 : std::sin(arg) / arg;
+            double w = (x + TAPS / 2.0) / TAPS;
+            double window = 0.42 - 0.5 * std::cos(2 * PI * w)
+                + 0.08 * std::cos(4 * PI * w);
+            taps[i] = sinc * window;
+            sum += taps[i];
+        }
+        // every phase passes DC as it is, so a ratio change doesn't click
+        for (u32 i = 0; i < TAPS; i++) {
+            row[i] = static_cast<float>(taps[i] / sum);
+        }
+    }
+}
+
+ResamplerKind Resampler::get_kind(void) const
+{
+    return kind;
+}
+
+void Resampler::set_adjust(double adjust)
+{
+    this->adjust = adjust;
+    step = static_cast<u64>(std::llround(baseStep / (1 + adjust)
+                * (static_cast<u64>(1) << FRACTION_BITS)));
+}
+
+double Resampler::get_adjust(void) const
+{
+    return adjust;
+}
+
+u32 Resampler::max_output(u32 count, double max_adjust) const
+{
+    return static_cast<u32>(std::ceil(count * (1 + max_adjust)
+                / baseStep)) + 2;
+}
+
+u32 Resampler::process(const s16 *in, u32 count, s16 *out)
+{
+    size_t start = history.size();
+    history.resize(start + count);
+    for (u32 i = 0; i < count; i++) {
+        history[start + i] = in[i];
+    }
+
+    u32 made = 0;
+    const float *samples = history.data();
+    size_t end = history.size();
+    while ((position >> FRACTION_BITS) + TAPS <= end) {
+        const float *window = samples + (position >> FRACTION_BITS);
+        u32 fraction = static_cast<u32>(position);
+        u32 phase = fraction >> (FRACTION_BITS - PHASE_BITS);
+        // the bits below the phase, as a fraction of one
+        float between = (fraction << PHASE_BITS) * (1.0f / 4294967296.0f);
+        float low = dot(window, &table[phase * TAPS]);
+        float high = dot(window, &table[(phase + 1) * TAPS]);
+        float sample = low + (high - low) * between;
+        out[made++] = static_cast<s16>(std::lrint(std::min(std::max(sample,
+                            -32768.0f), 32767.0f)));
+        position += step;
+    }
+
+    // the input the next output starts at, and everything after it, stays
+    size_t used = std::min(static_cast<size_t>(position >> FRACTION_BITS),
+            end);
+    history.erase(history.begin(), history.begin() + used);
+    position -= static_cast<u64>(used) << FRACTION_BITS;
+    return made;
+}
+
+void Resampler::clear(void)
+{
+    // zeros before the first sample, so the first output is centred on it
+    history.assign(TAPS / 2 - 1, 0);
+    position = 0;
+}
@@ -0,0 +1,93 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include "utils.h"
+#include <vector>
+
+enum ResamplerKind
+{
+    RESAMPLER_SCALAR,
+    RESAMPLER_SSE2,
+    RESAMPLER_AVX2,     // with FMA
+    RESAMPLER_KIND_COUNT,
+};
+
+/**
+ * @return: Whether the host cpu can run the given kind of resampler kernel.
+ */
+bool resampler_supported(ResamplerKind kind);
+
+/**
+ * @return: The fastest kind of resampler kernel the host cpu can run.
+ */
+ResamplerKind best_resampler_kind(void);
+
+const char *resampler_kind_name(ResamplerKind kind);
+
+/**
+ * Converts a stream of mono samples from one rate to another whose ratio
+ * can be nudged while it runs, so audio made at the emulated NES's rate can
+ * be played at the sound card's without the two clocks drifting apart.
+ *
+ * Every output sample is a 32 tap windowed sinc over the input, low-passed
+ * below the lower of the two Nyquist rates. The sinc is tabled at 256
+ * phases between two input samples and the output is interpolated between
+ * the two phases either side of where it falls, so any ratio works. The
+ * dot products are the whole cost and are done 4 or 8 taps at a time.
+ */
+class Resampler
+{
+public:
+    static const u32 TAPS = 32;
+    static const u32 PHASE_BITS = 8;
+    static const u32 PHASES = 1 << PHASE_BITS;
+
+    Resampler(u32 input_rate, u32 output_rate,
+            ResamplerKind kind = best_resampler_kind());
+    ~Resampler(void) {}
+
+    ResamplerKind get_kind(void) const;
+
+    /**
+     * Changes the ratio from the next output sample on.
+     *
+     * @param adjust: How much faster than output_rate the output is made,
+     * e.g. 0.001 gives 0.1% more output samples per input sample.
+     */
+    void set_adjust(double adjust);
+    double get_adjust(void) const;
+
+    /**
+     * @return: The most output samples resampling count input samples
+     * could give at an adjustment of up to max_adjust.
+     */
+    u32 max_output(u32 count, double max_adjust) const;
+
+    /**
+     * Resamples all of the input. The last few input samples are kept for
+     * the taps of the next call, so the output lags by half the taps.
+     *
+     * @param out: Room for max_output(count) samples.
+     * @return: How many output samples were made.
+     */
+    u32 process(const s16 *in, u32 count, s16 *out);
+
+    /**
+     * Forgets the input so far, as if the stream started again.
+     */
+    void clear(void);
+
+private:
+    typedef float (*DotProduct)(const float *in, const float *taps);
+
+    ResamplerKind kind;
+    DotProduct dot;
+    double baseStep;    // input samples per output sample, unadjusted
+    double adjust;
+    u64 step;           // the same adjusted, with 32 fraction bits
+    u64 position;       // of the next output in history, 32 fraction bits
+    std::vector<float> history;     // input waiting to be passed over
+    std::vector<float> table;       // PHASES + 1 rows of TAPS
+};
+
+#endif
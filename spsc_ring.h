@@ -0,0 +1,126 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+/**
+ * A bounded queue between one producer thread and one consumer thread,
+ * without locks: each side owns one of the two counters and only reads the
+ * other's. Neither side ever waits, push() and pop() fail instead, so how
+ * to wait (spin, yield, drop the item) is up to the caller.
+ */
+template <typename T, u32 CAPACITY>
+class SpscRing
+{
+    // the counters wrap around, which only lines up with the slots then
+    static_assert(CAPACITY && !(CAPACITY & (CAPACITY - 1)),
+            "the capacity has to be a power of two");
+
+public:
+    SpscRing(void) : head(0), tail(0) {}
+
+    /**
+     * Called by the producer only.
+     *
+     * @return: False if the ring is full.
+     */
+    bool push(const T &item)
+    {
+        u32 h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == CAPACITY) {
+            return false;
+        }
+        items[h % CAPACITY] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Called by the consumer only.
+     *
+     * @return: False if the ring is empty.
+     */
+    bool pop(T &item)
+    {
+        u32 t = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == t) {
+            return false;
+        }
+        item = items[t % CAPACITY];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Pushes as many of the items as fit, with one update of the counter,
+     * for streams like audio that go through a sample at a time. Called by
+     * the producer only.
+     *
+     * @return: How many were pushed.
+     */
+    u32 push(const T *in, u32 count)
+    {
+        u32 h = head.load(std::memory_order_relaxed);
+        count = std::min(count, CAPACITY - (h - tail.load(
+                        std::memory_order_acquire)));
+        for (u32 i = 0; i < count; i++) {
+            items[(h + i) % CAPACITY] = in[i];
+        }
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * Pops up to count items. Called by the consumer only.
+     *
+     * @return: How many were popped.
+     */
+    u32 pop(T *out, u32 count)
+    {
+        u32 t = tail.load(std::memory_order_relaxed);
+        count = std::min(count, head.load(std::memory_order_acquire) - t);
+        for (u32 i = 0; i < count; i++) {
+            out[i] = items[(t + i) % CAPACITY];
+        }
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * @return: The items in the ring, only a hint unless both sides are idle.
+     */
+    u32 size(void) const
+    {
+        return head.load(std::memory_order_acquire)
+            - tail.load(std::memory_order_acquire);
+    }
+
+private:
+    T items[CAPACITY];
+    // on their own cache lines, so the two threads don't share one
+    alignas(64) std::atomic<u32> head;  // items pushed
+    alignas(64) std::atomic<u32> tail;  // items popped
+};
+
+/**
+ * Waits a little for the other side of a ring: yields at first, as it
+ * usually catches up within a few microseconds, then sleeps so an idle
+ * thread doesn't keep a core busy.
+ *
+ * @param tries: How many times the caller has waited so far, reset it once
+ * the ring moves.
+ */
+inline void back_off(u32 &tries)
+{
+    if (++tries < 64) {
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+#endif
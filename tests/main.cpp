@@ -1,16 +1,2362 @@
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <thread>
 #include "../cpu.h"
-
-static u8 memory[0x1000];
+#include "../bus.h"
+#include "../instructions.h"
+#include "../thread_pool.h"
+#include "../batch.h"
+#include "../cartridge.h"
+#include "../mapper.h"
+#include "../ppu.h"
+#include "../tile_decoder.h"
+#include "../frame_converter.h"
+#include "../render_thread.h"
+#include "../post_filter.h"
+#include "../video_sink.h"
+#include "../blip_buffer.h"
+#include "../apu.h"
+#include "../resampler.h"
+#include "../audio_stream.h"
+#include "../audio_sink.h"
+#ifdef HAVE_SDL2
+#include "../audio_output.h"
+#endif
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
 
 /**
- * The accumulator should be zero on startup, since it was declared static.
+ * The accumulator should be zero on startup, since init() clears it.
  */
 TEST(TestGetAccumulator, init_test)
 {
-    EXPECT_EQ(0, Cpu::get_accumulator());
+    Cpu cpu;
+    EXPECT_EQ(0, cpu.get_regA());
+}
+
+/**
+ * Cpus share no state, so several of them can run on their own threads.
+ * Each one counts X down from a different start value and stores it.
+ */
+TEST(TestCpuInstances, parallel_test)
+{
+    const u32 count = 4;
+    std::vector<Cpu *> cpus;
+    std::vector<std::thread> threads;
+    for (u32 i = 0; i < count; i++) {
+        cpus.push_back(new Cpu());
+        // LDX #n; loop: DEX; STX $0200; BNE loop; JMP *
+        cpus[i]->load({0xa2, static_cast<u8>(10 + i), 0xca, 0x8e, 0x00, 0x02,
+                0xd0, 0xfa, 0x4c, 0x08, 0x00}, 0);
+    }
+    for (u32 i = 0; i < count; i++) {
+        threads.emplace_back([&cpus, i]() {
+            for (u32 frame = 0; frame < 10; frame++) {
+                cpus[i]->run_frame();
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    for (u32 i = 0; i < count; i++) {
+        EXPECT_EQ(0, cpus[i]->get_regX());
+        EXPECT_EQ(0x08, cpus[i]->get_pc());
+        EXPECT_LE(10u * Cpu::CYCLES_PER_FRAME, cpus[i]->get_cycles());
+        delete cpus[i];
+    }
+}
+
+/**
+ * Every entry in the opcode table should sit at the index of its opcode, and
+ * only implied/accumulator instructions should be a single byte long.
+ */
+TEST(TestOpcodeTable, complete_test)
+{
+    for (u32 i = 0; i < 0x100; i++) {
+        EXPECT_EQ(i, opcodes[i].op);
+        EXPECT_NE(0, opcodes[i].cycle_count);
+        if (opcodes[i].address_mode == IMPLIED
+                || opcodes[i].address_mode == ACCUMULATOR) {
+            EXPECT_EQ(1, opcodes[i].bytes);
+        } else {
+            EXPECT_LT(1, opcodes[i].bytes);
+        }
+    }
+}
+/**
+ * Runs the same random code on an eager and a lazy flag Cpu and checks that
+ * the status register, as anything outside the cpu sees it, matches after
+ * every instruction.
+ */
+TEST(TestLazyFlags, conformance_test)
+{
+    Cpu eager(false);
+    Cpu lazy(true);
+    u32 seed = 0x1234567;
+    std::vector<u8> code(0x10000);
+    for (u32 i = 0; i < code.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        code[i] = static_cast<u8>(seed >> 16);
+    }
+    eager.load(code, 0);
+    lazy.load(code, 0);
+    for (u32 i = 0; i < 200000; i++) {
+        eager.step();
+        lazy.step();
+        ASSERT_EQ(eager.get_pc(), lazy.get_pc());
+        ASSERT_EQ(eager.get_status(), lazy.get_status());
+        ASSERT_EQ(eager.get_regA(), lazy.get_regA());
+        ASSERT_EQ(eager.get_regX(), lazy.get_regX());
+        ASSERT_EQ(eager.get_regY(), lazy.get_regY());
+        ASSERT_EQ(eager.get_sp(), lazy.get_sp());
+        ASSERT_EQ(eager.get_cycles(), lazy.get_cycles());
+    }
+}
+
+/**
+ * LDA #$7F; ADC #$01 overflows into the sign bit.
+ */
+TEST(TestLazyFlags, overflow_test)
+{
+    Cpu lazy(true);
+    lazy.load({0xa9, 0x7f, 0x69, 0x01}, 0);
+    lazy.step();
+    lazy.step();
+    EXPECT_EQ(0x80, lazy.get_regA());
+    EXPECT_EQ(Cpu::OVERFLOW_FLAG | Cpu::NEGATIVE_FLAG,
+            lazy.get_status() & (Cpu::OVERFLOW_FLAG | Cpu::NEGATIVE_FLAG
+                | Cpu::ZERO_FLAG | Cpu::CARRY_FLAG));
+}
+/**
+ * Runs the same random code through the interpreter and the block cache. The
+ * code writes all over itself, so this covers invalidation as well as the
+ * decoded instructions.
+ */
+TEST(TestBlockCache, conformance_test)
+{
+    Cpu interpreted(false);
+    Cpu cached(false);
+    cached.set_block_cache(true);
+    u32 seed = 0x7654321;
+    std::vector<u8> code(0x10000);
+    for (u32 i = 0; i < code.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        code[i] = static_cast<u8>(seed >> 16);
+    }
+    interpreted.load(code, 0);
+    cached.load(code, 0);
+    for (u32 i = 0; i < 20000; i++) {
+        s32 budget = 1 + i % 40;
+        ASSERT_EQ(interpreted.run_cycles(budget), cached.run_cycles(budget));
+        ASSERT_EQ(interpreted.get_pc(), cached.get_pc());
+        ASSERT_EQ(interpreted.get_status(), cached.get_status());
+        ASSERT_EQ(interpreted.get_regA(), cached.get_regA());
+        ASSERT_EQ(interpreted.get_regX(), cached.get_regX());
+        ASSERT_EQ(interpreted.get_regY(), cached.get_regY());
+        ASSERT_EQ(interpreted.get_sp(), cached.get_sp());
+        ASSERT_EQ(interpreted.get_cycles(), cached.get_cycles());
+    }
+    for (u32 i = 0; i < 0x10000; i++) {
+        ASSERT_EQ(interpreted.read_memory(i), cached.read_memory(i));
+    }
+    BlockCacheStats stats = cached.get_block_cache_stats();
+    EXPECT_LT(0u, stats.hits);
+    EXPECT_LT(0u, stats.writeInvalidations);
+}
+
+/**
+ * A loop that increments the immediate operand of its own LDA.
+ */
+TEST(TestBlockCache, self_modifying_test)
+{
+    Cpu cpu;
+    cpu.set_block_cache(true);
+    cpu.load({
+        0xa2, 0x05,         // LDX #$05
+        0xa9, 0x00,         // LDA #$00
+        0xee, 0x03, 0x00,   // INC $0003
+        0xca,               // DEX
+        0xd0, 0xf8,         // BNE $0002
+        0x4c, 0x0a, 0x00,   // JMP $000A
+    }, 0);
+    cpu.run_cycles(1000);
+    EXPECT_EQ(0x04, cpu.get_regA());
+    EXPECT_EQ(0x05, cpu.read_memory(0x0003));
+    EXPECT_LE(5u, cpu.get_block_cache_stats().writeInvalidations);
+}
+
+/**
+ * Switching the bank the code runs from drops its blocks.
+ */
+TEST(TestBlockCache, bank_switch_test)
+{
+    static const u8 bank_a[0x100] = { 0xa9, 0x11, 0x4c, 0x00, 0x80 };
+    static const u8 bank_b[0x100] = { 0xa9, 0x22, 0x4c, 0x00, 0x80 };
+    Cpu cpu;
+    cpu.set_block_cache(true);
+    cpu.get_bus().map_rom(0x8000, 0x100, bank_a, sizeof(bank_a));
+    cpu.set_pc(0x8000);
+    cpu.run_cycles(100);
+    EXPECT_EQ(0x11, cpu.get_regA());
+
+    cpu.get_bus().map_rom(0x8000, 0x100, bank_b, sizeof(bank_b));
+    cpu.run_cycles(100);
+    EXPECT_EQ(0x22, cpu.get_regA());
+    EXPECT_EQ(1u, cpu.get_block_cache_stats().remapInvalidations);
+}
+
+/**
+ * Mapping RAM that holds code again, as a mapper does when it re-enables
+ * its PRG RAM, doesn't hide later writes to the code from the cache, with
+ * or without the JIT, nor does mapping it read only for a while.
+ */
+TEST(TestBlockCache, remap_same_storage_test)
+{
+    for (u32 jit = 0; jit < 2; jit++) {
+        // LDA #$01; STA $00; JMP $6000
+        static const u8 code[] = {0xa9, 0x01, 0x85, 0x00, 0x4c, 0x00, 0x60};
+        std::vector<u8> ram(0x2000, 0);
+        memcpy(ram.data(), code, sizeof(code));
+        Cpu cpu;
+        cpu.set_block_cache(true);
+        if (jit && !cpu.set_jit(true)) {
+            continue;
+        }
+        Bus &bus = cpu.get_bus();
+        bus.map(0x6000, 0x2000, ram.data(), ram.size(), true);
+        cpu.set_pc(0x6000);
+        cpu.run_cycles(2000);
+        EXPECT_EQ(0x01, cpu.read_memory(0x0000));
+
+        bus.map(0x6000, 0x2000, ram.data(), ram.size(), true);
+        cpu.write_memory(0x6001, 0x02);
+        cpu.run_cycles(2000);
+        EXPECT_EQ(0x02, cpu.read_memory(0x0000)) << "jit " << jit;
+
+        bus.map(0x6000, 0x2000, ram.data(), ram.size(), false);
+        cpu.run_cycles(2000);
+        bus.map(0x6000, 0x2000, ram.data(), ram.size(), true);
+        cpu.write_memory(0x6001, 0x03);
+        cpu.run_cycles(2000);
+        EXPECT_EQ(0x03, cpu.read_memory(0x0000)) << "jit " << jit;
+    }
+}
+
+/**
+ * Dropping the blocks of a page keeps the writes to the storage it is
+ * mapped to watched while another page still has blocks decoded from it:
+ * page $00 switched onto the storage of page $01 and its mirrors is
+ * dropped on lookup, while page $01 keeps its blocks.
+ */
+TEST(TestBlockCache, mirror_drop_test)
+{
+    std::vector<u8> ram(0x800, 0);
+    Bus bus;
+    bus.map(0x0000, 0x2000, ram.data(), ram.size(), true);
+    BlockCache cache(bus);
+    for (u16 start : {0x0000, 0x0100}) {
+        Block *block = new Block();
+        block->start = start;
+        cache.insert(block, bus.get_read_page(start >> Bus::PAGE_SHIFT));
+    }
+
+    bus.map(0x0000, 0x100, &ram[0x100], 0x100, true);
+    EXPECT_EQ(nullptr, cache.lookup(0x0000));
+    EXPECT_EQ(1u, cache.get_stats().remapInvalidations);
+    EXPECT_NE(nullptr, cache.lookup(0x0100));
+
+    bus.write(0x0901, 0x00);
+    EXPECT_EQ(1u, cache.get_stats().writeInvalidations);
+    EXPECT_EQ(nullptr, cache.lookup(0x0100));
+    cache.collect();
+}
+
+/**
+ * Records the last write it got and answers reads with the low byte of the
+ * address.
+ */
+class TestDevice : public IoDevice
+{
+public:
+    u16 lastAddress = 0;
+    u8  lastVal = 0;
+
+    u8 io_read(u16 address) override
+    {
+        return static_cast<u8>(address);
+    }
+
+    void io_write(u16 address, u8 val) override
+    {
+        lastAddress = address;
+        lastVal = val;
+    }
+};
+
+/**
+ * The NES layout: 2 KB of ram mirrored up to $1FFF, registers at $2000 and a
+ * bank switched ROM that hands writes to the mapper.
+ */
+TEST(TestBus, mapping_test)
+{
+    Bus bus;
+    TestDevice ppu;
+    TestDevice mapper;
+    static u8 ram[0x800];
+    static u8 rom[0x8000];
+    rom[0] = 0x11;
+    rom[0x4000] = 0x22;
+
+    bus.map(0x0000, 0x2000, ram, sizeof(ram), true);
+    bus.map_io(0x2000, 0x2000, &ppu);
+    bus.map_rom(0x8000, 0x8000, rom, 0x4000);
+    bus.map_write_io(0x8000, 0x8000, &mapper);
+
+    bus.write(0x0801, 0x42);
+    EXPECT_EQ(0x42, bus.read(0x0001));
+    EXPECT_EQ(0x42, bus.read(0x1801));
+
+    EXPECT_EQ(0xf7, bus.read(0x3ff7));
+    bus.write(0x2006, 0x3f);
+    EXPECT_EQ(0x2006, ppu.lastAddress);
+
+    // the 16 KB bank is mirrored, writes go to the mapper not the ROM
+    EXPECT_EQ(0x11, bus.read(0xc000));
+    bus.write(0x8000, 0x01);
+    EXPECT_EQ(0x11, bus.read(0x8000));
+    EXPECT_EQ(0x01, mapper.lastVal);
+
+    // bank switching swaps pointers
+    bus.map_rom(0x8000, 0x4000, rom + 0x4000, 0x4000);
+    EXPECT_EQ(0x22, bus.read(0x8000));
+    EXPECT_EQ(0x11, bus.read(0xc000));
+
+    // watched ram hands writes through any mirror to the watcher
+    bus.watch_writes(0x00, &mapper);
+    bus.write(0x1803, 0x55);
+    EXPECT_EQ(0x1803, mapper.lastAddress);
+    EXPECT_EQ(0x00, bus.read(0x0003));
+    bus.unwatch_writes(0x08);
+    bus.write(0x1803, 0x55);
+    EXPECT_EQ(0x55, bus.read(0x0003));
+}
+
+/**
+ * Fills ROM at $8000 with random code in every page and maps registers at
+ * $2000. The code is made of every instruction that does not jump, with
+ * absolute operands in RAM, in the registers or in ROM, so native blocks run
+ * into memory mapped registers, writes to ROM and instructions the JIT
+ * leaves to the interpreter.
+ */
+static void map_random_cartridge(Cpu &cpu, std::vector<u8> &rom,
+        TestDevice &ppu, u32 seed)
+{
+    auto random = [&seed](void) {
+        seed = seed * 1103515245 + 12345;
+        return static_cast<u8>(seed >> 16);
+    };
+    static const u8 branches[] = {
+        0x10, 0x30, 0x50, 0x70, 0x90, 0xb0, 0xd0, 0xf0
+    };
+
+    rom.assign(0x8000, 0xea);
+    for (u32 page = 0; page < 0x80; page++) {
+        u32 pos = page << 8;
+        u32 count = 1 + random() % 20;
+        for (u32 i = 0; i < count; i++) {
+            const OpCode *op;
+            do {
+                op = &opcodes[random()];
+            } while (op->address_mode == RELATIVE || op->instruction == INST_BRK ||
+                    op->instruction == INST_RTI || op->instruction == INST_JMP ||
+                    op->instruction == INST_JSR || op->instruction == INST_RTS);
+            rom[pos++] = op->op;
+            if (op->bytes > 1) {
+                rom[pos++] = random();
+            }
+            if (op->bytes > 2) {
+                u8 high = random();
+                rom[pos++] = high >= 0xe0 ? high :
+                    high >= 0xc0 ? 0x20 | (high & 0x1f) : high & 0x1f;
+            }
+        }
+        // branch to one of the next two pages
+        rom[pos++] = branches[random() % 8];
+        rom[pos++] = 3;
+        for (u32 i = 1; i <= 2; i++) {
+            u16 next = 0x8000 | (((page + i) & 0x7f) << 8);
+            rom[pos++] = 0x4c;
+            rom[pos++] = static_cast<u8>(next);
+            rom[pos++] = static_cast<u8>(next >> 8);
+        }
+    }
+
+    for (u32 i = 0; i < 0x2000; i++) {
+        cpu.write_memory(i, random());
+    }
+    cpu.get_bus().map_io(0x2000, 0x2000, &ppu);
+    cpu.get_bus().map_rom(0x8000, 0x8000, rom.data(), rom.size());
+    cpu.set_pc(0x8000);
+}
+
+/**
+ * The JIT has to end up exactly where the interpreter does, cycle for cycle.
+ */
+TEST(TestJit, conformance_test)
+{
+    Cpu interpreted(false);
+    Cpu compiled(false);
+    if (!compiled.set_jit(true)) {
+        GTEST_SKIP();
+    }
+    TestDevice ppu;
+    std::vector<u8> rom;
+    map_random_cartridge(interpreted, rom, ppu, 0x2468ace);
+    map_random_cartridge(compiled, rom, ppu, 0x2468ace);
+    for (u32 i = 0; i < 20000; i++) {
+        s32 budget = 1 + (i * 37) % 400;
+        ASSERT_EQ(interpreted.run_cycles(budget), compiled.run_cycles(budget));
+        ASSERT_EQ(interpreted.get_pc(), compiled.get_pc());
+        ASSERT_EQ(interpreted.get_status(), compiled.get_status());
+        ASSERT_EQ(interpreted.get_regA(), compiled.get_regA());
+        ASSERT_EQ(interpreted.get_regX(), compiled.get_regX());
+        ASSERT_EQ(interpreted.get_regY(), compiled.get_regY());
+        ASSERT_EQ(interpreted.get_sp(), compiled.get_sp());
+        ASSERT_EQ(interpreted.get_cycles(), compiled.get_cycles());
+    }
+    for (u32 i = 0; i < 0x2000; i++) {
+        ASSERT_EQ(interpreted.read_memory(i), compiled.read_memory(i));
+    }
+    JitStats stats = compiled.get_jit_stats();
+    EXPECT_LT(0u, stats.blocksCompiled);
+    EXPECT_LT(0u, stats.nativeRuns);
+    EXPECT_LT(0u, stats.fallbacks);
+}
+
+/**
+ * Verification mode runs every native block on the interpreter as well.
+ */
+TEST(TestJit, verify_test)
+{
+    Cpu cpu;
+    if (!cpu.set_jit(true)) {
+        GTEST_SKIP();
+    }
+    cpu.set_jit_verify(true);
+    TestDevice ppu;
+    std::vector<u8> rom;
+    map_random_cartridge(cpu, rom, ppu, 0x1357bdf);
+    for (u32 i = 0; i < 2000; i++) {
+        cpu.run_cycles(400);
+    }
+    JitStats stats = cpu.get_jit_stats();
+    EXPECT_LT(0u, stats.verifiedRuns);
+    EXPECT_EQ(0u, stats.verifyMismatches);
+}
+
+/**
+ * Every task runs exactly once, wherever it ends up being stolen to, and the
+ * pool can be waited on again after more tasks are submitted.
+ */
+TEST(TestThreadPool, submit_test)
+{
+    ThreadPool pool(4);
+    std::atomic<u32> sum(0);
+    for (u32 round = 1; round <= 2; round++) {
+        for (u32 i = 1; i <= 1000; i++) {
+            pool.submit([&sum, i] { sum += i; });
+        }
+        pool.wait();
+        EXPECT_EQ(round * 500500u, sum.load());
+    }
+}
+
+/**
+ * A manifest runs the same NROM image until it halts and for a fixed number
+ * of frames. The image stores $42 to RAM directly and through a mirror.
+ */
+TEST(TestBatch, manifest_test)
+{
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "nesEmulator_batch_test";
+    fs::create_directories(dir);
+
+    std::vector<u8> image(16 + 0x4000);
+    memcpy(image.data(), "NES\x1a\x01\x00", 6);
+    // LDA #$42; STA $10; STA $0811; JMP *
+    const u8 code[] = {0xa9, 0x42, 0x85, 0x10, 0x8d, 0x11, 0x08, 0x4c, 0x07,
+        0x80};
+    memcpy(&image[16], code, sizeof(code));
+    image[16 + 0x3ffd] = 0x80;
+    FILE *fp = fopen((dir / "cart.nes").c_str(), "wb");
+    ASSERT_NE(nullptr, fp);
+    fwrite(image.data(), 1, image.size(), fp);
+    fclose(fp);
+    fp = fopen((dir / "jobs.txt").c_str(), "w");
+    ASSERT_NE(nullptr, fp);
+    fprintf(fp, "# comment\ncart.nes exit=halt\n\ncart.nes frames=3\n");
+    fclose(fp);
+
+    BatchJob defaults = {};
+    defaults.frames = 600;
+    std::vector<BatchJob> jobs;
+    std::string error;
+    ASSERT_TRUE(load_batch_jobs((dir / "jobs.txt").string(), defaults, jobs,
+                error)) << error;
+    ASSERT_EQ(2u, jobs.size());
+
+    u64 hash = 0xcbf29ce484222325ull;
+    for (u32 i = 0; i < 0x800; i++) {
+        hash ^= (i == 0x10 || i == 0x11) ? 0x42 : 0;
+        hash *= 0x100000001b3ull;
+    }
+
+    BatchResult halted = run_batch_job(jobs[0]);
+    EXPECT_TRUE(halted.ok);
+    EXPECT_EQ("halt", halted.exit);
+    EXPECT_EQ(1u, halted.frames);
+    EXPECT_EQ(0x8007, halted.pc);
+    EXPECT_EQ(hash, halted.ramHash);
+
+    BatchResult limited = run_batch_job(jobs[1]);
+    EXPECT_TRUE(limited.ok);
+    EXPECT_EQ("limit", limited.exit);
+    EXPECT_EQ(3u, limited.frames);
+    // the first frame ends at the first vblank, a little early
+    EXPECT_LT(2u * Cpu::CYCLES_PER_FRAME, limited.cycles);
+    EXPECT_EQ(hash, limited.ramHash);
+    EXPECT_FALSE(limited.hasFrame);
+
+    // a cycle limit stops the PPU in the middle of the first frame
+    BatchJob cut = jobs[1];
+    cut.frames = 0;
+    cut.cycles = 1000;
+    BatchResult stopped = run_batch_job(cut);
+    EXPECT_EQ("limit", stopped.exit);
+    EXPECT_EQ(0u, stopped.frames);
+    EXPECT_LE(1000u, stopped.cycles);
+    EXPECT_GT(1010u, stopped.cycles);
+
+    // rendering is off, so the frame is the backdrop, colour $00
+    BatchJob capture = jobs[0];
+    capture.captureFrame = true;
+    capture.frameFormat = PIXEL_GRAY8;
+    capture.frameDir = dir.string();
+    BatchResult captured = run_batch_job(capture);
+    EXPECT_TRUE(captured.ok);
+    EXPECT_TRUE(captured.hasFrame);
+    std::vector<u8> frame(Ppu::WIDTH * Ppu::HEIGHT, 0);
+    fp = fopen((dir / "cart.gray8").c_str(), "rb");
+    ASSERT_NE(nullptr, fp);
+    EXPECT_EQ(frame.size(), fread(frame.data(), 1, frame.size(), fp));
+    fclose(fp);
+    EXPECT_EQ(0x7c, frame[0]);
+    EXPECT_EQ(0x7c, frame.back());
+
+    // skipping frames doesn't change the outcome, the last one is rendered
+    BatchJob every = jobs[1];
+    every.captureFrame = true;
+    BatchJob skipping = every;
+    skipping.renderInterval = 2;
+    BatchResult all = run_batch_job(every);
+    BatchResult some = run_batch_job(skipping);
+    EXPECT_EQ(all.cycles, some.cycles);
+    EXPECT_EQ(all.ramHash, some.ramHash);
+    EXPECT_EQ(all.frameHash, some.frameHash);
+
+    BatchJob missing = defaults;
+    missing.rom = (dir / "missing.nes").string();
+    EXPECT_FALSE(run_batch_job(missing).ok);
+    fs::remove_all(dir);
+}
+
+/**
+ * Reads a whole file.
+ */
+static std::vector<u8> read_bytes(const std::string &path)
+{
+    std::vector<u8> data;
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp) {
+        u8 buffer[4096];
+        size_t read;
+        while ((read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+            data.insert(data.end(), buffer, buffer + read);
+        }
+        fclose(fp);
+    }
+    return data;
+}
+
+static u32 read_u32(const std::vector<u8> &data, size_t offset)
+{
+    return data[offset] | (data[offset + 1] << 8) | (data[offset + 2] << 16)
+        | (static_cast<u32>(data[offset + 3]) << 24);
+}
+
+/**
+ * A job that plays a tone records it: the hash is of the raw file, which
+ * is the same every run, and the channels are saved beside it.
+ */
+TEST(TestBatch, audio_test)
+{
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "nesEmulator_batch_audio";
+    fs::create_directories(dir);
+    std::vector<u8> image(16 + 0x4000);
+    memcpy(image.data(), "NES\x1a\x01\x00", 6);
+    // pulse 1 at 440 Hz, constant volume 15, then JMP *
+    const u8 code[] = {0xa9, 0x01, 0x8d, 0x15, 0x40, 0xa9, 0xbf, 0x8d, 0x00,
+        0x40, 0xa9, 0xfd, 0x8d, 0x02, 0x40, 0xa9, 0x08, 0x8d, 0x03, 0x40,
+        0x4c, 0x14, 0x80};
+    memcpy(&image[16], code, sizeof(code));
+    image[16 + 0x3ffd] = 0x80;
+    FILE *fp = fopen((dir / "tone.nes").c_str(), "wb");
+    ASSERT_NE(nullptr, fp);
+    fwrite(image.data(), 1, image.size(), fp);
+    fclose(fp);
+
+    BatchJob job = {};
+    job.rom = (dir / "tone.nes").string();
+    job.frames = 30;
+    job.captureAudio = true;
+    BatchResult hashed = run_batch_job(job);
+    ASSERT_TRUE(hashed.ok) << hashed.error;
+    EXPECT_TRUE(hashed.hasAudio);
+    EXPECT_NEAR(48000 / 2, hashed.audioSamples, 48000 / 60);
+
+    job.audioDir = dir.string();
+    job.audioRaw = true;
+    job.audioChannels = true;
+    BatchResult saved = run_batch_job(job);
+    ASSERT_TRUE(saved.ok) << saved.error;
+    EXPECT_EQ(hashed.audioSamples, saved.audioSamples);
+    EXPECT_EQ(hashed.audioHash, saved.audioHash);
+    std::vector<u8> mix = read_bytes((dir / "tone.raw").string());
+    ASSERT_EQ(2 * saved.audioSamples, mix.size());
+    u64 hash = 0xcbf29ce484222325ull;
+    for (u8 byte : mix) {
+        hash ^= byte;
+        hash *= 0x100000001b3ull;
+    }
+    EXPECT_EQ(saved.audioHash, hash);
+    EXPECT_EQ(mix, read_bytes((dir / "tone.pulse1.raw").string()));
+    std::vector<u8> triangle = read_bytes((dir / "tone.triangle.raw")
+            .string());
+    EXPECT_EQ(std::vector<u8>(mix.size(), 0), triangle);
+    fs::remove_all(dir);
+}
+
+/**
+ * iNES and NES 2.0 headers: 12 bit mappers, exponent sizes, RAM sizes and
+ * the junk old tools left in iNES headers.
+ */
+TEST(TestCartridge, header_test)
+{
+    std::vector<u8> image(16 + 0x200 + 2 * 0x4000 + 0x2000, 0);
+    memcpy(image.data(), "NES\x1a\x02\x01", 6);
+    image[6] = 0x17;    // mapper 1, vertical, battery, trainer
+    image[7] = 0x40;
+    RomHeader header;
+    std::string error;
+    ASSERT_TRUE(parse_rom_header(image.data(), image.size(), &header, error))
+        << error;
+    EXPECT_EQ(ROM_INES, header.format);
+    EXPECT_EQ(0x41, header.mapper);
+    EXPECT_EQ(0x8000u, header.prgSize);
+    EXPECT_EQ(0x2000u, header.chrSize);
+    EXPECT_EQ(0u, header.prgRamSize);
+    EXPECT_EQ(0x2000u, header.prgNvramSize);
+    EXPECT_EQ(0u, header.chrRamSize);
+    EXPECT_TRUE(header.trainer);
+    EXPECT_EQ(Ppu::VERTICAL, header.mirroring);
+
+    memcpy(&image[12], "Dude", 4);
+    ASSERT_TRUE(parse_rom_header(image.data(), image.size(), &header, error));
+    EXPECT_EQ(1, header.mapper);
+
+    // mapper $123 submapper 2, 2^14 * 3 bytes of PRG, no CHR, 8KB of PRG
+    // NVRAM and 32KB of CHR RAM, PAL
+    std::vector<u8> nes2(16 + 0xc000, 0);
+    memcpy(nes2.data(), "NES\x1a", 4);
+    nes2[4] = (14 << 2) | 1;
+    nes2[6] = 0x38;
+    nes2[7] = 0x28;
+    nes2[8] = 0x21;
+    nes2[9] = 0x0f;
+    nes2[10] = 0x70;
+    nes2[11] = 0x09;
+    nes2[12] = 0x01;
+    ASSERT_TRUE(parse_rom_header(nes2.data(), nes2.size(), &header, error))
+        << error;
+    EXPECT_EQ(ROM_NES2, header.format);
+    EXPECT_EQ(0x123, header.mapper);
+    EXPECT_EQ(2, header.submapper);
+    EXPECT_EQ(0xc000u, header.prgSize);
+    EXPECT_EQ(0u, header.chrSize);
+    EXPECT_EQ(0u, header.prgRamSize);
+    EXPECT_EQ(0x2000u, header.prgNvramSize);
+    EXPECT_EQ(0x8000u, header.chrRamSize);
+    EXPECT_EQ(Ppu::FOUR_SCREEN, header.mirroring);
+    EXPECT_EQ(TIMING_PAL, header.timing);
+
+    EXPECT_FALSE(parse_rom_header(nes2.data(), nes2.size() - 1, &header,
+                error));
+    EXPECT_EQ("truncated iNES image", error);
+    EXPECT_FALSE(parse_rom_header(nes2.data() + 1, nes2.size() - 1, &header,
+                error));
+    EXPECT_EQ("not an iNES image", error);
+}
+
+/**
+ * Cartridges of the same file share its mapping, with the ROM pointing into
+ * it, while each has its own RAM.
+ */
+TEST(TestCartridge, shared_mapping_test)
+{
+    namespace fs = std::filesystem;
+    fs::path path = fs::temp_directory_path() / "nesEmulator_cart_test.nes";
+    std::vector<u8> image(16 + 0x4000 + 0x2000, 0);
+    memcpy(image.data(), "NES\x1a\x01\x01", 6);
+    for (u32 i = 16; i < image.size(); i++) {
+        image[i] = static_cast<u8>(i / 0x400);
+    }
+    FILE *fp = fopen(path.c_str(), "wb");
+    ASSERT_NE(nullptr, fp);
+    fwrite(image.data(), 1, image.size(), fp);
+    fclose(fp);
+
+    std::string error;
+    std::unique_ptr<Cartridge> first(new Cartridge());
+    std::unique_ptr<Cartridge> second(new Cartridge());
+    ASSERT_TRUE(first->load(path.string(), error)) << error;
+    ASSERT_TRUE(second->load(path.string(), error)) << error;
+    std::shared_ptr<const RomFile> file = RomFile::open(path.string(), error);
+    ASSERT_TRUE(file);
+    EXPECT_TRUE(file->is_mapped());
+    EXPECT_EQ(file->get_data() + 16, first->get_prg());
+    EXPECT_EQ(first->get_prg(), second->get_prg());
+    EXPECT_EQ(first->get_prg() + 0x4000, first->get_chr());
+    EXPECT_NE(first->get_prg_ram(), second->get_prg_ram());
+    EXPECT_EQ(0x2000u, first->get_prg_ram_size());
+    EXPECT_EQ(NULL, first->get_chr_ram());
+
+    // banks wrap around the ROM
+    EXPECT_EQ(first->get_prg(), first->get_prg_bank(3, 0x4000));
+    EXPECT_EQ(first->get_chr() + 0x1c00, first->get_chr_bank(15, 0x400));
+    EXPECT_EQ(image[16 + 0x5c00], first->get_chr_bank(15, 0x400)[0]);
+
+    // once nothing uses it, the next load maps the file again
+    first.reset();
+    second.reset();
+    file.reset();
+    Cartridge third;
+    ASSERT_TRUE(third.load(path.string(), error));
+    EXPECT_EQ(0, memcmp(third.get_prg(), &image[16], 0x6000));
+
+    EXPECT_FALSE(third.load((path.string() + ".missing"), error));
+    fs::remove(path);
+}
+
+/**
+ * Writes an iNES image whose 8KB PRG banks and 1KB CHR banks are filled with
+ * their numbers, with JMP $E000 at the start of the last PRG bank and the
+ * reset vector pointing at it.
+ */
+static std::string write_mapper_rom(const char *name, u8 mapper, u32 prg_banks,
+        u32 chr_banks)
+{
+    std::vector<u8> image(16 + prg_banks * 0x4000 + chr_banks * 0x2000);
+    memcpy(image.data(), "NES\x1a", 4);
+    image[4] = static_cast<u8>(prg_banks);
+    image[5] = static_cast<u8>(chr_banks);
+    image[6] = static_cast<u8>(mapper << 4);
+    image[7] = mapper & 0xf0;
+    u8 *prg = &image[16];
+    u32 prgSize = prg_banks * 0x4000;
+    for (u32 i = 0; i < prgSize; i++) {
+        prg[i] = static_cast<u8>(i / 0x2000);
+    }
+    const u8 loop[] = {0x4c, 0x00, 0xe0};
+    memcpy(prg + prgSize - 0x2000, loop, sizeof(loop));
+    prg[prgSize - 4] = 0x00;
+    prg[prgSize - 3] = 0xe0;
+    for (u32 i = 0; i < chr_banks * 0x2000; i++) {
+        prg[prgSize + i] = static_cast<u8>(i / 0x400);
+    }
+    std::string path = (std::filesystem::temp_directory_path() / name)
+        .string();
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (fp) {
+        fwrite(image.data(), 1, image.size(), fp);
+        fclose(fp);
+    }
+    return path;
+}
+
+/**
+ * Writes an MMC1 register through its serial port, a bit at a time.
+ */
+static void write_mmc1(Cpu &cpu, u16 address, u8 val)
+{
+    for (u32 i = 0; i < 5; i++) {
+        cpu.write_memory(address, (val >> i) & 0x01);
+    }
+}
+
+/**
+ * UxROM, CNROM and MMC1 switch banks by pointing the pages into the ROM
+ * mapping, and code in a switched bank is what the block cache runs.
+ */
+TEST(TestMapper, banking_test)
+{
+    std::string error;
+    std::string path = write_mapper_rom("nesEmulator_uxrom.nes", 2, 8, 0);
+    Cartridge uxrom;
+    ASSERT_TRUE(uxrom.load(path, error)) << error;
+    {
+        Cpu cpu(true);
+        cpu.init();
+        Ppu ppu(cpu);
+        std::unique_ptr<Mapper> mapper = Mapper::create(cpu, ppu, uxrom,
+                error);
+        ASSERT_TRUE(mapper) << error;
+        EXPECT_EQ(2, mapper->get_number());
+        EXPECT_EQ(0, cpu.read_memory(0x8000));
+        EXPECT_EQ(0x4c, cpu.read_memory(0xe000));
+        cpu.write_memory(0x8000, 5);
+        EXPECT_EQ(10, cpu.read_memory(0x8000));
+        EXPECT_EQ(11, cpu.read_memory(0xa000));
+        EXPECT_EQ(uxrom.get_prg() + 5 * 0x4000,
+                cpu.get_bus().get_read_page(0x80));
+        EXPECT_EQ(uxrom.get_prg() + 7 * 0x4000,
+                cpu.get_bus().get_read_page(0xc0));
+
+        // 8KB of CHR RAM, and PRG RAM at $6000
+        ppu.write_vram(0x0123, 0x5a);
+        EXPECT_EQ(0x5a, uxrom.get_chr_ram()[0x0123]);
+        cpu.write_memory(0x6000, 0x77);
+        EXPECT_EQ(0x77, uxrom.get_prg_ram()[0]);
+    }
+    {
+        // blocks decoded from a bank are dropped once it is switched out:
+        // bank 5 is all ASL A, bank 3 all ASL $06
+        Cpu cpu(true);
+        cpu.init();
+        cpu.set_block_cache(true);
+        Ppu ppu(cpu);
+        std::unique_ptr<Mapper> mapper = Mapper::create(cpu, ppu, uxrom,
+                error);
+        ASSERT_TRUE(mapper) << error;
+        cpu.write_memory(0x8000, 5);
+        cpu.set_pc(0x8000);
+        cpu.run_cycles(20);
+        EXPECT_EQ(0u, cpu.get_block_cache_stats().remapInvalidations);
+        cpu.write_memory(0x8000, 3);
+        cpu.set_pc(0x8000);
+        cpu.run_cycles(20);
+        EXPECT_EQ(1u, cpu.get_block_cache_stats().remapInvalidations);
+    }
+    std::filesystem::remove(path);
+
+    path = write_mapper_rom("nesEmulator_cnrom.nes", 3, 2, 4);
+    Cartridge cnrom;
+    ASSERT_TRUE(cnrom.load(path, error)) << error;
+    {
+        Cpu cpu(true);
+        cpu.init();
+        Ppu ppu(cpu);
+        std::unique_ptr<Mapper> mapper = Mapper::create(cpu, ppu, cnrom,
+                error);
+        ASSERT_TRUE(mapper) << error;
+        EXPECT_EQ(0, ppu.read_vram(0x0000));
+        EXPECT_EQ(7, ppu.read_vram(0x1c00));
+        cpu.write_memory(0x8000, 2);
+        EXPECT_EQ(16, ppu.read_vram(0x0000));
+        EXPECT_EQ(23, ppu.read_vram(0x1c00));
+        // the bank number wraps around the ROM
+        cpu.write_memory(0x8000, 5);
+        EXPECT_EQ(8, ppu.read_vram(0x0000));
+    }
+    std::filesystem::remove(path);
+
+    path = write_mapper_rom("nesEmulator_mmc1.nes", 1, 8, 4);
+    Cartridge mmc1;
+    ASSERT_TRUE(mmc1.load(path, error)) << error;
+    {
+        Cpu cpu(true);
+        cpu.init();
+        Ppu ppu(cpu);
+        std::unique_ptr<Mapper> mapper = Mapper::create(cpu, ppu, mmc1,
+                error);
+        ASSERT_TRUE(mapper) << error;
+        // powers on with the last bank at $C000
+        EXPECT_EQ(14, cpu.read_memory(0xc000));
+        write_mmc1(cpu, 0xe000, 3);
+        EXPECT_EQ(6, cpu.read_memory(0x8000));
+        EXPECT_EQ(14, cpu.read_memory(0xc000));
+
+        // 32KB mode ignores the low bit, a reset write goes back to 16KB
+        // banks with the last one fixed
+        write_mmc1(cpu, 0x8000, 0x00);
+        EXPECT_EQ(4, cpu.read_memory(0x8000));
+        EXPECT_EQ(6, cpu.read_memory(0xc000));
+        cpu.write_memory(0x8000, 0x80);
+        EXPECT_EQ(6, cpu.read_memory(0x8000));
+        EXPECT_EQ(14, cpu.read_memory(0xc000));
+
+        // 4KB CHR banks, then one 8KB bank
+        write_mmc1(cpu, 0x8000, 0x1c);
+        write_mmc1(cpu, 0xa000, 3);
+        write_mmc1(cpu, 0xc000, 6);
+        EXPECT_EQ(12, ppu.read_vram(0x0000));
+        EXPECT_EQ(24, ppu.read_vram(0x1000));
+        write_mmc1(cpu, 0x8000, 0x0c);
+        EXPECT_EQ(8, ppu.read_vram(0x0000));
+        EXPECT_EQ(12, ppu.read_vram(0x1000));
+
+        // bit 4 of the PRG bank disables the PRG RAM
+        cpu.write_memory(0x6000, 0x12);
+        write_mmc1(cpu, 0xe000, 0x13);
+        EXPECT_EQ(0x60, cpu.read_memory(0x6000));
+        write_mmc1(cpu, 0xe000, 0x03);
+        EXPECT_EQ(0x12, cpu.read_memory(0x6000));
+    }
+    std::filesystem::remove(path);
+
+    path = write_mapper_rom("nesEmulator_mapper99.nes", 99, 2, 1);
+    Cartridge unknown;
+    ASSERT_TRUE(unknown.load(path, error)) << error;
+    {
+        Cpu cpu(true);
+        cpu.init();
+        Ppu ppu(cpu);
+        EXPECT_FALSE(Mapper::create(cpu, ppu, unknown, error));
+        EXPECT_EQ("unsupported mapper 99", error);
+    }
+    std::filesystem::remove(path);
+}
+
+/**
+ * MMC3 PRG and CHR banks in both modes, and its scanline counter raising
+ * the IRQ on the line the latch says.
+ */
+TEST(TestMapper, mmc3_test)
+{
+    std::string error;
+    std::string path = write_mapper_rom("nesEmulator_mmc3.nes", 4, 8, 8);
+    Cartridge cart;
+    ASSERT_TRUE(cart.load(path, error)) << error;
+    Cpu cpu(true);
+    cpu.init();
+    Ppu ppu(cpu);
+    std::unique_ptr<Mapper> mapper = Mapper::create(cpu, ppu, cart, error);
+    ASSERT_TRUE(mapper) << error;
+
+    cpu.write_memory(0x8000, 6);
+    cpu.write_memory(0x8001, 3);
+    cpu.write_memory(0x8000, 7);
+    cpu.write_memory(0x8001, 9);
+    EXPECT_EQ(3, cpu.read_memory(0x8000));
+    EXPECT_EQ(9, cpu.read_memory(0xa000));
+    EXPECT_EQ(14, cpu.read_memory(0xc000));
+    EXPECT_EQ(0x4c, cpu.read_memory(0xe000));
+    cpu.write_memory(0x8000, 0x46);
+    EXPECT_EQ(14, cpu.read_memory(0x8000));
+    EXPECT_EQ(3, cpu.read_memory(0xc000));
+
+    cpu.write_memory(0x8000, 0x00);
+    cpu.write_memory(0x8001, 9);    // 2KB banks ignore the low bit
+    cpu.write_memory(0x8000, 0x02);
+    cpu.write_memory(0x8001, 40);
+    EXPECT_EQ(8, ppu.read_vram(0x0000));
+    EXPECT_EQ(9, ppu.read_vram(0x0400));
+    EXPECT_EQ(40, ppu.read_vram(0x1000));
+    cpu.write_memory(0x8000, 0x80);
+    EXPECT_EQ(40, ppu.read_vram(0x0000));
+    EXPECT_EQ(8, ppu.read_vram(0x1000));
+
+    // write protected PRG RAM keeps its contents
+    cpu.write_memory(0x6000, 0x21);
+    cpu.write_memory(0xa001, 0xc0);
+    cpu.write_memory(0x6000, 0x22);
+    EXPECT_EQ(0x21, cpu.read_memory(0x6000));
+
+    // with rendering on the counter reloads on the pre-render line and
+    // counts down to 0 on line 9
+    cpu.set_pc(0xe000);
+    while (ppu.get_line() != Ppu::PRERENDER_LINE) {
+        cpu.step();
+        mapper->irq_pending();
+    }
+    cpu.write_memory(0x2001, 0x18);
+    cpu.write_memory(0xc000, 10);
+    cpu.write_memory(0xc001, 0);
+    cpu.write_memory(0xe001, 0);
+    while (!mapper->irq_pending() && cpu.get_cycles() < 100000) {
+        cpu.step();
+    }
+    // polling catches the PPU up to the cpu and no further: the counter is
+    // clocked on dot 260 and the JMP loop's next instruction boundary is
+    // on dot 262
+    EXPECT_EQ(9u, ppu.get_line());
+    EXPECT_EQ(262u, ppu.get_dot());
+    cpu.write_memory(0xe000, 0);
+    EXPECT_FALSE(mapper->irq_pending());
+
+    // and not at all while it's off
+    cpu.write_memory(0x2001, 0x00);
+    cpu.write_memory(0xe001, 0);
+    for (u32 i = 0; i < 4; i++) {
+        cpu.run_frame();
+    }
+    EXPECT_FALSE(mapper->irq_pending());
+    mapper.reset();
+    EXPECT_EQ(nullptr, cpu.get_bus().get_device(0x80));
+    EXPECT_EQ(nullptr, cpu.get_bus().get_read_page(0xff));
+    EXPECT_EQ(0, ppu.read_vram(0x1000));
+    std::filesystem::remove(path);
+}
+
+/**
+ * Loads code at $8000 with an NMI handler that counts NMIs in $10.
+ */
+static void load_ppu_program(Cpu &cpu, const std::vector<u8> &code)
+{
+    cpu.load(code, 0x8000);
+    // INC $10; RTI
+    cpu.load({0xe6, 0x10, 0x40}, 0x0300);
+    cpu.write_memory(0xfffa, 0x00);
+    cpu.write_memory(0xfffb, 0x03);
+    cpu.set_pc(0x8000);
+}
+
+/**
+ * A frame ends on dot 1 of line 241, where the NMI fires, and is 341 x 262
+ * dots long with rendering off. The block cache stops for the NMI as well.
+ */
+TEST(TestPpu, vblank_nmi_test)
+{
+    for (bool cache : {false, true}) {
+        Cpu cpu;
+        cpu.set_block_cache(cache);
+        Ppu ppu(cpu);
+        // LDA #$80; STA $2000; JMP *
+        load_ppu_program(cpu, {0xa9, 0x80, 0x8d, 0x00, 0x20, 0x4c, 0x05,
+                0x80});
+
+        ppu.run_frame();
+        EXPECT_EQ(1u, ppu.get_frame_count());
+        EXPECT_EQ(241u, ppu.get_line());
+        // dot 1 of line 241 is dot 82182 of the frame
+        u64 vblank = (241 * 341 + 1) / 3 + 1;
+        EXPECT_LE(vblank, cpu.get_cycles());
+        EXPECT_GT(vblank + 7, cpu.get_cycles());
+        EXPECT_EQ(0, cpu.read_memory(0x10));
+
+        u64 start = cpu.get_cycles();
+        ppu.run_frame();
+        ppu.run_frame();
+        EXPECT_NEAR(2 * 341 * 262 / 3.0, cpu.get_cycles() - start, 8);
+        EXPECT_EQ(2, cpu.read_memory(0x10));
+    }
+}
+
+/**
+ * Reads $2002 with the access falling on the given cycle.
+ *
+ * @return: The value read, with the number of NMIs taken by the end of the
+ * frame in the low bits.
+ */
+static u8 read_status_at(u32 cycle)
+{
+    Cpu cpu;
+    Ppu ppu(cpu);
+    // LDA #$80; STA $2000; LDA $10, 9 cycles
+    std::vector<u8> code = {0xa9, 0x80, 0x8d, 0x00, 0x20, 0xa5, 0x10};
+    // a NOP sled, LDA $2002 reads on its fourth cycle
+    if (cycle & 1) {
+        // NOP instead of LDA $10, 8 cycles
+        code[5] = 0xea;
+        code.pop_back();
+        code.insert(code.end(), (cycle - 3 - 8) / 2, 0xea);
+    } else {
+        code.insert(code.end(), (cycle - 3 - 9) / 2, 0xea);
+    }
+    u16 end = 0x8000 + code.size() + 5;
+    // LDA $2002; STA $11; JMP *
+    code.insert(code.end(), {0xad, 0x02, 0x20, 0x85, 0x11, 0x4c,
+            static_cast<u8>(end), static_cast<u8>(end >> 8)});
+    load_ppu_program(cpu, code);
+    cpu.run_cycles(29000);
+    return (cpu.read_memory(0x11) & 0x80) | cpu.read_memory(0x10);
+}
+
+/**
+ * Reading $2002 on the dot before vblank starts hides the flag and the NMI
+ * for the whole frame. A read a little later sees the flag and the NMI
+ * still fires.
+ */
+TEST(TestPpu, status_race_test)
+{
+    // dot 1 of line 241 falls on cycle 27394
+    EXPECT_EQ(0x01, read_status_at(27392));
+    EXPECT_EQ(0x00, read_status_at(27394));
+    EXPECT_EQ(0x81, read_status_at(27396));
+}
+
+/**
+ * Fills the screen with a solid tile and puts sprite 0 on it at (40, 31).
+ */
+static void load_solid_screen(Cpu &cpu, Ppu &ppu, std::vector<u8> &chr,
+        const std::vector<u8> &code)
+{
+    chr.assign(0x2000, 0);
+    memset(&chr[16], 0xff, 8);
+    ppu.map_chr(0x0000, 0x2000, chr.data(), chr.size(), true);
+    for (u16 address = 0x2000; address < 0x23c0; address++) {
+        ppu.write_vram(address, 1);
+    }
+    ppu.write_vram(0x3f00, 0x0f);
+    ppu.write_vram(0x3f01, 0x30);
+    ppu.write_vram(0x3f11, 0x16);
+
+    std::vector<u8> sprites(0x100, 0xff);
+    sprites[0] = 30;
+    sprites[1] = 1;
+    sprites[2] = 0;
+    sprites[3] = 40;
+    cpu.load(sprites, 0x0200);
+    load_ppu_program(cpu, code);
+}
+
+/**
+ * The sprite 0 hit shows up on the dot of the first pixel where the sprite
+ * covers the background, the sprite is drawn on top of it.
+ */
+TEST(TestPpu, sprite_zero_test)
+{
+    Cpu cpu;
+    Ppu ppu(cpu);
+    std::vector<u8> chr;
+    load_solid_screen(cpu, ppu, chr, {
+        0xa9, 0x02, 0x8d, 0x14, 0x40,   // LDA #$02; STA $4014
+        0xa9, 0x1e, 0x8d, 0x01, 0x20,   // LDA #$1E; STA $2001
+        0x2c, 0x02, 0x20, 0x50, 0xfb,   // wait: BIT $2002; BVC wait
+        0x4c, 0x0f, 0x80,               // JMP *
+    });
+    while (cpu.get_pc() != 0x800f) {
+        cpu.step();
+    }
+    // pixel 40 comes out on dot 41, the loop polls every 21 dots
+    EXPECT_EQ(31u, ppu.get_line());
+    EXPECT_LE(42u, ppu.get_dot());
+    EXPECT_GE(42u + 21, ppu.get_dot());
+
+    ppu.run_frame();
+    ppu.run_frame();
+    const u8 *frame = ppu.get_frame();
+    EXPECT_EQ(0x30, frame[0]);
+    EXPECT_EQ(0x30, frame[31 * Ppu::WIDTH + 39]);
+    EXPECT_EQ(0x16, frame[31 * Ppu::WIDTH + 40]);
+    EXPECT_EQ(0x16, frame[38 * Ppu::WIDTH + 47]);
+    EXPECT_EQ(0x30, frame[39 * Ppu::WIDTH + 47]);
+}
+
+/**
+ * Where sprites overlap the first one shows, even behind the background, a
+ * sprite behind the background shows through where it is transparent, and
+ * a ninth sprite on a line is dropped and flags overflow.
+ */
+TEST(TestPpu, sprite_priority_test)
+{
+    Cpu cpu;
+    Ppu ppu(cpu);
+    std::vector<u8> chr(0x2000, 0);
+    memset(&chr[0x10], 0xff, 8);    // tile 1, colour 1
+    memset(&chr[0x28], 0xff, 8);    // tile 2, colour 2
+    ppu.map_chr(0x0000, 0x2000, chr.data(), chr.size(), false);
+    // the top half has an opaque background, the bottom half none
+    for (u16 address = 0x2000; address < 0x21e0; address++) {
+        ppu.write_vram(address, 1);
+    }
+    ppu.write_vram(0x3f00, 0x0f);
+    ppu.write_vram(0x3f01, 0x30);
+    ppu.write_vram(0x3f12, 0x2a);
+    ppu.write_vram(0x3f16, 0x12);
+
+    std::vector<u8> sprites(0x100, 0xff);
+    auto put = [&](u32 n, u8 y, u8 attributes, u8 x) {
+        sprites[n * 4] = y;
+        sprites[n * 4 + 1] = 2;
+        sprites[n * 4 + 2] = attributes;
+        sprites[n * 4 + 3] = x;
+    };
+    put(0, 49, 0x20, 100);  // behind, palette 0
+    put(1, 49, 0x01, 104);  // in front, palette 1
+    put(2, 149, 0x20, 100);
+    put(3, 149, 0x01, 104);
+    for (u32 n = 4; n < 13; n++) {
+        put(n, 199, 0x00, static_cast<u8>((n - 4) * 16));
+    }
+    cpu.load(sprites, 0x0200);
+    load_ppu_program(cpu, {
+        0xa9, 0x02, 0x8d, 0x14, 0x40,   // LDA #$02; STA $4014
+        0xa9, 0x1e, 0x8d, 0x01, 0x20,   // LDA #$1E; STA $2001
+        0xad, 0x02, 0x20,               // wait: LDA $2002
+        0x29, 0x20, 0xf0, 0xf9,         // AND #$20; BEQ wait
+        0x85, 0x10,                     // STA $10
+        0x4c, 0x13, 0x80,               // JMP *
+    });
+    ppu.run_frame();
+    ppu.run_frame();
+    EXPECT_EQ(0x20, cpu.read_memory(0x10));
+
+    const u8 *frame = ppu.get_frame();
+    const u8 *top = frame + 50 * Ppu::WIDTH;
+    EXPECT_EQ(0x30, top[100]);
+    EXPECT_EQ(0x30, top[105]);
+    EXPECT_EQ(0x12, top[109]);
+    EXPECT_EQ(0x30, top[112]);
+    const u8 *bottom = frame + 150 * Ppu::WIDTH;
+    EXPECT_EQ(0x2a, bottom[100]);
+    EXPECT_EQ(0x2a, bottom[105]);
+    EXPECT_EQ(0x12, bottom[109]);
+    EXPECT_EQ(0x0f, bottom[112]);
+    const u8 *crowded = frame + 200 * Ppu::WIDTH;
+    EXPECT_EQ(0x2a, crowded[0]);
+    EXPECT_EQ(0x2a, crowded[7 * 16 + 7]);
+    EXPECT_EQ(0x0f, crowded[8 * 16]);
+}
+
+/**
+ * Skipped frames leave the frame alone but keep the sprite 0 hit, overflow
+ * and vblank on the same cycles as rendered ones.
+ */
+TEST(TestPpu, skip_rendering_test)
+{
+    u64 hitCycles[2];
+    for (u32 skip = 0; skip < 2; skip++) {
+        Cpu cpu;
+        Ppu ppu(cpu);
+        ppu.set_skip_rendering(skip);
+        std::vector<u8> chr;
+        load_solid_screen(cpu, ppu, chr, {
+            0xa9, 0x02, 0x8d, 0x14, 0x40,   // LDA #$02; STA $4014
+            0xa9, 0x1e, 0x8d, 0x01, 0x20,   // LDA #$1E; STA $2001
+            0x2c, 0x02, 0x20, 0x50, 0xfb,   // wait: BIT $2002; BVC wait
+            0x4c, 0x0f, 0x80,               // JMP *
+        });
+        while (cpu.get_pc() != 0x800f) {
+            cpu.step();
+        }
+        hitCycles[skip] = cpu.get_cycles();
+        EXPECT_EQ(31u, ppu.get_line());
+
+        ppu.run_frame();
+        EXPECT_EQ(1u, ppu.get_frame_count());
+        EXPECT_EQ(!skip, ppu.is_frame_rendered());
+        EXPECT_EQ(skip ? 0x00 : 0x16, ppu.get_frame()[31 * Ppu::WIDTH + 40]);
+
+        // the next frame is rendered
+        ppu.set_skip_rendering(false);
+        ppu.run_frame();
+        EXPECT_TRUE(ppu.is_frame_rendered());
+        EXPECT_EQ(0x16, ppu.get_frame()[31 * Ppu::WIDTH + 40]);
+    }
+    EXPECT_EQ(hitCycles[0], hitCycles[1]);
+}
+
+/**
+ * Frames drawn on the render thread from the PPU's logs are the frames the
+ * PPU draws itself, through a scroll split after the sprite 0 hit and
+ * nametable and CHR RAM writes in vblank, and the PPU draws the same frames
+ * again once the render thread is gone. The same goes for rendering the
+ * lines after the split in bands across a pool, sprites included.
+ */
+TEST(TestRenderThread, replay_test)
+{
+    const u32 FRAMES = 8;
+    std::vector<std::vector<u8>> expected;
+    for (u32 run = 0; run < 3; run++) {
+        bool threaded = run > 0;
+        u32 bandThreads = run == 2 ? 4 : 1;
+        Cpu cpu;
+        Ppu ppu(cpu);
+        std::vector<u8> chr;
+        load_solid_screen(cpu, ppu, chr, {
+            0xa9, 0x02, 0x8d, 0x14, 0x40,   // LDA #$02; STA $4014
+            0xa9, 0x80, 0x8d, 0x00, 0x20,   // LDA #$80; STA $2000
+            0xa9, 0x1e, 0x8d, 0x01, 0x20,   // LDA #$1E; STA $2001
+            0x2c, 0x02, 0x20, 0x70, 0xfb,   // clear: BIT $2002; BVS clear
+            0x2c, 0x02, 0x20, 0x50, 0xfb,   // hit: BIT $2002; BVC hit
+            0xe6, 0x11, 0xa5, 0x11,         // INC $11; LDA $11
+            0x8d, 0x05, 0x20,               // STA $2005
+            0x8d, 0x05, 0x20,               // STA $2005
+            0x4c, 0x0f, 0x80,               // JMP clear
+        });
+        cpu.load({
+            0xe6, 0x10,                     // INC $10
+            0xa9, 0x20, 0x8d, 0x06, 0x20,   // LDA #$20; STA $2006
+            0xa5, 0x10, 0x8d, 0x06, 0x20,   // LDA $10; STA $2006
+            0x8d, 0x07, 0x20,               // STA $2007
+            0xa9, 0x00, 0x8d, 0x06, 0x20,   // LDA #$00; STA $2006
+            0xa9, 0x18, 0x8d, 0x06, 0x20,   // LDA #$18; STA $2006
+            0xa5, 0x10, 0x8d, 0x07, 0x20,   // LDA $10; STA $2007
+            0xa9, 0x00, 0x8d, 0x05, 0x20,   // LDA #$00; STA $2005
+            0x8d, 0x05, 0x20,               // STA $2005
+            0x40,                           // RTI
+        }, 0x0300);
+        // sprites 1-3, further down: plain, flipped and behind the
+        // background
+        cpu.load({100, 1, 0x01, 60, 150, 1, 0x42, 200, 180, 1, 0x20, 10},
+                0x0204);
+
+        if (!threaded) {
+            for (u32 i = 0; i <= FRAMES; i++) {
+                ppu.run_frame();
+                expected.emplace_back(ppu.get_frame(),
+                        ppu.get_frame() + Ppu::WIDTH * Ppu::HEIGHT);
+            }
+            // the frames have to differ for the test to mean anything
+            EXPECT_NE(expected[1], expected[FRAMES - 1]);
+            continue;
+        }
+
+        {
+            RenderThread renderer(ppu, bandThreads);
+            for (u32 i = 0; i < FRAMES; i++) {
+                ppu.run_frame();
+                const RenderThread::Frame *frame = renderer.wait_frame();
+                ASSERT_NE(nullptr, frame);
+                EXPECT_EQ(i + 1, frame->number);
+                EXPECT_EQ(0, memcmp(expected[i].data(), frame->pixels,
+                            expected[i].size())) << "frame " << i + 1;
+                EXPECT_EQ(ppu.get_emphasis(0), frame->emphasis[0]);
+                renderer.release_frame(frame);
+            }
+            EXPECT_FALSE(ppu.is_frame_rendered());
+            EXPECT_EQ(0u, renderer.get_dropped_frames());
+            if (bandThreads > 1) {
+                EXPECT_LT(0u, renderer.get_band_line_count());
+            } else {
+                EXPECT_EQ(0u, renderer.get_band_line_count());
+            }
+        }
+        ppu.run_frame();
+        EXPECT_TRUE(ppu.is_frame_rendered());
+        EXPECT_EQ(0, memcmp(expected[FRAMES].data(), ppu.get_frame(),
+                    expected[FRAMES].size()));
+    }
+}
+
+/**
+ * Frames that nobody takes are dropped, the cpu keeps running.
+ */
+TEST(TestRenderThread, dropped_frames_test)
+{
+    Cpu cpu;
+    Ppu ppu(cpu);
+    load_ppu_program(cpu, {0x4c, 0x00, 0x80});  // JMP *
+    RenderThread renderer(ppu);
+    for (u32 i = 0; i < RenderThread::FRAMES + 2; i++) {
+        ppu.run_frame();
+    }
+    const RenderThread::Frame *frame = renderer.wait_frame();
+    ASSERT_NE(nullptr, frame);
+    EXPECT_EQ(1u, frame->number);
+    EXPECT_EQ(2u, renderer.get_dropped_frames());
+    renderer.release_frame(frame);
+}
+
+/**
+ * A destroyed PPU leaves the bus and the cpu's clock, so the cpu runs on
+ * without it and another PPU can take its place.
+ */
+TEST(TestPpu, destroy_test)
+{
+    Cpu cpu;
+    cpu.load({0x4c, 0x00, 0x80}, 0x8000);   // JMP $8000
+    cpu.set_pc(0x8000);
+    {
+        Ppu ppu(cpu);
+        cpu.run_cycles(Cpu::CYCLES_PER_FRAME);
+        EXPECT_EQ(&ppu, cpu.get_bus().get_device(0x20));
+    }
+    EXPECT_EQ(nullptr, cpu.get_bus().get_device(0x20));
+    EXPECT_EQ(nullptr, cpu.get_bus().get_device(0x3f));
+    EXPECT_EQ(nullptr, cpu.get_bus().get_device(0x40));
+    cpu.run_cycles(2 * Cpu::CYCLES_PER_FRAME);
+
+    Ppu ppu(cpu);
+    u64 frames = ppu.get_frame_count();
+    cpu.run_cycles(2 * Cpu::CYCLES_PER_FRAME);
+    EXPECT_LT(frames, ppu.get_frame_count());
+}
+
+/**
+ * $2007 reads come a read late through the buffer, except for the palette,
+ * and the nametables are mirrored.
+ */
+TEST(TestPpu, vram_access_test)
+{
+    Cpu cpu;
+    Ppu ppu(cpu);
+    load_ppu_program(cpu, {
+        0xa9, 0x21, 0x8d, 0x06, 0x20,   // LDA #$21; STA $2006
+        0xa9, 0x08, 0x8d, 0x06, 0x20,   // LDA #$08; STA $2006
+        0xa9, 0x5a, 0x8d, 0x07, 0x20,   // LDA #$5A; STA $2007
+        0xa9, 0x25, 0x8d, 0x06, 0x20,   // LDA #$25; STA $2006
+        0xa9, 0x08, 0x8d, 0x06, 0x20,   // LDA #$08; STA $2006
+        0xad, 0x07, 0x20, 0x85, 0x11,   // LDA $2007; STA $11
+        0xad, 0x07, 0x20, 0x85, 0x12,   // LDA $2007; STA $12
+        0xa9, 0x3f, 0x8d, 0x06, 0x20,   // LDA #$3F; STA $2006
+        0xa9, 0x10, 0x8d, 0x06, 0x20,   // LDA #$10; STA $2006
+        0xa9, 0x2c, 0x8d, 0x07, 0x20,   // LDA #$2C; STA $2007
+        0x4c, 0x32, 0x80,               // JMP *
+    });
+    cpu.run_cycles(200);
+    EXPECT_EQ(0x5a, ppu.read_vram(0x2108));
+    EXPECT_NE(0x5a, cpu.read_memory(0x11));
+    EXPECT_EQ(0x5a, cpu.read_memory(0x12));
+    EXPECT_EQ(0x2c, ppu.read_vram(0x3f00));
+}
+
+/**
+ * A frame scrolled by a few pixels comes out the same whichever decoder
+ * the background goes through, with or without the tile cache, and is
+ * shifted by the fine scroll.
+ */
+TEST(TestPpu, fine_scroll_test)
+{
+    std::vector<u8> chr(0x2000);
+    for (u32 i = 0; i < chr.size(); i++) {
+        chr[i] = static_cast<u8>(i * 37 + (i >> 4));
+    }
+    std::vector<u8> reference;
+    for (u32 run = 0; run < TILE_DECODER_COUNT * 2; run++) {
+        TileDecoderKind kind = static_cast<TileDecoderKind>(run >> 1);
+        Cpu cpu;
+        Ppu ppu(cpu);
+        if (!ppu.set_tile_decoder(kind)) {
+            continue;
+        }
+        ppu.set_tile_cache(run & 1);
+        ppu.map_chr(0x0000, 0x2000, chr.data(), chr.size(), false);
+        for (u16 address = 0x2000; address < 0x2400; address++) {
+            ppu.write_vram(address, static_cast<u8>(address * 7));
+        }
+        for (u16 address = 0x3f00; address < 0x3f10; address++) {
+            ppu.write_vram(address, static_cast<u8>(address & 0x0f));
+        }
+        load_ppu_program(cpu, {
+            0xa9, 0x0b, 0x8d, 0x05, 0x20,   // LDA #$0B; STA $2005
+            0xa9, 0x00, 0x8d, 0x05, 0x20,   // LDA #$00; STA $2005
+            0xa9, 0x0a, 0x8d, 0x01, 0x20,   // LDA #$0A; STA $2001
+            0x4c, 0x0f, 0x80,               // JMP *
+        });
+        ppu.run_frame();
+        ppu.run_frame();
+        const u8 *frame = ppu.get_frame();
+        if (reference.empty()) {
+            reference.assign(frame, frame + Ppu::WIDTH * Ppu::HEIGHT);
+            // pixel 0 is pixel 3 of the second tile of the first row
+            u8 index = ppu.read_vram(0x2001);
+            u8 low = chr[index << 4];
+            u8 high = chr[(index << 4) | 8];
+            u8 pixel = ((low >> 4) & 1) | (((high >> 4) & 1) << 1);
+            u8 attribute = ppu.read_vram(0x23c0) & 3;
+            EXPECT_EQ(pixel ? (attribute << 2) | pixel : 0, frame[0]);
+        } else {
+            EXPECT_EQ(0, memcmp(reference.data(), frame, reference.size()))
+                << tile_decoder_name(kind) << " " << (run & 1);
+        }
+    }
+}
+
+/**
+ * The tile cache picks up CHR RAM writes and bank switches, also when the
+ * written tile shows up in more than one bank.
+ */
+TEST(TestPpu, tile_cache_test)
+{
+    Cpu cpu;
+    Ppu ppu(cpu);
+    ppu.set_tile_cache(true);
+    std::vector<u8> chr(0x400, 0);
+    memset(&chr[0x10], 0xff, 8);
+    // mirrored into both pattern tables
+    ppu.map_chr(0x0000, 0x2000, chr.data(), chr.size(), true);
+    for (u16 address = 0x2000; address < 0x23c0; address++) {
+        ppu.write_vram(address, 1);
+    }
+    ppu.write_vram(0x3f00, 0x0f);
+    ppu.write_vram(0x3f01, 0x30);
+    ppu.write_vram(0x3f03, 0x2a);
+    load_ppu_program(cpu, {
+        0xa9, 0x0a, 0x8d, 0x01, 0x20,   // LDA #$0A; STA $2001
+        0x4c, 0x05, 0x80,               // JMP *
+    });
+    ppu.run_frame();
+    ppu.run_frame();
+    EXPECT_EQ(0x30, ppu.get_frame()[0]);
+    // tile 1 and tile 0, which the sprites in the cleared OAM use
+    TileCacheStats stats = ppu.get_tile_cache_stats();
+    EXPECT_EQ(2u, stats.misses);
+    EXPECT_LT(0.99, stats.hit_rate());
+
+    // written through the upper pattern table
+    for (u16 address = 0x1018; address < 0x1020; address++) {
+        ppu.write_vram(address, 0xff);
+    }
+    ppu.run_frame();
+    EXPECT_EQ(0x2a, ppu.get_frame()[0]);
+    EXPECT_EQ(1u, ppu.get_tile_cache_stats().writeInvalidations);
+
+    std::vector<u8> blank(0x400, 0);
+    ppu.map_chr(0x0000, 0x400, blank.data(), blank.size(), false);
+    ppu.run_frame();
+    EXPECT_EQ(0x0f, ppu.get_frame()[0]);
+    EXPECT_EQ(2u, ppu.get_tile_cache_stats().bankInvalidations);
+}
+
+/**
+ * Every decoder the host can run matches the scalar one, for any number of
+ * tiles, and stays inside the count * 8 bytes it was given.
+ */
+TEST(TestTileDecoder, kernels_test)
+{
+    u8 low[40], high[40], palette[40];
+    u32 seed = 1;
+    for (u32 i = 0; i < 40; i++) {
+        seed = seed * 1103515245 + 12345;
+        low[i] = seed >> 16;
+        high[i] = seed >> 24;
+        palette[i] = ((seed >> 8) & 3) << 2;
+    }
+    // a transparent tile, and one of each colour
+    low[3] = high[3] = 0;
+    low[4] = 0xf0;
+    high[4] = 0x3c;
+
+    TileDecoder scalar = get_tile_decoder(TILE_DECODER_SCALAR);
+    u8 expected[40 * 8];
+    scalar(low, high, palette, 40, expected);
+    EXPECT_EQ(0, expected[3 * 8]);
+    EXPECT_EQ((palette[4] | 1), expected[4 * 8]);
+    EXPECT_EQ((palette[4] | 3), expected[4 * 8 + 2]);
+    EXPECT_EQ((palette[4] | 2), expected[4 * 8 + 4]);
+    EXPECT_EQ(0, expected[4 * 8 + 6]);
+
+    for (u32 kind = 0; kind < TILE_DECODER_COUNT; kind++) {
+        TileDecoder decoder =
+            get_tile_decoder(static_cast<TileDecoderKind>(kind));
+        if (!decoder) {
+            continue;
+        }
+        for (u32 count = 0; count <= 40; count++) {
+            u8 out[40 * 8 + 1];
+            memset(out, 0xaa, sizeof(out));
+            decoder(low, high, palette, count, out);
+            EXPECT_EQ(0, memcmp(expected, out, count * 8))
+                << tile_decoder_name(static_cast<TileDecoderKind>(kind))
+                << " " << count;
+            EXPECT_EQ(0xaa, out[count * 8]);
+        }
+    }
+}
+
+/**
+ * Every converter the host can run matches the scalar one in each format,
+ * for any length of line, and the colours come out of the palette.
+ */
+TEST(TestFrameConverter, formats_test)
+{
+    u8 indices[100];
+    for (u32 i = 0; i < sizeof(indices); i++) {
+        indices[i] = (i * 29 + 7) & 63;
+    }
+    indices[0] = 0x30;
+    indices[1] = 0x0f;
+
+    for (u32 f = 0; f < PIXEL_FORMAT_COUNT; f++) {
+        PixelFormat format = static_cast<PixelFormat>(f);
+        FrameConverter scalar(format, CONVERTER_SCALAR);
+        u32 size = scalar.get_pixel_size();
+        EXPECT_EQ(pixel_size(format), size);
+        for (u8 emphasis = 0; emphasis < 8; emphasis++) {
+            u8 expected[sizeof(indices) * 4];
+            scalar.convert_line(indices, emphasis, sizeof(indices), expected);
+            for (u32 k = 0; k < CONVERTER_COUNT; k++) {
+                ConverterKind kind = static_cast<ConverterKind>(k);
+                if (!converter_supported(kind)) {
+                    continue;
+                }
+                FrameConverter converter(format, kind);
+                for (u32 count = 0; count <= sizeof(indices); count += 11) {
+                    u8 out[sizeof(indices) * 4 + 1];
+                    memset(out, 0xaa, sizeof(out));
+                    converter.convert_line(indices, emphasis, count, out);
+                    EXPECT_EQ(0, memcmp(expected, out, count * size))
+                        << pixel_format_name(format) << " "
+                        << converter_name(kind) << " " << count;
+                    EXPECT_EQ(0xaa, out[count * size]);
+                }
+            }
+        }
+    }
+
+    u8 rgba[8];
+    FrameConverter(PIXEL_RGBA8).convert_line(indices, 0, 2, rgba);
+    const u8 white[8] = {0xfc, 0xfc, 0xfc, 0xff, 0, 0, 0, 0xff};
+    EXPECT_EQ(0, memcmp(white, rgba, sizeof(rgba)));
+    // red emphasis dims green and blue
+    FrameConverter(PIXEL_RGBA8).convert_line(indices, 1, 1, rgba);
+    EXPECT_EQ(0xfc, rgba[0]);
+    EXPECT_EQ(0xce, rgba[1]);
+    EXPECT_EQ(0xce, rgba[2]);
+
+    u8 rgb565[2];
+    FrameConverter(PIXEL_RGB565).convert_line(indices, 0, 1, rgb565);
+    EXPECT_EQ(0xffff, rgb565[0] | rgb565[1] << 8);
+    u8 index[2];
+    FrameConverter(PIXEL_INDEX).convert_line(indices, 7, 2, index);
+    EXPECT_EQ(0x30, index[0]);
+    EXPECT_EQ(0x0f, index[1]);
+}
+
+/**
+ * Every filter kernel the host can run, split over any number of threads,
+ * matches the scalar one on a single thread, frame after frame. Scale2x
+ * rounds off a corner, nearest only repeats pixels and NTSC leaves grays
+ * alone.
+ */
+TEST(TestPostFilter, kernels_test)
+{
+    const u32 WIDTH = 37;
+    const u32 HEIGHT = 11;
+    // a few colours only, so neighbours often match
+    const u32 colours[] = {0xff000000, 0xffffffff, 0xff2040e0, 0xff10c030};
+    std::vector<u32> in(WIDTH * HEIGHT);
+    u32 seed = 1;
+    for (u32 &pixel : in) {
+        seed = seed * 1103515245 + 12345;
+        pixel = colours[(seed >> 16) & 3];
+    }
+    const u8 *frame = reinterpret_cast<const u8 *>(in.data());
+
+    for (u32 type = 0; type < FILTER_TYPE_COUNT; type++) {
+        PostFilter reference(static_cast<FilterType>(type), WIDTH, HEIGHT, 1,
+                FILTER_SCALAR);
+        u32 pitch = reference.get_width() * 4;
+        std::vector<u8> expected[3];
+        for (std::vector<u8> &out : expected) {
+            out.resize(pitch * reference.get_height());
+            reference.apply(frame, WIDTH * 4, out.data(), pitch);
+        }
+        for (u32 kind = 0; kind < FILTER_KIND_COUNT; kind++) {
+            if (!filter_supported(static_cast<FilterKind>(kind))) {
+                continue;
+            }
+            for (u32 threads : {1, 3}) {
+                PostFilter filter(static_cast<FilterType>(type), WIDTH,
+                        HEIGHT, threads, static_cast<FilterKind>(kind));
+                ASSERT_EQ(reference.get_width(), filter.get_width());
+                for (u32 i = 0; i < 3; i++) {
+                    std::vector<u8> out(expected[i].size());
+                    filter.apply(frame, WIDTH * 4, out.data(), pitch);
+                    EXPECT_EQ(expected[i], out) << filter_type_name(
+                            static_cast<FilterType>(type)) << " "
+                        << filter_kind_name(static_cast<FilterKind>(kind))
+                        << " x" << threads << " frame " << i;
+                }
+            }
+        }
+    }
+
+    // W W W
+    // W K K  the top left of K's 2x2 block goes white
+    // K K K
+    std::vector<u32> corner(9, 0xff000000);
+    corner[0] = corner[1] = corner[2] = corner[3] = 0xffffffff;
+    std::vector<u32> scaled(36);
+    PostFilter(FILTER_SCALE2X, 3, 3).apply(
+            reinterpret_cast<const u8 *>(corner.data()), 12,
+            reinterpret_cast<u8 *>(scaled.data()), 24);
+    EXPECT_EQ(0xffffffff, scaled[2 * 6 + 2]);
+    EXPECT_EQ(0xff000000, scaled[2 * 6 + 3]);
+    EXPECT_EQ(0xff000000, scaled[3 * 6 + 3]);
+
+    scaled.resize(81);
+    PostFilter(FILTER_NEAREST3, 3, 3).apply(
+            reinterpret_cast<const u8 *>(corner.data()), 12,
+            reinterpret_cast<u8 *>(scaled.data()), 36);
+    for (u32 y = 0; y < 9; y++) {
+        for (u32 x = 0; x < 9; x++) {
+            EXPECT_EQ(corner[y / 3 * 3 + x / 3], scaled[y * 9 + x]);
+        }
+    }
+
+    std::vector<u8> gray(WIDTH * HEIGHT * 4, 0x80);
+    std::vector<u8> filtered(gray.size());
+    PostFilter(FILTER_NTSC, WIDTH, HEIGHT).apply(gray.data(), WIDTH * 4,
+            filtered.data(), WIDTH * 4);
+    for (u32 i = 0; i < filtered.size(); i++) {
+        EXPECT_EQ((i & 3) == 3 ? 0xff : 0x80, filtered[i]);
+    }
+}
+
+/**
+ * Reads a whole Y4M stream and splits it into its header and frames.
+ */
+static std::vector<std::vector<u8>> read_y4m(FILE *fp, std::string &header)
+{
+    std::vector<u8> data;
+    u8 buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), fp))) {
+        data.insert(data.end(), buffer, buffer + count);
+    }
+    std::vector<std::vector<u8>> frames;
+    auto end = std::find(data.begin(), data.end(), '\n');
+    header.assign(data.begin(), end);
+    const size_t SIZE = Ppu::WIDTH * Ppu::HEIGHT * 3 / 2;
+    for (auto it = end + 1; it + 6 + SIZE <= data.end(); it += 6 + SIZE) {
+        EXPECT_EQ("FRAME\n", std::string(it, it + 6));
+        frames.emplace_back(it + 6, it + 6 + SIZE);
+    }
+    return frames;
+}
+
+/**
+ * Frames are written as 4:2:0 YUV in order, and a frame number skipped
+ * repeats the frame before it. An output that can't be opened fails.
+ */
+TEST(TestVideoSink, stream_test)
+{
+    namespace fs = std::filesystem;
+    fs::path path = fs::temp_directory_path() / "nesEmulator_video_test.y4m";
+    std::vector<u8> pixels(Ppu::WIDTH * Ppu::HEIGHT);
+    std::vector<u8> emphasis(Ppu::HEIGHT, 0);
+    {
+        VideoSink sink(path.string());
+        std::fill(pixels.begin(), pixels.end(), 0x30);
+        EXPECT_TRUE(sink.push_frame(pixels.data(), emphasis.data(), 5));
+        std::fill(pixels.begin(), pixels.end(), 0x0f);
+        EXPECT_TRUE(sink.push_frame(pixels.data(), emphasis.data(), 6));
+        std::fill(pixels.begin(), pixels.end(), 0x16);
+        EXPECT_TRUE(sink.push_frame(pixels.data(), emphasis.data(), 8));
+        EXPECT_TRUE(sink.close());
+        EXPECT_EQ(4u, sink.get_written_frames());
+        EXPECT_EQ(0u, sink.get_dropped_frames());
+        EXPECT_FALSE(sink.push_frame(pixels.data(), emphasis.data(), 9));
+    }
+
+    FILE *fp = fopen(path.string().c_str(), "rb");
+    ASSERT_NE(nullptr, fp);
+    std::string header;
+    std::vector<std::vector<u8>> frames = read_y4m(fp, header);
+    fclose(fp);
+    fs::remove(path);
+    EXPECT_EQ("YUV4MPEG2 W256 H240 F39375000:655171 Ip A1:1 C420jpeg "
+            "XCOLORRANGE=FULL", header);
+    ASSERT_EQ(4u, frames.size());
+    const size_t CB = Ppu::WIDTH * Ppu::HEIGHT;
+    const size_t CR = CB + CB / 4;
+    // $30 is 0xfcfcfc, $0f black and $16 0xf83800
+    const u8 expected[4][3] = {
+        {0xfc, 128, 128}, {0, 128, 128}, {0, 128, 128}, {107, 68, 229},
+    };
+    for (u32 i = 0; i < 4; i++) {
+        EXPECT_EQ(expected[i][0], frames[i][0]);
+        EXPECT_EQ(expected[i][0], frames[i][CB - 1]);
+        EXPECT_EQ(expected[i][1], frames[i][CB]);
+        EXPECT_EQ(expected[i][2], frames[i][CR]);
+        EXPECT_EQ(expected[i][2], frames[i].back());
+    }
+
+    VideoSink missing((path / "missing" / "video.y4m").string());
+    EXPECT_FALSE(missing.close());
+    EXPECT_NE("", missing.get_error());
+}
+
+#ifndef _WIN32
+/**
+ * Opening a FIFO waits for a reader on the writer thread, so pushing never
+ * blocks: once the ring is full the frames are dropped and counted.
+ */
+TEST(TestVideoSink, dropped_frames_test)
+{
+    namespace fs = std::filesystem;
+    fs::path path = fs::temp_directory_path() / "nesEmulator_video_fifo";
+    fs::remove(path);
+    ASSERT_EQ(0, mkfifo(path.string().c_str(), 0600));
+
+    std::vector<u8> pixels(Ppu::WIDTH * Ppu::HEIGHT, 0x21);
+    std::vector<u8> emphasis(Ppu::HEIGHT, 0);
+    const u32 FRAMES = VideoSink::FRAMES;
+    VideoSink sink(path.string());
+    for (u32 i = 1; i <= FRAMES + 3; i++) {
+        EXPECT_EQ(i <= FRAMES,
+                sink.push_frame(pixels.data(), emphasis.data(), i));
+    }
+    EXPECT_EQ(3u, sink.get_dropped_frames());
+
+    std::string header;
+    std::vector<std::vector<u8>> frames;
+    std::thread reader([&] {
+        FILE *fp = fopen(path.string().c_str(), "rb");
+        ASSERT_NE(nullptr, fp);
+        frames = read_y4m(fp, header);
+        fclose(fp);
+    });
+    EXPECT_TRUE(sink.close());
+    reader.join();
+    fs::remove(path);
+    EXPECT_EQ(FRAMES, sink.get_written_frames());
+    EXPECT_EQ(FRAMES, frames.size());
+}
+
+/**
+ * A FIFO that never gets a reader, e.g. because the encoder didn't start,
+ * fails the stream instead of hanging close().
+ */
+TEST(TestVideoSink, no_reader_test)
+{
+    namespace fs = std::filesystem;
+    fs::path path = fs::temp_directory_path() / "nesEmulator_video_noreader";
+    fs::remove(path);
+    ASSERT_EQ(0, mkfifo(path.string().c_str(), 0600));
+
+    std::vector<u8> pixels(Ppu::WIDTH * Ppu::HEIGHT, 0x21);
+    std::vector<u8> emphasis(Ppu::HEIGHT, 0);
+    VideoSink sink(path.string());
+    EXPECT_TRUE(sink.push_frame(pixels.data(), emphasis.data(), 1));
+    EXPECT_FALSE(sink.close());
+    EXPECT_EQ("no reader for " + path.string(), sink.get_error());
+    EXPECT_EQ(0u, sink.get_written_frames());
+    fs::remove(path);
+}
+#endif
+
+/**
+ * Loads a program that writes each (address, value) pair in turn and then
+ * loops, and runs it for a few cycles so the writes are done.
+ */
+static void write_apu(Cpu &cpu, const std::vector<std::pair<u16, u8>> &writes)
+{
+    std::vector<u8> code;
+    for (const std::pair<u16, u8> &write : writes) {
+        // LDA #val; STA address
+        code.insert(code.end(), {0xa9, write.second, 0x8d,
+                static_cast<u8>(write.first), static_cast<u8>(write.first >> 8)});
+    }
+    u16 end = 0x8000 + code.size();
+    // JMP *
+    code.insert(code.end(), {0x4c, static_cast<u8>(end),
+            static_cast<u8>(end >> 8)});
+    cpu.load(code, 0x8000);
+    cpu.set_pc(0x8000);
+    cpu.run_cycles(writes.size() * 6);
+}
+
+/**
+ * Reading in the middle of a frame keeps the steps already added to it,
+ * however far past the samples read they are.
+ */
+TEST(TestBlipBuffer, open_frame_test)
+{
+    // a clock a sample
+    BlipBuffer early(48000, 48000, 256);
+    BlipBuffer late(48000, 48000, 256);
+    std::vector<s16> earlySamples(220);
+    std::vector<s16> lateSamples(220);
+    early.add_delta(5, 1000);
+    late.add_delta(5, 1000);
+    early.end_frame(20);
+    late.end_frame(20);
+
+    early.add_delta(100, -2000);
+    EXPECT_EQ(20u, early.read_samples(earlySamples.data(), 20));
+    EXPECT_EQ(20u, late.read_samples(lateSamples.data(), 20));
+    late.add_delta(100, -2000);
+
+    early.end_frame(200);
+    late.end_frame(200);
+    EXPECT_EQ(200u, early.read_samples(&earlySamples[20], 200));
+    EXPECT_EQ(200u, late.read_samples(&lateSamples[20], 200));
+    EXPECT_EQ(lateSamples, earlySamples);
+    EXPECT_GT(-500, *std::min_element(earlySamples.begin(),
+                earlySamples.end()));
+}
+
+/**
+ * The length counters run out on the frame counter's half frames, which
+ * $4015 shows, along with the frame interrupt at the end of a 4 step
+ * sequence. 5 step mode clocks the counters as it is written and never
+ * interrupts. Everything else on the page still goes to the PPU.
+ */
+TEST(TestApu, status_test)
+{
+    Cpu cpu;
+    Ppu ppu(cpu);
+    Apu apu(cpu);
+    // pulse 1, 2 and noise get 2 from the length table, the triangle 254
+    write_apu(cpu, {{0x4015, 0x0f}, {0x4003, 0x18}, {0x4007, 0x18},
+            {0x400b, 0x08}, {0x400f, 0x18}});
+    EXPECT_EQ(0x0f, cpu.read_memory(0x4015));
+    // one half frame, at 14913
+    cpu.run_cycles(20000 - cpu.get_cycles());
+    EXPECT_EQ(0x0f, cpu.read_memory(0x4015));
+    // the second and the interrupt, at 29829
+    cpu.run_cycles(30000 - cpu.get_cycles());
+    EXPECT_EQ(0x44, cpu.read_memory(0x4015));
+    EXPECT_EQ(0x04, cpu.read_memory(0x4015));
+
+    write_apu(cpu, {{0x4017, 0xc0}, {0x4003, 0x18}, {0x4017, 0xc0}});
+    EXPECT_EQ(0x05, cpu.read_memory(0x4015));
+    cpu.run_cycles(80000);
+    EXPECT_EQ(0x04, cpu.read_memory(0x4015));
+
+    // OAM DMA halts the cpu for 513 or 514 cycles
+    write_apu(cpu, {});
+    cpu.load({0xa9, 0x02, 0x8d, 0x14, 0x40}, 0x8000);
+    cpu.set_pc(0x8000);
+    cpu.step();
+    u64 start = cpu.get_cycles();
+    cpu.step();
+    EXPECT_LE(start + 4 + 513, cpu.get_cycles());
+}
+
+/**
+ * Catches the APU up to the cpu every frame and keeps the samples.
+ */
+static std::vector<s16> run_apu(Cpu &cpu, Apu &apu, u32 frames)
+{
+    std::vector<s16> samples;
+    for (u32 i = 0; i < frames; i++) {
+        cpu.run_cycles(Cpu::CYCLES_PER_FRAME);
+        std::vector<s16> frame(apu.samples_available());
+        EXPECT_EQ(frame.size(), apu.read_samples(frame.data(), frame.size()));
+        samples.insert(samples.end(), frame.begin(), frame.end());
+    }
+    return samples;
+}
+
+/**
+ * A 440 Hz square wave on pulse 1 comes out at 48 kHz, crossing zero 880
+ * times a second once the high-pass has taken the DC out. A silent APU is
+ * silent, and samples nothing reads are dropped.
+ */
+TEST(TestApu, tone_test)
+{
+    Cpu cpu;
+    Apu apu(cpu);
+    // 50% duty, constant volume 15, period 253: 1789773 / 16 / 254 Hz
+    write_apu(cpu, {{0x4015, 0x01}, {0x4000, 0xbf}, {0x4002, 253},
+            {0x4003, 0x08}});
+    std::vector<s16> samples = run_apu(cpu, apu, 60);
+    double seconds = 60.0 * Cpu::CYCLES_PER_FRAME / Apu::CLOCK_RATE;
+    EXPECT_NEAR(48000 * seconds, samples.size(), 2);
+
+    // skip the first tenth of a second, while the DC settles
+    u32 crossings = 0;
+    s16 lowest = 0, highest = 0;
+    for (size_t i = 4800; i < samples.size(); i++) {
+        crossings += (samples[i - 1] < 0) != (samples[i] < 0);
+        lowest = std::min(lowest, samples[i]);
+        highest = std::max(highest, samples[i]);
+    }
+    double tone = Apu::CLOCK_RATE / 16.0 / 254;
+    EXPECT_NEAR(2 * tone * (samples.size() - 4800) / 48000.0, crossings, 4);
+    // a step of 15 * 246, around 0
+    EXPECT_LT(1500, highest);
+    EXPECT_GT(-1500, lowest);
+    EXPECT_EQ(0u, apu.get_dropped_samples());
+
+    Cpu quiet;
+    Apu silent(quiet);
+    for (s16 sample : run_apu(quiet, silent, 10)) {
+        ASSERT_EQ(0, sample);
+    }
+    quiet.run_cycles(Apu::CLOCK_RATE);
+    EXPECT_EQ(12000u, silent.samples_available());
+    EXPECT_NEAR(48000 - 12000, silent.get_dropped_samples(), 2);
+}
+
+/**
+ * With channel capture on, each channel's samples add up to the mix, and
+ * a channel that isn't playing is silent.
+ */
+TEST(TestApu, channels_test)
+{
+    Cpu cpu;
+    Apu apu(cpu);
+    write_apu(cpu, {{0x4015, 0x0d}, {0x4000, 0xbf}, {0x4002, 253},
+            {0x4003, 0x08}, {0x4008, 0xff}, {0x400a, 100}, {0x400b, 0x08},
+            {0x400c, 0x3a}, {0x400e, 0x04}, {0x400f, 0x08}});
+    cpu.run_cycles(Cpu::CYCLES_PER_FRAME);
+    EXPECT_FALSE(apu.get_channel_capture());
+    apu.set_channel_capture(true);
+    EXPECT_TRUE(apu.get_channel_capture());
+    EXPECT_LT(0u, apu.get_dropped_samples());
+    EXPECT_EQ(0u, apu.samples_available());
+
+    cpu.run_cycles(10 * Cpu::CYCLES_PER_FRAME);
+    u32 count = apu.samples_available();
+    std::vector<s16> mix(count);
+    std::vector<std::vector<s16>> channels(Apu::CHANNEL_COUNT,
+            std::vector<s16>(count));
+    s16 *outs[Apu::CHANNEL_COUNT];
+    for (u32 i = 0; i < Apu::CHANNEL_COUNT; i++) {
+        outs[i] = channels[i].data();
+    }
+    ASSERT_EQ(count, apu.read_samples(mix.data(), count, outs));
+    // after the mix's DC from before has settled
+    for (u32 i = 4800; i < count; i++) {
+        s32 sum = 0;
+        for (u32 c = 0; c < Apu::CHANNEL_COUNT; c++) {
+            sum += channels[c][i];
+        }
+        // each buffer rounds on its own
+        ASSERT_NEAR(mix[i], sum, 2 * Apu::CHANNEL_COUNT) << i;
+    }
+    for (u32 c = 0; c < Apu::CHANNEL_COUNT; c++) {
+        bool playing = c != Apu::CHANNEL_PULSE2 && c != Apu::CHANNEL_DMC;
+        s16 loudest = 0;
+        for (s16 sample : channels[c]) {
+            loudest = std::max<s16>(loudest, std::abs(sample));
+        }
+        EXPECT_EQ(playing, loudest > 500) << Apu::channel_name(
+                static_cast<Apu::Channel>(c));
+    }
+}
+
+/**
+ * A destroyed APU gives the page back to the PPU and leaves the clock.
+ */
+TEST(TestApu, destroy_test)
+{
+    Cpu cpu;
+    Ppu ppu(cpu);
+    {
+        Apu apu(cpu);
+        EXPECT_EQ(&apu, cpu.get_bus().get_device(0x40));
+        cpu.run_cycles(Cpu::CYCLES_PER_FRAME);
+    }
+    EXPECT_EQ(&ppu, cpu.get_bus().get_device(0x40));
+    cpu.run_cycles(Cpu::CYCLES_PER_FRAME);
 }
 
+/**
+ * The DMC plays a sample from memory a bit at a time, $4015 shows it while
+ * bytes are left and raises its interrupt once they are all fetched.
+ */
+TEST(TestApu, dmc_test)
+{
+    Cpu cpu;
+    Apu apu(cpu);
+    cpu.load(std::vector<u8>(17, 0xff), 0xc000);
+    // interrupt, 54 cycles a bit, 17 bytes from $C000, start at level 64
+    write_apu(cpu, {{0x4010, 0x8f}, {0x4012, 0x00}, {0x4013, 0x01},
+            {0x4011, 0x40}, {0x4015, 0x10}});
+    EXPECT_EQ(0x10, cpu.read_memory(0x4015));
+    cpu.run_cycles(17 * 8 * 54 - 1000);
+    EXPECT_EQ(0x10, cpu.read_memory(0x4015));
+    cpu.run_cycles(1000);
+    EXPECT_EQ(0x80, cpu.read_memory(0x4015));
+    // writing $4015 acknowledges it
+    write_apu(cpu, {{0x4015, 0x00}});
+    EXPECT_EQ(0x00, cpu.read_memory(0x4015));
+
+    // every bit is a 1, so the level only went up
+    std::vector<s16> samples(apu.samples_available());
+    apu.read_samples(samples.data(), samples.size());
+    EXPECT_LT(0, *std::max_element(samples.begin(), samples.end()));
+}
+
+static std::vector<s16> make_tone(double hz, u32 rate, u32 count,
+        double amplitude)
+{
+    std::vector<s16> samples(count);
+    for (u32 i = 0; i < count; i++) {
+        samples[i] = static_cast<s16>(std::lround(amplitude
+                    * std::sin(2 * M_PI * hz * i / rate)));
+    }
+    return samples;
+}
+
+/**
+ * Resamples in chunks of any size, as the frames of audio come.
+ */
+static std::vector<s16> resample(Resampler &resampler,
+        const std::vector<s16> &in, u32 chunk)
+{
+    std::vector<s16> out(resampler.max_output(in.size(), 0.01));
+    u32 made = 0;
+    for (size_t i = 0; i < in.size(); i += chunk) {
+        u32 count = std::min(static_cast<size_t>(chunk), in.size() - i);
+        made += resampler.process(&in[i], count, &out[made]);
+    }
+    out.resize(made);
+    return out;
+}
+
+/**
+ * A 1 kHz tone at a rate the APU can make, an NES clock over 32, comes out
+ * at 48 kHz in time and at its level on every kernel, a tone above the
+ * output's Nyquist rate doesn't come out at all, and the adjustment
+ * stretches the output.
+ */
+TEST(TestResampler, kernels_test)
+{
+    const u32 RATE = Apu::CLOCK_RATE / 32;
+    std::vector<s16> tone = make_tone(1000, RATE, RATE / 4, 10000);
+    std::vector<s16> reference;
+    for (u32 kind = 0; kind < RESAMPLER_KIND_COUNT; kind++) {
+        if (!resampler_supported(static_cast<ResamplerKind>(kind))) {
+            continue;
+        }
+        SCOPED_TRACE(resampler_kind_name(static_cast<ResamplerKind>(kind)));
+        Resampler resampler(RATE, 48000, static_cast<ResamplerKind>(kind));
+        std::vector<s16> out = resample(resampler, tone, 737);
+        // all but the last half of the taps' worth
+        EXPECT_NEAR(12000 - 16 * 48000.0 / RATE, out.size(), 2);
+        if (reference.empty()) {
+            // the first output is centred on the first input
+            for (size_t i = 32; i < out.size(); i++) {
+                ASSERT_NEAR(10000 * std::sin(2 * M_PI * 1000 * i / 48000),
+                        out[i], 10) << i;
+            }
+            reference = out;
+        } else {
+            ASSERT_EQ(reference.size(), out.size());
+            for (size_t i = 0; i < out.size(); i++) {
+                ASSERT_NEAR(reference[i], out[i], 1) << i;
+            }
+        }
+    }
+
+    // 36 kHz would alias to 12 kHz
+    Resampler down(96000, 48000);
+    std::vector<s16> high = resample(down, make_tone(36000, 96000, 9600,
+                10000), 1000);
+    for (size_t i = 32; i < high.size(); i++) {
+        ASSERT_GT(50, std::abs(high[i])) << i;
+    }
+
+    Resampler stretched(48000, 48000);
+    stretched.set_adjust(0.005);
+    EXPECT_EQ(0.005, stretched.get_adjust());
+    EXPECT_NEAR(48000 * 1.005, resample(stretched, std::vector<s16>(48000),
+                800).size(), 20);
+}
+
+/**
+ * Nothing plays until the ring holds the target, running dry is counted
+ * once and waits for the target again.
+ */
+TEST(TestAudioStream, underrun_test)
+{
+    AudioStream stream(48000, 48000, 50);
+    std::vector<s16> out(512, 1);
+    stream.pull_samples(out.data(), out.size());
+    EXPECT_EQ(std::vector<s16>(512, 0), out);
+    EXPECT_EQ(0u, stream.get_underruns());
+
+    std::vector<s16> tone = make_tone(1000, 48000, 4800, 10000);
+    EXPECT_EQ(0u, stream.push_samples(tone.data(), tone.size()));
+    EXPECT_NEAR(100, stream.get_latency_ms(), 1);
+    u64 played = 0;
+    while (stream.get_underruns() == 0) {
+        stream.pull_samples(out.data(), out.size());
+        played = stream.get_played_samples();
+        ASSERT_GT(20000u, played);
+    }
+    EXPECT_NEAR(4800, played, 16);
+    EXPECT_EQ(0, stream.get_latency_ms());
+    stream.pull_samples(out.data(), out.size());
+    EXPECT_EQ(1u, stream.get_underruns());
+
+    // a full ring drops what doesn't fit
+    std::vector<s16> second(48000);
+    u32 lost = stream.push_samples(second.data(), second.size());
+    EXPECT_NEAR(48000 - AudioStream::RING_SIZE, lost, 16);
+    EXPECT_EQ(lost, stream.get_dropped_samples());
+}
+
+/**
+ * A producer a little slower or faster than the device, pushing a frame at
+ * a time while the device pulls 512 samples at a time, settles with the
+ * adjustment making up the difference, and never runs dry or overflows
+ * once it has. The control is proportional, so the ring settles off the
+ * target by as much as the difference takes.
+ */
+TEST(TestAudioStream, rate_control_test)
+{
+    const u32 RATE = Apu::CLOCK_RATE / 32;
+    for (double drift : {-0.003, 0.003}) {
+        SCOPED_TRACE(drift);
+        AudioStream stream(RATE, 48000, 50);
+        // in seconds of device time
+        double frameLength = 1 / 60.0 / (1 + drift);
+        double pullLength = 512 / 48000.0;
+        double nextFrame = 0, nextPull = 0;
+        double made = 0;
+        std::vector<s16> in(RATE / 30);
+        std::vector<s16> out(512);
+        u64 underruns = 0;
+        double latency = 0;
+        for (u32 frame = 0; frame < 90 * 60;) {
+            if (nextFrame <= nextPull) {
+                // a frame's worth of samples, the fraction carried over
+                made += RATE / 60.0;
+                u32 count = static_cast<u32>(made);
+                made -= count;
+                EXPECT_EQ(0u, stream.push_samples(in.data(), count));
+                nextFrame += frameLength;
+                frame++;
+                if (frame == 60 * 60) {
+                    underruns = stream.get_underruns();
+                }
+                if (frame > 60 * 60) {
+                    latency += stream.get_latency_ms() / (30 * 60);
+                }
+            } else {
+                stream.pull_samples(out.data(), out.size());
+                nextPull += pullLength;
+            }
+        }
+        EXPECT_EQ(underruns, stream.get_underruns());
+        // more output per input when the producer is slow
+        EXPECT_NEAR(-drift, stream.get_adjust(), 0.0002);
+        // measured after each push, so with the frame just pushed
+        EXPECT_NEAR(50 * (1 + drift / AudioStream::MAX_ADJUST) + 1000 / 60.0,
+                latency, 3);
+    }
+}
+
+/**
+ * Two streams go to a WAV and a raw file whole, whatever size the pushes
+ * are. The WAV's header is kept up to date while it is written, and
+ * repair_wav() fixes one whose sizes are off.
+ */
+TEST(TestAudioSink, wav_test)
+{
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "nesEmulator_audio_test";
+    fs::create_directories(dir);
+    std::string wav = (dir / "mix.wav").string();
+    std::string raw = (dir / "mix.raw").string();
+    const u32 COUNT = 3 * AudioSink::BLOCK_SAMPLES + 123;
+    std::vector<s16> tone = make_tone(440, 48000, COUNT, 20000);
+    std::vector<s16> ramp(COUNT);
+    for (u32 i = 0; i < COUNT; i++) {
+        ramp[i] = static_cast<s16>(i * 7);
+    }
+
+    {
+        AudioSink sink({wav, raw}, 48000);
+        for (u32 done = 0, part = 1; done < COUNT; part = part * 3 + 1) {
+            part = std::min(part, COUNT - done);
+            const s16 *streams[2] = {&tone[done], &ramp[done]};
+            sink.push_samples(streams, part);
+            done += part;
+        }
+        // the blocks written so far are a valid file already
+        auto start = std::chrono::steady_clock::now();
+        while (sink.get_written_samples() < 3 * AudioSink::BLOCK_SAMPLES) {
+            ASSERT_GT(std::chrono::seconds(5),
+                    std::chrono::steady_clock::now() - start);
+            std::this_thread::yield();
+        }
+        std::vector<u8> partial = read_bytes(wav);
+        ASSERT_LE(44u, partial.size());
+        EXPECT_EQ(partial.size() - 44, read_u32(partial, 40));
+        EXPECT_EQ(partial.size() - 8, read_u32(partial, 4));
+        EXPECT_TRUE(sink.close());
+        EXPECT_EQ(COUNT, sink.get_written_samples());
+    }
+
+    std::vector<u8> data = read_bytes(wav);
+    ASSERT_EQ(44 + 2 * COUNT, data.size());
+    EXPECT_EQ(0, memcmp(data.data(), "RIFF", 4));
+    EXPECT_EQ(0, memcmp(&data[8], "WAVEfmt ", 8));
+    EXPECT_EQ(48000u, read_u32(data, 24));
+    EXPECT_EQ(2 * COUNT, read_u32(data, 40));
+    std::vector<u8> rawData = read_bytes(raw);
+    ASSERT_EQ(2 * COUNT, rawData.size());
+    for (u32 i = 0; i < COUNT; i++) {
+        ASSERT_EQ(tone[i], static_cast<s16>(data[44 + 2 * i]
+                    | (data[45 + 2 * i] << 8))) << i;
+        ASSERT_EQ(ramp[i], static_cast<s16>(rawData[2 * i]
+                    | (rawData[2 * i + 1] << 8))) << i;
+    }
+
+    // a crash before the header caught up, in the middle of a sample
+    data[4] = data[5] = data[40] = data[41] = data[42] = data[43] = 0;
+    data.push_back(1);
+    data.push_back(2);
+    data.push_back(3);
+    FILE *fp = fopen(wav.c_str(), "wb");
+    ASSERT_NE(nullptr, fp);
+    fwrite(data.data(), 1, data.size(), fp);
+    fclose(fp);
+    std::string error;
+    ASSERT_TRUE(repair_wav(wav, error)) << error;
+    data = read_bytes(wav);
+    EXPECT_EQ(2 * COUNT + 2, read_u32(data, 40));
+    EXPECT_EQ(36 + 2 * COUNT + 2, read_u32(data, 4));
+    EXPECT_FALSE(repair_wav(raw, error));
+    EXPECT_NE("", error);
+
+    AudioSink missing({(dir / "missing" / "mix.wav").string()}, 48000);
+    missing.push_samples(tone.data(), COUNT);
+    EXPECT_FALSE(missing.close());
+    EXPECT_NE("", missing.get_error());
+    fs::remove_all(dir);
+}
+
+#ifdef HAVE_SDL2
+/**
+ * Plays the APU in real time on SDL's dummy driver, which needs no sound
+ * card, and runs dry once nothing is pushed.
+ */
+TEST(TestAudioOutput, dummy_driver_test)
+{
+    setenv("SDL_AUDIODRIVER", "dummy", 1);
+    Cpu cpu;
+    Apu apu(cpu);
+    write_apu(cpu, {{0x4015, 0x01}, {0x4000, 0xbf}, {0x4002, 253},
+            {0x4003, 0x08}});
+    AudioOutput output(apu.get_sample_rate());
+    ASSERT_TRUE(output.open()) << output.get_error();
+    EXPECT_EQ(48000u, output.get_device_rate());
+
+    auto start = std::chrono::steady_clock::now();
+    for (u32 frame = 1; frame <= 30; frame++) {
+        cpu.run_cycles(Cpu::CYCLES_PER_FRAME);
+        std::vector<s16> samples(apu.samples_available());
+        apu.read_samples(samples.data(), samples.size());
+        EXPECT_EQ(0u, output.push_samples(samples.data(), samples.size()));
+        std::this_thread::sleep_until(start + std::chrono::microseconds(
+                    frame * 16639));
+    }
+    EXPECT_LT(0u, output.get_stream().get_played_samples());
+    EXPECT_LT(0, output.get_latency_ms());
+    EXPECT_GT(200, output.get_latency_ms());
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_LE(1u, output.get_underruns());
+    output.close();
+    EXPECT_EQ(0u, output.get_device_rate());
+}
+#endif
 
 int main(int argc, char **argv) 
 {
@@ -0,0 +1,110 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(u32 threads) : queued(0)
+{
+    if (!threads) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (!threads) {
+        threads = 1;
+    }
+    unfinished = 0;
+    next = 0;
+    stopping = false;
+
+    for (u32 i = 0; i < threads; i++) {
+        queues.emplace_back(new Queue);
+    }
+    for (u32 i = 0; i < threads; i++) {
+        this->threads.emplace_back(&ThreadPool::worker, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void(void)> task)
+{
+    u32 index;
+    {
+        // counted under the pool lock so a worker about to sleep sees it
+        std::lock_guard<std::mutex> guard(lock);
+        index = next;
+        next = (next + 1) % queues.size();
+        unfinished++;
+        queued++;
+    }
+    {
+        std::lock_guard<std::mutex> guard(queues[index]->lock);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::wait(void)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this] { return unfinished == 0; });
+}
+
+u32 ThreadPool::get_thread_count(void) const
+{
+    return threads.size();
+}
+
+/**
+ * Takes a task off the back of the worker's own queue, or steals one off the
+ * front of another queue.
+ *
+ * @return: Whether there was a task to take.
+ */
+bool ThreadPool::take(u32 index, std::function<void(void)> &task)
+{
+    for (u32 i = 0; i < queues.size(); i++) {
+        Queue &queue = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::worker(u32 index)
+{
+    for (;;) {
+        std::function<void(void)> task;
+        if (take(index, task)) {
+            task();
+            std::lock_guard<std::mutex> guard(lock);
+            if (--unfinished == 0) {
+                done.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "utils.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A work stealing thread pool. Every worker has its own queue and takes
+ * tasks from the back of it; a worker that runs dry steals from the front
+ * of the other queues, so long and short tasks even out across the threads.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * @param threads: The number of worker threads, 0 for one per core.
+     */
+    ThreadPool(u32 threads = 0);
+
+    /**
+     * Finishes the queued tasks and joins the workers.
+     */
+    ~ThreadPool(void);
+
+    /**
+     * Queues a task, tasks are spread over the workers round robin.
+     */
+    void submit(std::function<void(void)> task);
+
+    /**
+     * Blocks until every submitted task has finished.
+     */
+    void wait(void);
+
+    u32 get_thread_count(void) const;
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<std::function<void(void)>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable wake;   // tasks were queued or the pool stops
+    std::condition_variable done;   // the last task finished
+    std::atomic<u32> queued;        // tasks no worker has taken yet
+    u32 unfinished;                 // tasks that have not finished yet
+    u32 next;                       // the queue the next task goes to
+    bool stopping;
+
+    void worker(u32 index);
+    bool take(u32 index, std::function<void(void)> &task);
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include <string.h>
+
+#include "tile_cache.h"
+
+// tiles in a 1KB CHR bank
+static const u32 BANK_TILES = 64;
+
+double TileCacheStats::hit_rate(void) const
+{
+    u64 lookups = hits + misses;
+    return lookups ? static_cast<double>(hits) / lookups : 0.0;
+}
+
+TileCache::TileCache(TileDecoder decoder)
+{
+    decodeTiles = decoder;
+    memset(valid, 0, sizeof(valid));
+    reset_stats();
+}
+
+void TileCache::invalidate_tile(u32 tile)
+{
+    if (valid[tile]) {
+        valid[tile] = 0;
+        stats.writeInvalidations++;
+    }
+}
+
+void TileCache::invalidate_bank(u32 bank)
+{
+    for (u32 tile = bank * BANK_TILES; tile < (bank + 1) * BANK_TILES;
+            tile++) {
+        if (valid[tile]) {
+            valid[tile] = 0;
+            stats.bankInvalidations++;
+        }
+    }
+}
+
+void TileCache::set_decoder(TileDecoder decoder)
+{
+    decodeTiles = decoder;
+}
+
+const TileCacheStats &TileCache::get_stats(void) const
+{
+    return stats;
+}
+
+void TileCache::reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * Decodes a whole tile in one call, by handing the decoder its 8 rows as if
+ * they were 8 tiles of a line.
+ */
+void TileCache::decode(u32 tile, u8 palette, const u8 *pattern)
+{
+    u8 palettes[8];
+    memset(palettes, palette, sizeof(palettes));
+    decodeTiles(pattern, pattern + 8, palettes, 8, tiles[tile][palette >> 2]);
+}
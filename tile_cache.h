@@ -0,0 +1,71 @@
+#ifndef TILE_CACHE_H
+#define TILE_CACHE_H
+
+#include "utils.h"
+#include "tile_decoder.h"
+
+struct TileCacheStats
+{
+    u64 hits;
+    u64 misses;
+    u64 writeInvalidations; // tiles whose CHR RAM was written to
+    u64 bankInvalidations;  // tiles whose CHR bank was switched
+
+    /**
+     * @return: The fraction of lookups that found the tile decoded.
+     */
+    double hit_rate(void) const;
+};
+
+/**
+ * The 512 tiles of the pattern tables, decoded into 8x8 palette RAM indices
+ * once per palette they are drawn with, so fetching a row of a tile is a
+ * copy. A tile is decoded the first time it is looked up, and dropped when
+ * the CHR RAM behind it is written or its bank is switched.
+ */
+class TileCache
+{
+public:
+    static const u32 TILES = 512;
+    static const u32 TILE_SIZE = 64;    // 8 rows of 8 pixels
+
+    TileCache(TileDecoder decoder);
+    ~TileCache(void) {}
+
+    /**
+     * @param tile: The tile, its address in the pattern tables / 16.
+     * @param palette: The palette, already shifted left by 2.
+     * @param pattern: The tile's 16 pattern bytes, decoded if it's a miss.
+     * @return: The tile's rows, leftmost pixel first.
+     */
+    const u8 *lookup(u32 tile, u8 palette, const u8 *pattern)
+    {
+        u8 bit = 1 << (palette >> 2);
+        if (valid[tile] & bit) {
+            stats.hits++;
+        } else {
+            stats.misses++;
+            decode(tile, palette, pattern);
+            valid[tile] |= bit;
+        }
+        return tiles[tile][palette >> 2];
+    }
+
+    void invalidate_tile(u32 tile);
+    void invalidate_bank(u32 bank);
+
+    void set_decoder(TileDecoder decoder);
+
+    const TileCacheStats &get_stats(void) const;
+    void reset_stats(void);
+
+private:
+    TileDecoder decodeTiles;
+    u8 tiles[TILES][4][TILE_SIZE];
+    u8 valid[TILES];    // a bit for each palette the tile is decoded with
+    TileCacheStats stats;
+
+    void decode(u32 tile, u8 palette, const u8 *pattern);
+};
+
+#endif
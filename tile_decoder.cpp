@@ -0,0 +1,178 @@
+#include <string.h>
+
+#include "tile_decoder.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define TILE_DECODER_X86
+#include <immintrin.h>
+#endif
+
+static void decode_scalar(const u8 *low, const u8 *high, const u8 *palette,
+        u32 count, u8 *out)
+{
+    for (u32 tile = 0; tile < count; tile++, out += 8) {
+        for (u32 i = 0; i < 8; i++) {
+            u8 pixel = ((low[tile] >> (7 - i)) & 1)
+                | (((high[tile] >> (7 - i)) & 1) << 1);
+            out[i] = pixel ? palette[tile] | pixel : 0;
+        }
+    }
+}
+
+#ifdef TILE_DECODER_X86
+
+/**
+ * Spreads 16 tile bytes out so every byte fills the 8 lanes of its tile,
+ * two tiles to a register.
+ */
+static inline void expand_sse2(const u8 *src, __m128i out[8])
+{
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    __m128i pairs[2] = {_mm_unpacklo_epi8(bytes, bytes),
+        _mm_unpackhi_epi8(bytes, bytes)};
+    for (u32 i = 0; i < 2; i++) {
+        __m128i quads[2] = {_mm_unpacklo_epi16(pairs[i], pairs[i]),
+            _mm_unpackhi_epi16(pairs[i], pairs[i])};
+        for (u32 j = 0; j < 2; j++) {
+            out[i * 4 + j * 2] = _mm_unpacklo_epi32(quads[j], quads[j]);
+            out[i * 4 + j * 2 + 1] = _mm_unpackhi_epi32(quads[j], quads[j]);
+        }
+    }
+}
+
+static void decode_sse2(const u8 *low, const u8 *high, const u8 *palette,
+        u32 count, u8 *out)
+{
+    // the pattern bit of each pixel of a tile, leftmost first
+    const __m128i bits = _mm_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1,
+            -128, 64, 32, 16, 8, 4, 2, 1);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi8(2);
+    const __m128i zero = _mm_setzero_si128();
+
+    u32 tile = 0;
+    for (; tile + 16 <= count; tile += 16, out += 128) {
+        __m128i lows[8], highs[8], palettes[8];
+        expand_sse2(low + tile, lows);
+        expand_sse2(high + tile, highs);
+        expand_sse2(palette + tile, palettes);
+        for (u32 i = 0; i < 8; i++) {
+            __m128i l = _mm_cmpeq_epi8(_mm_and_si128(lows[i], bits), bits);
+            __m128i h = _mm_cmpeq_epi8(_mm_and_si128(highs[i], bits), bits);
+            __m128i pixel = _mm_or_si128(_mm_and_si128(l, one),
+                    _mm_and_si128(h, two));
+            __m128i transparent = _mm_cmpeq_epi8(pixel, zero);
+            pixel = _mm_or_si128(pixel,
+                    _mm_andnot_si128(transparent, palettes[i]));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 16),
+                    pixel);
+        }
+    }
+    decode_scalar(low + tile, high + tile, palette + tile, count - tile, out);
+}
+
+__attribute__((target("bmi2")))
+static void decode_bmi2(const u8 *low, const u8 *high, const u8 *palette,
+        u32 count, u8 *out)
+{
+    const u64 bytes = 0x0101010101010101ull;
+    for (u32 tile = 0; tile < count; tile++, out += 8) {
+        // pdep puts bit 0, the rightmost pixel, in byte 0, so swap the bytes
+        u64 pixel = __builtin_bswap64(_pdep_u64(low[tile], bytes))
+            | __builtin_bswap64(_pdep_u64(high[tile], bytes << 1));
+        u64 opaque = (pixel | (pixel >> 1)) & bytes;
+        pixel |= opaque * palette[tile];
+        memcpy(out, &pixel, sizeof(pixel));
+    }
+}
+
+__attribute__((target("avx2")))
+static void decode_avx2(const u8 *low, const u8 *high, const u8 *palette,
+        u32 count, u8 *out)
+{
+    const __m256i bits = _mm256_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1,
+            -128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1,
+            -128, 64, 32, 16, 8, 4, 2, 1);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi8(2);
+    const __m256i zero = _mm256_setzero_si256();
+    // picks tiles 4k and 4k + 1 into the low half, 4k + 2 and 4k + 3 into
+    // the high half, 8 lanes each
+    __m256i spread[4];
+    for (u32 k = 0; k < 4; k++) {
+        u8 index[32];
+        for (u32 i = 0; i < 32; i++) {
+            index[i] = static_cast<u8>(k * 4 + i / 8);
+        }
+        spread[k] = _mm256_loadu_si256(reinterpret_cast<__m256i *>(index));
+    }
+
+    u32 tile = 0;
+    for (; tile + 16 <= count; tile += 16, out += 128) {
+        __m256i lows = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(low + tile)));
+        __m256i highs = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(high + tile)));
+        __m256i palettes = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(palette + tile)));
+        for (u32 k = 0; k < 4; k++) {
+            __m256i l = _mm256_shuffle_epi8(lows, spread[k]);
+            __m256i h = _mm256_shuffle_epi8(highs, spread[k]);
+            __m256i p = _mm256_shuffle_epi8(palettes, spread[k]);
+            l = _mm256_cmpeq_epi8(_mm256_and_si256(l, bits), bits);
+            h = _mm256_cmpeq_epi8(_mm256_and_si256(h, bits), bits);
+            __m256i pixel = _mm256_or_si256(_mm256_and_si256(l, one),
+                    _mm256_and_si256(h, two));
+            __m256i transparent = _mm256_cmpeq_epi8(pixel, zero);
+            pixel = _mm256_or_si256(pixel,
+                    _mm256_andnot_si256(transparent, p));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k * 32),
+                    pixel);
+        }
+    }
+    decode_bmi2(low + tile, high + tile, palette + tile, count - tile, out);
+}
+
+#endif
+
+TileDecoder get_tile_decoder(TileDecoderKind kind)
+{
+    switch (kind) {
+    case TILE_DECODER_SCALAR:
+        return decode_scalar;
+#ifdef TILE_DECODER_X86
+    case TILE_DECODER_SSE2:
+        // part of x86-64
+        return decode_sse2;
+    case TILE_DECODER_BMI2:
+        return __builtin_cpu_supports("bmi2") ? decode_bmi2 : NULL;
+    case TILE_DECODER_AVX2:
+        // the tail goes to the BMI2 decoder, every AVX2 cpu has BMI2
+        return __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("bmi2") ? decode_avx2 : NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+TileDecoderKind best_tile_decoder(void)
+{
+    static const TileDecoderKind order[] = {
+        TILE_DECODER_AVX2, TILE_DECODER_BMI2, TILE_DECODER_SSE2,
+    };
+    for (TileDecoderKind kind : order) {
+        if (get_tile_decoder(kind)) {
+            return kind;
+        }
+    }
+    return TILE_DECODER_SCALAR;
+}
+
+const char *tile_decoder_name(TileDecoderKind kind)
+{
+    static const char *names[TILE_DECODER_COUNT] = {
+        "scalar", "sse2", "bmi2", "avx2",
+    };
+    return kind < TILE_DECODER_COUNT ? names[kind] : "unknown";
+}
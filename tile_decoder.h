@@ -0,0 +1,42 @@
+#ifndef TILE_DECODER_H
+#define TILE_DECODER_H
+
+#include "utils.h"
+
+/**
+ * Decodes a run of background tile rows into pixels. Each tile row is two
+ * pattern bytes, the leftmost pixel in bit 7, and the palette of the tile;
+ * a pixel comes out as its palette RAM index, the palette in bits 2-3 and
+ * the colour in bits 0-1, or 0 where it is transparent.
+ *
+ * @param low: The low pattern byte of each tile.
+ * @param high: The high pattern byte of each tile.
+ * @param palette: The palette of each tile, already shifted left by 2.
+ * @param count: The number of tiles.
+ * @param out: Where the count * 8 pixels go, nothing past them is written.
+ */
+typedef void (*TileDecoder)(const u8 *low, const u8 *high, const u8 *palette,
+        u32 count, u8 *out);
+
+enum TileDecoderKind
+{
+    TILE_DECODER_SCALAR,
+    TILE_DECODER_SSE2,
+    TILE_DECODER_BMI2,  // pdep, a tile at a time in a general register
+    TILE_DECODER_AVX2,
+    TILE_DECODER_COUNT,
+};
+
+/**
+ * @return: The given decoder, NULL if the host cpu can't run it.
+ */
+TileDecoder get_tile_decoder(TileDecoderKind kind);
+
+/**
+ * @return: The fastest decoder the host cpu can run.
+ */
+TileDecoderKind best_tile_decoder(void);
+
+const char *tile_decoder_name(TileDecoderKind kind);
+
+#endif
@@ -8,6 +8,14 @@
 #define local static
 #define db() printf("hit\n");
 
+#if defined(__GNUC__)
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define likely(x)   (x)
+#define unlikely(x) (x)
+#endif
+
 typedef uint8_t     u8;
 typedef uint16_t    u16;
 typedef uint32_t    u32;
@@ -0,0 +1,244 @@
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "video_sink.h"
+#include "frame_converter.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const u32 LUMA_SIZE = Ppu::WIDTH * Ppu::HEIGHT;
+static const u32 CHROMA_SIZE = LUMA_SIZE / 4;
+
+static u8 clamp_byte(s32 val)
+{
+    return static_cast<u8>(std::min(std::max(val, 0), 255));
+}
+
+/**
+ * Turns two lines of RGBA8 pixels into their luma and the chroma of each
+ * 2x2 block, full range BT.601 as in JPEG:
+ *   Y = (77R + 150G + 29B + 128) >> 8, the same as PIXEL_GRAY8
+ *   Cb = 128 + (-43R - 85G + 128B) / 256
+ *   Cr = 128 + (128R - 107G - 21B) / 256
+ * with R, G and B averaged over the block for the chroma.
+ */
+static void rgba_to_yuv420(const u8 *top, const u8 *bottom, u8 *luma_top,
+        u8 *luma_bottom, u8 *cb, u8 *cr)
+{
+    for (u32 x = 0; x < Ppu::WIDTH; x++) {
+        const u8 *p = top + x * 4;
+        const u8 *q = bottom + x * 4;
+        luma_top[x] = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+        luma_bottom[x] = (77 * q[0] + 150 * q[1] + 29 * q[2] + 128) >> 8;
+    }
+    for (u32 x = 0; x < Ppu::WIDTH / 2; x++) {
+        const u8 *p = top + x * 8;
+        const u8 *q = bottom + x * 8;
+        s32 r = p[0] + p[4] + q[0] + q[4];
+        s32 g = p[1] + p[5] + q[1] + q[5];
+        s32 b = p[2] + p[6] + q[2] + q[6];
+        // the sums are 4 pixels, so the scale is 1024 and 128 is 128 << 10
+        cb[x] = clamp_byte((-43 * r - 85 * g + 128 * b + (128 << 10) + 512)
+                >> 10);
+        cr[x] = clamp_byte((128 * r - 107 * g - 21 * b + (128 << 10) + 512)
+                >> 10);
+    }
+}
+
+static bool write_frame(FILE *fp, const std::vector<u8> &yuv)
+{
+    return fputs("FRAME\n", fp) >= 0
+        && fwrite(yuv.data(), 1, yuv.size(), fp) == yuv.size();
+}
+
+VideoSink::VideoSink(const std::string &path) : path(path), stopping(false),
+    failed(false), written(0), dropped(0)
+{
+    frames.reset(new Frame[FRAMES]);
+    for (u32 i = 0; i < FRAMES; i++) {
+        freeFrames.push(&frames[i]);
+    }
+    thread = std::thread(&VideoSink::run, this);
+}
+
+VideoSink::~VideoSink(void)
+{
+    close();
+}
+
+bool VideoSink::push_frame(const Ppu &ppu)
+{
+    Frame *frame;
+    if (stopping || failed || !freeFrames.pop(frame)) {
+        dropped++;
+        return false;
+    }
+    frame->number = ppu.get_frame_count();
+    memcpy(frame->pixels, ppu.get_frame(), sizeof(frame->pixels));
+    for (u32 y = 0; y < Ppu::HEIGHT; y++) {
+        frame->emphasis[y] = ppu.get_emphasis(y);
+    }
+    readyFrames.push(frame);
+    return true;
+}
+
+bool VideoSink::push_frame(const u8 *pixels, const u8 *emphasis, u64 number)
+{
+    Frame *frame;
+    if (stopping || failed || !freeFrames.pop(frame)) {
+        dropped++;
+        return false;
+    }
+    frame->number = number;
+    memcpy(frame->pixels, pixels, sizeof(frame->pixels));
+    memcpy(frame->emphasis, emphasis, sizeof(frame->emphasis));
+    readyFrames.push(frame);
+    return true;
+}
+
+bool VideoSink::close(void)
+{
+    if (thread.joinable()) {
+        stopping = true;
+        thread.join();
+    }
+    return error.empty();
+}
+
+u64 VideoSink::get_written_frames(void) const
+{
+    return written;
+}
+
+u64 VideoSink::get_dropped_frames(void) const
+{
+    return dropped;
+}
+
+const std::string &VideoSink::get_error(void) const
+{
+    return error;
+}
+
+/**
+ * Opens the output file. A FIFO without a reader is tried again until it
+ * has one, rather than blocking in the open where close() can't stop it.
+ *
+ * @return: NULL with error set if it can't be opened.
+ */
+FILE *VideoSink::open_output(void)
+{
+#ifdef _WIN32
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        error = "failed to open " + path;
+    }
+    return fp;
+#else
+    using Clock = std::chrono::steady_clock;
+    bool closing = false;
+    Clock::time_point deadline;
+    while (true) {
+        // a FIFO without a reader fails with ENXIO instead of waiting
+        int fd = ::open(path.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0666);
+        if (fd >= 0) {
+            // writes block again, so the reader sets the pace
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            FILE *fp = fdopen(fd, "wb");
+            if (!fp) {
+                ::close(fd);
+                error = "failed to open " + path;
+            }
+            return fp;
+        }
+        if (errno != ENXIO) {
+            error = "failed to open " + path;
+            return NULL;
+        }
+        if (stopping && !closing) {
+            closing = true;
+            // by value, the constant has no definition to refer to
+            deadline = Clock::now() + std::chrono::milliseconds(
+                    static_cast<s64>(READER_TIMEOUT_MS));
+        }
+        if (closing && Clock::now() >= deadline) {
+            error = "no reader for " + path;
+            return NULL;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+#endif
+}
+
+void VideoSink::run(void)
+{
+    // opening a FIFO waits for a reader, so it is done here
+    bool toStdout = path == "-";
+    FILE *fp = toStdout ? stdout : open_output();
+    std::string name = toStdout ? "stdout" : path;
+    if (!fp) {
+        failed = true;
+        return;
+    }
+
+    FrameConverter converter(PIXEL_RGBA8);
+    std::vector<u8> rgba(Ppu::WIDTH * 4 * 2);
+    std::vector<u8> yuv(LUMA_SIZE + 2 * CHROMA_SIZE);
+    bool ok = fprintf(fp, "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C420jpeg "
+            "XCOLORRANGE=FULL\n", Ppu::WIDTH, Ppu::HEIGHT, RATE_NUMERATOR,
+            RATE_DENOMINATOR) > 0;
+    bool started = false;
+    u64 last = 0;
+    u32 tries = 0;
+    while (ok) {
+        // stopping is read first, so a frame pushed before close() is
+        // always seen by the pop
+        bool draining = stopping;
+        Frame *frame;
+        if (!readyFrames.pop(frame)) {
+            if (draining) {
+                break;
+            }
+            back_off(tries);
+            continue;
+        }
+        tries = 0;
+
+        // the frames dropped or not drawn since the last one repeat it
+        for (u64 n = last + 1; started && ok && n < frame->number; n++) {
+            ok = write_frame(fp, yuv);
+            written += ok;
+        }
+        u8 *cb = &yuv[LUMA_SIZE];
+        u8 *cr = cb + CHROMA_SIZE;
+        for (u32 y = 0; y < Ppu::HEIGHT; y += 2) {
+            converter.convert_line(frame->pixels[y], frame->emphasis[y],
+                    Ppu::WIDTH, &rgba[0]);
+            converter.convert_line(frame->pixels[y + 1],
+                    frame->emphasis[y + 1], Ppu::WIDTH, &rgba[Ppu::WIDTH * 4]);
+            rgba_to_yuv420(&rgba[0], &rgba[Ppu::WIDTH * 4],
+                    &yuv[y * Ppu::WIDTH], &yuv[(y + 1) * Ppu::WIDTH],
+                    cb + y / 2 * Ppu::WIDTH / 2, cr + y / 2 * Ppu::WIDTH / 2);
+        }
+        last = frame->number;
+        started = true;
+        freeFrames.push(frame);
+        ok = ok && write_frame(fp, yuv);
+        written += ok;
+    }
+
+    if (toStdout ? fflush(fp) : fclose(fp)) {
+        ok = false;
+    }
+    if (!ok) {
+        error = "failed to write " + name;
+        failed = true;
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef VIDEO_SINK_H
+#define VIDEO_SINK_H
+
+#include "utils.h"
+#include "ppu.h"
+#include "spsc_ring.h"
+#include <stdio.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+/**
+ * Streams frames as uncompressed YUV4MPEG2 (Y4M) to a file, a FIFO or
+ * stdout, e.g. for ffmpeg to encode as it goes. The emulation only copies
+ * each frame's colour indices into a free buffer of a ring; a writer thread
+ * turns them into 4:2:0 YUV and does all the I/O, so a slow disk or encoder
+ * never holds up the cpu. When every buffer is taken the frame is dropped
+ * and counted, and the writer repeats the frame before it in its place so
+ * the stream keeps the NES's timing.
+ */
+class VideoSink
+{
+public:
+    static const u32 FRAMES = 8;
+    // the NTSC NES's frame rate, about 60.0988 frames a second
+    static const u32 RATE_NUMERATOR = 39375000;
+    static const u32 RATE_DENOMINATOR = 655171;
+    // how long close() waits for a FIFO to get a reader
+    static const u32 READER_TIMEOUT_MS = 2000;
+
+    /**
+     * Starts the writer thread, which opens the output. Opening a FIFO
+     * waits for a reader, frames pushed meanwhile fill the ring and are then
+     * dropped. If there is still none READER_TIMEOUT_MS after close(), it
+     * gives up with an error.
+     *
+     * @param path: Where the stream goes, "-" for stdout.
+     */
+    explicit VideoSink(const std::string &path);
+
+    /**
+     * Closes the stream, see close().
+     */
+    ~VideoSink(void);
+
+    /**
+     * Queues the PPU's last frame, numbered by its frame count.
+     *
+     * @return: False if the frame was dropped.
+     */
+    bool push_frame(const Ppu &ppu);
+
+    /**
+     * Queues a frame kept apart from its PPU, e.g. a RenderThread::Frame.
+     *
+     * @param pixels: Ppu::WIDTH x Ppu::HEIGHT colour indices.
+     * @param emphasis: The emphasis bits of each line.
+     * @param number: The frame's number, any frames skipped between it and
+     * the last one are filled with repeats.
+     * @return: False if the frame was dropped.
+     */
+    bool push_frame(const u8 *pixels, const u8 *emphasis, u64 number);
+
+    /**
+     * Waits for the queued frames to be written and closes the output.
+     * Frames pushed afterwards are dropped.
+     *
+     * @return: Whether the whole stream was written, see get_error().
+     */
+    bool close(void);
+
+    /**
+     * @return: The frames in the stream so far, repeats included.
+     */
+    u64 get_written_frames(void) const;
+
+    /**
+     * @return: The frames dropped because all the buffers were taken.
+     */
+    u64 get_dropped_frames(void) const;
+
+    /**
+     * @return: What went wrong with the output, empty if nothing did. Only
+     * set once close() returns.
+     */
+    const std::string &get_error(void) const;
+
+private:
+    struct Frame
+    {
+        u64 number;
+        u8 pixels[Ppu::HEIGHT][Ppu::WIDTH];
+        u8 emphasis[Ppu::HEIGHT];
+    };
+
+    std::string path;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    std::atomic<bool> failed;   // the writer gave up, drop everything
+    std::atomic<u64> written;
+    std::atomic<u64> dropped;
+    std::string error;          // the writer's, read after it is joined
+
+    std::unique_ptr<Frame[]> frames;
+    SpscRing<Frame *, FRAMES> readyFrames;  // to the writer
+    SpscRing<Frame *, FRAMES> freeFrames;   // back to the emulation
+
+    void run(void);
+    FILE *open_output(void);
+};
+
+#endif